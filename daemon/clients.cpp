@@ -0,0 +1,465 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#include "clients.h"
+#include "device.h"
+#include "../driver/channel.h"
+#include "../driver/macchina_j2534_ext.h"
+#include "../driver/shm_ring.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DEVICE_MAX_CHANNELS 10 // MAX_CHANNELS on Macchina
+#define CLIENT_WRITE_TIMEOUT_MS 2000 // Clients that stop reading for this long are dropped, so they can't hold the device thread up
+#define PIPE_BUFFER_SIZE sizeof(shm_hello) // Messages go through shared memory, the pipe only carries the hello
+
+namespace clients {
+	struct client {
+		unsigned long id;
+		HANDLE pipe;
+		bool closed = false; // Pipe handle has been closed, guarded by write_mutex
+		std::atomic<bool> dead{ false }; // Stop serving the client
+		std::mutex write_mutex; // Only one thread can write to the ring at a time
+		OVERLAPPED write_ov = { 0x00 };
+		HANDLE mapping = NULL;
+		shm_link* link = nullptr;
+		HANDLE events[SHM_EVENT_COUNT] = { NULL };
+		shm_ring rx; // From the client, only read by its thread
+		shm_ring tx; // To the client
+		uint8_t device_chan[DEVICE_MAX_CHANNELS + 1] = { 0x00 }; // Client channel ID -> Device channel ID
+	};
+
+	// Owner of a device channel
+	struct device_channel {
+		unsigned long client_id;
+		uint8_t client_chan;
+		bool raw_can; // Writes wait for TX credits (See CMD_CREDIT)
+	};
+
+	// Message sent to Macchina that is waiting on a response
+	struct pending_msg {
+		bool used;
+		unsigned long client_id; // 0 - Sent by the daemon itself, throw the response away
+		uint8_t client_msg_id;
+		uint8_t device_chan; // For CMD_CHANNEL_CREATE, so a failed create can be given back
+	};
+
+	// Everything below is guarded by route_mutex. It is held whilst writing to the device
+	// so Macchina sees commands in the same order as the tables were changed
+	std::mutex route_mutex;
+	std::map<unsigned long, std::shared_ptr<client>> connected;
+	device_channel owners[DEVICE_MAX_CHANNELS + 1] = { 0x00 };
+	pending_msg pending[256] = { 0x00 };
+	uint8_t next_msg_id = 0x01;
+	unsigned long next_client_id = 1;
+
+	bool transfer(HANDLE pipe, void* buf, DWORD len, OVERLAPPED* ov, DWORD timeout) {
+		DWORD done = 0;
+		ResetEvent(ov->hEvent);
+		BOOL ok = WriteFile(pipe, buf, len, &done, ov);
+		if (!ok && GetLastError() != ERROR_IO_PENDING) {
+			return false;
+		}
+		if (WaitForSingleObject(ov->hEvent, timeout) == WAIT_TIMEOUT) {
+			CancelIo(pipe);
+			GetOverlappedResult(pipe, ov, &done, TRUE);
+			return false;
+		}
+		if (!GetOverlappedResult(pipe, ov, &done, FALSE)) {
+			return false;
+		}
+		return done == len;
+	}
+
+	void sendToClient(std::shared_ptr<client> c, PCMSG* msg) {
+		std::lock_guard<std::mutex> lock(c->write_mutex);
+		if (c->closed) {
+			return;
+		}
+		if (!c->tx.writeMsg(msg, CLIENT_WRITE_TIMEOUT_MS)) {
+			daemon_log("CLIENT", "Client %lu is not reading, disconnecting it", c->id);
+			c->dead = true; // Its thread cleans up
+		}
+	}
+
+	void closeLink(client* c) {
+		if (c->link != nullptr) {
+			UnmapViewOfFile(c->link);
+		}
+		if (c->mapping != NULL) {
+			CloseHandle(c->mapping);
+		}
+		for (int i = 0; i < SHM_EVENT_COUNT; i++) {
+			if (c->events[i] != NULL) {
+				CloseHandle(c->events[i]);
+			}
+		}
+	}
+
+	// Creates the shared memory for a new client, then tells it where to find it
+	bool openLink(client* c) {
+		shm_hello hello = { SHM_LINK_MAGIC, SHM_LINK_VERSION };
+		snprintf(hello.name, sizeof(hello.name), "Local\\macchina-passthru-%lu-%lu", GetCurrentProcessId(), c->id);
+		c->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(shm_link), hello.name);
+		if (c->mapping != NULL) {
+			c->link = (shm_link*)MapViewOfFile(c->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(shm_link));
+		}
+		bool events_ok = true;
+		for (int i = 0; i < SHM_EVENT_COUNT; i++) {
+			c->events[i] = CreateEventA(NULL, FALSE, FALSE, shm_event_name(hello.name, i).c_str());
+			events_ok = events_ok && c->events[i] != NULL;
+		}
+		if (c->link == nullptr || !events_ok) {
+			daemon_log("CLIENT", "Cannot create shared memory - error is %d", GetLastError());
+			return false;
+		}
+		c->link->magic = SHM_LINK_MAGIC;
+		c->link->version = SHM_LINK_VERSION;
+		c->rx.attach(&c->link->to_daemon, c->link->to_daemon_data, SHM_RING_BYTES, true);
+		c->rx.setEvents(c->events[SHM_EVENT_TO_DAEMON_DATA], c->events[SHM_EVENT_TO_DAEMON_SPACE]);
+		c->tx.attach(&c->link->to_client, c->link->to_client_data, SHM_RING_BYTES, true);
+		c->tx.setEvents(c->events[SHM_EVENT_TO_CLIENT_DATA], c->events[SHM_EVENT_TO_CLIENT_SPACE]);
+		return transfer(c->pipe, &hello, sizeof(hello), &c->write_ov, CLIENT_WRITE_TIMEOUT_MS);
+	}
+
+	// Must hold route_mutex
+	uint8_t takeMsgID(unsigned long client_id, uint8_t client_msg_id, uint8_t device_chan) {
+		uint8_t id = next_msg_id++;
+		pending[id] = { true, client_id, client_msg_id, device_chan };
+		return id;
+	}
+
+	// Must hold route_mutex
+	uint8_t takeDeviceChannel(client* c, uint8_t client_chan) {
+		for (uint8_t i = 1; i <= DEVICE_MAX_CHANNELS; i++) {
+			if (owners[i].client_id == 0) {
+				owners[i] = { c->id, client_chan };
+				c->device_chan[client_chan] = i;
+				return i;
+			}
+		}
+		return 0;
+	}
+
+	// Must hold route_mutex
+	void freeDeviceChannel(uint8_t device_chan) {
+		std::map<unsigned long, std::shared_ptr<client>>::iterator it = connected.find(owners[device_chan].client_id);
+		if (it != connected.end()) {
+			it->second->device_chan[owners[device_chan].client_chan] = 0;
+		}
+		owners[device_chan] = { 0, 0 };
+		device::closeCredits(device_chan);
+	}
+
+	// Answers a command on the daemon's behalf, same format as PCCOMM::respondFail on Macchina
+	void respondFail(std::shared_ptr<client> c, PCMSG* req, uint8_t code, const char* err) {
+		if (!req->__require_response) {
+			return;
+		}
+		PCMSG resp = { 0x00 };
+		resp.cmd_id = req->cmd_id | CMD_RES_FROM_CMD;
+		resp.resp_code = code;
+		resp.arg_size = (uint16_t)strlen(err);
+		memcpy(resp.args, err, resp.arg_size);
+		resp.msg_id = req->msg_id;
+		sendToClient(c, &resp);
+	}
+
+	// Closes every device channel the client still has open. Must hold route_mutex
+	void releaseChannels(client* c) {
+		for (uint8_t i = 1; i <= DEVICE_MAX_CHANNELS; i++) {
+			if (owners[i].client_id == c->id) {
+				PCMSG m = { CMD_CHANNEL_DESTROY };
+				m.arg_size = 1;
+				m.args[0] = i;
+				m.__require_response = true;
+				m.msg_id = takeMsgID(0, 0, 0);
+				device::send(&m);
+				freeDeviceChannel(i);
+			}
+		}
+	}
+
+	bool isChannelCmd(uint8_t cmd_id) {
+		switch (cmd_id) {
+		case CMD_CHANNEL_CREATE:
+		case CMD_CHANNEL_DATA:
+		case CMD_CHANNEL_DESTROY:
+		case CMD_CHANNEL_IOCTL_REQ:
+		case CMD_CHANNEL_SET_FILTER:
+		case CMD_CHANNEL_REM_FILTER:
+		case CMD_CHANNEL_DATA_PART:
+		case CMD_CHANNEL_START_PERIODIC:
+		case CMD_CHANNEL_STOP_PERIODIC:
+		case CMD_CHANNEL_IOCTL_RESP:
+		case CMD_TX_TRACE:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Raw CAN frames only go to Macchina when it has room for them, in as many messages as that takes.
+	// Runs on the client's own thread, so only that client waits
+	void sendCanData(PCMSG* msg) {
+		PCMSG part = *msg;
+		uint16_t pos = 1; // After channel ID
+		while (pos < msg->arg_size) {
+			uint16_t records = 0;
+			for (uint16_t i = pos; i + CAN_TX_RECORD_HDR <= msg->arg_size; i += CAN_TX_RECORD_HDR + (msg->args[i] & CAN_RECORD_DLC)) {
+				records++;
+			}
+			if (records == 0) { // Malformed tail, Macchina reports it
+				break;
+			}
+			uint16_t credits = device::takeTxCredits(msg->args[0], records, CLIENT_WRITE_TIMEOUT_MS);
+			if (credits == 0) {
+				daemon_log("CLIENTS", "No room on Macchina for channel %u after %d ms, sending anyway", msg->args[0], CLIENT_WRITE_TIMEOUT_MS);
+				credits = records;
+			}
+			uint16_t end = pos;
+			for (uint16_t i = 0; i < credits; i++) {
+				end += CAN_TX_RECORD_HDR + (msg->args[end] & CAN_RECORD_DLC);
+			}
+			part.arg_size = 1 + end - pos;
+			memcpy(&part.args[1], &msg->args[pos], end - pos);
+			bool last = end >= msg->arg_size;
+			part.trace_id = last ? msg->trace_id : 0; // Written once the whole batch is out
+			part.__require_response = last && msg->__require_response;
+			device::send(&part);
+			pos = end;
+		}
+	}
+
+	// Rewrites a message from the client into device IDs and sends it on
+	void fromClient(std::shared_ptr<client> c, PCMSG* msg) {
+		std::unique_lock<std::mutex> lock(route_mutex);
+		if (msg->cmd_id == CMD_EXIT) { // Client is done with the device, but others may not be
+			releaseChannels(c.get());
+			return;
+		}
+		uint8_t device_chan = 0;
+		if (isChannelCmd(msg->cmd_id) && msg->args[0] != 0) { // Channel 0 is the device itself (Device IOCTLs)
+			uint8_t client_chan = msg->args[0];
+			if (client_chan > DEVICE_MAX_CHANNELS) {
+				lock.unlock();
+				respondFail(c, msg, ERR_INVALID_CHANNEL_ID, "Channel ID is too large");
+				return;
+			}
+			if (msg->cmd_id == CMD_CHANNEL_CREATE) {
+				if (c->device_chan[client_chan] != 0) {
+					lock.unlock();
+					respondFail(c, msg, ERR_CHANNEL_IN_USE, "Channel ID is already in use");
+					return;
+				}
+				device_chan = takeDeviceChannel(c.get(), client_chan);
+				if (device_chan == 0) {
+					lock.unlock();
+					respondFail(c, msg, ERR_EXCEEDED_LIMIT, "All device channels are in use by other applications");
+					return;
+				}
+				// The client's RX window is for its own link. The daemon keeps up with Macchina, so it asks for none
+				if (msg->arg_size < 12) {
+					msg->arg_size = 12;
+				}
+				msg->args[10] = 0;
+				msg->args[11] = 0;
+				owners[device_chan].raw_can = msg->args[1] == PROTOCOL_CAN;
+				device::openCredits(device_chan, owners[device_chan].raw_can);
+			}
+			else {
+				device_chan = c->device_chan[client_chan];
+				if (device_chan == 0) {
+					lock.unlock();
+					respondFail(c, msg, ERR_INVALID_CHANNEL_ID, "Channel is not open");
+					return;
+				}
+				if (msg->cmd_id == CMD_CHANNEL_DESTROY) { // Macchina handles commands in order, so its free for the next create already
+					freeDeviceChannel(device_chan);
+				}
+			}
+			msg->args[0] = device_chan;
+		}
+		if (msg->__require_response) {
+			msg->msg_id = takeMsgID(c->id, msg->msg_id, msg->cmd_id == CMD_CHANNEL_CREATE ? device_chan : 0);
+		}
+		if (msg->cmd_id == CMD_CHANNEL_DATA && device_chan != 0 && owners[device_chan].raw_can) {
+			lock.unlock(); // Only this client's thread can destroy the channel, so it stays put
+			sendCanData(msg);
+			return;
+		}
+		device::send(msg);
+	}
+
+	// Only show the client its own channels, under its own IDs
+	// Only the caller's channels are left in. The Host counters are the daemon's, it has the port
+	void filterStats(std::shared_ptr<client> c, PCMSG* msg) {
+		MACCHINA_DEVICE_STATS st;
+		const uint16_t fw_size = offsetof(MACCHINA_DEVICE_STATS, HostRxCrcErrors);
+		if (msg->arg_size != 1 + fw_size) {
+			return;
+		}
+		memcpy(&st, &msg->args[1], fw_size);
+		frame_stats link;
+		device::getLinkStats(&link);
+		st.HostRxCrcErrors = link.crc_errors;
+		st.HostRxSkipped = link.skipped;
+		msg->arg_size = 1 + sizeof(st);
+		for (int i = 0; i < MACCHINA_STATS_MAX_CHANNELS; i++) {
+			uint8_t id = (uint8_t)st.Channels[i].ChannelID;
+			if (id != 0 && id <= DEVICE_MAX_CHANNELS && owners[id].client_id == c->id) {
+				st.Channels[i].ChannelID = owners[id].client_chan;
+			}
+			else {
+				memset(&st.Channels[i], 0x00, sizeof(st.Channels[i]));
+			}
+		}
+		memcpy(&msg->args[1], &st, sizeof(st));
+	}
+
+	void fromDevice(PCMSG* msg) {
+		std::shared_ptr<client> target;
+		std::unique_lock<std::mutex> lock(route_mutex);
+		if ((msg->cmd_id & 0xF0) == CMD_RES_FROM_CMD) { // Response, goes to whoever sent the command
+			pending_msg p = pending[msg->msg_id];
+			pending[msg->msg_id].used = false;
+			if (!p.used || p.client_id == 0) {
+				return;
+			}
+			std::map<unsigned long, std::shared_ptr<client>>::iterator it = connected.find(p.client_id);
+			if (it == connected.end()) {
+				return;
+			}
+			target = it->second;
+			msg->msg_id = p.client_msg_id;
+			if (msg->cmd_id == (CMD_CHANNEL_CREATE | CMD_RES_FROM_CMD) && msg->resp_code != STATUS_NOERROR && p.device_chan != 0) {
+				freeDeviceChannel(p.device_chan);
+			}
+			else if (msg->cmd_id == (CMD_STATS | CMD_RES_FROM_CMD)) {
+				filterStats(target, msg);
+			}
+		}
+		else if (isChannelCmd(msg->cmd_id) && msg->args[0] != 0) { // Unsolicited channel data, goes to the channel's owner
+			uint8_t device_chan = msg->args[0];
+			if (device_chan == 0 || device_chan > DEVICE_MAX_CHANNELS || owners[device_chan].client_id == 0) {
+				return; // Channel closed whilst this was on its way
+			}
+			std::map<unsigned long, std::shared_ptr<client>>::iterator it = connected.find(owners[device_chan].client_id);
+			if (it == connected.end()) {
+				return;
+			}
+			target = it->second;
+			msg->args[0] = owners[device_chan].client_chan;
+		}
+		else { // Logs, trace events and device IOCTL results (MACCHINA_IOCTL_AUTOBAUD) are for everyone. Only the client waiting on a result keeps it
+			std::vector<std::shared_ptr<client>> all;
+			for (auto& kv : connected) {
+				all.push_back(kv.second);
+			}
+			lock.unlock();
+			for (auto& c : all) {
+				sendToClient(c, msg);
+			}
+			return;
+		}
+		lock.unlock();
+		sendToClient(target, msg);
+	}
+
+	void clientThread(std::shared_ptr<client> c) {
+		PCMSG msg;
+		DWORD waiting = 0;
+		if (openLink(c.get())) {
+			daemon_log("CLIENT", "Client %lu connected", c->id);
+			while (!c->dead) {
+				if (c->rx.readMsg(&msg, DAEMON_POLL_MS)) {
+					fromClient(c, &msg);
+				}
+				else if (!PeekNamedPipe(c->pipe, NULL, 0, NULL, &waiting, NULL)) { // Client has closed its end
+					break;
+				}
+			}
+		}
+		route_mutex.lock();
+		releaseChannels(c.get()); // Application quit (Or crashed) without closing its channels
+		for (int i = 0; i < 256; i++) {
+			if (pending[i].client_id == c->id) {
+				pending[i].client_id = 0;
+			}
+		}
+		connected.erase(c->id);
+		route_mutex.unlock();
+		std::lock_guard<std::mutex> lock(c->write_mutex);
+		c->closed = true;
+		DisconnectNamedPipe(c->pipe);
+		CloseHandle(c->pipe);
+		CloseHandle(c->write_ov.hEvent);
+		closeLink(c.get());
+		daemon_log("CLIENT", "Client %lu disconnected", c->id);
+	}
+
+	void listen() {
+		OVERLAPPED ov = { 0x00 };
+		ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		while (true) {
+			HANDLE pipe = CreateNamedPipeW(DAEMON_PIPE_NAME, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+				PIPE_UNLIMITED_INSTANCES, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, NULL);
+			if (pipe == INVALID_HANDLE_VALUE) {
+				daemon_log("CLIENT", "Cannot create pipe - error is %d", GetLastError());
+				CloseHandle(ov.hEvent);
+				return;
+			}
+			DWORD unused = 0;
+			ResetEvent(ov.hEvent);
+			bool ok = ConnectNamedPipe(pipe, &ov) != 0;
+			if (!ok && GetLastError() == ERROR_IO_PENDING) {
+				ok = GetOverlappedResult(pipe, &ov, &unused, TRUE) != 0;
+			}
+			else if (!ok && GetLastError() == ERROR_PIPE_CONNECTED) { // Client got in before ConnectNamedPipe
+				ok = true;
+			}
+			if (!ok) {
+				CloseHandle(pipe);
+				continue;
+			}
+			std::shared_ptr<client> c = std::make_shared<client>();
+			c->pipe = pipe;
+			c->write_ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			route_mutex.lock();
+			c->id = next_client_id++;
+			connected[c->id] = c;
+			route_mutex.unlock();
+			std::thread(clientThread, c).detach();
+		}
+	}
+
+	void disconnectAll() {
+		std::lock_guard<std::mutex> lock(route_mutex);
+		for (auto& kv : connected) {
+			kv.second->dead = true;
+		}
+	}
+}
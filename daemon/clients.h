@@ -0,0 +1,49 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+#include "daemon.h"
+
+// Every process using the DLL is a client with its own pipe instance. Each client numbers
+// its channels and message IDs from 1 as if it had the device to itself, so the daemon
+// gives every channel a free device channel ID, and every message that wants a response a
+// free message ID, then puts the client's own IDs back on whatever Macchina sends back.
+// Filters and periodic messages live in the device channel, so they follow the channel
+namespace clients
+{
+	/// <summary>
+	/// Accepts client connections on DAEMON_PIPE_NAME. Each client gets its own thread.
+	/// Only returns if the pipe cannot be created
+	/// </summary>
+	void listen();
+
+	/// <summary>
+	/// Passes a message from Macchina on to the client it belongs to.
+	/// Called from the device thread
+	/// </summary>
+	/// <param name="msg">Message read from Macchina</param>
+	void fromDevice(PCMSG* msg);
+
+	/// <summary>
+	/// Drops every client. Called when the device has gone away
+	/// </summary>
+	void disconnectAll();
+};
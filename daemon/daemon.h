@@ -0,0 +1,30 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "../driver/usbcomm.h"
+
+/// <summary>
+/// Prints a line to the daemon console, prefixed with the tag
+/// </summary>
+void daemon_log(const char* tag, const char* fmt, ...);
@@ -0,0 +1,182 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#include "device.h"
+#include "../driver/discovery.h"
+#include <mutex>
+
+namespace device {
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	std::mutex write_mutex;
+	OVERLAPPED write_ov = { 0x00 };
+	OVERLAPPED read_ov = { 0x00 };
+	frame_decoder decoder; // Only used by the device thread (And open, before it starts)
+	link_credits credits; // TX flow control for raw CAN channels, RX is never flow controlled here (See CMD_CREDIT)
+
+	// Overlapped so the device thread can sit in a read whilst clients write
+	bool transfer(bool write, void* buf, DWORD len, OVERLAPPED* ov) {
+		DWORD done = 0;
+		ResetEvent(ov->hEvent);
+		BOOL ok = write ? WriteFile(handle, buf, len, &done, ov) : ReadFile(handle, buf, len, &done, ov);
+		if (!ok && GetLastError() != ERROR_IO_PENDING) {
+			return false;
+		}
+		if (!GetOverlappedResult(handle, ov, &done, TRUE)) {
+			return false;
+		}
+		return done == len;
+	}
+
+	// Never asks for more than the rest of the frame being put together, so the read can't wait on the next one
+	bool readFrame(PCMSG* msg) {
+		unsigned long crc_errors = decoder.stats.crc_errors;
+		frame_credit credit;
+		while (!decoder.next(msg, &credit)) {
+			if (decoder.stats.crc_errors != crc_errors) {
+				daemon_log("DEVICE", "Corrupt message from Macchina, looking for the next one (%lu so far)", decoder.stats.crc_errors);
+				crc_errors = decoder.stats.crc_errors;
+			}
+			DWORD want = (DWORD)decoder.wanted();
+			if (!transfer(false, decoder.tail(), want, &read_ov)) {
+				return false;
+			}
+			decoder.added(want);
+		}
+		credits.received(&credit);
+		return true;
+	}
+
+	// Checks Macchina is on the other end of the port. Reads time out whilst this runs
+	bool hello(const wchar_t* port) {
+		PCMSG msg;
+		uint8_t frame[FRAME_SIZE];
+		discovery::makeHello(&msg);
+		frame_encode(&msg, nullptr, frame);
+		decoder.reset();
+		if (!transfer(true, frame, FRAME_SIZE, &write_ov)) {
+			return false;
+		}
+		ULONGLONG start = GetTickCount64();
+		while (GetTickCount64() - start <= HELLO_TIMEOUT_MS && readFrame(&msg)) {
+			device_info info = {};
+			if (discovery::readHello(&msg, &info)) {
+				daemon_log("DEVICE", "Found Macchina on %ls. Protocol %u, capabilities %08X, firmware built %s", port, info.protocol, info.caps, info.build.c_str());
+				return true;
+			}
+			if (msg.cmd_id == (CMD_HELLO | CMD_RES_FROM_CMD)) {
+				daemon_log("DEVICE", "Macchina on %ls has incompatible firmware (Protocol %u, daemon wants %u)", port, info.protocol, PC_PROTOCOL_VERSION);
+				return false;
+			}
+		}
+		return false;
+	}
+
+	bool open(const wchar_t* port) {
+		handle = CreateFileW(port, GENERIC_READ | GENERIC_WRITE, NULL, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+		if (handle == INVALID_HANDLE_VALUE) {
+			daemon_log("DEVICE", "Cannot open %ls - error is %d", port, GetLastError());
+			return false;
+		}
+
+		DCB params = { 0x00 };
+		if (!GetCommState(handle, &params)) {
+			daemon_log("DEVICE", "Cannot read comm states - error is %d", GetLastError());
+			close();
+			return false;
+		}
+		params.BaudRate = CBR_115200;
+		params.ByteSize = 8;
+		params.StopBits = ONESTOPBIT;
+		params.Parity = NOPARITY;
+		params.fDtrControl = DTR_CONTROL_DISABLE;
+		if (!SetCommState(handle, &params)) {
+			daemon_log("DEVICE", "Cannot set comm states - error is %d", GetLastError());
+			close();
+			return false;
+		}
+
+		COMMTIMEOUTS timeouts = { 0x00 };
+		timeouts.ReadTotalTimeoutConstant = HELLO_TIMEOUT_MS;
+		SetCommTimeouts(handle, &timeouts);
+		PurgeComm(handle, PURGE_RXCLEAR | PURGE_TXCLEAR);
+
+		write_ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		read_ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (!hello(port)) {
+			close();
+			return false;
+		}
+		timeouts.ReadTotalTimeoutConstant = 0; // All zero - Reads wait until the whole message is here
+		SetCommTimeouts(handle, &timeouts);
+		return true;
+	}
+
+	void close() {
+		credits.reset();
+		if (handle != INVALID_HANDLE_VALUE) {
+			CloseHandle(handle);
+			handle = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	bool send(PCMSG* msg) {
+		uint8_t frame[FRAME_SIZE];
+		frame_credit credit;
+		credits.headerCredit(&credit);
+		frame_encode(msg, &credit, frame);
+		std::lock_guard<std::mutex> lock(write_mutex);
+		if (!transfer(true, frame, FRAME_SIZE, &write_ov)) {
+			daemon_log("DEVICE", "Error writing message! Code %d", GetLastError());
+			return false;
+		}
+		credits.told(&credit);
+		return true;
+	}
+
+	bool read(PCMSG* msg) {
+		do {
+			if (!readFrame(msg)) {
+				daemon_log("DEVICE", "Error reading message! Code %d", GetLastError());
+				return false;
+			}
+			if (msg->cmd_id == CMD_CREDIT) {
+				credits.receivedMsg(msg);
+			}
+		} while (msg->cmd_id == CMD_CREDIT);
+		return true;
+	}
+
+	void openCredits(uint8_t channel, bool tx_flow) {
+		credits.open(channel, tx_flow, 0);
+	}
+
+	void closeCredits(uint8_t channel) {
+		credits.close(channel);
+	}
+
+	uint16_t takeTxCredits(uint8_t channel, uint16_t want, unsigned long timeout_ms) {
+		return credits.takeTx(channel, want, timeout_ms);
+	}
+
+	void getLinkStats(frame_stats* stats) {
+		*stats = decoder.stats;
+	}
+}
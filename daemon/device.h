@@ -0,0 +1,79 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+#include "daemon.h"
+#include "../driver/link_frame.h"
+
+// The daemon is the only process with the serial port open. Writes come from
+// every client thread, reads only from the device thread
+namespace device
+{
+	/// <summary>
+	/// Opens a serial port, and checks Macchina is on it with a CMD_HELLO
+	/// </summary>
+	/// <param name="port">Port path, such as \\.\COM12</param>
+	/// <returns>Boolean indicating if Macchina was found on the port</returns>
+	bool open(const wchar_t* port);
+
+	/// <summary>
+	/// Closes the serial port
+	/// </summary>
+	void close();
+
+	/// <summary>
+	/// Sends a message to Macchina. Safe to call from any thread
+	/// </summary>
+	/// <param name="msg">Message to send</param>
+	/// <returns>Boolean indicating if the whole message was written</returns>
+	bool send(PCMSG* msg);
+
+	/// <summary>
+	/// Blocks until a whole message has arrived from Macchina
+	/// </summary>
+	/// <param name="msg">Message that is read</param>
+	/// <returns>False if the port has failed (Most likely unplugged)</returns>
+	bool read(PCMSG* msg);
+
+	/// <summary>
+	/// Starts counting credits for a channel on Macchina, before its CMD_CHANNEL_CREATE is sent.
+	/// Clients never see CMD_CREDIT, the daemon keeps its own count with Macchina
+	/// </summary>
+	/// <param name="channel">Channel ID on Macchina</param>
+	/// <param name="tx_flow">Raw CAN channel, so writes wait for room on Macchina</param>
+	void openCredits(uint8_t channel, bool tx_flow);
+
+	/// <summary>
+	/// Stops counting credits for a channel, waking any client waiting on them
+	/// </summary>
+	void closeCredits(uint8_t channel);
+
+	/// <summary>
+	/// Takes up to 'want' TX credits for a channel, waiting for at least one
+	/// </summary>
+	/// <returns>Credits taken, 0 on timeout. 'want' if the channel is not flow controlled</returns>
+	uint16_t takeTxCredits(uint8_t channel, uint16_t want, unsigned long timeout_ms);
+
+	/// <summary>
+	/// Frame counters for messages read from Macchina (See link_frame.h)
+	/// </summary>
+	void getLinkStats(frame_stats* stats);
+};
@@ -0,0 +1,91 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+// Passthru daemon. Owns the serial port to Macchina so that more than one application
+// can use the device at the same time (See clients.h). The DLL uses the daemon whenever
+// it is running, and opens the port itself when it is not.
+//
+// Usage: macchina-daemon [port]    (Default is to find Macchina by its USB IDs, see discovery.h)
+
+#include "daemon.h"
+#include "device.h"
+#include "clients.h"
+#include "../driver/discovery.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+std::mutex log_mutex;
+
+void daemon_log(const char* tag, const char* fmt, ...) {
+	std::lock_guard<std::mutex> lock(log_mutex);
+	va_list args;
+	va_start(args, fmt);
+	printf("[%s] ", tag);
+	vprintf(fmt, args);
+	printf("\n");
+	va_end(args);
+}
+
+void deviceThread() {
+	PCMSG msg;
+	while (device::read(&msg)) {
+		clients::fromDevice(&msg);
+	}
+	// Channels on the device are gone with it, so there is nothing for the clients to carry on with
+	daemon_log("DEVICE", "Lost Macchina, exiting");
+	clients::disconnectAll();
+	device::close();
+	exit(1);
+}
+
+int wmain(int argc, wchar_t* argv[]) {
+	std::vector<std::wstring> ports;
+	if (argc > 1) {
+		std::wstring port = argv[1];
+		if (port.rfind(L"\\\\", 0) != 0) { // COM10 and up only open with the device path
+			port = L"\\\\.\\" + port;
+		}
+		ports.push_back(port);
+	}
+	else {
+		ports = discovery::candidatePorts();
+	}
+	bool found = false;
+	for (const std::wstring& port : ports) {
+		if (device::open(port.c_str())) {
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		daemon_log("DEVICE", "Cannot find Macchina");
+		return 1;
+	}
+	daemon_log("DEVICE", "Waiting for clients");
+	std::thread(deviceThread).detach();
+	clients::listen();
+	device::close();
+	return 1;
+}
@@ -0,0 +1,106 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+// Throughput of the shared memory ring between the DLL and the daemon (See shm_ring.h).
+// The writer and reader are threads here, which costs the same as two processes (It is the
+// same memory either way), and keeps the benchmark the same on both platforms.
+//
+// Linux:   g++ -O2 -std=c++17 -pthread -I../driver ring_bench.cpp ../driver/shm_ring.cpp -o ring_bench
+// Windows: cl /O2 /std:c++17 /EHsc /I..\driver ring_bench.cpp ..\driver\shm_ring.cpp
+//
+// Usage: ring_bench [messages]    (Default is 10 million)
+
+#include "shm_ring.h"
+#include "protocol_handler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#define DEFAULT_MESSAGES 10000000UL
+
+struct result {
+	double seconds;
+	unsigned long errors;
+};
+
+// One CMD_CHANNEL_DATA holding a single 8 byte CAN frame, the smallest message the DLL sends in bulk
+static void make_msg(PCMSG* msg, unsigned long n)
+{
+	memset(msg, 0x00, sizeof(PCMSG));
+	msg->cmd_id = CMD_CHANNEL_DATA;
+	msg->args[0] = 1; // Channel
+	msg->args[1] = 8; // DLC
+	msg->args[2] = 0x00;
+	msg->args[3] = 0x00;
+	msg->args[4] = 0x07;
+	msg->args[5] = 0xE0;
+	memcpy(&msg->args[CAN_TX_RECORD_HDR + 1], &n, sizeof(n) < 8 ? sizeof(n) : 8);
+	msg->arg_size = 1 + CAN_TX_RECORD_HDR + 8;
+}
+
+static result run(shm_link* link, unsigned long count)
+{
+	shm_ring tx;
+	shm_ring rx;
+	tx.attach(&link->to_daemon, link->to_daemon_data, SHM_RING_BYTES, true);
+	rx.attach(&link->to_daemon, link->to_daemon_data, SHM_RING_BYTES, false);
+	result res = { 0, 0 };
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::thread reader([&]() {
+		PCMSG msg;
+		for (unsigned long i = 0; i < count; i++) {
+			unsigned long n = 0;
+			if (!rx.readMsg(&msg, 1000)) {
+				res.errors++;
+				continue;
+			}
+			memcpy(&n, &msg.args[CAN_TX_RECORD_HDR + 1], sizeof(n) < 8 ? sizeof(n) : 8);
+			if (n != i || msg.arg_size != 1 + CAN_TX_RECORD_HDR + 8) { // Lost, repeated or mangled
+				res.errors++;
+			}
+		}
+	});
+	PCMSG msg;
+	for (unsigned long i = 0; i < count; i++) {
+		make_msg(&msg, i);
+		if (!tx.writeMsg(&msg, 1000)) {
+			res.errors++;
+		}
+	}
+	reader.join();
+	res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return res;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_MESSAGES;
+	shm_link* link = new shm_link();
+	printf("Ring: %u bytes, message record: %u bytes\n", SHM_RING_BYTES, SHM_MSG_HEADER_SIZE + 1 + CAN_TX_RECORD_HDR + 8);
+	for (int pass = 0; pass < 3; pass++) {
+		result res = run(link, count);
+		printf("Pass %d: %lu messages in %.3fs - %.2fM msgs/s, %lu errors\n", pass + 1, count, res.seconds, count / res.seconds / 1000000.0, res.errors);
+	}
+	delete link;
+	return 0;
+}
@@ -1,360 +1,897 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#include "pch.h"
-#include "channel.h"
-#include "Logger.h"
-#include "globals.h"
-
-
-
-std::tuple<int, unsigned long> channel_group::addChannel(unsigned long ProtocolID, unsigned long Flags, unsigned long Baudrate)
-{
-    unsigned long chanid = getFreeChannelID();
-    if (chanid != 0) {
-        channel c = channel(chanid);
-        int res;
-        // Firstly, set protocol
-        res = c.setProtocol(ProtocolID);
-        if (res != STATUS_NOERROR) {
-            LOGGER.logError("CHAN_GROUP", "Error setting channel protocol!");
-            return std::make_tuple(res, 0);
-        }
-        // Then, set channel flags
-        res = c.setFlags(Flags);
-        if (res != STATUS_NOERROR) {
-            LOGGER.logError("CHAN_GROUP", "Error setting channel flags!");
-            return std::make_tuple(res, 0);
-        }
-        // Set channel baud rate
-        res = c.setBaud(Baudrate);
-        if (res != STATUS_NOERROR) {
-            LOGGER.logError("CHAN_GROUP", "Error setting channel baudrate!");
-            return std::make_tuple(res, 0);
-        }
-        // Now channel is setup here, deploy on the Macchina!
-        res = c.setMacchinaChannel();
-        if (res != STATUS_NOERROR) {
-            LOGGER.logError("CHAN_GROUP", "Error deploying channel on macchina!");
-            return std::make_tuple(res, 0);
-        }
-        this->channels.emplace(std::make_pair(chanid, c));
-        LOGGER.logDebug("CHAN_GROUP", "Created channel OK. Id is %lu", chanid);
-    }
-    else {
-        LOGGER.logError("CHAN_GROUP", "Error creating channel!");
-        globals::setErrorString("No more free channels");
-        return std::make_tuple(ERR_FAILED, chanid);
-    }
-    return std::make_tuple(STATUS_NOERROR, chanid);
-}
-
-int channel_group::removeChannel(unsigned long channelid)
-{
-    used[channelid - 1] = false;
-    if (channels.find(channelid) != channels.end()) {
-        int ret = channels.at(channelid).removeChannel();
-        channels.erase(channelid);
-        return ret;
-    }
-    return ERR_INVALID_CHANNEL_ID; // Channel doesn't exist??
-}
-
-void channel_group::recvPayload(PCMSG* m)
-{
-    // We know its channel data coming into this function
-    channel* chan = getChannelWithID(m->args[0]);
-    if (chan == nullptr) {
-        LOGGER.logError("CHAN_RECV", "Cannot send data to requested channel %d (Channel does not exist)", m->args[0]);
-    }
-    else {
-        chan->recvData(&m->args[1], m->arg_size-1); // Arg 0 is the Channel ID
-    }
-}
-
-int channel_group::requestChannelData(unsigned long ChannelID, PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout)
-{
-   channel* chan = getChannelWithID(ChannelID);
-   if (chan == nullptr) {
-       return ERR_INVALID_CHANNEL_ID;
-   }
-   return chan->requestData(pMsg, pNumMsgs, Timeout);
-}
-
-unsigned long channel_group::getFreeChannelID()
-{
-    for (int i = 0; i < MAX_CHANNELS; i++) {
-        if (used[i] == false) { // Channel isn't being used
-            used[i] = true; // Channel is now marked as used
-            return i + 1; // Return +1 to where we are in the array (ID 0 indicates no channel created)
-        }
-    }
-    LOGGER.logError("CHAN_GROUP", "No free channels!");
-    return 0;
-}
-
-int channel_group::setFilter(unsigned long channel_id, unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID)
-{
-    channel* chan = getChannelWithID(channel_id);
-    if (chan == nullptr) {
-        return ERR_INVALID_CHANNEL_ID;
-    }  
-    return chan->setFilter(FilterType, pMaskMsg, pPatternMsg, pFlowControlMsg, pFilterID);
-}
-
-int channel_group::remove_filter(unsigned long channel_id, unsigned long filterID)
-{
-    channel* chan = getChannelWithID(channel_id);
-    if (chan == nullptr) {
-        return ERR_INVALID_CHANNEL_ID;
-    }
-    return chan->remove_filter(filterID);
-}
-
-int channel_group::send_payload(unsigned long channel_id, PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long timeout)
-{
-    channel* chan = getChannelWithID(channel_id);
-    if (chan == nullptr) {
-        return ERR_INVALID_CHANNEL_ID;
-    }
-    LOGGER.logInfo("CHAN_SEND", "Sending %lu messages to channel %lu", *pNumMsgs, channel_id);
-    for (unsigned long i = 0; i < *pNumMsgs; i++) {
-        chan->sendPayload(&pMsg[i]);
-    }
-    return STATUS_NOERROR;
-}
-
-channel* channel_group::getChannelWithID(unsigned long id)
-{
-    try {
-        return &this->channels.at(id);
-    }
-    catch (std::exception) {
-        return nullptr;
-    }
-}
-
-channel_group channels = channel_group();
-
-channel::channel(unsigned long id)
-{
-    this->id = id;
-    this->macchinaProtocolID = 0x00;
-}
-
-int channel::setProtocol(unsigned long ProtocolID)
-{
-
-    switch (ProtocolID) {
-    case ISO15765:
-        this->handler = new iso15765_handler(this->id);
-        this->macchinaProtocolID = PROTOCOL_ISO15765;
-        break;
-    case ISO9141:
-        this->handler = new iso9141_handler(this->id);
-        this->macchinaProtocolID = PROTOCOL_ISO9141;
-        break;
-    case CAN:
-        this->handler = new can_handler(this->id);
-        this->macchinaProtocolID = PROTOCOL_CAN;
-        break;
-    default:
-        LOGGER.logError("CHAN_PROT", "Unsupported protocol %lu", ProtocolID);
-        return ERR_INVALID_PROTOCOL_ID;
-    }
-    return STATUS_NOERROR;
-}
-
-int channel::setFlags(unsigned long Flags)
-{
-    if (this->handler == nullptr) {
-        globals::setErrorString("Handler is null");
-        return ERR_FAILED;
-    }
-    this->handler->setFlags(Flags);
-    return STATUS_NOERROR;
-}
-
-int channel::setBaud(unsigned long Baudrate)
-{
-    if (this->handler == nullptr) {
-        globals::setErrorString("Handler is null");
-        return ERR_FAILED;
-    }
-    this->handler->setBaud(Baudrate);
-    return STATUS_NOERROR;
-}
-
-int channel::setMacchinaChannel()
-{
-    // Paylaod args format
-    // 0 - Channel ID
-    // 1 - Protocol ID
-    // 2-6 - Baud rate of channel
-    PCMSG m = {
-        CMD_CHANNEL_CREATE,
-        0,
-        6,
-        (uint8_t)this->id,
-        this->macchinaProtocolID
-    };
-    PCMSG resp = {};
-    unsigned long baud = handler->getBaud();
-    memcpy(&m.args[2], &baud, 4);
-    switch (usbcomm::sendMsgResp(&m, &resp))
-    {
-    case CMD_RES::CMD_OK:
-        return STATUS_NOERROR;
-    case CMD_RES::SEND_FAIL:
-        return ERR_DEVICE_NOT_CONNECTED;
-    case CMD_RES::CMD_TIMEOUT:
-        globals::setErrorString(usbcomm::getLastError());
-        return ERR_FAILED;
-    case CMD_RES::CMD_FAIL:
-        return m.args[1];
-    default:
-        return ERR_FAILED;
-    }
-}
-
-int channel::sendPayload(PASSTHRU_MSG* msg)
-{
-    // Cannot send enough data
-    if (msg->DataSize > 508) {
-        return ERR_BUFFER_FULL;
-    }
-    LOGGER.logDebug("HANDLER", "WRITE --> Contents: %s", LOGGER.bytesToString(msg->Data, msg->DataSize).c_str());
-    PCMSG m = { 0x00 };
-    m.arg_size = msg->DataSize + 1; // +1 for channel ID
-    m.cmd_id = CMD_CHANNEL_DATA; // Sending data
-    m.args[0] = (uint8_t)this->id;
-    memcpy(&m.args[1], msg->Data, msg->DataSize);
-    usbcomm::sendMsg(&m);
-    return 0;
-}
-
-int channel::setFilter(unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID)
-{
-    // Safety test - if filter is 0x03, then pFlowControlMsg must NOT be null as laid out in spec!
-    if (FilterType == FLOW_CONTROL_FILTER && pFlowControlMsg == nullptr) {
-        LOGGER.logError("CHAN_FILT", "Flow control filter wanted but pFlowControlMsg is null!");
-        return ERR_NULL_PARAMETER;
-    }
-
-    // Check if we have avaliable channel filters
-    for (int i = 0; i < CHANNEL_MAX_FILTERS; i++) {
-        if (filters[i] == nullptr) { // Found a free slot, allocate it
-            filters[i] = new handler_filter{ 0x00 };
-
-            // Set filter values
-            filters[i]->id = i+1;
-            *pFilterID = (unsigned long)(i + 1);
-            filters[i]->type = (uint8_t)FilterType;
-            memcpy(&filters[i]->mask, pMaskMsg, sizeof(&pMaskMsg));
-            memcpy(&filters[i]->filter, pPatternMsg, sizeof(&pPatternMsg));
-            if (FilterType == FLOW_CONTROL_FILTER) { // Only copy if flow control (else pFlowControl is nullptr)
-                memcpy(&filters[i]->flow, pFlowControlMsg, sizeof(&pFlowControlMsg));
-            }
-
-            // Construct data to send to Macchina device
-            PCMSG m = { 0x00 };
-            m.cmd_id = CMD_CHANNEL_SET_FILTER;
-            m.arg_size = 15; // 1 for CID, 1 for FID, 1 for FType, 4 for Mask, 4 for pattern, 4 for Flow
-            m.args[0] = this->id; // ID of channel for the filter
-            m.args[1] = filters[i]->id; // Filter ID to set on Macchina
-            m.args[2] = filters[i]->type; // Type of filter
-            // Copy the first 4 the bytes for each filter, the rest we can do in Software later
-            memcpy(&m.args[3], &pMaskMsg->Data[0], 4);
-            memcpy(&m.args[7], &pPatternMsg->Data[0], 4);
-            if (FilterType == FLOW_CONTROL_FILTER) {
-                memcpy(&m.args[11], &pFlowControlMsg->Data[0], 4);
-            }
-            usbcomm::sendMsg(&m);
-            LOGGER.logDebug("CAN_FILT", "Adding filter with ID %lu", *pFilterID);
-            return STATUS_NOERROR;
-        }
-    }
-    // No more free filters
-    LOGGER.logError("CAN_FILT", "Cannot add any more filters - Limit exceeded");
-    return ERR_EXCEEDED_LIMIT;
-}
-
-int channel::remove_filter(unsigned long filterID)
-{
-    // Filter doesn't exit?
-    if (filters[filterID - 1] == nullptr) {
-        LOGGER.logError("CAN_FILT", "Cannot remove filter with ID of %lu, does not exist!", filterID);
-        return ERR_INVALID_MSG_ID;
-    }
-    LOGGER.logDebug("CAN_FILT", "Removing filter with ID %lu", filterID);
-    // Filter exists, remove it
-    delete filters[filterID - 1];
-    filters[filterID - 1] = nullptr;
-    PCMSG m = { 0x00 };
-    m.cmd_id = CMD_CHANNEL_REM_FILTER;
-    m.arg_size = 2; // 1 for CID, 1 for FID
-    m.args[0] = this->id;
-    m.args[1] = filterID;
-    usbcomm::sendMsg(&m);
-    return STATUS_NOERROR;
-}
-
-int channel::removeChannel()
-{
-    PCMSG m = {
-        CMD_CHANNEL_DESTROY,
-        1,
-    };
-    m.args[0] = this->id;
-    // Ensure Macchina removed the channel
-    PCMSG resp = {};
-    switch (usbcomm::sendMsgResp(&m, &resp))
-    {
-    case CMD_RES::CMD_OK:
-        return STATUS_NOERROR;
-    case CMD_RES::SEND_FAIL:
-        return ERR_DEVICE_NOT_CONNECTED;
-    case CMD_RES::CMD_FAIL:
-        LOGGER.logError("CHAN_DEL", "Macchina failed to remove channel");
-        return m.args[1];
-    case CMD_RES::CMD_TIMEOUT:
-        globals::setErrorString(usbcomm::getLastError());
-        return ERR_FAILED;
-    default:
-        LOGGER.logError("CHAN_DEL", "WTF - CMD_RES invalid??");
-        globals::setErrorString("CMD_RES invalid");
-        return ERR_FAILED;
-    }
-}
-
-void channel::recvData(uint8_t* m, uint16_t len)
-{
-    if (this->handler != nullptr) {
-        this->handler->recvData(m, len);
-    }
-}
-
-int channel::requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout)
-{
-    if (this->handler != nullptr) {
-        return this->handler->requestData(pMsg, pNumMsgs, Timeout);
-    }
-    return ERR_FAILED;
-}
\ No newline at end of file
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "pch.h"
+#include "channel.h"
+#include "Logger.h"
+#include "globals.h"
+#include "ioctl_handler.h"
+#include "latency_trace.h"
+
+
+
+std::tuple<int, unsigned long> channel_group::addChannel(unsigned long ProtocolID, unsigned long Flags, unsigned long Baudrate)
+{
+    unsigned long chanid = getFreeChannelID();
+    if (chanid != 0) {
+        channel c = channel(chanid);
+        int res;
+        // Firstly, set protocol
+        res = c.setProtocol(ProtocolID);
+        if (res != STATUS_NOERROR) {
+            LOGGER.logError("CHAN_GROUP", "Error setting channel protocol!");
+            return std::make_tuple(res, 0);
+        }
+        // Then, set channel flags
+        res = c.setFlags(Flags);
+        if (res != STATUS_NOERROR) {
+            LOGGER.logError("CHAN_GROUP", "Error setting channel flags!");
+            return std::make_tuple(res, 0);
+        }
+        // Set channel baud rate
+        res = c.setBaud(Baudrate);
+        if (res != STATUS_NOERROR) {
+            LOGGER.logError("CHAN_GROUP", "Error setting channel baudrate!");
+            return std::make_tuple(res, 0);
+        }
+        // Now channel is setup here, deploy on the Macchina!
+        res = c.setMacchinaChannel();
+        if (res != STATUS_NOERROR) {
+            LOGGER.logError("CHAN_GROUP", "Error deploying channel on macchina!");
+            return std::make_tuple(res, 0);
+        }
+        this->channels.emplace(std::make_pair(chanid, c));
+        LOGGER.logDebug("CHAN_GROUP", "Created channel OK. Id is %lu", chanid);
+    }
+    else {
+        LOGGER.logError("CHAN_GROUP", "Error creating channel!");
+        globals::setErrorString("No more free channels");
+        return std::make_tuple(ERR_FAILED, chanid);
+    }
+    return std::make_tuple(STATUS_NOERROR, chanid);
+}
+
+int channel_group::removeChannel(unsigned long channelid)
+{
+    used[channelid - 1] = false;
+    if (channels.find(channelid) != channels.end()) {
+        int ret = channels.at(channelid).removeChannel();
+        channels.erase(channelid);
+        return ret;
+    }
+    return ERR_INVALID_CHANNEL_ID; // Channel doesn't exist??
+}
+
+// PassThruClose - Everything the application left connected
+void channel_group::removeAll()
+{
+    while (!channels.empty()) {
+        this->removeChannel(channels.begin()->first);
+    }
+}
+
+// Called once the device is back after dropping off. It may have been reset, or still have channels
+// from before, so clear it out and then put every channel back how the application left it
+int channel_group::replay()
+{
+    std::vector<PCMSG> msgs;
+    PCMSG exit = { CMD_EXIT };
+    msgs.push_back(exit);
+    for (auto& c : this->channels) {
+        c.second.replayMsgs(&msgs);
+    }
+    int failed = usbcomm::sendPipelined(msgs);
+    if (failed != 0) {
+        LOGGER.logError("CHAN_GROUP", "%d of %u messages failed restoring %u channel(s)", failed, (unsigned)msgs.size(), (unsigned)this->channels.size());
+        return ERR_FAILED;
+    }
+    LOGGER.logInfo("CHAN_GROUP", "Restored %u channel(s) with %u messages", (unsigned)this->channels.size(), (unsigned)msgs.size());
+    return STATUS_NOERROR;
+}
+
+void channel_group::recvPayload(PCMSG* m)
+{
+    // We know its channel data coming into this function
+    channel* chan = getChannelWithID(m->args[0]);
+    if (chan == nullptr) {
+        LOGGER.logError("CHAN_RECV", "Cannot send data to requested channel %d (Channel does not exist)", m->args[0]);
+    }
+    else {
+        chan->recvData(&m->args[1], m->arg_size-1); // Arg 0 is the Channel ID
+    }
+}
+
+void channel_group::recvPayloadPart(PCMSG* m)
+{
+    channel* chan = getChannelWithID(m->args[0]);
+    if (chan == nullptr) {
+        LOGGER.logError("CHAN_RECV", "Cannot send data part to requested channel %d (Channel does not exist)", m->args[0]);
+        return;
+    }
+    if (m->arg_size < DATA_PART_HEADER_SIZE) {
+        LOGGER.logError("CHAN_RECV", "Data part for channel %d is too small", m->args[0]);
+        return;
+    }
+    uint32_t total, offset;
+    memcpy(&total, &m->args[1], 4);
+    memcpy(&offset, &m->args[5], 4);
+    chan->recvDataPart(total, offset, &m->args[DATA_PART_HEADER_SIZE], m->arg_size - DATA_PART_HEADER_SIZE);
+}
+
+int channel_group::requestChannelData(unsigned long ChannelID, PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout)
+{
+   channel* chan = getChannelWithID(ChannelID);
+   if (chan == nullptr) {
+       return ERR_INVALID_CHANNEL_ID;
+   }
+   return chan->requestData(pMsg, pNumMsgs, Timeout);
+}
+
+int channel_group::set_config(unsigned long ChannelID, SCONFIG_LIST* pInput)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->setConfig(pInput);
+}
+
+int channel_group::get_config(unsigned long ChannelID, SCONFIG_LIST* pInput)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->getConfig(pInput);
+}
+
+int channel_group::ioctl(unsigned long ChannelID, unsigned long IoctlID, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->ioctl(IoctlID, in, in_len, out, out_len);
+}
+
+int channel_group::get_drop_counts(unsigned long ChannelID, MACCHINA_DROP_COUNTS* pOutput)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->getDropCounts(pOutput);
+}
+
+int channel_group::get_stats(unsigned long ChannelID, MACCHINA_DRIVER_STATS* pOutput, bool reset)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->getStats(pOutput, reset);
+}
+
+int channel_group::set_latency_trace(unsigned long ChannelID, bool state)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->setLatencyTrace(state);
+}
+
+int channel_group::start_periodic(unsigned long ChannelID, PASSTHRU_MSG* pMsg, unsigned long* pMsgID, unsigned long TimeInterval)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->startPeriodic(pMsg, pMsgID, TimeInterval);
+}
+
+int channel_group::stop_periodic(unsigned long ChannelID, unsigned long MsgID)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->stopPeriodic(MsgID);
+}
+
+int channel_group::clear_periodic(unsigned long ChannelID)
+{
+    channel* chan = getChannelWithID(ChannelID);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->clearPeriodic();
+}
+
+unsigned long channel_group::getFreeChannelID()
+{
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        if (used[i] == false) { // Channel isn't being used
+            used[i] = true; // Channel is now marked as used
+            return i + 1; // Return +1 to where we are in the array (ID 0 indicates no channel created)
+        }
+    }
+    LOGGER.logError("CHAN_GROUP", "No free channels!");
+    return 0;
+}
+
+int channel_group::setFilter(unsigned long channel_id, unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID)
+{
+    channel* chan = getChannelWithID(channel_id);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }  
+    return chan->setFilter(FilterType, pMaskMsg, pPatternMsg, pFlowControlMsg, pFilterID);
+}
+
+int channel_group::remove_filter(unsigned long channel_id, unsigned long filterID)
+{
+    channel* chan = getChannelWithID(channel_id);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    return chan->remove_filter(filterID);
+}
+
+int channel_group::send_payload(unsigned long channel_id, PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long timeout)
+{
+    channel* chan = getChannelWithID(channel_id);
+    if (chan == nullptr) {
+        return ERR_INVALID_CHANNEL_ID;
+    }
+    LOGGER.logInfo("CHAN_SEND", "Sending %lu messages to channel %lu", *pNumMsgs, channel_id);
+    return chan->sendPayloads(pMsg, pNumMsgs, timeout);
+}
+
+channel* channel_group::getChannelWithID(unsigned long id)
+{
+    try {
+        return &this->channels.at(id);
+    }
+    catch (std::exception) {
+        return nullptr;
+    }
+}
+
+channel_group channels = channel_group();
+
+channel::channel(unsigned long id)
+{
+    this->id = id;
+    this->macchinaProtocolID = 0x00;
+}
+
+int channel::setProtocol(unsigned long ProtocolID)
+{
+
+    switch (ProtocolID) {
+    case ISO15765:
+        this->handler = new iso15765_handler(this->id);
+        this->macchinaProtocolID = PROTOCOL_ISO15765;
+        break;
+    case ISO9141:
+        this->handler = new iso9141_handler(this->id, ISO9141);
+        this->macchinaProtocolID = PROTOCOL_ISO9141;
+        break;
+    case ISO14230:
+        this->handler = new iso9141_handler(this->id, ISO14230);
+        this->macchinaProtocolID = PROTOCOL_ISO14230;
+        break;
+    case CAN:
+        this->handler = new can_handler(this->id);
+        this->macchinaProtocolID = PROTOCOL_CAN;
+        break;
+    default:
+        LOGGER.logError("CHAN_PROT", "Unsupported protocol %lu", ProtocolID);
+        return ERR_INVALID_PROTOCOL_ID;
+    }
+    return STATUS_NOERROR;
+}
+
+int channel::setFlags(unsigned long Flags)
+{
+    if (this->handler == nullptr) {
+        globals::setErrorString("Handler is null");
+        return ERR_FAILED;
+    }
+    this->handler->setFlags(Flags);
+    return STATUS_NOERROR;
+}
+
+int channel::setBaud(unsigned long Baudrate)
+{
+    if (this->handler == nullptr) {
+        globals::setErrorString("Handler is null");
+        return ERR_FAILED;
+    }
+    this->handler->setBaud(Baudrate);
+    return STATUS_NOERROR;
+}
+
+void channel::createMsg(PCMSG* m)
+{
+    // Paylaod args format
+    // 0 - Channel ID
+    // 1 - Protocol ID
+    // 2-5 - Baud rate of channel
+    // 6-9 - Connect flags (CAN_29BIT_ID, ISO15765_ADDR_TYPE...)
+    // 10-11 - RX window (See CMD_CREDIT)
+    memset(m, 0x00, sizeof(PCMSG));
+    m->cmd_id = CMD_CHANNEL_CREATE;
+    m->arg_size = 12;
+    m->args[0] = (uint8_t)this->id;
+    m->args[1] = this->macchinaProtocolID;
+    uint32_t baud = handler->getBaud();
+    memcpy(&m->args[2], &baud, 4);
+    uint32_t flags = handler->getFlags();
+    memcpy(&m->args[6], &flags, 4);
+    uint16_t rx_window = handler->rxRoom();
+    memcpy(&m->args[10], &rx_window, 2);
+}
+
+// Flow control starts before the create goes out, so Macchina's first TX limit can't be missed
+void channel::openCredits(PCMSG* create)
+{
+    uint16_t rx_window;
+    memcpy(&rx_window, &create->args[10], 2);
+    usbcomm::openCredits((uint8_t)this->id, this->macchinaProtocolID == PROTOCOL_CAN, rx_window);
+}
+
+int channel::setMacchinaChannel()
+{
+    PCMSG m;
+    this->createMsg(&m);
+    this->openCredits(&m);
+    PCMSG resp = {};
+    CMD_RES res = usbcomm::sendMsgResp(&m, &resp);
+    if (res != CMD_RES::CMD_OK) {
+        usbcomm::closeCredits((uint8_t)this->id);
+    }
+    switch (res)
+    {
+    case CMD_RES::CMD_OK:
+        return STATUS_NOERROR;
+    case CMD_RES::SEND_FAIL:
+        return ERR_DEVICE_NOT_CONNECTED;
+    case CMD_RES::CMD_TIMEOUT:
+        globals::setErrorString(usbcomm::getLastError());
+        return ERR_FAILED;
+    case CMD_RES::CMD_FAIL:
+        return resp.resp_code;
+    default:
+        return ERR_FAILED;
+    }
+}
+
+int channel::sendPayload(PASSTHRU_MSG* msg)
+{
+    if (msg->DataSize > sizeof(msg->Data)) {
+        return ERR_INVALID_MSG;
+    }
+    LOGGER.logDebug("HANDLER", "WRITE --> Contents: %s", LOGGER.bytesToString(msg->Data, msg->DataSize).c_str());
+    PCMSG m = { 0x00 };
+    m.args[0] = (uint8_t)this->id;
+    // Fits in one message
+    if (msg->DataSize <= sizeof(m.args) - 1) {
+        m.arg_size = msg->DataSize + 1; // +1 for channel ID
+        m.cmd_id = CMD_CHANNEL_DATA; // Sending data
+        m.trace_id = this->traceID();
+        memcpy(&m.args[1], msg->Data, msg->DataSize);
+        return usbcomm::sendMsg(&m) ? STATUS_NOERROR : ERR_DEVICE_NOT_CONNECTED;
+    }
+    // Too big (Large ISO15765 payloads), stream it over in parts
+    m.cmd_id = CMD_CHANNEL_DATA_PART;
+    uint32_t total = msg->DataSize;
+    memcpy(&m.args[1], &total, 4);
+    for (uint32_t offset = 0; offset < total; offset += DATA_PART_MAX_BYTES) {
+        uint16_t part_len = (uint16_t)min(DATA_PART_MAX_BYTES, total - offset);
+        memcpy(&m.args[5], &offset, 4);
+        memcpy(&m.args[DATA_PART_HEADER_SIZE], &msg->Data[offset], part_len);
+        m.arg_size = DATA_PART_HEADER_SIZE + part_len;
+        if (offset + part_len == total) { // Device transmits once the last part arrives
+            m.trace_id = this->traceID();
+        }
+        if (!usbcomm::sendMsg(&m)) {
+            return ERR_DEVICE_NOT_CONNECTED;
+        }
+    }
+    return STATUS_NOERROR;
+}
+
+int channel::sendPayloads(PASSTHRU_MSG* msgs, unsigned long* pNumMsgs, unsigned long Timeout)
+{
+    if (this->latency_trace) {
+        this->write_us = latency_trace::now_us();
+    }
+    int res = STATUS_NOERROR;
+    if (this->macchinaProtocolID == PROTOCOL_CAN) {
+        res = this->sendCanBatch(msgs, pNumMsgs, Timeout);
+    } else {
+        for (unsigned long i = 0; i < *pNumMsgs; i++) {
+            // The device would drop a multi frame payload sent whilst the last one is still going
+            iso15765_handler* iso = nullptr;
+            if (this->macchinaProtocolID == PROTOCOL_ISO15765 && msgs[i].DataSize >= ISO15765_MULTI_FRAME_SIZE) {
+                iso = static_cast<iso15765_handler*>(this->handler);
+                if (!iso->startTx(Timeout)) {
+                    res = Timeout == 0 ? ERR_BUFFER_FULL : ERR_TIMEOUT;
+                    *pNumMsgs = i;
+                    break;
+                }
+            }
+            res = this->sendPayload(&msgs[i]);
+            if (res != STATUS_NOERROR) {
+                if (iso != nullptr) {
+                    iso->endTx(); // No indication is coming for it
+                }
+                *pNumMsgs = i;
+                break;
+            }
+        }
+    }
+    unsigned long bytes = 0;
+    for (unsigned long i = 0; i < *pNumMsgs; i++) {
+        bytes += msgs[i].DataSize;
+    }
+    this->handler->countTx(*pNumMsgs, bytes);
+    return res;
+}
+
+// Packs raw CAN frames into as few messages as possible, the device writes them straight into its Tx mailboxes.
+// Each batch only holds as many frames as Macchina has room for (See CMD_CREDIT), so none are dropped there
+int channel::sendCanBatch(PASSTHRU_MSG* msgs, unsigned long* pNumMsgs, unsigned long Timeout)
+{
+    PCMSG m = { 0x00 };
+    m.cmd_id = CMD_CHANNEL_DATA;
+    m.args[0] = (uint8_t)this->id;
+    unsigned long sent = 0;
+    while (sent < *pNumMsgs) {
+        // Frames that fit in the next batch
+        unsigned long end = sent;
+        uint16_t size = 1; // After channel ID
+        while (end < *pNumMsgs && msgs[end].DataSize >= 4 && msgs[end].DataSize <= 12 && size + CAN_TX_RECORD_HDR + msgs[end].DataSize - 4 <= 1 + CAN_BATCH_SIZE) {
+            size += (uint16_t)(CAN_TX_RECORD_HDR + msgs[end].DataSize - 4);
+            end++;
+        }
+        if (end == sent) {
+            LOGGER.logError("CHAN_SEND", "Invalid CAN message size %lu", msgs[sent].DataSize);
+            *pNumMsgs = sent;
+            return ERR_INVALID_MSG;
+        }
+        uint16_t credits = usbcomm::takeTxCredits((uint8_t)this->id, (uint16_t)(end - sent), Timeout);
+        if (credits == 0) { // Macchina's Tx ring is still full
+            *pNumMsgs = sent;
+            return Timeout == 0 ? ERR_BUFFER_FULL : ERR_TIMEOUT;
+        }
+        end = sent + credits;
+        uint16_t pos = 1;
+        for (unsigned long i = sent; i < end; i++) {
+            PASSTHRU_MSG* msg = &msgs[i];
+            uint8_t dlc = (uint8_t)(msg->DataSize - 4);
+            m.args[pos] = dlc;
+            if ((msg->TxFlags | this->handler->getFlags()) & CAN_29BIT_ID) {
+                m.args[pos] |= CAN_RECORD_EXT;
+            }
+            memcpy(&m.args[pos + 1], msg->Data, msg->DataSize); // CAN ID + data
+            pos += CAN_TX_RECORD_HDR + dlc;
+        }
+        m.arg_size = pos;
+        m.trace_id = this->traceID();
+        if (!usbcomm::sendMsg(&m)) {
+            *pNumMsgs = sent;
+            return ERR_DEVICE_NOT_CONNECTED;
+        }
+        sent = end;
+    }
+    return STATUS_NOERROR;
+}
+
+int channel::setFilter(unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID)
+{
+    // Safety test - if filter is 0x03, then pFlowControlMsg must NOT be null as laid out in spec!
+    if (FilterType == FLOW_CONTROL_FILTER && pFlowControlMsg == nullptr) {
+        LOGGER.logError("CHAN_FILT", "Flow control filter wanted but pFlowControlMsg is null!");
+        return ERR_NULL_PARAMETER;
+    }
+
+    // Check if we have avaliable channel filters
+    for (int i = 0; i < CHANNEL_MAX_FILTERS; i++) {
+        if (filters[i] == nullptr) { // Found a free slot, allocate it
+            filters[i] = new handler_filter{ 0x00 };
+
+            // Set filter values
+            filters[i]->id = i+1;
+            *pFilterID = (unsigned long)(i + 1);
+            filters[i]->type = (uint8_t)FilterType;
+            filters[i]->mask = *pMaskMsg;
+            filters[i]->filter = *pPatternMsg;
+            if (FilterType == FLOW_CONTROL_FILTER) { // Only copy if flow control (else pFlowControl is nullptr)
+                filters[i]->flow = *pFlowControlMsg;
+            }
+
+            // Send it to Macchina. If that fails its still kept, and goes out on reconnect
+            PCMSG m;
+            this->filterMsg(filters[i], &m);
+            usbcomm::sendMsg(&m);
+            LOGGER.logDebug("CAN_FILT", "Adding filter with ID %lu", *pFilterID);
+            return STATUS_NOERROR;
+        }
+    }
+    // No more free filters
+    LOGGER.logError("CAN_FILT", "Cannot add any more filters - Limit exceeded");
+    return ERR_EXCEEDED_LIMIT;
+}
+
+void channel::filterMsg(handler_filter* f, PCMSG* m)
+{
+    memset(m, 0x00, sizeof(PCMSG));
+    m->cmd_id = CMD_CHANNEL_SET_FILTER;
+    m->arg_size = FILTER_ARGS_SIZE;
+    m->args[0] = this->id; // ID of channel for the filter
+    m->args[1] = f->id; // Filter ID to set on Macchina
+    m->args[2] = f->type; // Type of filter
+    // Copy the first 4 the bytes for each filter, the rest we can do in Software later
+    memcpy(&m->args[3], &f->mask.Data[0], 4);
+    memcpy(&m->args[7], &f->filter.Data[0], 4);
+    if (f->type == FLOW_CONTROL_FILTER) {
+        memcpy(&m->args[11], &f->flow.Data[0], 4);
+    }
+    // ISO15765 extended addressing - The byte after the CAN ID is the target address
+    if (f->mask.DataSize > 4 && f->filter.DataSize > 4) {
+        m->args[15] = f->mask.Data[4];
+        m->args[16] = f->filter.Data[4];
+    }
+    if (f->type == FLOW_CONTROL_FILTER && f->flow.DataSize > 4) {
+        m->args[17] = f->flow.Data[4];
+    }
+}
+
+int channel::remove_filter(unsigned long filterID)
+{
+    // Filter doesn't exit?
+    if (filters[filterID - 1] == nullptr) {
+        LOGGER.logError("CAN_FILT", "Cannot remove filter with ID of %lu, does not exist!", filterID);
+        return ERR_INVALID_MSG_ID;
+    }
+    LOGGER.logDebug("CAN_FILT", "Removing filter with ID %lu", filterID);
+    // Filter exists, remove it
+    delete filters[filterID - 1];
+    filters[filterID - 1] = nullptr;
+    PCMSG m = { 0x00 };
+    m.cmd_id = CMD_CHANNEL_REM_FILTER;
+    m.arg_size = 2; // 1 for CID, 1 for FID
+    m.args[0] = this->id;
+    m.args[1] = filterID;
+    usbcomm::sendMsg(&m);
+    return STATUS_NOERROR;
+}
+
+// Device sends the message itself, so the interval holds no matter how busy the PC is
+int channel::startPeriodic(PASSTHRU_MSG* pMsg, unsigned long* pMsgID, unsigned long TimeInterval)
+{
+    if (pMsg == nullptr || pMsgID == nullptr) {
+        return ERR_NULL_PARAMETER;
+    }
+    if (TimeInterval < 5 || TimeInterval > 65535) {
+        return ERR_INVALID_TIME_INTERVAL;
+    }
+    PCMSG m = { 0x00 };
+    m.cmd_id = CMD_CHANNEL_START_PERIODIC;
+    m.args[0] = (uint8_t)this->id;
+    uint32_t interval = TimeInterval;
+    memcpy(&m.args[2], &interval, 4);
+    uint16_t len;
+    if (this->macchinaProtocolID == PROTOCOL_CAN) { // Single batch record, same as sendCanBatch
+        if (pMsg->DataSize < 4 || pMsg->DataSize > 12) {
+            return ERR_INVALID_MSG;
+        }
+        len = (uint16_t)(CAN_TX_RECORD_HDR + pMsg->DataSize - 4);
+        m.args[PERIODIC_HEADER_SIZE] = (uint8_t)(pMsg->DataSize - 4);
+        if ((pMsg->TxFlags | this->handler->getFlags()) & CAN_29BIT_ID) {
+            m.args[PERIODIC_HEADER_SIZE] |= CAN_RECORD_EXT;
+        }
+        memcpy(&m.args[PERIODIC_HEADER_SIZE + 1], pMsg->Data, pMsg->DataSize);
+    } else {
+        if (pMsg->DataSize == 0 || pMsg->DataSize > PERIODIC_MAX_DATA) {
+            return ERR_INVALID_MSG;
+        }
+        len = (uint16_t)pMsg->DataSize;
+        memcpy(&m.args[PERIODIC_HEADER_SIZE], pMsg->Data, pMsg->DataSize);
+    }
+    for (int i = 0; i < CHANNEL_MAX_PERIODIC; i++) {
+        if (!this->periodic_used[i]) {
+            m.args[1] = i + 1;
+            m.arg_size = PERIODIC_HEADER_SIZE + len;
+            if (!usbcomm::sendMsg(&m)) {
+                return ERR_DEVICE_NOT_CONNECTED;
+            }
+            this->periodic_used[i] = true;
+            this->periodic[i] = m;
+            *pMsgID = i + 1;
+            LOGGER.logDebug("PERIODIC", "Started periodic message %lu every %lu ms", *pMsgID, TimeInterval);
+            return STATUS_NOERROR;
+        }
+    }
+    LOGGER.logError("PERIODIC", "Cannot start any more periodic messages - Limit exceeded");
+    return ERR_EXCEEDED_LIMIT;
+}
+
+int channel::stopPeriodic(unsigned long MsgID)
+{
+    if (MsgID == 0 || MsgID > CHANNEL_MAX_PERIODIC || !this->periodic_used[MsgID - 1]) {
+        LOGGER.logError("PERIODIC", "Cannot stop periodic message with ID of %lu, does not exist!", MsgID);
+        return ERR_INVALID_MSG_ID;
+    }
+    PCMSG m = { 0x00 };
+    m.cmd_id = CMD_CHANNEL_STOP_PERIODIC;
+    m.arg_size = 2; // 1 for CID, 1 for message ID
+    m.args[0] = (uint8_t)this->id;
+    m.args[1] = (uint8_t)MsgID;
+    this->periodic_used[MsgID - 1] = false;
+    return usbcomm::sendMsg(&m) ? STATUS_NOERROR : ERR_DEVICE_NOT_CONNECTED;
+}
+
+int channel::clearPeriodic()
+{
+    memset(this->periodic_used, 0x00, sizeof(this->periodic_used));
+    return this->ioctl(CLEAR_PERIODIC_MSGS, nullptr, 0, nullptr, nullptr);
+}
+
+int channel::removeChannel()
+{
+    usbcomm::closeCredits((uint8_t)this->id); // Lets a write waiting on credits give up
+    PCMSG m = {
+        CMD_CHANNEL_DESTROY,
+        0,
+        1,
+    };
+    m.args[0] = this->id;
+    // Ensure Macchina removed the channel
+    PCMSG resp = {};
+    switch (usbcomm::sendMsgResp(&m, &resp))
+    {
+    case CMD_RES::CMD_OK:
+        return STATUS_NOERROR;
+    case CMD_RES::SEND_FAIL:
+        return ERR_DEVICE_NOT_CONNECTED;
+    case CMD_RES::CMD_FAIL:
+        LOGGER.logError("CHAN_DEL", "Macchina failed to remove channel");
+        return resp.resp_code;
+    case CMD_RES::CMD_TIMEOUT:
+        globals::setErrorString(usbcomm::getLastError());
+        return ERR_FAILED;
+    default:
+        LOGGER.logError("CHAN_DEL", "WTF - CMD_RES invalid??");
+        globals::setErrorString("CMD_RES invalid");
+        return ERR_FAILED;
+    }
+}
+
+// Same order the application set the channel up in. Only the ones Macchina answers wait for a response
+void channel::replayMsgs(std::vector<PCMSG>* msgs)
+{
+    PCMSG m;
+    this->createMsg(&m);
+    this->openCredits(&m); // Macchina starts counting again from the create
+    if (this->macchinaProtocolID == PROTOCOL_ISO15765) {
+        static_cast<iso15765_handler*>(this->handler)->endTx(); // Along with anything it was sending
+    }
+    m.__require_response = true;
+    msgs->push_back(m);
+    for (auto& c : this->config) {
+        uint32_t pair[2] = { c.first, c.second };
+        if (this->isDeviceParam(c.first) && ioctl_handler::make_ioctl((uint8_t)this->id, SET_CONFIG, (uint8_t*)pair, sizeof(pair), &m)) {
+            m.__require_response = true;
+            msgs->push_back(m);
+        }
+    }
+    if (this->monitor) {
+        uint8_t state = 1;
+        ioctl_handler::make_ioctl((uint8_t)this->id, MACCHINA_IOCTL_SET_MONITOR, &state, 1, &m);
+        m.__require_response = true;
+        msgs->push_back(m);
+    }
+    for (int i = 0; i < CHANNEL_MAX_FILTERS; i++) {
+        if (this->filters[i] != nullptr) {
+            this->filterMsg(this->filters[i], &m);
+            msgs->push_back(m);
+        }
+    }
+    for (int i = 0; i < CHANNEL_MAX_PERIODIC; i++) {
+        if (this->periodic_used[i]) {
+            msgs->push_back(this->periodic[i]);
+        }
+    }
+}
+
+void channel::recvData(uint8_t* m, uint16_t len)
+{
+    if (this->handler != nullptr) {
+        this->handler->recvData(m, len);
+    }
+}
+
+void channel::recvDataPart(uint32_t total, uint32_t offset, uint8_t* m, uint16_t len)
+{
+    if (total > sizeof(PASSTHRU_MSG::Data) || offset + len > total) {
+        LOGGER.logError("CHAN_RECV", "Invalid data part (Total %lu, offset %lu, len %u)", total, offset, len);
+        return;
+    }
+    if (offset == 0) { // First part, start again
+        this->rx_parts.clear();
+        this->rx_parts.reserve(total);
+    }
+    if (offset != this->rx_parts.size()) {
+        LOGGER.logError("CHAN_RECV", "Data part out of order. Want offset %lu, got %lu", this->rx_parts.size(), offset);
+        this->rx_parts.clear();
+        return;
+    }
+    this->rx_parts.insert(this->rx_parts.end(), m, m + len);
+    if (this->rx_parts.size() == total) {
+        this->recvData(this->rx_parts.data(), (uint16_t)total);
+        this->rx_parts.clear();
+    }
+}
+
+int channel::requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout)
+{
+    if (this->handler == nullptr) {
+        return ERR_FAILED;
+    }
+    int res = this->handler->requestData(pMsg, pNumMsgs, Timeout);
+    if (res == STATUS_NOERROR) {
+        usbcomm::giveRxCredits((uint8_t)this->id, this->handler->rxRoom());
+    }
+    return res;
+}
+
+// K-Line timings are enforced on Macchina, so they live there
+bool channel::isDeviceParam(unsigned long Parameter)
+{
+    if (this->macchinaProtocolID == PROTOCOL_ISO15765) {
+        return Parameter == ISO15765_BS || Parameter == ISO15765_STMIN; // Go in Macchina's flow control frames
+    }
+    if (this->macchinaProtocolID != PROTOCOL_ISO9141 && this->macchinaProtocolID != PROTOCOL_ISO14230) {
+        return false;
+    }
+    switch (Parameter) {
+    case P1_MAX:
+    case P3_MIN:
+    case P4_MIN:
+    case W1:
+    case W2:
+    case W3:
+    case W4:
+    case W5:
+    case TIDLE:
+    case TINIL:
+    case TWUP:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int channel::setConfig(SCONFIG_LIST* pInput)
+{
+    for (unsigned long i = 0; i < pInput->NumOfParams; i++) {
+        SCONFIG* c = &pInput->ConfigPtr[i];
+        LOGGER.logDebug("CHAN_CFG", "Setting param %lu to %lu", c->Parameter, c->Value);
+        if (c->Parameter == DATA_RATE && this->handler != nullptr) {
+            this->handler->setBaud(c->Value);
+        }
+        if (this->isDeviceParam(c->Parameter)) {
+            uint32_t pair[2] = { c->Parameter, c->Value };
+            int res = this->ioctl(SET_CONFIG, (uint8_t*)pair, sizeof(pair), nullptr, nullptr);
+            if (res != STATUS_NOERROR) {
+                return res;
+            }
+        }
+        this->config[c->Parameter] = c->Value;
+    }
+    return STATUS_NOERROR;
+}
+
+int channel::getConfig(SCONFIG_LIST* pInput)
+{
+    for (unsigned long i = 0; i < pInput->NumOfParams; i++) {
+        SCONFIG* c = &pInput->ConfigPtr[i];
+        if (c->Parameter == DATA_RATE && this->handler != nullptr) {
+            c->Value = this->handler->getBaud();
+        } else if (this->isDeviceParam(c->Parameter)) {
+            uint32_t param = c->Parameter;
+            uint32_t value = 0;
+            uint16_t len = sizeof(value);
+            int res = this->ioctl(GET_CONFIG, (uint8_t*)&param, sizeof(param), (uint8_t*)&value, &len);
+            if (res != STATUS_NOERROR) {
+                return res;
+            }
+            c->Value = value;
+        } else if (this->config.find(c->Parameter) != this->config.end()) {
+            c->Value = this->config.at(c->Parameter);
+        } else {
+            c->Value = 0; // Never set, so its still the J2534 default
+        }
+    }
+    return STATUS_NOERROR;
+}
+
+int channel::ioctl(unsigned long IoctlID, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len)
+{
+    int res = ioctl_handler::send_ioctl((uint8_t)this->id, IoctlID, in, in_len, out, out_len);
+    if (res == STATUS_NOERROR && IoctlID == MACCHINA_IOCTL_SET_MONITOR && in_len > 0) {
+        this->monitor = in[0] != 0;
+    }
+    return res;
+}
+
+// Filter rejects are counted by the device, so that count needs a trip to Macchina
+int channel::getStats(MACCHINA_DRIVER_STATS* pOutput, bool reset)
+{
+    if (this->handler == nullptr) {
+        return ERR_FAILED;
+    }
+    MACCHINA_DEVICE_STATS dev;
+    int res = ioctl_handler::get_device_stats(nullptr, &dev);
+    if (res != STATUS_NOERROR) {
+        return res;
+    }
+    this->handler->getStats(pOutput, reset);
+    for (unsigned long i = 0; i < MACCHINA_STATS_MAX_CHANNELS; i++) {
+        if (dev.Channels[i].ChannelID == this->id) {
+            pOutput->RxFiltered = dev.Channels[i].RxFiltered - this->filtered_base;
+            if (reset) {
+                this->filtered_base = dev.Channels[i].RxFiltered;
+            }
+        }
+    }
+    return STATUS_NOERROR;
+}
+
+int channel::setLatencyTrace(bool state)
+{
+    if (state && this->macchinaProtocolID != PROTOCOL_CAN && this->macchinaProtocolID != PROTOCOL_ISO15765) {
+        return ERR_NOT_SUPPORTED; // Only CAN frames are timed on the device
+    }
+    this->latency_trace = state;
+    return STATUS_NOERROR;
+}
+
+// Trace ID for the next message sent to the device, 0 if this channel is not being traced
+uint16_t channel::traceID()
+{
+    if (!this->latency_trace) {
+        return 0;
+    }
+    return latency_trace::begin(this->id, this->write_us);
+}
+
+int channel::getDropCounts(MACCHINA_DROP_COUNTS* pOutput)
+{
+    if (this->handler == nullptr) {
+        return ERR_FAILED;
+    }
+    this->handler->getDropCounts(&pOutput->RxDropped, &pOutput->RxOverwritten);
+    return STATUS_NOERROR;
+}
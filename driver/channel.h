@@ -1,101 +1,144 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-#include <map>
-#include <queue>
-#include <tuple>
-#include "protocol_handler.h"
-#include "usbcomm.h"
-
-#define CHANNEL_SETTING_BAUD     0x01 // Baud rate change - 32bit unsigned long
-#define CHANNEL_SETTING_FLAGS    0x02 // Flag change - 32bit unsigned long
-#define CHANNEL_SETTING_PROTOCOL 0x03 // Protocol change - 1 byte (see below)
-
-// Protocol identifiers for sending to Macchina
-#define PROTOCOL_ISO15765 0x01
-#define PROTOCOL_CAN      0x02
-#define PROTOCOL_ISO9141  0x03
-
-#define PROTOCOL_FILTER_BLOCK 0x01 // Block filter for channel
-#define PROTOCOL_FILTER_PASS  0x02 // Pass filter for channel
-#define PROTOCOL_FILTER_ISO   0x03 // ISO filter (pass filter + Response ID)
-
-/**
-	Class that holds data about 1 channel
-**/
-
-#define CHANNEL_MAX_FILTERS 10
-
-/// <summary>
-/// Struct for storing filter data
-/// </summary>
-struct handler_filter {
-	uint8_t id; // Unique ID per channel
-	uint8_t type; // Type of filter
-	PASSTHRU_MSG mask; // Mask
-	PASSTHRU_MSG filter; // Filter
-	PASSTHRU_MSG flow; // Flow control CAN ID for ISO15765
-};
-
-class channel
-{
-public:
-	channel(unsigned long id);
-	int setProtocol(unsigned long ProtocolID);
-	int setFlags(unsigned long Flags);
-	int setBaud(unsigned long Baudrate);
-	int setMacchinaChannel(); // Sets the channel up on Macchina
-	int sendPayload(PASSTHRU_MSG* msg);
-	int setFilter(unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID);
-	int remove_filter(unsigned long filterID);
-	int removeChannel();
-	void recvData(uint8_t* m, uint16_t len);
-	int requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout);
-private:
-	protocol_handler* handler = nullptr;
-	uint8_t macchinaProtocolID;
-	handler_filter* filters[CHANNEL_MAX_FILTERS] = { nullptr };
-	unsigned long id;
-};
-
-
-/**
-	Class that holds a group of channels
-**/
-class channel_group {
-#define MAX_CHANNELS 10
-private:
-	std::map<unsigned long, channel> channels;
-	unsigned long getFreeChannelID();
-	bool used[MAX_CHANNELS] = { false };
-public:
-	int setFilter(unsigned long channel_id, unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID);
-	int remove_filter(unsigned long channel_id,  unsigned long filterID);
-	int send_payload(unsigned long channel_id, PASSTHRU_MSG *pMsg, unsigned long* pNumMsgs, unsigned long timeout);
-	channel* getChannelWithID(unsigned long id);
-	std::tuple<int, unsigned long> addChannel(unsigned long ProtocolID, unsigned long Flags, unsigned long Baudrate);
-	int removeChannel(unsigned long channelid);
-	void recvPayload(PCMSG* m);
-	int requestChannelData(unsigned long ChannelID, PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout);
-};
-
-extern channel_group channels;
-
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+#include <map>
+#include <queue>
+#include <tuple>
+#include <vector>
+#include "protocol_handler.h"
+#include "usbcomm.h"
+#include "macchina_j2534_ext.h"
+
+#define CHANNEL_SETTING_BAUD     0x01 // Baud rate change - 32bit unsigned long
+#define CHANNEL_SETTING_FLAGS    0x02 // Flag change - 32bit unsigned long
+#define CHANNEL_SETTING_PROTOCOL 0x03 // Protocol change - 1 byte (see below)
+
+// Protocol identifiers for sending to Macchina
+#define PROTOCOL_ISO15765 0x01
+#define PROTOCOL_CAN      0x02
+#define PROTOCOL_ISO9141  0x03
+#define PROTOCOL_ISO14230 0x04
+
+#define PROTOCOL_FILTER_BLOCK 0x01 // Block filter for channel
+#define PROTOCOL_FILTER_PASS  0x02 // Pass filter for channel
+#define PROTOCOL_FILTER_ISO   0x03 // ISO filter (pass filter + Response ID)
+
+/**
+	Class that holds data about 1 channel
+**/
+
+#define CHANNEL_MAX_FILTERS 10
+#define CHANNEL_MAX_PERIODIC 10
+#define PERIODIC_MAX_DATA 64 // Device limit, J2534 only allows single frames anyway
+
+/// <summary>
+/// Struct for storing filter data
+/// </summary>
+struct handler_filter {
+	uint8_t id; // Unique ID per channel
+	uint8_t type; // Type of filter
+	PASSTHRU_MSG mask; // Mask
+	PASSTHRU_MSG filter; // Filter
+	PASSTHRU_MSG flow; // Flow control CAN ID for ISO15765
+};
+
+class channel
+{
+public:
+	channel(unsigned long id);
+	int setProtocol(unsigned long ProtocolID);
+	int setFlags(unsigned long Flags);
+	int setBaud(unsigned long Baudrate);
+	int setMacchinaChannel(); // Sets the channel up on Macchina
+	int sendPayload(PASSTHRU_MSG* msg);
+	int sendPayloads(PASSTHRU_MSG* msgs, unsigned long* pNumMsgs, unsigned long Timeout);
+	int setFilter(unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID);
+	int remove_filter(unsigned long filterID);
+	int removeChannel();
+	void recvData(uint8_t* m, uint16_t len);
+	void recvDataPart(uint32_t total, uint32_t offset, uint8_t* m, uint16_t len);
+	int requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout);
+	int setConfig(SCONFIG_LIST* pInput);
+	int getConfig(SCONFIG_LIST* pInput);
+	int ioctl(unsigned long IoctlID, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+	int getDropCounts(MACCHINA_DROP_COUNTS* pOutput);
+	int getStats(MACCHINA_DRIVER_STATS* pOutput, bool reset);
+	int setLatencyTrace(bool state);
+	int startPeriodic(PASSTHRU_MSG* pMsg, unsigned long* pMsgID, unsigned long TimeInterval);
+	int stopPeriodic(unsigned long MsgID);
+	int clearPeriodic();
+	void replayMsgs(std::vector<PCMSG>* msgs); // Everything needed to set this channel up again on a reconnected device
+private:
+	void createMsg(PCMSG* m);
+	void openCredits(PCMSG* create);
+	void filterMsg(handler_filter* f, PCMSG* m);
+	int sendCanBatch(PASSTHRU_MSG* msgs, unsigned long* pNumMsgs, unsigned long Timeout);
+	bool isDeviceParam(unsigned long Parameter);
+	protocol_handler* handler = nullptr;
+	uint8_t macchinaProtocolID;
+	handler_filter* filters[CHANNEL_MAX_FILTERS] = { nullptr };
+	unsigned long id;
+	std::vector<uint8_t> rx_parts; // Payload being assembled from CMD_CHANNEL_DATA_PART
+	std::map<unsigned long, unsigned long> config; // SET_CONFIG parameters
+	bool periodic_used[CHANNEL_MAX_PERIODIC] = { false }; // Periodic messages running on the device
+	PCMSG periodic[CHANNEL_MAX_PERIODIC]; // CMD_CHANNEL_START_PERIODIC that started each of them
+	bool monitor = false; // MACCHINA_IOCTL_SET_MONITOR
+	unsigned long filtered_base = 0; // Device filter reject count when the stats were last reset
+	bool latency_trace = false; // Give every message written a trace ID (MACCHINA_IOCTL_SET_LATENCY_TRACE)
+	uint64_t write_us = 0; // When the application called PassThruWriteMsgs, if tracing
+	uint16_t traceID();
+};
+
+
+/**
+	Class that holds a group of channels
+**/
+class channel_group {
+#define MAX_CHANNELS 10
+private:
+	std::map<unsigned long, channel> channels;
+	unsigned long getFreeChannelID();
+	bool used[MAX_CHANNELS] = { false };
+public:
+	int setFilter(unsigned long channel_id, unsigned long FilterType, PASSTHRU_MSG* pMaskMsg, PASSTHRU_MSG* pPatternMsg, PASSTHRU_MSG* pFlowControlMsg, unsigned long* pFilterID);
+	int remove_filter(unsigned long channel_id,  unsigned long filterID);
+	int send_payload(unsigned long channel_id, PASSTHRU_MSG *pMsg, unsigned long* pNumMsgs, unsigned long timeout);
+	channel* getChannelWithID(unsigned long id);
+	std::tuple<int, unsigned long> addChannel(unsigned long ProtocolID, unsigned long Flags, unsigned long Baudrate);
+	int removeChannel(unsigned long channelid);
+	void removeAll();
+	void recvPayload(PCMSG* m);
+	void recvPayloadPart(PCMSG* m);
+	int requestChannelData(unsigned long ChannelID, PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout);
+	int set_config(unsigned long ChannelID, SCONFIG_LIST* pInput);
+	int get_config(unsigned long ChannelID, SCONFIG_LIST* pInput);
+	int ioctl(unsigned long ChannelID, unsigned long IoctlID, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+	int get_drop_counts(unsigned long ChannelID, MACCHINA_DROP_COUNTS* pOutput);
+	int get_stats(unsigned long ChannelID, MACCHINA_DRIVER_STATS* pOutput, bool reset);
+	int set_latency_trace(unsigned long ChannelID, bool state);
+	int start_periodic(unsigned long ChannelID, PASSTHRU_MSG* pMsg, unsigned long* pMsgID, unsigned long TimeInterval);
+	int stop_periodic(unsigned long ChannelID, unsigned long MsgID);
+	int clear_periodic(unsigned long ChannelID);
+	int replay();
+};
+
+extern channel_group channels;
+
@@ -0,0 +1,117 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+// Not using the precompiled header, the daemon builds this too
+#include "discovery.h"
+#include <windows.h>
+#include <setupapi.h>
+#include <string.h>
+#include <wchar.h>
+
+#pragma comment(lib, "setupapi.lib")
+
+// USB IDs Macchina shows up with
+static const wchar_t* usb_ids[] = {
+	L"VID_2341&PID_003E", // SerialUSB on the M2 (Arduino Due native USB port)
+};
+
+namespace discovery {
+	bool isMacchina(const wchar_t* instance_id) {
+		for (const wchar_t* id : usb_ids) {
+			if (wcsstr(instance_id, id) != NULL) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Every present USB device node, not just the ports class, as composite devices put the port on an interface node
+	std::vector<std::wstring> usbPorts() {
+		std::vector<std::wstring> ports;
+		HDEVINFO set = SetupDiGetClassDevsW(NULL, L"USB", NULL, DIGCF_PRESENT | DIGCF_ALLCLASSES);
+		if (set == INVALID_HANDLE_VALUE) {
+			return ports;
+		}
+		SP_DEVINFO_DATA dev = { sizeof(SP_DEVINFO_DATA) };
+		for (DWORD i = 0; SetupDiEnumDeviceInfo(set, i, &dev); i++) {
+			wchar_t instance_id[256] = { 0x00 };
+			if (!SetupDiGetDeviceInstanceIdW(set, &dev, instance_id, 256, NULL)) {
+				continue;
+			}
+			_wcsupr_s(instance_id, 256);
+			if (!isMacchina(instance_id)) {
+				continue;
+			}
+			HKEY key = SetupDiOpenDevRegKey(set, &dev, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_READ);
+			if (key == INVALID_HANDLE_VALUE) {
+				continue;
+			}
+			wchar_t name[32] = { 0x00 };
+			DWORD size = sizeof(name) - sizeof(wchar_t);
+			DWORD type = 0;
+			if (RegQueryValueExW(key, L"PortName", NULL, &type, (LPBYTE)name, &size) == ERROR_SUCCESS && type == REG_SZ) {
+				ports.push_back(std::wstring(L"\\\\.\\") + name);
+			}
+			RegCloseKey(key);
+		}
+		SetupDiDestroyDeviceInfoList(set);
+		return ports;
+	}
+
+	std::vector<std::wstring> candidatePorts() {
+		std::vector<std::wstring> ports;
+		wchar_t forced[32] = { 0x00 };
+		if (GetEnvironmentVariableW(L"MACCHINA_PORT", forced, 32) > 0 && forced[0] != 0x00) {
+			ports.push_back(wcsncmp(forced, L"\\\\", 2) == 0 ? std::wstring(forced) : std::wstring(L"\\\\.\\") + forced);
+			return ports;
+		}
+		ports = usbPorts();
+		bool has_legacy = false;
+		for (const std::wstring& p : ports) {
+			has_legacy = has_legacy || _wcsicmp(p.c_str(), LEGACY_PORT) == 0;
+		}
+		if (!has_legacy) {
+			ports.push_back(LEGACY_PORT);
+		}
+		return ports;
+	}
+
+	void makeHello(PCMSG* msg) {
+		uint16_t version = PC_PROTOCOL_VERSION;
+		memset(msg, 0x00, sizeof(PCMSG));
+		msg->cmd_id = CMD_HELLO;
+		msg->arg_size = 2;
+		memcpy(msg->args, &version, 2);
+		msg->__require_response = true;
+	}
+
+	bool readHello(const PCMSG* msg, device_info* info) {
+		if (msg->cmd_id != (CMD_HELLO | CMD_RES_FROM_CMD) || msg->resp_code != STATUS_NOERROR || msg->arg_size < 1 + HELLO_SIZE) {
+			return false;
+		}
+		const uint8_t* res = &msg->args[1];
+		memcpy(&info->protocol, &res[0], 2);
+		memcpy(&info->caps, &res[2], 4);
+		info->channels = res[6];
+		info->build.assign((const char*)&res[7], strnlen((const char*)&res[7], HELLO_SIZE - 7));
+		return info->protocol == PC_PROTOCOL_VERSION;
+	}
+}
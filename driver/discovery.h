@@ -0,0 +1,63 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "usbcomm.h"
+
+// Finding Macchina without relying on which COM number Windows gave it. Ports are found
+// from the USB IDs, then each one is sent a CMD_HELLO - only Macchina answers it, and the
+// answer says what the firmware can do. Used by the DLL and by the passthru daemon
+
+#define HELLO_TIMEOUT_MS 250 // Macchina answers in well under 1ms, anything else on the port never will
+#define LEGACY_PORT L"\\\\.\\COM12" // Tried last, in case the device is not using its usual USB IDs
+
+struct device_info {
+	uint16_t protocol; // PC_PROTOCOL_VERSION of the firmware
+	uint32_t caps; // CAP_*
+	uint8_t channels;
+	std::string build; // Firmware build date and time
+};
+
+namespace discovery
+{
+	/// <summary>
+	/// Lists the ports that could be Macchina, most likely first. If the MACCHINA_PORT
+	/// environment variable is set (For example COM5), only that port is returned
+	/// </summary>
+	/// <returns>Device paths, such as \\.\COM5</returns>
+	std::vector<std::wstring> candidatePorts();
+
+	/// <summary>
+	/// Fills in a CMD_HELLO request
+	/// </summary>
+	void makeHello(PCMSG* msg);
+
+	/// <summary>
+	/// Checks a message read back from a candidate port
+	/// </summary>
+	/// <param name="msg">Message read from the port</param>
+	/// <param name="info">Set from the response</param>
+	/// <returns>True if the message is a CMD_HELLO response from a compatible Macchina</returns>
+	bool readHello(const PCMSG* msg, device_info* info);
+};
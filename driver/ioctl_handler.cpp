@@ -1,103 +1,373 @@
-#include "pch.h"
-#include "ioctl_handler.h"
-#include "Logger.h"
-#include "channel.h"
-#include "usbcomm.h"
-#include "globals.h"
-
-int ioctl_handler::set_config(unsigned long channelID, SCONFIG_LIST* pInput)
-{
-    if (pInput == nullptr) { return ERR_NULLPARAMETER; }
-    LOGGER.logDebug("IOCTL", "SET_CONFIG called for channel %d with %d param(s)", channelID, pInput->NumOfParams);
-    return channels.set_config(channelID, pInput);
-}
-
-int ioctl_handler::get_config(unsigned long channelID, SCONFIG_LIST* pInput)
-{
-    if (pInput == nullptr) { return ERR_NULLPARAMETER; }
-    LOGGER.logDebug("IOCTL", "GET_CONFIG called for channel %d. Want %d param(s)", channelID, pInput->NumOfParams);
-    return channels.get_config(channelID, pInput);
-}
-
-int ioctl_handler::read_batt(unsigned long* vbatt)
-{
-    if (vbatt == nullptr) { return ERR_NULLPARAMETER; }
-    LOGGER.logDebug("IOCTL", "READ_VBATT called");
-    PCMSG msg = {
-        CMD_IOCTL_GET,
-        0x01,
-        READ_VBATT
-    };
-    float f;
-    switch (usbcomm::sendMsgResp(&msg, 50)) {
-    case CMD_RES::CMD_OK:
-        *vbatt = (msg.args[1] << 24) & (msg.args[2] << 16) & (msg.args[3] << 8) & msg.args[4];
-        break;
-    default:
-        return ERR_FAILED;
-    }
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::read_prog_voltage(unsigned long* vProg)
-{
-    if (vProg == nullptr) { return ERR_NULLPARAMETER; }
-    LOGGER.logDebug("IOCTL", "READ_PROGRAMMING_VOLTAGE called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::five_baud_init(unsigned long channelID, SBYTE_ARRAY* pInput, SBYTE_ARRAY* pOutput)
-{
-    if (pInput == nullptr || pOutput == nullptr) { return ERR_NULLPARAMETER; }
-    LOGGER.logDebug("IOCTL", "FIVE_BAUD_INIT called with %d target ECU addresses", pInput->NumOfBytes);
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::fast_init(unsigned long channelID, PASSTHRU_MSG* pInput, PASSTHRU_MSG* pOutput)
-{
-    if (pInput == nullptr || pOutput == nullptr) { return ERR_NULLPARAMETER; }
-    LOGGER.logDebug("IOCTL", "FAST_INIT called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::clear_tx_buffers(unsigned long channelID)
-{
-    LOGGER.logDebug("IOCTL", "CLEAR_TX_BUFFERS called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::clear_rx_buffers(unsigned long channelID)
-{
-    LOGGER.logDebug("IOCTL", "CLEAR_RX_BUFFERS called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::clear_periodic_msgs(unsigned long channelID)
-{
-    LOGGER.logDebug("IOCTL", "CLEAR_PERIODIC_MSGS called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::clear_msg_filters(unsigned long channelID)
-{
-    LOGGER.logDebug("IOCTL", "CLEAR_MSG_FILTERS called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::clear_mlt(unsigned long channelID)
-{
-    LOGGER.logDebug("IOCTL", "CLEAR_FUNCT_MSG_LOOKUP_TABLE called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::add_to_mlt(unsigned long channelID, SBYTE_ARRAY* pInput)
-{
-    LOGGER.logDebug("IOCTL", "ADD_TO_FUNCT_MSG_LOOKUP_TABLE called");
-    return STATUS_NOERROR;
-}
-
-int ioctl_handler::del_from_mlt(unsigned long channelID, SBYTE_ARRAY* pInput)
-{
-    LOGGER.logDebug("IOCTL", "DELETE_FROM_FUNCT_MSG_LOOKUP_TABLE called");
-    return STATUS_NOERROR;
-}
+#include "pch.h"
+#include "ioctl_handler.h"
+#include "Logger.h"
+#include "channel.h"
+#include "usbcomm.h"
+#include "globals.h"
+#include "latency_trace.h"
+#include "link_frame.h"
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+namespace ioctl_handler {
+    MACCHINA_AUTOBAUD_RESULT autobaud_results[2] = {}; // Per controller, BaudRate 0 if not found yet
+    std::map<uint8_t, PCMSG> async_results; // CMD_CHANNEL_IOCTL_RESP by channel ID
+    std::mutex async_mutex;
+}
+
+// Device finished an IOCTL it accepted earlier (FIVE_BAUD_INIT, FAST_INIT, MACCHINA_IOCTL_AUTOBAUD)
+void ioctl_handler::recv_async_result(PCMSG* m)
+{
+    if (m->arg_size < IOCTL_RESP_HEADER_SIZE) {
+        LOGGER.logError("IOCTL", "Invalid IOCTL result of %u bytes", m->arg_size);
+        return;
+    }
+    async_mutex.lock();
+    async_results[m->args[0]] = *m;
+    async_mutex.unlock();
+}
+
+// Waits for the device to finish an IOCTL on a channel. out_len is the size of out, and gets set to how much Macchina responded with
+static int wait_async_result(uint8_t channelID, unsigned long IoctlID, uint8_t* out, uint16_t* out_len)
+{
+    clock_t begin_time = clock();
+    PCMSG res = {};
+    bool found = false;
+    while (!found && (clock() - begin_time) < ASYNC_IOCTL_WAIT_MS) {
+        ioctl_handler::async_mutex.lock();
+        auto it = ioctl_handler::async_results.find(channelID);
+        if (it != ioctl_handler::async_results.end()) {
+            res = it->second;
+            ioctl_handler::async_results.erase(it);
+            found = true;
+        }
+        ioctl_handler::async_mutex.unlock();
+        if (!found) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    if (!found) {
+        LOGGER.logError("IOCTL", "Timeout waiting for IOCTL %lu to finish", IoctlID);
+        globals::setErrorString("Timeout waiting for Macchina to finish IOCTL");
+        return ERR_FAILED;
+    }
+    uint32_t id;
+    memcpy(&id, &res.args[1], 4);
+    if (id != IoctlID) {
+        LOGGER.logError("IOCTL", "Wanted result of IOCTL %lu, got %lu", IoctlID, id);
+        return ERR_FAILED;
+    }
+    *out_len = min(*out_len, res.arg_size - IOCTL_RESP_HEADER_SIZE);
+    memcpy(out, &res.args[IOCTL_RESP_HEADER_SIZE], *out_len);
+    return res.args[5];
+}
+
+bool ioctl_handler::make_ioctl(uint8_t channelID, unsigned long IoctlID, uint8_t* in, uint16_t in_len, PCMSG* m)
+{
+    // Args format
+    // 0   - Channel ID
+    // 1-4 - IOCTL ID
+    // 5.. - Input data
+    if (in_len > sizeof(m->args) - 5) {
+        return false;
+    }
+    memset(m, 0x00, sizeof(PCMSG));
+    m->cmd_id = CMD_CHANNEL_IOCTL_REQ;
+    m->arg_size = (uint16_t)(5 + in_len);
+    m->args[0] = channelID;
+    uint32_t ioctl_id = IoctlID;
+    memcpy(&m->args[1], &ioctl_id, 4);
+    if (in_len > 0) {
+        memcpy(&m->args[5], in, in_len);
+    }
+    return true;
+}
+
+// Sends an IOCTL to Macchina (Channel 0 is the device itself). out_len is the size of out, and gets set to how much Macchina responded with
+int ioctl_handler::send_ioctl(uint8_t channelID, unsigned long IoctlID, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len)
+{
+    PCMSG m;
+    if (!make_ioctl(channelID, IoctlID, in, in_len, &m)) {
+        return ERR_INVALID_IOCTL_VALUE;
+    }
+    PCMSG resp = {};
+    switch (usbcomm::sendMsgResp(&m, &resp))
+    {
+    case CMD_RES::CMD_OK:
+        if (out != nullptr && out_len != nullptr) { // Response data starts at arg 1
+            *out_len = min(*out_len, resp.arg_size > 0 ? resp.arg_size - 1 : 0);
+            memcpy(out, &resp.args[1], *out_len);
+        }
+        return STATUS_NOERROR;
+    case CMD_RES::SEND_FAIL:
+        return ERR_DEVICE_NOT_CONNECTED;
+    case CMD_RES::CMD_FAIL:
+        LOGGER.logError("IOCTL", "Macchina failed IOCTL %lu", IoctlID);
+        globals::setErrorString(usbcomm::getLastError());
+        return resp.resp_code;
+    case CMD_RES::CMD_TIMEOUT:
+        globals::setErrorString(usbcomm::getLastError());
+        return ERR_FAILED;
+    default:
+        globals::setErrorString("CMD_RES invalid");
+        return ERR_FAILED;
+    }
+}
+
+int ioctl_handler::set_config(unsigned long channelID, SCONFIG_LIST* pInput)
+{
+    if (pInput == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "SET_CONFIG called for channel %d with %d param(s)", channelID, pInput->NumOfParams);
+    return channels.set_config(channelID, pInput);
+}
+
+int ioctl_handler::get_config(unsigned long channelID, SCONFIG_LIST* pInput)
+{
+    if (pInput == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "GET_CONFIG called for channel %d. Want %d param(s)", channelID, pInput->NumOfParams);
+    return channels.get_config(channelID, pInput);
+}
+
+int ioctl_handler::read_batt(unsigned long* vbatt)
+{
+    if (vbatt == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "READ_VBATT called");
+    *vbatt = globals::getBatVoltage(); // Updated by every ping
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::read_prog_voltage(unsigned long* vProg)
+{
+    if (vProg == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "READ_PROGRAMMING_VOLTAGE called");
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::five_baud_init(unsigned long channelID, SBYTE_ARRAY* pInput, SBYTE_ARRAY* pOutput)
+{
+    if (pInput == nullptr || pOutput == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "FIVE_BAUD_INIT called with %d target ECU addresses", pInput->NumOfBytes);
+    if (pInput->NumOfBytes != 1 || pInput->BytePtr == nullptr || pOutput->BytePtr == nullptr) { return ERR_INVALID_IOCTL_VALUE; }
+    async_mutex.lock(); // Anything left over is from an init we gave up on
+    async_results.erase((uint8_t)channelID);
+    async_mutex.unlock();
+    // Device sends the address at 5 baud in the background, then the key bytes come back as a CMD_CHANNEL_IOCTL_RESP
+    int res = channels.ioctl(channelID, FIVE_BAUD_INIT, pInput->BytePtr, 1, nullptr, nullptr);
+    if (res != STATUS_NOERROR) {
+        return res;
+    }
+    uint8_t key_bytes[2];
+    uint16_t len = sizeof(key_bytes);
+    res = wait_async_result((uint8_t)channelID, FIVE_BAUD_INIT, key_bytes, &len);
+    if (res != STATUS_NOERROR) {
+        return res;
+    }
+    if (len != sizeof(key_bytes)) {
+        LOGGER.logError("IOCTL", "Expected 2 key bytes, got %u", len);
+        return ERR_FAILED;
+    }
+    LOGGER.logInfo("IOCTL", "5 baud init OK. Key bytes %02X %02X", key_bytes[0], key_bytes[1]);
+    pOutput->NumOfBytes = min(pOutput->NumOfBytes, sizeof(key_bytes));
+    memcpy(pOutput->BytePtr, key_bytes, pOutput->NumOfBytes);
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::fast_init(unsigned long channelID, PASSTHRU_MSG* pInput, PASSTHRU_MSG* pOutput)
+{
+    if (pInput == nullptr || pOutput == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "FAST_INIT called");
+    if (pInput->DataSize == 0 || pInput->DataSize > sizeof(PCMSG::args) - 5) { return ERR_INVALID_MSG; }
+    async_mutex.lock();
+    async_results.erase((uint8_t)channelID);
+    async_mutex.unlock();
+    // Device does the wake up pattern and sends the StartCommunication request, then the response comes back as a CMD_CHANNEL_IOCTL_RESP
+    int res = channels.ioctl(channelID, FAST_INIT, pInput->Data, (uint16_t)pInput->DataSize, nullptr, nullptr);
+    if (res != STATUS_NOERROR) {
+        return res;
+    }
+    uint8_t resp[sizeof(PCMSG::args)];
+    uint16_t len = sizeof(resp);
+    res = wait_async_result((uint8_t)channelID, FAST_INIT, resp, &len);
+    if (res != STATUS_NOERROR) {
+        return res;
+    }
+    LOGGER.logInfo("IOCTL", "Fast init OK. Response: %s", LOGGER.bytesToString(resp, len).c_str());
+    memset(pOutput, 0x00, sizeof(PASSTHRU_MSG));
+    pOutput->ProtocolID = pInput->ProtocolID;
+    pOutput->DataSize = len;
+    memcpy(pOutput->Data, resp, len);
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::clear_tx_buffers(unsigned long channelID)
+{
+    LOGGER.logDebug("IOCTL", "CLEAR_TX_BUFFERS called");
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::clear_rx_buffers(unsigned long channelID)
+{
+    LOGGER.logDebug("IOCTL", "CLEAR_RX_BUFFERS called");
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::clear_periodic_msgs(unsigned long channelID)
+{
+    LOGGER.logDebug("IOCTL", "CLEAR_PERIODIC_MSGS called");
+    return channels.clear_periodic(channelID);
+}
+
+int ioctl_handler::clear_msg_filters(unsigned long channelID)
+{
+    LOGGER.logDebug("IOCTL", "CLEAR_MSG_FILTERS called");
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::clear_mlt(unsigned long channelID)
+{
+    LOGGER.logDebug("IOCTL", "CLEAR_FUNCT_MSG_LOOKUP_TABLE called");
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::add_to_mlt(unsigned long channelID, SBYTE_ARRAY* pInput)
+{
+    LOGGER.logDebug("IOCTL", "ADD_TO_FUNCT_MSG_LOOKUP_TABLE called");
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::del_from_mlt(unsigned long channelID, SBYTE_ARRAY* pInput)
+{
+    LOGGER.logDebug("IOCTL", "DELETE_FROM_FUNCT_MSG_LOOKUP_TABLE called");
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::set_monitor(unsigned long channelID, unsigned long* pInput)
+{
+    if (pInput == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "MACCHINA_IOCTL_SET_MONITOR called for channel %d. State: %lu", channelID, *pInput);
+    uint8_t state = *pInput != 0;
+    return channels.ioctl(channelID, MACCHINA_IOCTL_SET_MONITOR, &state, 1, nullptr, nullptr);
+}
+
+int ioctl_handler::get_drops(unsigned long channelID, MACCHINA_DROP_COUNTS* pOutput)
+{
+    if (pOutput == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "MACCHINA_IOCTL_GET_DROPS called for channel %d", channelID);
+    return channels.get_drop_counts(channelID, pOutput);
+}
+
+int ioctl_handler::autobaud(MACCHINA_AUTOBAUD_REQ* pInput, MACCHINA_AUTOBAUD_RESULT* pOutput)
+{
+    if (pInput == nullptr || pOutput == nullptr) { return ERR_NULLPARAMETER; }
+    if (pInput->Controller > 1) { return ERR_INVALID_IOCTL_VALUE; }
+    LOGGER.logDebug("IOCTL", "MACCHINA_IOCTL_AUTOBAUD called for CAN%lu. Budget %lu ms", pInput->Controller, pInput->TimeoutMs);
+    MACCHINA_AUTOBAUD_RESULT* cached = &autobaud_results[pInput->Controller];
+    if (cached->BaudRate != 0 && !(pInput->Flags & MACCHINA_AUTOBAUD_RESCAN)) { // Bus rate won't change whilst we are plugged in
+        *pOutput = *cached;
+        return STATUS_NOERROR;
+    }
+    // Args format
+    // 0   - Controller
+    // 1-4 - Time budget in ms
+    uint8_t in[5];
+    in[0] = (uint8_t)pInput->Controller;
+    uint32_t budget = pInput->TimeoutMs;
+    memcpy(&in[1], &budget, 4);
+    async_mutex.lock();
+    async_results.erase(0);
+    async_mutex.unlock();
+    // Device listens in the background, so it carries on with every other channel meanwhile. The rate comes back as a CMD_CHANNEL_IOCTL_RESP
+    int res = send_ioctl(0, MACCHINA_IOCTL_AUTOBAUD, in, sizeof(in), nullptr, nullptr);
+    if (res != STATUS_NOERROR) {
+        return res;
+    }
+    uint8_t out[6];
+    uint16_t out_len = sizeof(out);
+    res = wait_async_result(0, MACCHINA_IOCTL_AUTOBAUD, out, &out_len);
+    if (res != STATUS_NOERROR) {
+        return res; // ERR_TIMEOUT if nothing was heard at any rate
+    }
+    if (out_len != sizeof(out)) {
+        LOGGER.logError("IOCTL", "Autobaud response is %u bytes, expected %u", out_len, sizeof(out));
+        return ERR_FAILED;
+    }
+    uint32_t baud;
+    uint16_t sample_point;
+    memcpy(&baud, &out[0], 4);
+    memcpy(&sample_point, &out[4], 2);
+    cached->BaudRate = baud;
+    cached->SamplePoint = sample_point;
+    LOGGER.logInfo("IOCTL", "CAN%lu bus rate is %lu (Sample point %u)", pInput->Controller, baud, sample_point);
+    *pOutput = *cached;
+    return STATUS_NOERROR;
+}
+
+int ioctl_handler::get_device_stats(unsigned long* pInput, MACCHINA_DEVICE_STATS* pOutput)
+{
+    if (pOutput == nullptr) { return ERR_NULLPARAMETER; }
+    uint8_t flags = pInput == nullptr ? 0 : (uint8_t)*pInput;
+    LOGGER.logDebug("IOCTL", "MACCHINA_IOCTL_GET_DEVICE_STATS called. Flags %02X", flags);
+    PCMSG m = {
+        CMD_STATS,
+        0,
+        1,
+        flags
+    };
+    PCMSG resp = {};
+    switch (usbcomm::sendMsgResp(&m, &resp))
+    {
+    case CMD_RES::CMD_OK: {
+        // Response data starts at arg 1. The daemon adds the Host counters, otherwise they are ours
+        const uint16_t fw_size = offsetof(MACCHINA_DEVICE_STATS, HostRxCrcErrors);
+        frame_stats link;
+        if (resp.arg_size == fw_size + 1 && usbcomm::getLinkStats(&link)) {
+            memcpy(pOutput, &resp.args[1], fw_size);
+            pOutput->HostRxCrcErrors = link.crc_errors;
+            pOutput->HostRxSkipped = link.skipped;
+        } else if (resp.arg_size == sizeof(MACCHINA_DEVICE_STATS) + 1) {
+            memcpy(pOutput, &resp.args[1], sizeof(MACCHINA_DEVICE_STATS));
+        } else {
+            LOGGER.logError("IOCTL", "Stats response is %u bytes, expected %u", resp.arg_size - 1, fw_size);
+            return ERR_FAILED;
+        }
+        return STATUS_NOERROR;
+    }
+    case CMD_RES::SEND_FAIL:
+        return ERR_DEVICE_NOT_CONNECTED;
+    case CMD_RES::CMD_FAIL:
+        globals::setErrorString(usbcomm::getLastError());
+        return resp.resp_code;
+    case CMD_RES::CMD_TIMEOUT:
+        globals::setErrorString(usbcomm::getLastError());
+        return ERR_FAILED;
+    default:
+        globals::setErrorString("CMD_RES invalid");
+        return ERR_FAILED;
+    }
+}
+
+int ioctl_handler::get_channel_stats(unsigned long channelID, unsigned long* pInput, MACCHINA_DRIVER_STATS* pOutput)
+{
+    if (pOutput == nullptr) { return ERR_NULLPARAMETER; }
+    bool reset = pInput != nullptr && (*pInput & MACCHINA_STATS_RESET);
+    LOGGER.logDebug("IOCTL", "MACCHINA_IOCTL_GET_CHANNEL_STATS called for channel %lu. Reset %d", channelID, reset);
+    return channels.get_stats(channelID, pOutput, reset);
+}
+
+int ioctl_handler::set_latency_trace(unsigned long channelID, unsigned long* pInput)
+{
+    if (pInput == nullptr) { return ERR_NULLPARAMETER; }
+    LOGGER.logDebug("IOCTL", "MACCHINA_IOCTL_SET_LATENCY_TRACE called for channel %lu. State: %lu", channelID, *pInput);
+    return channels.set_latency_trace(channelID, *pInput != 0);
+}
+
+void ioctl_handler::reset()
+{
+    latency_trace::reset();
+    memset(autobaud_results, 0x00, sizeof(autobaud_results));
+    async_mutex.lock();
+    async_results.clear();
+    async_mutex.unlock();
+}
@@ -1,27 +1,42 @@
-#pragma once
-
-#ifndef IOCTL_H_
-#define IOCTL_H_
-
-#include "j2534_v0404.h"
-
-namespace ioctl_handler
-{
-	int set_config(unsigned long channelID, SCONFIG_LIST* pInput);
-	int get_config(unsigned long channelID, SCONFIG_LIST* pInput);
-	int read_batt(unsigned long* vbatt);
-	int read_prog_voltage(unsigned long* vProg);
-	int five_baud_init(unsigned long channelID, SBYTE_ARRAY* pInput, SBYTE_ARRAY* pOutput);
-	int fast_init(unsigned long channelID, PASSTHRU_MSG* pInput, PASSTHRU_MSG* pOutput);
-	int clear_tx_buffers(unsigned long channelID);
-	int clear_rx_buffers(unsigned long channelID);
-	int clear_periodic_msgs(unsigned long channelID);
-	int clear_msg_filters(unsigned long channelID);
-	int clear_mlt(unsigned long channelID);
-	int add_to_mlt(unsigned long channelID, SBYTE_ARRAY* pInput);
-	int del_from_mlt(unsigned long channelID, SBYTE_ARRAY* pInput);
-
-};
-
-#endif
-
+#pragma once
+
+#ifndef IOCTL_H_
+#define IOCTL_H_
+
+#include <stdint.h>
+#include "j2534_v0404.h"
+#include "macchina_j2534_ext.h"
+#include "usbcomm.h"
+
+#define ASYNC_IOCTL_WAIT_MS 5000 // 5 baud init alone is 2 seconds of address bits
+
+namespace ioctl_handler
+{
+	bool make_ioctl(uint8_t channelID, unsigned long IoctlID, uint8_t* in, uint16_t in_len, PCMSG* m); // CMD_CHANNEL_IOCTL_REQ, false if in is too big
+	int send_ioctl(uint8_t channelID, unsigned long IoctlID, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+	void recv_async_result(PCMSG* m); // CMD_CHANNEL_IOCTL_RESP from the comm thread
+	void reset(); // Forget everything cached about the device
+	int set_config(unsigned long channelID, SCONFIG_LIST* pInput);
+	int get_config(unsigned long channelID, SCONFIG_LIST* pInput);
+	int read_batt(unsigned long* vbatt);
+	int read_prog_voltage(unsigned long* vProg);
+	int five_baud_init(unsigned long channelID, SBYTE_ARRAY* pInput, SBYTE_ARRAY* pOutput);
+	int fast_init(unsigned long channelID, PASSTHRU_MSG* pInput, PASSTHRU_MSG* pOutput);
+	int clear_tx_buffers(unsigned long channelID);
+	int clear_rx_buffers(unsigned long channelID);
+	int clear_periodic_msgs(unsigned long channelID);
+	int clear_msg_filters(unsigned long channelID);
+	int clear_mlt(unsigned long channelID);
+	int add_to_mlt(unsigned long channelID, SBYTE_ARRAY* pInput);
+	int del_from_mlt(unsigned long channelID, SBYTE_ARRAY* pInput);
+	int set_monitor(unsigned long channelID, unsigned long* pInput);
+	int get_drops(unsigned long channelID, MACCHINA_DROP_COUNTS* pOutput);
+	int autobaud(MACCHINA_AUTOBAUD_REQ* pInput, MACCHINA_AUTOBAUD_RESULT* pOutput);
+	int get_device_stats(unsigned long* pInput, MACCHINA_DEVICE_STATS* pOutput);
+	int get_channel_stats(unsigned long channelID, unsigned long* pInput, MACCHINA_DRIVER_STATS* pOutput);
+	int set_latency_trace(unsigned long channelID, unsigned long* pInput);
+
+};
+
+#endif
+
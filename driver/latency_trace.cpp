@@ -0,0 +1,115 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#include "pch.h"
+#include "latency_trace.h"
+#include "Logger.h"
+#include "trace_export.h"
+#include <chrono>
+#include <map>
+#include <mutex>
+
+struct pending_trace {
+	unsigned long channel;
+	uint64_t api_us; // Application called PassThruWriteMsgs
+	uint64_t sent_us; // Written to USB
+};
+
+namespace latency_trace {
+	uint16_t next_id = 1;
+	std::map<uint16_t, pending_trace> pending;
+	std::mutex mutex;
+}
+
+uint64_t latency_trace::now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns the trace ID to send the message with
+uint16_t latency_trace::begin(unsigned long channelID, uint64_t api_us)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	uint16_t id = next_id++;
+	if (next_id == 0) { // 0 means not traced
+		next_id = 1;
+	}
+	if (pending.size() >= LATENCY_TRACE_MAX_PENDING) { // Device never reported on these
+		pending.erase(pending.begin());
+	}
+	pending[id] = { channelID, api_us, 0 };
+	return id;
+}
+
+void latency_trace::sent(uint16_t traceID)
+{
+	uint64_t now = now_us();
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = pending.find(traceID);
+	if (it != pending.end()) {
+		it->second.sent_us = now;
+	}
+}
+
+void latency_trace::recvTrace(PCMSG* msg)
+{
+	uint64_t now = now_us();
+	if (msg->arg_size < TX_TRACE_SIZE) {
+		LOGGER.logError("LATENCY", "Invalid trace report of %u bytes", msg->arg_size);
+		return;
+	}
+	uint16_t id;
+	uint32_t usb_us, tx_us, bus_us, report_us;
+	memcpy(&id, &msg->args[1], 2);
+	memcpy(&usb_us, &msg->args[3], 4);
+	memcpy(&tx_us, &msg->args[7], 4);
+	memcpy(&bus_us, &msg->args[11], 4);
+	memcpy(&report_us, &msg->args[15], 4);
+	pending_trace t;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = pending.find(id);
+		if (it == pending.end() || it->second.sent_us == 0) {
+			LOGGER.logWarn("LATENCY", "Report for unknown trace %u", id);
+			return;
+		}
+		t = it->second;
+		pending.erase(it);
+	}
+	// Device times wrap every 71 minutes, differences are still right
+	uint32_t device_us = report_us - usb_us;
+	int64_t usb = (int64_t)(now - t.sent_us) - device_us; // Both directions, plus the comm thread picking it up
+	if (trace_export::enabled()) {
+		trace_export::deviceClock(report_us, now);
+		std::string args = trace_export::arg("trace", id);
+		trace_export::complete("Write", "latency", TRACE_TRACK_CHANNEL(t.channel), t.api_us, t.sent_us, args);
+		trace_export::deviceEvent("Firmware", "latency", usb_us, tx_us - usb_us, args);
+		trace_export::deviceEvent("Bus", "latency", tx_us, bus_us - tx_us, args);
+	}
+	LOGGER.logInfo("LATENCY", "Channel %lu trace %u: Total %llu us. Driver %llu us, USB %lld us, Firmware %lu us, Bus %lu us, Report %lu us",
+		t.channel, id, now - t.api_us, t.sent_us - t.api_us, usb, tx_us - usb_us, bus_us - tx_us, report_us - bus_us);
+}
+
+void latency_trace::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	pending.clear();
+}
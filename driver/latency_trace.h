@@ -0,0 +1,46 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+
+#ifndef LATENCY_TRACE_H_
+#define LATENCY_TRACE_H_
+
+#include <stdint.h>
+#include "usbcomm.h"
+
+#define LATENCY_TRACE_MAX_PENDING 256 // Traced messages the device has not reported on yet, oldest are forgotten
+
+// Times messages from PassThruWriteMsgs through to the CAN bus (MACCHINA_IOCTL_SET_LATENCY_TRACE).
+// The driver stamps when the application handed a message over and when it was written to USB,
+// the device sends back when it received it, started transmitting it and when the last frame left the
+// controller (CMD_TX_TRACE). The two clocks are never compared directly - USB time is the round trip
+// minus the time the device held the message, so the stages always add up to the total.
+namespace latency_trace
+{
+	uint64_t now_us();
+	uint16_t begin(unsigned long channelID, uint64_t api_us);
+	void sent(uint16_t traceID);
+	void recvTrace(PCMSG* msg);
+	void reset();
+};
+
+#endif
@@ -0,0 +1,318 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+// Not using the precompiled header, the daemon builds this too
+#include "link_frame.h"
+#include <string.h>
+#include <chrono>
+
+struct crc_table {
+	uint32_t entries[256];
+	crc_table() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int bit = 0; bit < 8; bit++) {
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			}
+			this->entries[i] = c;
+		}
+	}
+};
+
+static uint32_t crc_update(uint32_t crc, const uint8_t* data, size_t len)
+{
+	static const crc_table table;
+	for (size_t i = 0; i < len; i++) {
+		crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// Bytes 2-5 of the frame header
+static void credit_bytes(const frame_credit* credit, uint8_t* out)
+{
+	memset(out, 0x00, FRAME_HEADER_SIZE - 2);
+	if (credit != nullptr && credit->channel != 0) {
+		out[0] = credit->channel;
+		memcpy(&out[2], &credit->limit, 2);
+	}
+}
+
+uint32_t frame_crc(const frame_credit* credit, const PCMSG* msg)
+{
+	if (msg->arg_size > sizeof(msg->args)) {
+		return 0;
+	}
+	const uint8_t* m = (const uint8_t*)msg;
+	uint8_t header[FRAME_HEADER_SIZE - 2];
+	credit_bytes(credit, header);
+	uint32_t crc = 0xFFFFFFFF;
+	crc = crc_update(crc, header, sizeof(header));
+	crc = crc_update(crc, m, offsetof(PCMSG, args));
+	crc = crc_update(crc, msg->args, msg->arg_size);
+	crc = crc_update(crc, &m[offsetof(PCMSG, msg_id)], sizeof(PCMSG) - offsetof(PCMSG, msg_id));
+	return ~crc;
+}
+
+void frame_encode(const PCMSG* msg, const frame_credit* credit, uint8_t* out)
+{
+	out[0] = FRAME_SYNC_0;
+	out[1] = FRAME_SYNC_1;
+	credit_bytes(credit, &out[2]);
+	memcpy(&out[FRAME_HEADER_SIZE], msg, sizeof(PCMSG));
+	uint32_t crc = frame_crc(credit, msg);
+	memcpy(&out[FRAME_HEADER_SIZE + sizeof(PCMSG)], &crc, FRAME_CRC_SIZE);
+}
+
+uint8_t* frame_decoder::tail()
+{
+	return &this->buf[this->used];
+}
+
+size_t frame_decoder::wanted()
+{
+	return FRAME_SIZE - this->used;
+}
+
+void frame_decoder::added(size_t len)
+{
+	this->used += len;
+}
+
+void frame_decoder::reset()
+{
+	this->used = 0;
+}
+
+// Moves the first place at or after 'from' that could be the start of a frame to the front
+void frame_decoder::resync(size_t from)
+{
+	size_t i = from;
+	while (i < this->used && !(this->buf[i] == FRAME_SYNC_0 && (i + 1 == this->used || this->buf[i + 1] == FRAME_SYNC_1))) {
+		i++;
+	}
+	if (i == 0) {
+		return;
+	}
+	this->stats.skipped += (unsigned long)i;
+	memmove(this->buf, &this->buf[i], this->used - i);
+	this->used -= i;
+}
+
+bool frame_decoder::next(PCMSG* msg, frame_credit* credit)
+{
+	this->resync(0);
+	if (this->used < FRAME_SIZE) {
+		return false;
+	}
+	memcpy(msg, &this->buf[FRAME_HEADER_SIZE], sizeof(PCMSG));
+	credit->channel = this->buf[2];
+	memcpy(&credit->limit, &this->buf[4], 2);
+	uint32_t crc;
+	memcpy(&crc, &this->buf[FRAME_HEADER_SIZE + sizeof(PCMSG)], FRAME_CRC_SIZE);
+	if (msg->arg_size > sizeof(msg->args) || crc != frame_crc(credit, msg)) {
+		this->stats.crc_errors++;
+		this->resync(1); // Sync bytes were real data, the next frame starts somewhere after them
+		return false;
+	}
+	this->used = 0;
+	this->stats.frames++;
+	return true;
+}
+
+void link_credits::open(uint8_t channel, bool tx_flow, uint16_t rx_window)
+{
+	if (channel == 0 || channel > CREDIT_CHANNELS) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->mutex);
+	state* c = &this->chans[channel];
+	memset(c, 0x00, sizeof(state));
+	c->tx_flow = tx_flow; // Nothing can be sent until Macchina gives the first limit
+	c->rx_flow = rx_window != 0;
+	c->rx_window = rx_window;
+	c->rx_limit = rx_window;
+	c->rx_told = rx_window; // Went in the create
+}
+
+void link_credits::close(uint8_t channel)
+{
+	if (channel == 0 || channel > CREDIT_CHANNELS) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->mutex);
+	memset(&this->chans[channel], 0x00, sizeof(state));
+	this->tx_ready.notify_all();
+}
+
+void link_credits::reset()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	memset(this->chans, 0x00, sizeof(this->chans));
+	this->tx_ready.notify_all();
+}
+
+uint16_t link_credits::takeTx(uint8_t channel, uint16_t want, unsigned long timeout_ms)
+{
+	if (channel == 0 || channel > CREDIT_CHANNELS) {
+		return want;
+	}
+	std::unique_lock<std::mutex> lock(this->mutex);
+	state* c = &this->chans[channel];
+	auto ready = [c]() { return !c->tx_flow || (int16_t)(c->tx_limit - c->tx_sent) > 0; };
+	if (!this->tx_ready.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready)) {
+		return 0;
+	}
+	if (!c->tx_flow) { // Closed, or Macchina went, whilst waiting. The write fails on its own
+		return want;
+	}
+	uint16_t taken = (uint16_t)(c->tx_limit - c->tx_sent);
+	if (taken > want) {
+		taken = want;
+	}
+	c->tx_sent += taken;
+	return taken;
+}
+
+// Must hold mutex. Limits only ever go up, an older one arriving late is ignored
+void link_credits::applyTx(uint8_t channel, uint16_t limit)
+{
+	if (channel == 0 || channel > CREDIT_CHANNELS) {
+		return;
+	}
+	state* c = &this->chans[channel];
+	if (c->tx_flow && (int16_t)(limit - c->tx_limit) > 0) {
+		c->tx_limit = limit;
+		this->tx_ready.notify_all();
+	}
+}
+
+void link_credits::received(const frame_credit* credit)
+{
+	if (credit->channel == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->applyTx(credit->channel, credit->limit);
+}
+
+void link_credits::receivedMsg(const PCMSG* msg)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	for (size_t pos = 0; pos + CREDIT_RECORD_SIZE <= msg->arg_size && pos + CREDIT_RECORD_SIZE <= sizeof(msg->args); pos += CREDIT_RECORD_SIZE) {
+		uint16_t limit;
+		memcpy(&limit, &msg->args[pos + 1], 2);
+		this->applyTx(msg->args[pos], limit);
+	}
+}
+
+void link_credits::rxArrived(uint8_t channel)
+{
+	if (channel == 0 || channel > CREDIT_CHANNELS) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->chans[channel].rx_received++;
+}
+
+// Waits for a quarter of the window before giving credits back on their own, the rest go with other traffic
+bool link_credits::rxRoom(uint8_t channel, uint16_t room)
+{
+	if (channel == 0 || channel > CREDIT_CHANNELS) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(this->mutex);
+	state* c = &this->chans[channel];
+	if (!c->rx_flow) {
+		return false;
+	}
+	uint16_t limit = c->rx_received + room;
+	if ((int16_t)(limit - c->rx_limit) > 0) {
+		c->rx_limit = limit;
+	}
+	return (uint16_t)(c->rx_limit - c->rx_told) >= c->rx_window / 4;
+}
+
+void link_credits::headerCredit(frame_credit* credit)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	credit->channel = 0;
+	for (int i = 0; i < CREDIT_CHANNELS; i++) {
+		uint8_t id = this->next_chan;
+		this->next_chan = this->next_chan % CREDIT_CHANNELS + 1;
+		state* c = &this->chans[id];
+		if (c->rx_flow && c->rx_limit != c->rx_told) {
+			credit->channel = id;
+			credit->limit = c->rx_limit;
+			return;
+		}
+	}
+}
+
+// Only now is the limit Macchina's to use. If the write failed it goes out with the next frame instead
+void link_credits::told(const frame_credit* credit)
+{
+	if (credit->channel == 0 || credit->channel > CREDIT_CHANNELS) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->tellLimit(credit->channel, credit->limit);
+}
+
+void link_credits::toldMsg(const PCMSG* msg)
+{
+	if (msg->cmd_id != CMD_CREDIT) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->mutex);
+	for (size_t pos = 0; pos + CREDIT_RECORD_SIZE <= msg->arg_size && pos + CREDIT_RECORD_SIZE <= sizeof(msg->args); pos += CREDIT_RECORD_SIZE) {
+		uint16_t limit;
+		memcpy(&limit, &msg->args[pos + 1], 2);
+		if (msg->args[pos] != 0 && msg->args[pos] <= CREDIT_CHANNELS) {
+			this->tellLimit(msg->args[pos], limit);
+		}
+	}
+}
+
+// Two frames can carry limits for the same channel, so a write finishing late doesn't take rx_told back
+void link_credits::tellLimit(uint8_t channel, uint16_t limit)
+{
+	state* c = &this->chans[channel];
+	if ((int16_t)(limit - c->rx_told) > 0) {
+		c->rx_told = limit;
+	}
+}
+
+bool link_credits::makeMsg(PCMSG* msg, bool all)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	memset(msg, 0x00, sizeof(PCMSG));
+	msg->cmd_id = CMD_CREDIT;
+	for (uint8_t id = 1; id <= CREDIT_CHANNELS; id++) {
+		state* c = &this->chans[id];
+		if (c->rx_flow && (all || c->rx_limit != c->rx_told)) {
+			msg->args[msg->arg_size] = id;
+			memcpy(&msg->args[msg->arg_size + 1], &c->rx_limit, 2);
+			msg->arg_size += CREDIT_RECORD_SIZE;
+		}
+	}
+	return msg->arg_size != 0;
+}
@@ -0,0 +1,152 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include "usbcomm.h"
+
+// Every PCMSG on the serial port goes inside a frame, so if bytes are lost or mangled the
+// reader finds the start of the next good message rather than staying out of step for good.
+// The firmware has its own copy of this (pc_comm.cpp)
+// 0-1     - FRAME_SYNC_0, FRAME_SYNC_1
+// 2       - Channel ID of the credit update carried by this frame, 0 if none (See CMD_CREDIT)
+// 3       - Unused, 0
+// 4-5     - Credit limit for that channel
+// 6-525   - PCMSG
+// 526-529 - CRC-32 of bytes 2-5 and the PCMSG (See frame_crc)
+#define FRAME_SYNC_0 0xA5
+#define FRAME_SYNC_1 0x5A
+#define FRAME_HEADER_SIZE 6
+#define FRAME_CRC_SIZE 4
+#define FRAME_SIZE (FRAME_HEADER_SIZE + sizeof(PCMSG) + FRAME_CRC_SIZE)
+
+struct frame_stats {
+	unsigned long frames; // Good frames read
+	unsigned long crc_errors; // Frames thrown away because the CRC or arg_size was wrong
+	unsigned long skipped; // Bytes thrown away looking for the start of a frame
+};
+
+// Credit update in a frame header
+struct frame_credit {
+	uint8_t channel; // 0 - No update
+	uint16_t limit;
+};
+
+/// <summary>
+/// CRC-32 (IEEE) of the parts of a frame that mean anything - the credit update, the message
+/// header, arg_size bytes of args and the fields after them. Unused args are not sent through the CRC
+/// </summary>
+/// <returns>CRC, or 0 if arg_size is too big to be a real message</returns>
+uint32_t frame_crc(const frame_credit* credit, const PCMSG* msg);
+
+/// <summary>
+/// Puts a message in a frame
+/// </summary>
+/// <param name="credit">Update to carry with it, or nullptr</param>
+/// <param name="out">FRAME_SIZE bytes</param>
+void frame_encode(const PCMSG* msg, const frame_credit* credit, uint8_t* out);
+
+// Pulls messages out of the bytes read from the port. Bytes go straight into the decoder's
+// buffer (tail, then added), and it never wants more than the rest of one frame, so a
+// blocking read of wanted() bytes can't take any of the next one
+class frame_decoder
+{
+public:
+	uint8_t* tail(); // Where the next bytes read should go
+	size_t wanted(); // Bytes still needed to make up a whole frame
+	void added(size_t len);
+
+	/// <summary>
+	/// Takes the frame at the front of the buffer, if it is whole and good. A bad one is
+	/// thrown away, and the buffer moved on to the next place a frame could start
+	/// </summary>
+	/// <param name="credit">Filled in with the frame's credit update</param>
+	/// <returns>True if msg and credit were filled in</returns>
+	bool next(PCMSG* msg, frame_credit* credit);
+	void reset(); // Throws away anything buffered, the counters are kept
+	frame_stats stats = {};
+private:
+	void resync(size_t from);
+	uint8_t buf[FRAME_SIZE];
+	size_t used = 0;
+};
+
+#define CREDIT_CHANNELS 16 // Highest channel ID that can be flow controlled, same as Macchina
+#define CREDIT_RECORD_SIZE 3 // CMD_CREDIT args - Channel ID, then the limit (16bit)
+#define CREDIT_UNLIMITED 0xFFFF
+
+// Credit based flow control for the PC end of the serial link (See CMD_CREDIT). TX credits are
+// room in Macchina's Tx ring, taken by whichever thread writes channel data. RX credits are
+// room in the driver's queues, given back as the application reads and sent to Macchina with
+// the next frame to go out. Limits are running totals, so only ever compared by difference
+class link_credits
+{
+public:
+	void open(uint8_t channel, bool tx_flow, uint16_t rx_window); // Before the create goes out, so no update is missed
+	void close(uint8_t channel);
+	void reset(); // Macchina has gone, wakes anything waiting on credits
+
+	/// <summary>
+	/// Takes up to 'want' TX credits, waiting for at least one if there are none
+	/// </summary>
+	/// <returns>Credits taken, 0 if none came in time. 'want' if the channel is not flow controlled</returns>
+	uint16_t takeTx(uint8_t channel, uint16_t want, unsigned long timeout_ms);
+	void received(const frame_credit* credit); // TX limit from a frame header
+	void receivedMsg(const PCMSG* msg); // TX limits from a CMD_CREDIT
+
+	void rxArrived(uint8_t channel); // A data message for the channel was read
+
+	/// <summary>
+	/// Sets the data messages the channel still has room for
+	/// </summary>
+	/// <returns>True if enough credit has built up to be worth a CMD_CREDIT on its own</returns>
+	bool rxRoom(uint8_t channel, uint16_t room);
+	void headerCredit(frame_credit* credit); // Next RX limit Macchina hasn't been sent, for a frame header
+
+	/// <summary>
+	/// Makes a CMD_CREDIT with the RX limits Macchina hasn't been sent
+	/// </summary>
+	/// <param name="all">Every RX limit, in case an update was lost</param>
+	/// <returns>False if there was nothing to send</returns>
+	bool makeMsg(PCMSG* msg, bool all);
+	void told(const frame_credit* credit); // Frame from headerCredit was written
+	void toldMsg(const PCMSG* msg); // CMD_CREDIT from makeMsg was written
+private:
+	struct state {
+		bool tx_flow;
+		uint16_t tx_limit; // Records Macchina has room for
+		uint16_t tx_sent;
+		bool rx_flow;
+		uint16_t rx_window;
+		uint16_t rx_received;
+		uint16_t rx_limit; // Data messages we have room for
+		uint16_t rx_told; // Last RX limit sent to Macchina
+	};
+	void applyTx(uint8_t channel, uint16_t limit);
+	void tellLimit(uint8_t channel, uint16_t limit);
+	state chans[CREDIT_CHANNELS + 1] = {};
+	uint8_t next_chan = 1;
+	std::mutex mutex;
+	std::condition_variable tx_ready;
+};
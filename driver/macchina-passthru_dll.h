@@ -1,37 +1,37 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-#include "j2534_v0404.h"
-
-extern PTOPEN	PassThruOpen;
-extern PTCLOSE	PassThruClose;
-extern PTCONNECT PassThruConnect;
-extern PTDISCONNECT PassThruDisconnect;
-extern PTREADMSGS PassThruReadMsgs;
-extern PTWRITEMSGS PassThruWriteMsgs;
-extern PTSTARTPERIODICMSG PassThruStartPeriodicMsg;
-extern PTSTOPPERIODICMSG PassThruStopPeriodicMsg;
-extern PTSTARTMSGFILTER PassThruStartMsgFilter;
-extern PTSTOPMSGFILTER PassThruStopMsgFilter;
-extern PTSETPROGRAMMINGVOLTAGE PassThruSetProgrammingVoltage;
-extern PTREADVERSION PassThruReadVersion;
-extern PTGETLASTERROR PassThruGetLastError;
-extern PTIOCTL PassThruIoctl;
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+#include "j2534_v0404.h"
+
+extern PTOPEN	PassThruOpen;
+extern PTCLOSE	PassThruClose;
+extern PTCONNECT PassThruConnect;
+extern PTDISCONNECT PassThruDisconnect;
+extern PTREADMSGS PassThruReadMsgs;
+extern PTWRITEMSGS PassThruWriteMsgs;
+extern PTSTARTPERIODICMSG PassThruStartPeriodicMsg;
+extern PTSTOPPERIODICMSG PassThruStopPeriodicMsg;
+extern PTSTARTMSGFILTER PassThruStartMsgFilter;
+extern PTSTOPMSGFILTER PassThruStopMsgFilter;
+extern PTSETPROGRAMMINGVOLTAGE PassThruSetProgrammingVoltage;
+extern PTREADVERSION PassThruReadVersion;
+extern PTGETLASTERROR PassThruGetLastError;
+extern PTIOCTL PassThruIoctl;
@@ -0,0 +1,133 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef MACCHINA_J2534_EXT_H_
+#define MACCHINA_J2534_EXT_H_
+
+// Macchina specific additions to J2534. Applications can include this header to use them
+
+// PassThruConnect flags
+#define MACCHINA_MONITOR_MODE 0x10000000 // CAN - Listen only, every frame on the bus is received regardless of filters
+
+// PassThruIoctl IDs (0x10000 onwards is reserved for tool vendors)
+#define MACCHINA_IOCTL_SET_MONITOR 0x10000 // pInput - unsigned long* (1 = Monitor mode on, 0 = Off). pOutput - NULL
+#define MACCHINA_IOCTL_GET_DROPS   0x10001 // pInput - NULL. pOutput - MACCHINA_DROP_COUNTS*
+#define MACCHINA_IOCTL_AUTOBAUD    0x10002 // Device level (Pass the DeviceID). pInput - MACCHINA_AUTOBAUD_REQ*. pOutput - MACCHINA_AUTOBAUD_RESULT*
+#define MACCHINA_IOCTL_GET_DEVICE_STATS 0x10003 // Device level (Pass the DeviceID). pInput - NULL or unsigned long* (MACCHINA_STATS_*). pOutput - MACCHINA_DEVICE_STATS*
+#define MACCHINA_IOCTL_GET_CHANNEL_STATS 0x10004 // pInput - NULL or unsigned long* (MACCHINA_STATS_*). pOutput - MACCHINA_DRIVER_STATS*
+#define MACCHINA_IOCTL_SET_LATENCY_TRACE 0x10005 // CAN and ISO15765 only. pInput - unsigned long* (1 = Log where the time goes for every message written, 0 = Off). pOutput - NULL
+
+// Frames the device could not deliver since the channel was connected
+typedef struct {
+	unsigned long RxDropped; // Lost because the device Rx ring was full
+	unsigned long RxOverwritten; // Lost in the CAN mailboxes before the device could read them
+} MACCHINA_DROP_COUNTS;
+
+#define MACCHINA_AUTOBAUD_RESCAN 0x01 // Listen again even if a rate was already found for this controller
+
+// Listens to the bus (Never transmitting or ACKing) until a frame is received at one of the standard rates
+typedef struct {
+	unsigned long Controller; // 0 = CAN0, 1 = CAN1. Must not be in use by a channel
+	unsigned long TimeoutMs; // Time budget, the device caps this at 1500ms
+	unsigned long Flags; // MACCHINA_AUTOBAUD_*
+} MACCHINA_AUTOBAUD_REQ;
+
+typedef struct {
+	unsigned long BaudRate; // Rate frames were received at
+	unsigned long SamplePoint; // Sample point used, in tenths of a percent (875 = 87.5%)
+} MACCHINA_AUTOBAUD_RESULT;
+
+#define MACCHINA_STATS_RESET 0x01 // GET_DEVICE_STATS - Clear the loop histogram, maximums and peaks once they have been read
+                                  // GET_CHANNEL_STATS - Start every counter from 0 again once they have been read
+
+#define MACCHINA_STATS_LOOP_BUCKETS 12 // Bucket 0 is < 4us, bucket n is < 2^(n+2)us, the last one is everything longer
+#define MACCHINA_STATS_MAX_CHANNELS 10
+
+// Counters kept by the device firmware. Same layout as stats.h in the firmware, so it is packed.
+// Counters only ever go up (Take the difference between two reads), the rest are cleared by MACCHINA_STATS_RESET.
+// The Host counters at the end are not from the firmware, they are kept by whatever has the port open
+#pragma pack(push, 1)
+typedef struct {
+	unsigned long RxFrames; // Received by the controller, including ones that were filtered out
+	unsigned long BusErrors;
+	unsigned long RxDropped; // Rx ring was full
+	unsigned long RxOverwritten; // Lost in a mailbox
+	unsigned short RxRingPeak;
+	unsigned short TxRingPeak;
+	unsigned char TxErrorCount; // TEC at the time of the read
+	unsigned char RxErrorCount; // REC at the time of the read
+} MACCHINA_CAN_STATS;
+
+typedef struct {
+	unsigned char ChannelID; // 0 if the slot is unused. Device channel IDs, not J2534 ones
+	unsigned long RxFrames; // Sent to the PC
+	unsigned long TxFrames; // Sent on the bus
+	unsigned long RxDropped; // Could not be sent to the PC
+	unsigned long TxDropped; // Could not be sent on the bus
+	unsigned long RxFiltered; // Thrown away by the channel's filters
+} MACCHINA_CHANNEL_STATS;
+
+typedef struct {
+	unsigned long UptimeMs;
+	unsigned long LoopHistogram[MACCHINA_STATS_LOOP_BUCKETS]; // Time taken by each pass of the firmware main loop
+	unsigned long LoopMaxUs;
+	unsigned long UsbBytesIn;
+	unsigned long UsbBytesOut;
+	unsigned short UsbTxPeak; // Most bytes ever waiting to go to the PC
+	unsigned long UsbTxStalls; // Times the device had to wait for the PC to read
+	unsigned long UsbTxDropped; // Log and trace messages thrown away because the PC was not reading
+	MACCHINA_CAN_STATS Can[2];
+	MACCHINA_CHANNEL_STATS Channels[MACCHINA_STATS_MAX_CHANNELS];
+	unsigned long UsbRxCrcErrors; // Messages from the PC thrown away as corrupt
+	unsigned long UsbRxSkipped; // Bytes from the PC thrown away finding the start of the next message
+	unsigned char PoolSmallPeak; // Most of the device's buffer blocks in use at once (Small blocks, then full ISO15765 payload blocks)
+	unsigned char PoolLargePeak;
+	unsigned short PoolFailed; // Times the device had no free buffer block. The payload that needed it was refused
+	unsigned long HostRxCrcErrors; // Messages from the device thrown away as corrupt (By the DLL, or the passthru daemon)
+	unsigned long HostRxSkipped; // Bytes from the device thrown away finding the start of the next message
+} MACCHINA_DEVICE_STATS;
+#pragma pack(pop)
+
+// Latency histogram. Buckets are log-linear (4 per power of 2) so the relative error stays under 25% at any latency:
+// Buckets 0-3 are exactly 0-3us. After that, bucket n starts at (4 + n % 4) << (n / 4 - 1) us, and ends where bucket n+1 starts.
+// The last bucket holds everything longer (7 << 22 us, about 29.4 seconds and up)
+#define MACCHINA_LATENCY_BUCKETS 96
+
+// Counters the driver keeps for one channel
+typedef struct {
+	unsigned long TxMsgs; // Passed to PassThruWriteMsgs and sent to the device
+	unsigned long TxBytes;
+	unsigned long RxMsgs; // Put in the receive queue
+	unsigned long RxBytes;
+	unsigned long RxFiltered; // Rejected by the channel's filters (Filtering is done on the device)
+	unsigned long QueuePeak; // Most messages waiting for PassThruReadMsgs
+	unsigned long QueueOverflows; // Messages thrown away because the receive queue was full
+	// Time from the device receiving a message to PassThruReadMsgs returning it.
+	// The device clock is lined up with the PC clock using the fastest message seen since the last reset,
+	// so this is how much longer than the quickest possible delivery each message took.
+	// Messages without a device timestamp (ISO15765) are not included
+	unsigned long LatencyCount;
+	unsigned long LatencyMaxUs;
+	unsigned long Latency[MACCHINA_LATENCY_BUCKETS];
+} MACCHINA_DRIVER_STATS;
+
+#endif
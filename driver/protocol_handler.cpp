@@ -1,126 +1,281 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#include "pch.h"
-#include "protocol_handler.h"
-#include "Logger.h"
-#include "usbcomm.h"
-
-protocol_handler::protocol_handler(unsigned long channelID)
-{
-	this->channelid = channelID;
-	this->baud = 0;
-	this->flags = 0;
-}
-
-void protocol_handler::setFlags(unsigned long flags)
-{
-	this->flags = flags;
-}
-
-void protocol_handler::setBaud(unsigned long baud)
-{
-	this->baud = baud;
-}
-
-unsigned long protocol_handler::getBaud()
-{
-	return this->baud;
-}
-
-int protocol_handler::requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout)
-{
-	if (this->msg_queue.size() == 0) { // Sorry, nothing here to read
-		return ERR_BUFFER_EMPTY;
-	}
-	// TODO handle timeout
-	unsigned long max_read = min(*pNumMsgs, msg_queue.size()); // Calculate how many messages we can read at most
-	*pNumMsgs = max_read; // Let the req application know how many messages we read
-	for (unsigned long i = 0; i < max_read; i++) {
-		memcpy(&pMsg[i], &this->msg_queue.front(), sizeof(PASSTHRU_MSG));
-		LOGGER.logDebug("HANDLER", "READ <-- Contents: %s", LOGGER.bytesToString(pMsg[i].Data, pMsg[i].DataSize).c_str());
-		// Now pop the queue
-		this->msg_queue.pop();
-	}
-	return STATUS_NOERROR;
-}
-
-iso9141_handler::iso9141_handler(unsigned long channelID) : protocol_handler(channelID)
-{
-	LOGGER.logDebug("ISO9141", "Handler created");
-}
-
-void iso9141_handler::recvData(uint8_t* m, uint16_t len)
-{
-	PASSTHRU_MSG rx = {};
-	rx.ProtocolID = ISO9141;
-	this->msg_queue.push(rx);
-}
-
-iso15765_handler::iso15765_handler(unsigned long channelID) : protocol_handler(channelID)
-{
-	LOGGER.logDebug("ISO15765", "Handler created");
-}
-
-void iso15765_handler::recvData(uint8_t* m, uint16_t len)
-{
-	// Now convert the data packet into a PASSTHRU_MSG
-	PASSTHRU_MSG rx = { 0x00 };
-	rx.ProtocolID = ISO15765;
-	if (m[0] == 0xFF) { // Special indicator saying its a FIRST FF Indication
-		LOGGER.logDebug("ISO15765", "First frame indication!");
-		rx.DataSize = 4;
-		rx.RxStatus = ISO15765_FIRST_FRAME; // Set this! Need to know ECU has started to send data
-		memcpy(&rx.Data, &m[1], 4);
-		this->msg_queue.push(rx);
-	}
-	else if (m[0] == 0xAA && len == 1) { // Speical message saying Tx Complete
-		LOGGER.logInfo("ISO15765", "MFP Tx Complete!");
-		rx.DataSize = 0;
-		rx.RxStatus = TX_MSG_TYPE; // Transfer complete
-		this->msg_queue.push(rx);
-	} else {
-		LOGGER.logDebug("ISO15765", "Normal payload!");
-		// Add the message to the queue
-		rx.DataSize = len;
-
-		// What the hell. Below breaks Vediamo/DAS, even though its part of the spec!?
-		//if (len > 11) { // Only set TX_MSG_TYPE if it was a multi frame payload
-		//	rx.RxStatus = TX_MSG_TYPE;
-		//}
-		memcpy(&rx.Data, m, len);
-		this->msg_queue.push(rx);
-	}
-}
-
-can_handler::can_handler(unsigned long channelID) : protocol_handler(channelID)
-{
-	LOGGER.logDebug("CAN", "Handler created");
-}
-
-void can_handler::recvData(uint8_t* m, uint16_t len)
-{
-	PASSTHRU_MSG rx = { 0x00 };
-	// Add the message to the queue
-	rx.DataSize = len;
-	rx.ProtocolID = CAN;
-	memcpy(&rx.Data, m, len);
-	this->msg_queue.push(rx);
-}
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "pch.h"
+#include "protocol_handler.h"
+#include "Logger.h"
+#include "usbcomm.h"
+#include <chrono>
+
+// PC clock in us. Only the low 32 bits are used, same as the device timestamps
+static uint32_t host_us()
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear bucket for a latency (See MACCHINA_LATENCY_BUCKETS)
+static unsigned long latency_bucket(uint32_t us)
+{
+	if (us < 4) {
+		return us;
+	}
+	unsigned long msb = 31;
+	while (!(us & (1UL << msb))) {
+		msb--;
+	}
+	unsigned long bucket = (msb - 1) * 4 + ((us >> (msb - 2)) & 0x03);
+	return min(bucket, MACCHINA_LATENCY_BUCKETS - 1);
+}
+
+protocol_handler::protocol_handler(unsigned long channelID)
+{
+	this->channelid = channelID;
+	this->baud = 0;
+	this->flags = 0;
+}
+
+void protocol_handler::setFlags(unsigned long flags)
+{
+	this->flags = flags;
+}
+
+unsigned long protocol_handler::getFlags()
+{
+	return this->flags;
+}
+
+void protocol_handler::setBaud(unsigned long baud)
+{
+	this->baud = baud;
+}
+
+unsigned long protocol_handler::getBaud()
+{
+	return this->baud;
+}
+
+int protocol_handler::requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout)
+{
+	std::lock_guard<std::mutex> lock(this->queue_mutex);
+	if (this->msg_queue.size() == 0) { // Sorry, nothing here to read
+		return ERR_BUFFER_EMPTY;
+	}
+	// TODO handle timeout
+	unsigned long max_read = min(*pNumMsgs, msg_queue.size()); // Calculate how many messages we can read at most
+	*pNumMsgs = max_read; // Let the req application know how many messages we read
+	uint32_t now = host_us();
+	for (unsigned long i = 0; i < max_read; i++) {
+		std::vector<uint8_t>& queued = this->msg_queue.front();
+		memcpy(&pMsg[i], queued.data(), queued.size());
+		LOGGER.logDebug("HANDLER", "READ <-- Contents: %s", LOGGER.bytesToString(pMsg[i].Data, pMsg[i].DataSize).c_str());
+		if (pMsg[i].Timestamp != 0 && this->clock_synced) {
+			int32_t latency = (int32_t)(now - (uint32_t)pMsg[i].Timestamp - this->clock_offset);
+			uint32_t us = latency < 0 ? 0 : (uint32_t)latency; // Clock offset moved on after this one was queued
+			this->stats.Latency[latency_bucket(us)]++;
+			this->stats.LatencyCount++;
+			this->stats.LatencyMaxUs = max(this->stats.LatencyMaxUs, us);
+		}
+		// Now pop the queue
+		this->queue_bytes -= queued.size();
+		this->msg_queue.pop();
+	}
+	return STATUS_NOERROR;
+}
+
+void protocol_handler::getDropCounts(unsigned long* dropped, unsigned long* overwritten)
+{
+	*dropped = this->rx_dropped;
+	*overwritten = this->rx_overwritten;
+}
+
+void protocol_handler::countTx(unsigned long numMsgs, unsigned long numBytes)
+{
+	std::lock_guard<std::mutex> lock(this->queue_mutex);
+	this->stats.TxMsgs += numMsgs;
+	this->stats.TxBytes += numBytes;
+}
+
+// RxFiltered is filled in by the channel, the device keeps that count
+void protocol_handler::getStats(MACCHINA_DRIVER_STATS* pOutput, bool reset)
+{
+	std::lock_guard<std::mutex> lock(this->queue_mutex);
+	*pOutput = this->stats;
+	if (reset) {
+		memset(&this->stats, 0x00, sizeof(this->stats));
+		this->stats.QueuePeak = (unsigned long)this->msg_queue.size();
+		this->clock_synced = false;
+	}
+}
+
+// Data messages from the device the queue can still take, for the RX credits (See CMD_CREDIT)
+uint16_t protocol_handler::rxRoom()
+{
+	std::lock_guard<std::mutex> lock(this->queue_mutex);
+	size_t used = min(this->queue_bytes, (size_t)HANDLER_RX_QUEUE_BYTES);
+	return (uint16_t)min((HANDLER_RX_QUEUE_BYTES - used) / this->msg_bytes, (size_t)UINT16_MAX);
+}
+
+// Called from the comm thread for every message received
+void protocol_handler::queueMsg(PASSTHRU_MSG* msg)
+{
+	std::lock_guard<std::mutex> lock(this->queue_mutex);
+	size_t size = QUEUED_MSG_HDR + min(msg->DataSize, (unsigned long)sizeof(msg->Data));
+	if (this->queue_bytes + size > HANDLER_RX_QUEUE_BYTES) { // Application is not reading
+		this->stats.QueueOverflows++;
+		return;
+	}
+	if (msg->Timestamp != 0) { // Fastest delivery seen lines the clocks up
+		uint32_t offset = host_us() - (uint32_t)msg->Timestamp;
+		if (!this->clock_synced || (int32_t)(offset - this->clock_offset) < 0) {
+			this->clock_offset = offset;
+			this->clock_synced = true;
+		}
+	}
+	const uint8_t* bytes = (const uint8_t*)msg;
+	this->msg_queue.emplace(bytes, bytes + size);
+	this->queue_bytes += size;
+	this->stats.RxMsgs++;
+	this->stats.RxBytes += msg->DataSize;
+	this->stats.QueuePeak = max(this->stats.QueuePeak, (unsigned long)this->msg_queue.size());
+}
+
+iso9141_handler::iso9141_handler(unsigned long channelID, unsigned long protocolID) : protocol_handler(channelID)
+{
+	this->protocolID = protocolID;
+	LOGGER.logDebug("ISO9141", "Handler created");
+}
+
+void iso9141_handler::recvData(uint8_t* m, uint16_t len)
+{
+	if (len <= KLINE_RX_RECORD_HDR || len - KLINE_RX_RECORD_HDR > sizeof(PASSTHRU_MSG::Data)) {
+		LOGGER.logError("ISO9141", "Invalid message of %u bytes", len);
+		return;
+	}
+	PASSTHRU_MSG rx = { 0x00 };
+	rx.ProtocolID = this->protocolID;
+	memcpy(&rx.Timestamp, &m[0], 4);
+	rx.DataSize = len - KLINE_RX_RECORD_HDR;
+	memcpy(rx.Data, &m[KLINE_RX_RECORD_HDR], rx.DataSize);
+	this->queueMsg(&rx);
+}
+
+iso15765_handler::iso15765_handler(unsigned long channelID) : protocol_handler(channelID)
+{
+	LOGGER.logDebug("ISO15765", "Handler created");
+}
+
+void iso15765_handler::recvData(uint8_t* m, uint16_t len)
+{
+	// Now convert the data packet into a PASSTHRU_MSG
+	PASSTHRU_MSG rx = { 0x00 };
+	rx.ProtocolID = ISO15765;
+	if (m[0] == 0xFF) { // Special indicator saying its a FIRST FF Indication
+		LOGGER.logDebug("ISO15765", "First frame indication!");
+		rx.DataSize = min(len - 1, 5); // CAN ID, plus the address byte if using extended addressing
+		rx.RxStatus = ISO15765_FIRST_FRAME | (this->flags & (CAN_29BIT_ID | ISO15765_ADDR_TYPE)); // Set this! Need to know ECU has started to send data
+		memcpy(&rx.Data, &m[1], rx.DataSize);
+		this->queueMsg(&rx);
+	}
+	else if (m[0] == 0xAB && len <= 6) { // Multi frame payload was dropped or aborted, there is no J2534 message for that
+		LOGGER.logWarn("ISO15765", "MFP Tx failed!");
+		this->endTx();
+	}
+	else if (m[0] == 0xAA && len <= 6) { // Speical message saying Tx Complete (Optionally with the CAN ID and address byte)
+		LOGGER.logInfo("ISO15765", "MFP Tx Complete!");
+		this->endTx();
+		rx.DataSize = len - 1;
+		rx.RxStatus = TX_MSG_TYPE | (this->flags & (CAN_29BIT_ID | ISO15765_ADDR_TYPE)); // Transfer complete
+		memcpy(&rx.Data, &m[1], len - 1);
+		this->queueMsg(&rx);
+	} else if (len > sizeof(rx.Data)) {
+		LOGGER.logError("ISO15765", "Payload of %u bytes is too large!", len);
+	} else {
+		LOGGER.logDebug("ISO15765", "Normal payload!");
+		// Add the message to the queue
+		rx.DataSize = len;
+		rx.RxStatus = this->flags & (CAN_29BIT_ID | ISO15765_ADDR_TYPE);
+
+		// What the hell. Below breaks Vediamo/DAS, even though its part of the spec!?
+		//if (len > 11) { // Only set TX_MSG_TYPE if it was a multi frame payload
+		//	rx.RxStatus = TX_MSG_TYPE;
+		//}
+		memcpy(&rx.Data, m, len);
+		this->queueMsg(&rx);
+	}
+}
+
+bool iso15765_handler::startTx(unsigned long timeout_ms)
+{
+	std::unique_lock<std::mutex> lock(this->tx_mutex);
+	if (!this->tx_done.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return !this->tx_busy; })) {
+		return false;
+	}
+	this->tx_busy = true;
+	return true;
+}
+
+void iso15765_handler::endTx()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->tx_mutex);
+		this->tx_busy = false;
+	}
+	this->tx_done.notify_all();
+}
+
+can_handler::can_handler(unsigned long channelID) : protocol_handler(channelID)
+{
+	this->msg_bytes = (CAN_BATCH_SIZE / CAN_RX_RECORD_HDR) * (QUEUED_MSG_HDR + 12); // Batch of frames with no data, counted as the largest frame
+	LOGGER.logDebug("CAN", "Handler created");
+}
+
+void can_handler::recvData(uint8_t* m, uint16_t len)
+{
+	// Device batches up frames, so unpack each record into its own message
+	uint16_t pos = 0;
+	while (pos + CAN_RX_RECORD_HDR <= len) {
+		uint8_t dlc = m[pos] & CAN_RECORD_DLC;
+		if (dlc > 8 || pos + CAN_RX_RECORD_HDR + dlc > len) {
+			LOGGER.logError("CAN", "Invalid record in batch at %u", pos);
+			return;
+		}
+		if (m[pos] & CAN_RECORD_STATUS) { // Device lost frames, keep count for the application
+			uint32_t dropped, overwritten;
+			memcpy(&dropped, &m[pos + CAN_RX_RECORD_HDR], 4);
+			memcpy(&overwritten, &m[pos + CAN_RX_RECORD_HDR + 4], 4);
+			this->rx_dropped += dropped;
+			this->rx_overwritten += overwritten;
+			LOGGER.logWarn("CAN", "Device lost frames! Dropped: %lu, Overwritten: %lu", dropped, overwritten);
+			pos += CAN_RX_RECORD_HDR + dlc;
+			continue;
+		}
+		PASSTHRU_MSG rx = { 0x00 };
+		rx.ProtocolID = CAN;
+		if (m[pos] & CAN_RECORD_EXT) {
+			rx.RxStatus |= CAN_29BIT_ID;
+		}
+		memcpy(&rx.Timestamp, &m[pos + 5], 4);
+		memcpy(&rx.Data[0], &m[pos + 1], 4); // CAN ID
+		memcpy(&rx.Data[4], &m[pos + CAN_RX_RECORD_HDR], dlc);
+		rx.DataSize = 4 + dlc;
+		this->queueMsg(&rx);
+		pos += CAN_RX_RECORD_HDR + dlc;
+	}
+}
@@ -1,58 +1,110 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-#include <queue>
-#include "j2534_v0404.h"
-
-class protocol_handler
-{
-public:
-	explicit protocol_handler(unsigned long channelID);
-	void setFlags(unsigned long flags);
-	void setBaud(unsigned long baud);
-	unsigned long getBaud();
-	virtual void recvData(uint8_t* m, uint16_t len) = 0;
-	int requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout);
-protected:
-	std::queue<PASSTHRU_MSG> msg_queue;
-	unsigned long baud;
-	unsigned long flags;
-	unsigned long channelid;
-};
-
-class iso9141_handler : public protocol_handler {
-public:
-	iso9141_handler(unsigned long channelID);
-	void recvData(uint8_t* m, uint16_t len);
-};
-
-class iso15765_handler : public protocol_handler {
-public:
-	iso15765_handler(unsigned long channelID);
-	void recvData(uint8_t* m, uint16_t len);
-};
-
-class can_handler : public protocol_handler {
-public:
-	can_handler(unsigned long channelID);
-	void recvData(uint8_t* m, uint16_t len);
-};
-
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <queue>
+#include <vector>
+#include "j2534_v0404.h"
+#include "macchina_j2534_ext.h"
+
+#define HANDLER_RX_QUEUE_BYTES (4 * 1024 * 1024) // Messages waiting for PassThruReadMsgs before new ones are thrown away
+#define QUEUED_MSG_HDR offsetof(PASSTHRU_MSG, Data) // Each message is only queued up to the end of its data
+
+class protocol_handler
+{
+public:
+	explicit protocol_handler(unsigned long channelID);
+	void setFlags(unsigned long flags);
+	unsigned long getFlags();
+	void setBaud(unsigned long baud);
+	unsigned long getBaud();
+	virtual void recvData(uint8_t* m, uint16_t len) = 0;
+	int requestData(PASSTHRU_MSG* pMsg, unsigned long* pNumMsgs, unsigned long Timeout);
+	void getDropCounts(unsigned long* dropped, unsigned long* overwritten);
+	void countTx(unsigned long numMsgs, unsigned long numBytes);
+	void getStats(MACCHINA_DRIVER_STATS* pOutput, bool reset);
+	uint16_t rxRoom();
+protected:
+	void queueMsg(PASSTHRU_MSG* msg);
+	std::mutex queue_mutex; // Messages are queued by the comm thread, and read by the application
+	std::queue<std::vector<uint8_t>> msg_queue; // PASSTHRU_MSG, cut short after DataSize
+	size_t queue_bytes = 0;
+	MACCHINA_DRIVER_STATS stats = {};
+	bool clock_synced = false;
+	uint32_t clock_offset = 0; // PC time - device time (us) of the fastest message since the stats were reset
+	unsigned long rx_dropped = 0; // Frames the device reported losing (MACCHINA_IOCTL_GET_DROPS)
+	unsigned long rx_overwritten = 0;
+	size_t msg_bytes = sizeof(PASSTHRU_MSG); // Most of the queue one data message from the device can fill
+	unsigned long baud;
+	unsigned long flags;
+	unsigned long channelid;
+};
+
+// K-Line messages, one per CMD_CHANNEL_DATA (Device to PC)
+// 0-3 - Rx timestamp in us
+// ..  - Message, checksum already checked and removed
+#define KLINE_RX_RECORD_HDR 4
+
+class iso9141_handler : public protocol_handler {
+public:
+	iso9141_handler(unsigned long channelID, unsigned long protocolID);
+	void recvData(uint8_t* m, uint16_t len);
+private:
+	unsigned long protocolID; // ISO9141 or ISO14230
+};
+
+// Payloads over 7 bytes go out as multiple frames, and the device runs one per channel at a time.
+// Each waits for the device to say the last one is done (Or was dropped) before going over
+#define ISO15765_MULTI_FRAME_SIZE 12 // Smallest PASSTHRU_MSG (CAN ID + address byte + payload) that needs it
+
+class iso15765_handler : public protocol_handler {
+public:
+	iso15765_handler(unsigned long channelID);
+	void recvData(uint8_t* m, uint16_t len);
+	bool startTx(unsigned long timeout_ms); // False if the last multi frame payload is still being sent
+	void endTx(); // Indication came in, or none is coming (Payload never reached the device, or it started again)
+private:
+	std::mutex tx_mutex;
+	std::condition_variable tx_done;
+	bool tx_busy = false;
+};
+
+// Raw CAN batch records, packed back to back in CMD_CHANNEL_DATA (Both directions)
+// 0   - Flags (CAN_RECORD_*) | DLC
+// 1-4 - CAN ID (Big endian, same as J2534)
+// 5-8 - Rx timestamp in us (Device to PC only)
+// ..  - Data
+#define CAN_RECORD_EXT     0x80 // 29 bit ID
+#define CAN_RECORD_RTR     0x40 // Remote frame
+#define CAN_RECORD_STATUS  0x20 // Not a frame - Data is frames dropped, then frames overwritten on the device since the last status (32bit each)
+#define CAN_RECORD_DLC     0x0F
+#define CAN_RX_RECORD_HDR  9
+#define CAN_TX_RECORD_HDR  5
+#define CAN_BATCH_SIZE     511 // Fits in a single CMD_CHANNEL_DATA with the channel ID
+
+class can_handler : public protocol_handler {
+public:
+	can_handler(unsigned long channelID);
+	void recvData(uint8_t* m, uint16_t len);
+};
+
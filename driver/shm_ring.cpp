@@ -0,0 +1,213 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+// Not using the precompiled header, the daemon and the Linux benchmark build this too
+#include "shm_ring.h"
+#include <chrono>
+#include <string.h>
+#ifndef _WIN32
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define EVENT_DATA  0
+#define EVENT_SPACE 1
+
+static uint32_t record_size(uint32_t len)
+{
+	return 4 + ((len + 3) & ~3UL);
+}
+
+void shm_ring::attach(shm_ring_state* state, uint8_t* data, uint32_t size, bool reset)
+{
+	this->state = state;
+	this->data = data;
+	this->size = size;
+	if (reset) {
+		this->state->head.store(0);
+		this->state->tail.store(0);
+		this->state->reader_sleeping.store(0);
+		this->state->writer_sleeping.store(0);
+	}
+	this->head_cache = this->state->head.load();
+	this->tail_cache = this->state->tail.load();
+}
+
+#ifdef _WIN32
+void shm_ring::setEvents(HANDLE data_event, HANDLE space_event)
+{
+	this->events[EVENT_DATA] = data_event;
+	this->events[EVENT_SPACE] = space_event;
+}
+
+std::string shm_event_name(const char* link_name, int event)
+{
+	return std::string(link_name) + "-" + std::to_string(event);
+}
+#endif
+
+bool shm_ring::hasData()
+{
+	if (this->head_cache == this->state->tail.load(std::memory_order_relaxed)) {
+		this->head_cache = this->state->head.load(std::memory_order_acquire);
+	}
+	return this->head_cache != this->state->tail.load(std::memory_order_relaxed);
+}
+
+bool shm_ring::hasSpace()
+{
+	uint32_t head = this->state->head.load(std::memory_order_relaxed);
+	if (head - this->tail_cache + this->need > this->size) {
+		this->tail_cache = this->state->tail.load(std::memory_order_acquire);
+	}
+	return head - this->tail_cache + this->need <= this->size;
+}
+
+// Spins for a bit, then flags that this side is asleep and sleeps until woken or timed out.
+// The flag is set before looking one last time, and the other side always moves its position
+// before checking the flag, so one of the two always sees the other
+bool shm_ring::wait(std::atomic<uint32_t>* sleeping, int event, bool (shm_ring::*ready)(), uint32_t timeout_ms)
+{
+	for (int i = 0; i < SHM_RING_SPIN; i++) {
+		if ((this->*ready)()) {
+			return true;
+		}
+	}
+	if (timeout_ms == 0) {
+		return false;
+	}
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (true) {
+		sleeping->store(1);
+		if ((this->*ready)()) {
+			sleeping->store(0);
+			return true;
+		}
+		long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (left <= 0) {
+			sleeping->store(0);
+			return (this->*ready)();
+		}
+#ifdef _WIN32
+		WaitForSingleObject(this->events[event], (DWORD)left);
+#else
+		(void)event; // The futex is the sleeping flag itself
+		struct timespec ts = { (time_t)(left / 1000), (long)(left % 1000) * 1000000 };
+		syscall(SYS_futex, (uint32_t*)sleeping, FUTEX_WAIT, 1, &ts, NULL, 0); // Shared between processes, so not FUTEX_PRIVATE
+#endif
+	}
+}
+
+void shm_ring::wake(std::atomic<uint32_t>* sleeping, int event)
+{
+	if (sleeping->load() == 0 || sleeping->exchange(0) == 0) {
+		return; // Other side is awake, nothing to do (The common case)
+	}
+#ifdef _WIN32
+	SetEvent(this->events[event]);
+#else
+	(void)event;
+	syscall(SYS_futex, (uint32_t*)sleeping, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+bool shm_ring::write(const void* buf, uint32_t len, uint32_t timeout_ms)
+{
+	uint32_t rec = record_size(len);
+	if (rec > this->size / 2) {
+		return false;
+	}
+	uint32_t head = this->state->head.load(std::memory_order_relaxed);
+	uint32_t offset = head & (this->size - 1);
+	uint32_t skip = (this->size - offset < rec) ? this->size - offset : 0; // Record would run off the end
+	this->need = skip + rec;
+	if (!this->hasSpace() && !this->wait(&this->state->writer_sleeping, EVENT_SPACE, &shm_ring::hasSpace, timeout_ms)) {
+		return false;
+	}
+	if (skip != 0) {
+		uint32_t marker = SHM_RING_SKIP;
+		memcpy(&this->data[offset], &marker, 4);
+		offset = 0;
+	}
+	memcpy(&this->data[offset], &len, 4);
+	memcpy(&this->data[offset + 4], buf, len);
+	this->state->head.store(head + skip + rec); // Sequentially consistent, see wait()
+	this->wake(&this->state->reader_sleeping, EVENT_DATA);
+	return true;
+}
+
+bool shm_ring::read(void* buf, uint32_t max, uint32_t* len, uint32_t timeout_ms)
+{
+	if (!this->hasData() && !this->wait(&this->state->reader_sleeping, EVENT_DATA, &shm_ring::hasData, timeout_ms)) {
+		return false;
+	}
+	uint32_t tail = this->state->tail.load(std::memory_order_relaxed);
+	uint32_t offset = tail & (this->size - 1);
+	uint32_t rec_len;
+	memcpy(&rec_len, &this->data[offset], 4);
+	if (rec_len == SHM_RING_SKIP) { // Record after it was published at the same time, so its there
+		tail += this->size - offset;
+		offset = 0;
+		memcpy(&rec_len, &this->data[offset], 4);
+	}
+	*len = rec_len;
+	memcpy(buf, &this->data[offset + 4], rec_len < max ? rec_len : max);
+	this->state->tail.store(tail + record_size(rec_len)); // Sequentially consistent, see wait()
+	this->wake(&this->state->writer_sleeping, EVENT_SPACE);
+	return true;
+}
+
+bool shm_ring::writeMsg(const PCMSG* msg, uint32_t timeout_ms)
+{
+	uint8_t buf[SHM_MSG_HEADER_SIZE + sizeof(msg->args)];
+	uint16_t arg_size = msg->arg_size < sizeof(msg->args) ? msg->arg_size : sizeof(msg->args);
+	buf[0] = msg->cmd_id;
+	buf[1] = msg->resp_code;
+	memcpy(&buf[2], &arg_size, 2);
+	buf[4] = msg->msg_id;
+	buf[5] = msg->__require_response;
+	memcpy(&buf[6], &msg->trace_id, 2);
+	memcpy(&buf[SHM_MSG_HEADER_SIZE], msg->args, arg_size);
+	return this->write(buf, SHM_MSG_HEADER_SIZE + arg_size, timeout_ms);
+}
+
+bool shm_ring::readMsg(PCMSG* msg, uint32_t timeout_ms)
+{
+	uint8_t buf[SHM_MSG_HEADER_SIZE + sizeof(msg->args)];
+	uint32_t len = 0;
+	if (!this->read(buf, sizeof(buf), &len, timeout_ms)) {
+		return false;
+	}
+	if (len < SHM_MSG_HEADER_SIZE || len > sizeof(buf)) {
+		return false;
+	}
+	memset(msg, 0x00, sizeof(PCMSG)); // Same as a message off the serial port, unused args are 0
+	msg->cmd_id = buf[0];
+	msg->resp_code = buf[1];
+	msg->arg_size = (uint16_t)(len - SHM_MSG_HEADER_SIZE);
+	msg->msg_id = buf[4];
+	msg->__require_response = buf[5] != 0;
+	memcpy(&msg->trace_id, &buf[6], 2);
+	memcpy(msg->args, &buf[SHM_MSG_HEADER_SIZE], msg->arg_size);
+	return true;
+}
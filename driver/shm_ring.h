@@ -0,0 +1,139 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "usbcomm.h"
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Single producer, single consumer ring in shared memory. The DLL and the passthru daemon
+// use a pair of them (One each way) so messages pass between the processes without a system
+// call each. A side only sleeps when its ring is empty (Reader) or full (Writer), and the other
+// side only makes the call to wake it up when it sees it asleep.
+//
+// Builds on Windows (Named events to sleep on) and Linux (Futex on the sleeping flag)
+
+#define SHM_RING_BYTES (256 * 1024) // Per direction. Must be a power of 2
+#define SHM_RING_SPIN 256 // Times to look again before going to sleep, a busy channel is back well before then
+
+#define SHM_LINK_MAGIC 0x4D324C4B // 'M2LK'
+#define SHM_LINK_VERSION 1
+
+// Ring positions only ever go up (Wrapping at 2^32), the offset into the data is pos & (size - 1).
+// Each record is a 32bit length followed by the bytes, padded up to 4 bytes. Records never wrap,
+// if one would not fit before the end, the writer puts SHM_RING_SKIP to send the reader to the start
+#define SHM_RING_SKIP 0xFFFFFFFF
+
+// Compact PCMSG record, so a CAN frame costs its own size rather than sizeof(PCMSG)
+// 0   - cmd_id
+// 1   - resp_code
+// 2-3 - arg_size
+// 4   - msg_id
+// 5   - __require_response
+// 6-7 - trace_id
+// ..  - args (arg_size bytes)
+#define SHM_MSG_HEADER_SIZE 8
+
+// Positions and sleeping flags, each on its own cache line so the two sides don't fight over them
+struct shm_ring_state {
+	alignas(64) std::atomic<uint32_t> head; // Only written by the writer
+	alignas(64) std::atomic<uint32_t> tail; // Only written by the reader
+	alignas(64) std::atomic<uint32_t> reader_sleeping; // Reader found the ring empty (Futex word on Linux)
+	alignas(64) std::atomic<uint32_t> writer_sleeping; // Writer found the ring full (Futex word on Linux)
+};
+
+// Layout of the shared memory the daemon creates for each client
+struct shm_link {
+	uint32_t magic;
+	uint32_t version;
+	shm_ring_state to_daemon;
+	shm_ring_state to_client;
+	uint8_t to_daemon_data[SHM_RING_BYTES];
+	uint8_t to_client_data[SHM_RING_BYTES];
+};
+
+// First thing the daemon writes down the pipe to a new client. Name is the shared memory section,
+// the events are the same name with -0 to -3 on the end (See shm_event_name)
+struct shm_hello {
+	uint32_t magic;
+	uint32_t version;
+	char name[64];
+};
+
+#define SHM_EVENT_TO_DAEMON_DATA  0
+#define SHM_EVENT_TO_DAEMON_SPACE 1
+#define SHM_EVENT_TO_CLIENT_DATA  2
+#define SHM_EVENT_TO_CLIENT_SPACE 3
+#define SHM_EVENT_COUNT           4
+
+class shm_ring
+{
+public:
+	/// <summary>
+	/// Attaches to a ring. Only the side that creates the shared memory should reset it
+	/// </summary>
+	void attach(shm_ring_state* state, uint8_t* data, uint32_t size, bool reset);
+#ifdef _WIN32
+	/// <summary>
+	/// Sets the auto reset events used to sleep on (Windows only, Linux uses the futex)
+	/// </summary>
+	void setEvents(HANDLE data_event, HANDLE space_event);
+#endif
+	/// <summary>
+	/// Writes a record, waiting up to timeout_ms for space. Only one thread may write at a time
+	/// </summary>
+	/// <returns>False if the ring stayed full, or the record can never fit</returns>
+	bool write(const void* buf, uint32_t len, uint32_t timeout_ms);
+
+	/// <summary>
+	/// Reads a record, waiting up to timeout_ms for one. Only one thread may read at a time
+	/// </summary>
+	/// <param name="len">Set to the size of the record. Records bigger than max are cut short</param>
+	/// <returns>False if nothing arrived</returns>
+	bool read(void* buf, uint32_t max, uint32_t* len, uint32_t timeout_ms);
+
+	bool writeMsg(const PCMSG* msg, uint32_t timeout_ms);
+	bool readMsg(PCMSG* msg, uint32_t timeout_ms);
+private:
+	bool hasData();
+	bool hasSpace();
+	bool wait(std::atomic<uint32_t>* sleeping, int event, bool (shm_ring::*ready)(), uint32_t timeout_ms);
+	void wake(std::atomic<uint32_t>* sleeping, int event);
+	shm_ring_state* state = nullptr;
+	uint8_t* data = nullptr;
+	uint32_t size = 0;
+	uint32_t need = 0; // Bytes the writer is waiting for
+	uint32_t head_cache = 0; // Last head the reader saw, so it only reads the writer's cache line when it runs out
+	uint32_t tail_cache = 0; // Last tail the writer saw
+#ifdef _WIN32
+	HANDLE events[2] = { NULL, NULL }; // Data, Space
+#endif
+};
+
+#ifdef _WIN32
+/// <summary>
+/// Name of one of a link's events (SHM_EVENT_*)
+/// </summary>
+std::string shm_event_name(const char* link_name, int event);
+#endif
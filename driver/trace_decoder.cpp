@@ -0,0 +1,102 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#include "pch.h"
+#include "trace_decoder.h"
+#include "Logger.h"
+#include "trace_export.h"
+#include <map>
+
+// Text for each event ID in the firmware's trace.h. Args are in order a0, a1, a2 then aux
+struct trace_format {
+	const char* tag;
+	const char* fmt;
+};
+
+static const std::map<uint16_t, trace_format> trace_formats = {
+	{ 0x0001, { "CAN", "Tx frame %08X: %08X %08X (DLC %u)" } },
+	{ 0x0002, { "CAN", "Error sending frame %08X" } },
+	{ 0x0003, { "CAN", "Tx ring full - %lu frames dropped" } },
+	{ 0x0010, { "ISO15765", "Rx frame %08X: %08X %08X (DLC %u)" } },
+	{ 0x0011, { "ISO15765", "SF_DL invalid from %08X - Ignoring (PCI %02lX)" } },
+	{ 0x0012, { "ISO15765", "First frame from %08X. FF_DL %lu" } },
+	{ 0x0013, { "ISO15765", "Not a valid ISO frame from %08X (PCI %02lX)" } },
+	{ 0x0014, { "ISO15765", "Sending flow control on %08X. BS %lu, Flow status %lu" } },
+	{ 0x0015, { "ISO15765", "Flow control received. BS %lu, STmin %lu us, Flow status %lu" } },
+	{ 0x0016, { "ISO15765", "Sending multiple frames on %08X. %lu bytes" } },
+	{ 0x0017, { "ISO15765", "Wrong consecutive frame from %08X, wanted SN %lu but got %lu - Aborting" } },
+	{ 0x0018, { "ISO15765", "No flow control for %08X within %lu ms - Aborting Tx" } },
+	{ 0x0019, { "ISO15765", "No consecutive frame from %08X within %lu ms - Aborting Rx" } },
+	{ 0x0020, { "K-LINE", "%lu errors" } },
+};
+
+static void log_event(trace_event* e)
+{
+	auto it = trace_formats.find(e->id);
+	if (it == trace_formats.end()) {
+		LOGGER.logWarn("M_TRACE", "[%lu] Unknown event %04X: %08X %08X %08X %02X", e->timestamp, e->id, e->args[0], e->args[1], e->args[2], e->aux);
+		return;
+	}
+	// Args the format doesn't use are ignored
+	if (trace_export::enabled()) {
+		char text[256];
+		snprintf(text, sizeof(text), it->second.fmt, e->args[0], e->args[1], e->args[2], e->aux);
+		trace_export::deviceEvent(it->second.tag, "firmware", e->timestamp, 0, trace_export::arg("event", text));
+	}
+	std::string line = "[%lu] " + std::string(it->second.fmt);
+	std::string tag = std::string("M_TRACE ") + it->second.tag;
+	switch (e->level) {
+	case TRACE_LEVEL_ERROR:
+		LOGGER.logError(tag, line.c_str(), e->timestamp, e->args[0], e->args[1], e->args[2], e->aux);
+		break;
+	case TRACE_LEVEL_INFO:
+		LOGGER.logInfo(tag, line.c_str(), e->timestamp, e->args[0], e->args[1], e->args[2], e->aux);
+		break;
+	default:
+		LOGGER.logDebug(tag, line.c_str(), e->timestamp, e->args[0], e->args[1], e->args[2], e->aux);
+		break;
+	}
+}
+
+void trace_decoder::decode(PCMSG* msg)
+{
+	if (msg->arg_size < TRACE_MSG_HEADER_SIZE || msg->arg_size > sizeof(msg->args)) {
+		LOGGER.logError("M_TRACE", "Invalid trace message of %u bytes", msg->arg_size);
+		return;
+	}
+	uint32_t lost;
+	memcpy(&lost, &msg->args[0], 4);
+	if (trace_export::enabled() && msg->arg_size >= TRACE_MSG_HEADER_SIZE + sizeof(trace_event)) {
+		// Newest event was the closest to when the message was sent
+		uint16_t count = (msg->arg_size - TRACE_MSG_HEADER_SIZE) / sizeof(trace_event);
+		trace_event last;
+		memcpy(&last, &msg->args[TRACE_MSG_HEADER_SIZE + (count - 1) * sizeof(trace_event)], sizeof(trace_event));
+		trace_export::deviceClock(last.timestamp, trace_export::now_us());
+	}
+	if (lost != 0) {
+		LOGGER.logWarn("M_TRACE", "Macchina lost %lu trace events", lost);
+	}
+	for (uint16_t pos = TRACE_MSG_HEADER_SIZE; pos + sizeof(trace_event) <= msg->arg_size; pos += sizeof(trace_event)) {
+		trace_event e;
+		memcpy(&e, &msg->args[pos], sizeof(trace_event));
+		log_event(&e);
+	}
+}
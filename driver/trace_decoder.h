@@ -0,0 +1,57 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+
+#ifndef TRACE_DECODER_H_
+#define TRACE_DECODER_H_
+
+#include <stdint.h>
+#include "usbcomm.h"
+
+// CMD_TRACE args format
+// 0-3  - Events lost since the last CMD_TRACE because the ring was full (32bit)
+// 4..  - trace_event records back to back
+#define TRACE_MSG_HEADER_SIZE 4
+
+// Event levels
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+#pragma pack(push, 1)
+// Same layout as trace.h in the firmware (20 bytes)
+struct trace_event {
+	uint32_t timestamp; // us
+	uint16_t id;
+	uint8_t level;
+	uint8_t aux;
+	uint32_t args[3];
+};
+#pragma pack(pop)
+
+// Turns binary trace events from Macchina into log lines
+namespace trace_decoder
+{
+	void decode(PCMSG* msg);
+};
+
+#endif
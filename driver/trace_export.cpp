@@ -0,0 +1,208 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#include "pch.h"
+#include "trace_export.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <set>
+
+namespace trace_export {
+	std::ofstream file;
+	std::mutex mutex;
+	std::atomic<bool> active = false;
+	bool first = true; // No comma before the first event
+	uint64_t start_us = 0;
+	std::set<std::pair<int, unsigned long>> named; // Tracks that already have a name
+	// Device clock mapping. The sample that arrived quickest since the last resync is used
+	bool synced = false;
+	uint32_t sync_device = 0;
+	uint64_t sync_host = 0;
+}
+
+static std::string escape(const std::string& s)
+{
+	std::string out;
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		if ((unsigned char)c >= 0x20) {
+			out += c;
+		}
+	}
+	return out;
+}
+
+// Caller holds the mutex
+static void write_event(const std::string& json)
+{
+	if (!trace_export::active) {
+		return;
+	}
+	trace_export::file << (trace_export::first ? "\n" : ",\n") << json << std::flush;
+	trace_export::first = false;
+}
+
+// Caller holds the mutex
+static void name_track(int pid, unsigned long tid, const std::string& name)
+{
+	if (!trace_export::named.insert({ pid, tid }).second) {
+		return;
+	}
+	write_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) + ",\"tid\":" + std::to_string(tid) +
+		",\"args\":{\"name\":\"" + escape(name) + "\"}}");
+}
+
+static std::string timestamp(uint64_t us)
+{
+	return std::to_string(us < trace_export::start_us ? 0 : us - trace_export::start_us);
+}
+
+void trace_export::start()
+{
+	char path[MAX_PATH] = { 0x00 };
+	if (GetEnvironmentVariableA(TRACE_EXPORT_ENV, path, sizeof(path)) == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	if (active) {
+		return;
+	}
+	file.open(path, std::ios_base::trunc);
+	if (!file.is_open()) {
+		return;
+	}
+	active = true;
+	first = true;
+	synced = false;
+	named.clear();
+	start_us = now_us();
+	file << "[";
+	write_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(TRACE_DRIVER_PID) + ",\"args\":{\"name\":\"Driver\"}}");
+	write_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(TRACE_DEVICE_PID) + ",\"args\":{\"name\":\"Macchina\"}}");
+	name_track(TRACE_DEVICE_PID, TRACE_TRACK_FIRMWARE, "Firmware");
+}
+
+void trace_export::stop()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!active) {
+		return;
+	}
+	file << "\n]\n";
+	file.close();
+	active = false;
+}
+
+bool trace_export::enabled()
+{
+	return active;
+}
+
+uint64_t trace_export::now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_export::nameThread(const char* name)
+{
+	if (!active) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	name_track(TRACE_DRIVER_PID, GetCurrentThreadId(), name);
+}
+
+void trace_export::complete(const char* name, const char* cat, unsigned long track, uint64_t start, uint64_t end, const std::string& args)
+{
+	if (!active) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	unsigned long tid = track;
+	if (track == TRACE_TRACK_THREAD) {
+		tid = GetCurrentThreadId();
+		name_track(TRACE_DRIVER_PID, tid, "Thread " + std::to_string(tid));
+	} else {
+		name_track(TRACE_DRIVER_PID, tid, "Channel " + std::to_string(track - TRACE_TRACK_CHANNEL(0)));
+	}
+	write_event(std::string("{\"name\":\"") + name + "\",\"cat\":\"" + cat + "\",\"ph\":\"X\",\"pid\":" + std::to_string(TRACE_DRIVER_PID) +
+		",\"tid\":" + std::to_string(tid) + ",\"ts\":" + timestamp(start) + ",\"dur\":" + std::to_string(end - start) +
+		",\"args\":{" + args + "}}");
+}
+
+// A device time and when the PC received it. USB only ever adds delay, so the quickest one is the closest
+void trace_export::deviceClock(uint32_t device_us, uint64_t host_us)
+{
+	if (!active) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	int64_t mapped = (int64_t)sync_host + (int32_t)(device_us - sync_device);
+	if (!synced || (int64_t)host_us < mapped || host_us - sync_host > TRACE_DEVICE_RESYNC_US) {
+		sync_device = device_us;
+		sync_host = host_us;
+		synced = true;
+	}
+}
+
+void trace_export::deviceEvent(const char* name, const char* cat, uint32_t device_us, uint32_t dur_us, const std::string& args)
+{
+	if (!active) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!synced) {
+		return; // No idea where this goes yet
+	}
+	uint64_t host = sync_host + (int32_t)(device_us - sync_device); // Differences are still right across a wrap
+	write_event(std::string("{\"name\":\"") + escape(name) + "\",\"cat\":\"" + cat + "\",\"ph\":\"" + (dur_us == 0 ? "i\",\"s\":\"t" : "X") +
+		"\",\"pid\":" + std::to_string(TRACE_DEVICE_PID) + ",\"tid\":" + std::to_string(TRACE_TRACK_FIRMWARE) +
+		",\"ts\":" + timestamp(host) + (dur_us == 0 ? "" : ",\"dur\":" + std::to_string(dur_us)) + ",\"args\":{" + args + "}}");
+}
+
+std::string trace_export::arg(const char* key, const std::string& value)
+{
+	return std::string("\"") + key + "\":\"" + escape(value) + "\"";
+}
+
+std::string trace_export::arg(const char* key, unsigned long value)
+{
+	return std::string("\"") + key + "\":" + std::to_string(value);
+}
+
+trace_export::span::span(const char* name, const char* cat, unsigned long track)
+{
+	this->name = name;
+	this->cat = cat;
+	this->track = track;
+	this->start = trace_export::active ? trace_export::now_us() : 0;
+}
+
+trace_export::span::~span()
+{
+	if (trace_export::active && this->start != 0) {
+		trace_export::complete(this->name, this->cat, this->track, this->start, trace_export::now_us(), this->args);
+	}
+}
@@ -0,0 +1,74 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+
+#ifndef TRACE_EXPORT_H_
+#define TRACE_EXPORT_H_
+
+#include <stdint.h>
+#include <string>
+
+// Set this environment variable to a file path before the application opens the device to record
+// a Chrome trace-event JSON file (Loads in chrome://tracing or ui.perfetto.dev)
+#define TRACE_EXPORT_ENV "MACCHINA_TRACE_FILE"
+
+#define TRACE_DRIVER_PID 1 // PassThru API, USB and comm thread activity
+#define TRACE_DEVICE_PID 2 // Events reported by the firmware (CMD_TRACE, CMD_TX_TRACE)
+
+#define TRACE_TRACK_THREAD 0 // Track of the calling thread
+#define TRACE_TRACK_CHANNEL(id) (1000 + (id)) // One track per J2534 channel
+#define TRACE_TRACK_FIRMWARE 1 // Device process only
+
+#define TRACE_DEVICE_RESYNC_US 10000000 // Device clock is lined up with the PC clock again this often, so drift can't build up
+
+// Writes driver and firmware activity as trace events. Does nothing unless TRACE_EXPORT_ENV was set when the device was opened
+namespace trace_export
+{
+	void start();
+	void stop();
+	bool enabled();
+	uint64_t now_us();
+	void nameThread(const char* name);
+	void complete(const char* name, const char* cat, unsigned long track, uint64_t start_us, uint64_t end_us, const std::string& args = "");
+	void deviceClock(uint32_t device_us, uint64_t host_us);
+	void deviceEvent(const char* name, const char* cat, uint32_t device_us, uint32_t dur_us, const std::string& args);
+	std::string arg(const char* key, const std::string& value);
+	std::string arg(const char* key, unsigned long value);
+
+	// Records how long the enclosing scope took
+	class span
+	{
+	public:
+		span(const char* name, const char* cat, unsigned long track);
+		~span();
+		std::string args;
+	private:
+		const char* name;
+		const char* cat;
+		unsigned long track;
+		uint64_t start;
+	};
+};
+
+#define TRACE_API_SPAN(name, track) trace_export::span _api_span(name, "api", track)
+
+#endif
@@ -1,195 +1,527 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#include "pch.h"
-#include "usbcomm.h"
-#include <mutex>
-#include <map>
-#include "Logger.h"
-
-namespace usbcomm {
-	HANDLE handler;
-	bool connected = false;
-	std::mutex mutex;
-	COMSTAT com;
-	DWORD errors;
-	std::string lastError = "";
-	
-
-
-	uint8_t msg_id = 0x01;
-	std::map<uint8_t, PCMSG> results;
-	std::mutex resMutex;
-
-	bool OpenPort() {
-		mutex.lock();
-		// TODO - Allow different COM Ports
-		handler = CreateFile(L"\\\\.\\COM12", GENERIC_READ | GENERIC_WRITE, NULL, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-
-		if (handler == INVALID_HANDLE_VALUE) {
-			LOGGER.logError("MACCHINA", "Cannot create handler - error is %d", GetLastError());
-			mutex.unlock();
-			return false;
-		}
-
-		DCB params = { 0x00 };
-		if (!GetCommState(handler, &params)) {
-			LOGGER.logError("MACCHINA", "Cannot read comm states - error is %d", GetLastError());
-			mutex.unlock();
-			return false;
-		}
-
-		params.BaudRate = CBR_115200;
-		params.ByteSize = 8;
-		params.StopBits = ONESTOPBIT;
-		params.Parity = NOPARITY;
-		params.fDtrControl = DTR_CONTROL_DISABLE;
-
-		if (!SetCommState(handler, &params)) {
-			LOGGER.logError("MACCHINA", "Cannot set comm states - error is %d", GetLastError());
-			mutex.unlock();
-			return false;
-		}
-
-		PurgeComm(handler, PURGE_RXCLEAR | PURGE_TXCLEAR);
-		connected = true;
-		mutex.unlock();
-		return true;
-	}
-
-	void ClosePort() {
-		mutex.lock();
-		CloseHandle(handler);
-		mutex.unlock();
-		connected = false;
-	}
-
-	std::string getLastError()
-	{
-		return lastError;
-	}
-
-	bool internalSendMsg(PCMSG* msg, bool responseRequired) {
-		msg->__require_response = responseRequired; // Just for sanity sake
-		DWORD written = 0;
-		mutex.lock();
-		if (!WriteFile(handler, msg, sizeof(struct PCMSG), &written, NULL)) {
-			DWORD error = GetLastError();
-			LOGGER.logWarn("M_SEND", "Error writing message! Code %d", (int)error);
-			if (error == 22 || error == 433) { // Device doesn't exit!? - Maybe unplugged!
-				connected = false;
-			}
-			mutex.unlock();
-			return false;
-		}
-		mutex.unlock();
-		return true;
-	}
-
-	bool mapHasResult(uint8_t wantID) {
-		return results.find(wantID) != results.end();
-	}
-
-	bool sendMsg(PCMSG* msg) {
-		return internalSendMsg(msg, false);
-	}
-
-	CMD_RES sendMsgResp(PCMSG* msg, PCMSG* resp)
-	{
-		resMutex.lock();
-		results.erase(msg_id); // Erase any old message that was in this ID's slot
-		uint8_t want_id = msg_id; // Set the target ID to the msg_id
-		msg_id++; // Incriment the next id for future sent message
-		msg->msg_id = want_id; // Set it in the message so Macchina knows it has to respond with same ID
-		resMutex.unlock();
-		// Send the message first
-		if (!internalSendMsg(msg, true)) {
-			lastError = "Could not send command to Macchina";
-			return CMD_RES::SEND_FAIL;
-		}
-		// Wait for our response message
-		const clock_t begin_time = clock();
-		while (!mapHasResult(want_id) && clock() - begin_time / (CLOCKS_PER_SEC / 1000) <= MAX_WAIT_TIME_MS) {
-			std::this_thread::sleep_for(std::chrono::microseconds(100));
-		}
-
-		// Either timer expired or we have a message before timer ended, figure out which
-		if (!mapHasResult(want_id)) { // Still no result!? - Macchinas probably frozen (again!)
-			LOGGER.logError("M_SEND_RESP", "Timeout waiting for Macchina to respond", lastError.c_str());
-			lastError = "Timeout requesting response";
-			return CMD_RES::CMD_TIMEOUT;
-		}
-
-		resMutex.lock(); // Lock damn result mutex so poller thread can't touch the results map whilst im doing memcpy (This caused 8+ hours of pain...!)
-		PCMSG p = results.at(want_id);
-		memcpy(&resp, &p, sizeof(struct PCMSG)); // Copies the found message to msg pointer
-		results.erase(want_id); // We can now remove the message in the results map
-		resMutex.unlock(); // Unlock this piece of shit....Not optimal but multithreading is making me loosing my sanity here
-
-		if (resp->resp_code == STATUS_NOERROR) { // Macchina happily responded to the request sent
-			return CMD_RES::CMD_OK;
-		}
-		else { // FFS. Something happened on Macchina, report the error (Args are the error string)
-			lastError.assign((char*)msg->args, msg->arg_size);
-			LOGGER.logDebug("M_SEND_RESP", "Macchina Failed to process request. Error: '%s'", lastError);
-			return CMD_RES::CMD_FAIL;
-		}
-	}
-
-
-	bool pollMessage(PCMSG* msg) {
-		if (!connected) { // Don't throw an exception, exit early if not connected
-			return false;
-		}
-		DWORD read = 0;
-		mutex.lock();
-		ClearCommError(handler, &errors, &com);
-		memset(msg, 0x00, sizeof(struct PCMSG));
-		if (com.cbInQue >= sizeof(struct PCMSG)) {
-			ReadFile(handler, msg, sizeof(struct PCMSG), &read, NULL);
-			mutex.unlock();
-			if (read != sizeof(struct PCMSG)) {
-				LOGGER.logError("M_READ", "Missmatch. Want %lu bytes, got %lu", sizeof(PCMSG), read);
-				return false;
-			}
-			if (msg->cmd_id == CMD_LOG) {
-				LOGGER.logInfo("M_READ", "Macchina message: '%s'", msg->args);
-				return false;
-			}
-			// Its a response message for a command sent on another thread!
-			else if ((msg->cmd_id & 0xF0) == CMD_RES_FROM_CMD) {
-				//LOGGER.logDebug("M_READ", "Received a result message - ID %02X, Code: %02X", msg->msg_id, msg->resp_code);
-				resMutex.lock();
-				PCMSG tmp = {0x00};
-				memcpy(&tmp, msg, sizeof(struct PCMSG));
-				results.emplace(msg->msg_id, tmp);
-				resMutex.unlock();
-				return false; // Return false so we don't process it later on this thread
-			}
-			return true;
-		}
-		mutex.unlock();
-		return false;
-	}
-
-	bool isConnected() {
-		return connected;
-	}
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "pch.h"
+#include "usbcomm.h"
+#include <mutex>
+#include <map>
+#include <queue>
+#include "Logger.h"
+#include "trace_decoder.h"
+#include "latency_trace.h"
+#include "trace_export.h"
+#include "shm_ring.h"
+#include "discovery.h"
+#include "link_frame.h"
+
+namespace usbcomm {
+	HANDLE handler = INVALID_HANDLE_VALUE;
+	bool connected = false;
+	bool via_daemon = false; // Talking to the passthru daemon rather than the serial port
+	HANDLE link_mapping = NULL; // Shared memory with the daemon
+	shm_link* link = nullptr;
+	HANDLE link_events[SHM_EVENT_COUNT] = { NULL };
+	shm_ring link_tx; // To the daemon, guarded by mutex
+	shm_ring link_rx; // From the daemon, only read by the comm thread
+	std::mutex mutex;
+	COMSTAT com;
+	DWORD errors;
+	frame_decoder decoder; // Serial port only, the daemon checks frames itself
+	link_credits credits; // Serial port only, the daemon does flow control for its clients
+	std::string lastError = "";
+	
+
+
+	uint8_t msg_id = 0x01;
+	std::map<uint8_t, PCMSG> results;
+	std::mutex resMutex;
+	std::queue<PCMSG> read_ahead; // Read, but waiting for the comm thread
+	std::mutex read_ahead_mutex; // Comm thread, and ClosePort() emptying it
+
+	// Errors that mean the port has gone (Unplugged, or USB reset it)
+	bool portGone(DWORD error) {
+		return error == 22 || error == 433 || error == 1167;
+	}
+
+	void closeHandler() {
+		if (handler != INVALID_HANDLE_VALUE) {
+			CloseHandle(handler);
+			handler = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	void closeLink() {
+		if (link != nullptr) {
+			UnmapViewOfFile(link);
+			link = nullptr;
+		}
+		if (link_mapping != NULL) {
+			CloseHandle(link_mapping);
+			link_mapping = NULL;
+		}
+		for (int i = 0; i < SHM_EVENT_COUNT; i++) {
+			if (link_events[i] != NULL) {
+				CloseHandle(link_events[i]);
+				link_events[i] = NULL;
+			}
+		}
+	}
+
+	// Daemon tells us which shared memory to use as soon as the pipe is connected.
+	// The pipe is then left alone, it only tells each side if the other has gone
+	bool openLink() {
+		shm_hello hello = { 0x00 };
+		DWORD read = 0;
+		if (!ReadFile(handler, &hello, sizeof(hello), &read, NULL) || read != sizeof(hello)) {
+			LOGGER.logError("MACCHINA", "No hello from the passthru daemon - error is %d", GetLastError());
+			return false;
+		}
+		if (hello.magic != SHM_LINK_MAGIC || hello.version != SHM_LINK_VERSION) {
+			LOGGER.logError("MACCHINA", "Passthru daemon is a different version (%lu)", (unsigned long)hello.version);
+			return false;
+		}
+		hello.name[sizeof(hello.name) - 1] = 0x00;
+		link_mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, hello.name);
+		if (link_mapping != NULL) {
+			link = (shm_link*)MapViewOfFile(link_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(shm_link));
+		}
+		bool events_ok = true;
+		for (int i = 0; i < SHM_EVENT_COUNT; i++) {
+			link_events[i] = OpenEventA(EVENT_ALL_ACCESS, FALSE, shm_event_name(hello.name, i).c_str());
+			events_ok = events_ok && link_events[i] != NULL;
+		}
+		if (link == nullptr || !events_ok) {
+			LOGGER.logError("MACCHINA", "Cannot open shared memory '%s' - error is %d", hello.name, GetLastError());
+			closeLink();
+			return false;
+		}
+		link_tx.attach(&link->to_daemon, link->to_daemon_data, SHM_RING_BYTES, false);
+		link_tx.setEvents(link_events[SHM_EVENT_TO_DAEMON_DATA], link_events[SHM_EVENT_TO_DAEMON_SPACE]);
+		link_rx.attach(&link->to_client, link->to_client_data, SHM_RING_BYTES, false);
+		link_rx.setEvents(link_events[SHM_EVENT_TO_CLIENT_DATA], link_events[SHM_EVENT_TO_CLIENT_SPACE]);
+		return true;
+	}
+
+	// Opens a port that might be Macchina, and checks with a CMD_HELLO that it is
+	bool openDevice(const std::wstring& port) {
+		handler = CreateFile(port.c_str(), GENERIC_READ | GENERIC_WRITE, NULL, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (handler == INVALID_HANDLE_VALUE) {
+			LOGGER.logDebug("MACCHINA", "Cannot open %ls - error is %d", port.c_str(), GetLastError());
+			return false;
+		}
+
+		DCB params = { 0x00 };
+		if (!GetCommState(handler, &params)) {
+			LOGGER.logError("MACCHINA", "Cannot read comm states of %ls - error is %d", port.c_str(), GetLastError());
+			closeHandler();
+			return false;
+		}
+
+		params.BaudRate = CBR_115200;
+		params.ByteSize = 8;
+		params.StopBits = ONESTOPBIT;
+		params.Parity = NOPARITY;
+		params.fDtrControl = DTR_CONTROL_DISABLE;
+
+		if (!SetCommState(handler, &params)) {
+			LOGGER.logError("MACCHINA", "Cannot set comm states of %ls - error is %d", port.c_str(), GetLastError());
+			closeHandler();
+			return false;
+		}
+
+		COMMTIMEOUTS timeouts = { 0x00 };
+		timeouts.ReadTotalTimeoutConstant = HELLO_TIMEOUT_MS; // Only the hello waits, pollMessage never reads more than is there
+		SetCommTimeouts(handler, &timeouts);
+		PurgeComm(handler, PURGE_RXCLEAR | PURGE_TXCLEAR);
+
+		PCMSG msg;
+		uint8_t frame[FRAME_SIZE];
+		DWORD done = 0;
+		frame_credit credit;
+		discovery::makeHello(&msg);
+		frame_encode(&msg, nullptr, frame);
+		decoder.reset();
+		if (WriteFile(handler, frame, FRAME_SIZE, &done, NULL)) {
+			const clock_t begin_time = clock();
+			// Logs and such may already have been on their way, so look past them
+			while ((clock() - begin_time) / (CLOCKS_PER_SEC / 1000) <= HELLO_TIMEOUT_MS) {
+				if (!decoder.next(&msg, &credit)) {
+					if (!ReadFile(handler, decoder.tail(), (DWORD)decoder.wanted(), &done, NULL) || done == 0) {
+						break;
+					}
+					decoder.added(done);
+					continue;
+				}
+				device_info info = {};
+				if (discovery::readHello(&msg, &info)) {
+					LOGGER.logInfo("MACCHINA", "Found Macchina on %ls. Protocol %u, capabilities %08X, firmware built %s",
+						port.c_str(), info.protocol, info.caps, info.build.c_str());
+					return true;
+				}
+				if (msg.cmd_id == (CMD_HELLO | CMD_RES_FROM_CMD)) {
+					LOGGER.logError("MACCHINA", "Macchina on %ls has incompatible firmware (Protocol %u, driver wants %u)", port.c_str(), info.protocol, PC_PROTOCOL_VERSION);
+					break;
+				}
+			}
+		}
+		LOGGER.logDebug("MACCHINA", "No hello from %ls", port.c_str());
+		closeHandler();
+		return false;
+	}
+
+	bool OpenPort() {
+		mutex.lock();
+		// Daemon owns the port if its running, so share the device through it
+		handler = CreateFile(DAEMON_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, NULL, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (handler != INVALID_HANDLE_VALUE) {
+			if (!openLink()) {
+				closeHandler();
+				mutex.unlock();
+				return false;
+			}
+			LOGGER.logInfo("MACCHINA", "Connected to the passthru daemon");
+			via_daemon = true;
+			connected = true;
+			mutex.unlock();
+			return true;
+		}
+		via_daemon = false;
+
+		for (const std::wstring& port : discovery::candidatePorts()) {
+			if (openDevice(port)) {
+				connected = true;
+				mutex.unlock();
+				return true;
+			}
+		}
+		LOGGER.logDebug("MACCHINA", "Cannot find Macchina on any port"); // Callers say if they have given up
+		mutex.unlock();
+		return false;
+	}
+
+	void ClosePort() {
+		mutex.lock();
+		closeHandler();
+		closeLink();
+		mutex.unlock();
+		connected = false;
+		read_ahead_mutex.lock(); // Nothing from before a reconnect is handed out after it
+		read_ahead = std::queue<PCMSG>();
+		read_ahead_mutex.unlock();
+		credits.reset(); // Channels set them up again if the device comes back
+	}
+
+	std::string getLastError()
+	{
+		return lastError;
+	}
+
+	bool internalSendMsg(PCMSG* msg, bool responseRequired) {
+		msg->__require_response = responseRequired; // Just for sanity sake
+		DWORD written = 0;
+		uint8_t frame[FRAME_SIZE];
+		frame_credit credit = {};
+		if (!via_daemon) {
+			credits.headerCredit(&credit);
+			frame_encode(msg, &credit, frame); // Outside the lock, so the CRC isn't holding up other threads
+		}
+		mutex.lock();
+		if (via_daemon) {
+			if (!link_tx.writeMsg(msg, MAX_WAIT_TIME_MS)) {
+				LOGGER.logWarn("M_SEND", "Passthru daemon is not reading messages");
+				mutex.unlock();
+				return false;
+			}
+		}
+		else if (!WriteFile(handler, frame, FRAME_SIZE, &written, NULL)) {
+			DWORD error = GetLastError();
+			LOGGER.logWarn("M_SEND", "Error writing message! Code %d", (int)error);
+			if (portGone(error)) { // Device doesn't exit!? - Maybe unplugged! The ping thread opens it again
+				connected = false;
+			}
+			mutex.unlock();
+			return false;
+		}
+		mutex.unlock();
+		credits.told(&credit); // Not before, a failed write would lose the update
+		credits.toldMsg(msg);
+		if (msg->trace_id != 0) {
+			latency_trace::sent(msg->trace_id);
+		}
+		return true;
+	}
+
+	bool mapHasResult(uint8_t wantID) {
+		return results.find(wantID) != results.end();
+	}
+
+	bool sendMsg(PCMSG* msg) {
+		return internalSendMsg(msg, false);
+	}
+
+	CMD_RES sendMsgResp(PCMSG* msg, PCMSG* resp)
+	{
+		trace_export::span span("sendMsgResp", "usb", TRACE_TRACK_THREAD);
+		if (trace_export::enabled()) {
+			span.args = trace_export::arg("cmd", msg->cmd_id);
+		}
+		resMutex.lock();
+		results.erase(msg_id); // Erase any old message that was in this ID's slot
+		uint8_t want_id = msg_id; // Set the target ID to the msg_id
+		msg_id++; // Incriment the next id for future sent message
+		msg->msg_id = want_id; // Set it in the message so Macchina knows it has to respond with same ID
+		resMutex.unlock();
+		// Send the message first
+		if (!internalSendMsg(msg, true)) {
+			lastError = "Could not send command to Macchina";
+			return CMD_RES::SEND_FAIL;
+		}
+		// Wait for our response message
+		const clock_t begin_time = clock();
+		while (!mapHasResult(want_id) && (clock() - begin_time) / (CLOCKS_PER_SEC / 1000) <= MAX_WAIT_TIME_MS) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+
+		// Either timer expired or we have a message before timer ended, figure out which
+		if (!mapHasResult(want_id)) { // Still no result!? - Macchinas probably frozen (again!)
+			LOGGER.logError("M_SEND_RESP", "Timeout waiting for Macchina to respond", lastError.c_str());
+			lastError = "Timeout requesting response";
+			return CMD_RES::CMD_TIMEOUT;
+		}
+
+		resMutex.lock(); // Lock damn result mutex so poller thread can't touch the results map whilst im doing memcpy (This caused 8+ hours of pain...!)
+		PCMSG p = results.at(want_id);
+		*resp = p; // Copies the found message to resp pointer
+		results.erase(want_id); // We can now remove the message in the results map
+		resMutex.unlock(); // Unlock this piece of shit....Not optimal but multithreading is making me loosing my sanity here
+
+		if (resp->resp_code == STATUS_NOERROR) { // Macchina happily responded to the request sent
+			return CMD_RES::CMD_OK;
+		}
+		else { // FFS. Something happened on Macchina, report the error (Args are the error string)
+			lastError.assign((char*)resp->args, min(resp->arg_size, sizeof(resp->args)));
+			LOGGER.logDebug("M_SEND_RESP", "Macchina Failed to process request. Error: '%s'", lastError.c_str());
+			return CMD_RES::CMD_FAIL;
+		}
+	}
+
+	// Used to put a reconnected device back how it was. Every message is written straight away, then
+	// the responses are collected at the end, so the whole lot costs about one round trip
+	int sendPipelined(std::vector<PCMSG>& msgs)
+	{
+		trace_export::span span("sendPipelined", "usb", TRACE_TRACK_THREAD);
+		int failed = 0;
+		std::vector<uint8_t> waiting;
+		auto collect = [&]() {
+			const clock_t begin_time = clock();
+			for (uint8_t want_id : waiting) {
+				while (!mapHasResult(want_id) && (clock() - begin_time) / (CLOCKS_PER_SEC / 1000) <= MAX_WAIT_TIME_MS) {
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+				}
+				std::lock_guard<std::mutex> lock(resMutex);
+				auto it = results.find(want_id);
+				if (it == results.end()) {
+					LOGGER.logError("M_PIPELINE", "Timeout waiting for response to message %u", want_id);
+					failed++;
+					continue;
+				}
+				if (it->second.resp_code != STATUS_NOERROR) {
+					LOGGER.logError("M_PIPELINE", "Macchina failed command %02X (Code %u)", it->second.cmd_id & 0x0F, it->second.resp_code);
+					failed++;
+				}
+				results.erase(it);
+			}
+			waiting.clear();
+		};
+		for (PCMSG& m : msgs) {
+			if (m.__require_response) {
+				resMutex.lock();
+				results.erase(msg_id);
+				m.msg_id = msg_id++;
+				resMutex.unlock();
+			}
+			if (!internalSendMsg(&m, m.__require_response)) {
+				lastError = "Could not send command to Macchina";
+				return (int)msgs.size();
+			}
+			if (m.__require_response) {
+				waiting.push_back(m.msg_id);
+				if (waiting.size() == PIPELINE_WINDOW) { // Message IDs are only 8 bits
+					collect();
+				}
+			}
+		}
+		collect();
+		return failed;
+	}
+
+	// Messages from the daemon arrive through shared memory. Waits a little if there are none,
+	// there is no reason to keep the comm thread spinning
+	bool readLink(PCMSG* msg, uint32_t timeout_ms) {
+		if (link_rx.readMsg(msg, timeout_ms)) {
+			return true;
+		}
+		DWORD waiting = 0;
+		if (!PeekNamedPipe(handler, NULL, 0, NULL, &waiting, NULL)) { // Daemon has gone away
+			LOGGER.logError("M_READ", "Lost the passthru daemon - error is %d", GetLastError());
+			connected = false;
+		}
+		return false;
+	}
+
+	bool nextFrame(PCMSG* msg) {
+		frame_credit credit;
+		if (!decoder.next(msg, &credit)) {
+			return false;
+		}
+		credits.received(&credit);
+		return true;
+	}
+
+	// Only ever reads up to the end of the frame being put together, so a message never waits behind the next one
+	bool readPort(PCMSG* msg) {
+		if (nextFrame(msg)) {
+			return true;
+		}
+		unsigned long crc_errors = decoder.stats.crc_errors;
+		DWORD read = 0;
+		mutex.lock();
+		if (!ClearCommError(handler, &errors, &com)) {
+			DWORD error = GetLastError();
+			if (portGone(error) && connected) {
+				LOGGER.logError("M_READ", "Lost Macchina - error is %d", (int)error);
+				connected = false;
+			}
+			mutex.unlock();
+			return false;
+		}
+		if (com.cbInQue == 0) {
+			mutex.unlock();
+			return false;
+		}
+		ReadFile(handler, decoder.tail(), min(com.cbInQue, (DWORD)decoder.wanted()), &read, NULL);
+		mutex.unlock();
+		decoder.added(read);
+		if (nextFrame(msg)) {
+			return true;
+		}
+		if (decoder.stats.crc_errors != crc_errors) {
+			LOGGER.logWarn("M_READ", "Corrupt message from Macchina, looking for the next one (%lu so far)", decoder.stats.crc_errors);
+		}
+		return false;
+	}
+
+	// Handles what can be dealt with straight away. True if the comm thread has to handle it
+	bool route(PCMSG* msg) {
+		if (msg->cmd_id == CMD_LOG) {
+			LOGGER.logInfo("M_READ", "Macchina message: '%s'", msg->args);
+			return false;
+		}
+		else if (msg->cmd_id == CMD_TRACE) {
+			trace_decoder::decode(msg);
+			return false;
+		}
+		else if (msg->cmd_id == CMD_CREDIT) {
+			credits.receivedMsg(msg);
+			return false;
+		}
+		else if (msg->cmd_id == CMD_CHANNEL_DATA || msg->cmd_id == CMD_CHANNEL_DATA_PART) {
+			credits.rxArrived(msg->args[0]); // Never opened when the daemon has the port
+		}
+		// Its a response message for a command sent on another thread!
+		else if ((msg->cmd_id & 0xF0) == CMD_RES_FROM_CMD) {
+			//LOGGER.logDebug("M_READ", "Received a result message - ID %02X, Code: %02X", msg->msg_id, msg->resp_code);
+			resMutex.lock();
+			PCMSG tmp = {0x00};
+			memcpy(&tmp, msg, sizeof(struct PCMSG));
+			results.emplace(msg->msg_id, tmp);
+			resMutex.unlock();
+			return false; // Return false so we don't process it later on this thread
+		}
+		return true;
+	}
+
+	// Reads everything waiting, so a response behind a burst of channel data reaches sendMsgResp
+	// without waiting for any of that data to be queued for the application. There is no limit,
+	// the RX credits (See CMD_CREDIT) already bound how much channel data can pile up here
+	bool pollMessage(PCMSG* msg) {
+		if (!connected) { // Don't throw an exception, exit early if not connected
+			return false;
+		}
+		PCMSG m;
+		std::lock_guard<std::mutex> lock(read_ahead_mutex);
+		while (true) {
+			bool wait = via_daemon && read_ahead.empty(); // Nothing else to do until something arrives
+			if (!(via_daemon ? readLink(&m, wait ? DAEMON_POLL_MS : 0) : readPort(&m))) {
+				break;
+			}
+			if (route(&m)) {
+				read_ahead.push(m);
+			}
+		}
+		if (read_ahead.empty()) {
+			return false;
+		}
+		*msg = read_ahead.front();
+		read_ahead.pop();
+		return true;
+	}
+
+	void openCredits(uint8_t channel, bool tx_flow, uint16_t rx_window) {
+		if (!via_daemon) {
+			credits.open(channel, tx_flow, rx_window);
+		}
+	}
+
+	void closeCredits(uint8_t channel) {
+		credits.close(channel);
+	}
+
+	uint16_t takeTxCredits(uint8_t channel, uint16_t want, unsigned long timeout_ms) {
+		return credits.takeTx(channel, want, timeout_ms);
+	}
+
+	// Small amounts wait to go out in the header of whatever is sent next
+	void giveRxCredits(uint8_t channel, uint16_t room) {
+		PCMSG msg;
+		if (credits.rxRoom(channel, room) && credits.makeMsg(&msg, false)) {
+			sendMsg(&msg);
+		}
+	}
+
+	void refreshCredits() {
+		PCMSG msg;
+		if (credits.makeMsg(&msg, true)) {
+			sendMsg(&msg);
+		}
+	}
+
+	bool isConnected() {
+		return connected;
+	}
+
+	bool getLinkStats(frame_stats* stats) {
+		if (via_daemon) {
+			return false;
+		}
+		*stats = decoder.stats;
+		return true;
+	}
 }
\ No newline at end of file
@@ -1,124 +1,260 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-
-#include <stdint.h>
-#include <string>
-#include "j2534_v0404.h"
-
-#define MAX_WAIT_TIME_MS 2000
-
-// Command ID's for Misc
-#define CMD_LOG  0x01
-#define CMD_PING 0x02
-
-// Channel command ID's
-#define CMD_CHANNEL_CREATE     0x03 // Creating a new channel
-#define CMD_CHANNEL_DATA       0x04 // Send data to/from channel
-#define CMD_CHANNEL_DESTROY    0x05 // Killing a channel
-#define CMD_CHANNEL_IOCTL_REQ  0x06 // IOCTL request to device
-#define CMD_CHANNEL_IOCTL_RESP 0x07 // IOCTL Response from device
-#define CMD_CHANNEL_SET_FILTER 0x08 // Add a filter to a channel
-#define CMD_CHANNEL_REM_FILTER 0x09 // Remove a filter from a channel;
-
-// Command responses (From macchina)
-#define CMD_RES_FROM_CMD       0xA0 // This gets put onto the first nibble of a CMD Id if its the Macchina responding from it 
-
-#define CMD_EXIT 0xFF // If sent, device will reset itself back into default state (Assume use app has quit)
-
-
-/// <summary>
-/// Structure that is transmitted to and from the Macchina
-/// </summary>
-struct PCMSG { // Total 512 bytes
-    uint8_t cmd_id;
-    uint8_t resp_code; // J2534 response code
-    uint16_t arg_size;
-    uint8_t args[512];
-    uint8_t msg_id;
-    bool __require_response;
-};
-
-/// <summary>
-/// Enumeration for Macchina response codes
-/// </summary>
-enum class CMD_RES {
-    // Send OK - And Macchina was OK processing request
-    CMD_OK,
-    // Send Failed (Macchina didn't even receive the request)
-    SEND_FAIL,
-    // Macchina failed to process the command sent to it
-    CMD_FAIL,
-    // Macchina did not respond in time
-    CMD_TIMEOUT
-};
-
-namespace usbcomm
-{
-    /// <summary>
-    /// Polls for a message from Macchina
-    /// </summary>
-    /// <param name="msg">Pointer to a PCMSG that will be used if read is OK</param>
-    /// <returns>Boolean indicating if data was read or not</returns>
-    bool pollMessage(PCMSG* msg);
-
-    /// <summary>
-    /// Sends a message to Macchina, and doesn't poll for its response
-    /// </summary>
-    /// <param name="msg">Pointer to message to send</param>
-    /// <returns>Boolean indicating if Message was sent OK to Macchina</returns>
-    bool sendMsg(PCMSG* msg);
-
-    /// <summary>
-    /// Sends a message to Macchina, and attempts to read the response.
-    /// This function will return CMD_TIMEOUT if a response is not seen after 2 seconds
-    /// </summary>
-    /// <param name="msg">Pointer to message to send</param>
-    /// <param name="maxWaitMs">Maximum time in MS to poll for the response</param>
-    /// <returns></returns>
-    CMD_RES sendMsgResp(PCMSG* send, PCMSG* resp);
-
-    /// <summary>
-    /// Indicates if Macchina is currently connected or not
-    /// </summary>
-    /// <returns>Boolean indicating connection state</returns>
-    bool isConnected();
-
-    /// <summary>
-    /// Attempts to open a Serial port connection to Macchina
-    /// </summary>
-    /// <returns>Boolean indicating if port was successfully opened</returns>
-    bool OpenPort();
-
-    /// <summary>
-    /// Closes the port with the Macchina
-    /// </summary>
-    void ClosePort();
-
-    /// <summary>
-    /// Gets a string containing the last error message during message
-    /// transmission, in the event of CMD_RES::CMD_FAIL, the error message
-    /// originates from the Macchina itself
-    /// </summary>
-    /// <returns>String containing the last error message</returns>
-    std::string getLastError();
-};
-
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "j2534_v0404.h"
+
+#define MAX_WAIT_TIME_MS 2000
+#define PIPELINE_WINDOW 64 // Most responses sendPipelined waits for at once
+
+// Named pipe served by the passthru daemon (See daemon/). When it is running the daemon owns the
+// serial port, and each process using the DLL connects to its own pipe instance. Messages then
+// go through shared memory (See shm_ring.h), the pipe only tells each side when the other has gone
+#define DAEMON_PIPE_NAME L"\\\\.\\pipe\\macchina-passthru"
+#define DAEMON_POLL_MS 100 // Longest the comm thread waits for a message from the daemon before checking it is still there
+
+// Command ID's for Misc
+#define CMD_LOG  0x01
+#define CMD_PING 0x02
+
+// Channel command ID's
+#define CMD_CHANNEL_CREATE     0x03 // Creating a new channel
+#define CMD_CHANNEL_DATA       0x04 // Send data to/from channel
+#define CMD_CHANNEL_DESTROY    0x05 // Killing a channel
+#define CMD_CHANNEL_IOCTL_REQ  0x06 // IOCTL request to device
+#define CMD_CHANNEL_IOCTL_RESP 0x07 // IOCTL Response from device
+#define CMD_CHANNEL_SET_FILTER 0x08 // Add a filter to a channel
+#define CMD_CHANNEL_REM_FILTER 0x09 // Remove a filter from a channel;
+#define CMD_CHANNEL_DATA_PART  0x0A // Part of channel data too big for one message (See below)
+#define CMD_CHANNEL_START_PERIODIC 0x0B // Start (Or replace) a periodic message (See below)
+#define CMD_CHANNEL_STOP_PERIODIC  0x0C // Stop a periodic message. Args - Channel ID, message ID
+#define CMD_TRACE              0x0D // Binary trace events from Macchina (See trace_decoder.h)
+#define CMD_STATS              0x0E // Read the device counters. Args - MACCHINA_STATS_* flags. Response is a MACCHINA_DEVICE_STATS, without the Host counters
+#define CMD_TX_TRACE           0x0F // Where the time went for a message sent with a trace_id (See below)
+#define CMD_HELLO              0x10 // Sent first on a port that might be Macchina. Args - PC_PROTOCOL_VERSION (16bit). Response is below
+#define CMD_CREDIT             0x11 // Flow control limits (Both directions, see below). No response
+
+// CMD_HELLO response format
+// 0-1 - Macchina's PC_PROTOCOL_VERSION
+// 2-5 - Capabilities (CAP_*)
+// 6   - Number of channels
+// 7.. - Firmware build date and time, NUL terminated
+#define HELLO_SIZE 32
+#define PC_PROTOCOL_VERSION 3 // Goes up when a message changes in a way the other side can't handle
+
+#define CAP_CAN_BATCH 0x00000001 // CAN frames are batched in CMD_CHANNEL_DATA
+#define CAP_DATA_PART 0x00000002 // CMD_CHANNEL_DATA_PART
+#define CAP_PERIODIC  0x00000004 // Periodic messages run on the device
+#define CAP_STATS     0x00000008 // CMD_STATS
+#define CAP_TX_TRACE  0x00000010 // CMD_TX_TRACE
+#define CAP_KLINE     0x00000020 // ISO9141 and ISO14230 channels
+
+// CMD_CHANNEL_CREATE args format
+// 0     - Channel ID
+// 1     - Protocol (PROTOCOL_*)
+// 2-5   - Baud rate
+// 6-9   - Connect flags
+// 10-11 - RX window. Data messages the driver has room for, 0 to be sent everything (See below)
+
+// Credit based flow control. Each side only sends a channel what the other has room for.
+// Limits are running totals from when the channel was created (16 bit, wrapping), so an
+// update that goes missing is made up by the next one rather than losing credits for good
+// TX - Raw CAN channels. Limit is CAN records the driver may have sent, going up as Macchina's Tx ring drains
+// RX - Channels created with an RX window. Limit is CMD_CHANNEL_DATA and CMD_CHANNEL_DATA_PART
+//      messages Macchina may have sent, going up as the application reads them
+// One update rides in the header of every frame (See link_frame.h). CMD_CREDIT carries the
+// updates waiting when there is no other traffic for them, its args are records of:
+// 0   - Channel ID
+// 1-2 - Limit
+
+// CMD_CHANNEL_SET_FILTER args format
+// 0     - Channel ID
+// 1     - Filter ID
+// 2     - Filter type
+// 3-6   - Mask (32bit)
+// 7-10  - Pattern (32bit)
+// 11-14 - Flow control (32bit)
+// 15-17 - Extended address bytes (Mask, pattern, flow control)
+#define FILTER_ARGS_SIZE 18
+
+// CMD_CHANNEL_START_PERIODIC args format
+// 0   - Channel ID
+// 1   - Message ID (1 based)
+// 2-5 - Interval in ms (32bit)
+// 6.. - Message, formatted the same as CMD_CHANNEL_DATA
+#define PERIODIC_HEADER_SIZE 6
+
+// CMD_TX_TRACE args format. All times are in us on Macchina's clock
+// 0     - Channel ID
+// 1-2   - Trace ID of the message
+// 3-6   - Message finished arriving over USB
+// 7-10  - Handler started transmitting it
+// 11-14 - Last frame of it left the CAN controller
+// 15-18 - This report was queued for the PC
+#define TX_TRACE_SIZE 19
+
+// CMD_CHANNEL_DATA_PART args format
+// 0     - Channel ID
+// 1-4   - Total payload size (32bit)
+// 5-8   - Offset of this part within the payload (32bit)
+// 9-511 - Payload bytes
+#define DATA_PART_HEADER_SIZE  9
+#define DATA_PART_MAX_BYTES    (512 - DATA_PART_HEADER_SIZE)
+
+// CMD_CHANNEL_IOCTL_RESP args format (IOCTLs that finish after their CMD_CHANNEL_IOCTL_REQ was answered)
+// 0     - Channel ID
+// 1-4   - IOCTL ID (32bit)
+// 5     - J2534 status
+// 6-511 - Output
+#define IOCTL_RESP_HEADER_SIZE 6
+
+// Command responses (From macchina)
+#define CMD_RES_FROM_CMD       0xA0 // This gets put onto the first nibble of a CMD Id if its the Macchina responding from it 
+
+#define CMD_EXIT 0xFF // If sent, device will reset itself back into default state (Assume use app has quit)
+
+
+/// <summary>
+/// Structure that is transmitted to and from the Macchina
+/// </summary>
+struct PCMSG { // Total 512 bytes
+    uint8_t cmd_id;
+    uint8_t resp_code; // J2534 response code
+    uint16_t arg_size;
+    uint8_t args[512];
+    uint8_t msg_id;
+    bool __require_response;
+    uint16_t trace_id; // Non zero to have Macchina time this message through to the bus (See CMD_TX_TRACE)
+};
+
+/// <summary>
+/// Enumeration for Macchina response codes
+/// </summary>
+enum class CMD_RES {
+    // Send OK - And Macchina was OK processing request
+    CMD_OK,
+    // Send Failed (Macchina didn't even receive the request)
+    SEND_FAIL,
+    // Macchina failed to process the command sent to it
+    CMD_FAIL,
+    // Macchina did not respond in time
+    CMD_TIMEOUT
+};
+
+struct frame_stats; // link_frame.h
+
+namespace usbcomm
+{
+    /// <summary>
+    /// Polls for a message from Macchina. Responses are picked out as soon as they are read,
+    /// ahead of channel data that arrived before them but has not been handled yet
+    /// </summary>
+    /// <param name="msg">Pointer to a PCMSG that will be used if read is OK</param>
+    /// <returns>Boolean indicating if data was read or not</returns>
+    bool pollMessage(PCMSG* msg);
+
+    /// <summary>
+    /// Sends a message to Macchina, and doesn't poll for its response
+    /// </summary>
+    /// <param name="msg">Pointer to message to send</param>
+    /// <returns>Boolean indicating if Message was sent OK to Macchina</returns>
+    bool sendMsg(PCMSG* msg);
+
+    /// <summary>
+    /// Sends a message to Macchina, and attempts to read the response.
+    /// This function will return CMD_TIMEOUT if a response is not seen after 2 seconds
+    /// </summary>
+    /// <param name="msg">Pointer to message to send</param>
+    /// <param name="maxWaitMs">Maximum time in MS to poll for the response</param>
+    /// <returns></returns>
+    CMD_RES sendMsgResp(PCMSG* send, PCMSG* resp);
+
+    /// <summary>
+    /// Sends messages back to back without waiting for responses in between, then waits
+    /// for the response to every message that has __require_response set
+    /// </summary>
+    /// <param name="msgs">Messages to send, in order</param>
+    /// <returns>Number of messages that failed, or timed out</returns>
+    int sendPipelined(std::vector<PCMSG>& msgs);
+
+    /// <summary>
+    /// Starts flow control for a channel that is about to be created (See CMD_CREDIT).
+    /// Does nothing when the passthru daemon owns the port, it does the flow control
+    /// </summary>
+    /// <param name="tx_flow">Macchina limits what is sent to the channel (Raw CAN)</param>
+    /// <param name="rx_window">RX window given in the create, 0 for none</param>
+    void openCredits(uint8_t channel, bool tx_flow, uint16_t rx_window);
+
+    void closeCredits(uint8_t channel);
+
+    /// <summary>
+    /// Takes up to 'want' TX credits for the channel, waiting up to timeout_ms if there are none
+    /// </summary>
+    /// <returns>Credits taken, 0 if Macchina had no room in time</returns>
+    uint16_t takeTxCredits(uint8_t channel, uint16_t want, unsigned long timeout_ms);
+
+    /// <summary>
+    /// Tells Macchina the channel has room for more, once enough has built up
+    /// </summary>
+    /// <param name="room">Data messages the channel's queue can still hold</param>
+    void giveRxCredits(uint8_t channel, uint16_t room);
+
+    /// <summary>
+    /// Sends every RX limit again, in case an update was lost. Called with the ping
+    /// </summary>
+    void refreshCredits();
+
+    /// <summary>
+    /// Indicates if Macchina is currently connected or not
+    /// </summary>
+    /// <returns>Boolean indicating connection state</returns>
+    bool isConnected();
+
+    /// <summary>
+    /// Frame counters for messages read from the serial port (See link_frame.h)
+    /// </summary>
+    /// <returns>False if the passthru daemon owns the port, it keeps the counters then</returns>
+    bool getLinkStats(frame_stats* stats);
+
+    /// <summary>
+    /// Attempts to connect to the passthru daemon, or if it is not running,
+    /// to open a Serial port connection to Macchina
+    /// </summary>
+    /// <returns>Boolean indicating if port was successfully opened</returns>
+    bool OpenPort();
+
+    /// <summary>
+    /// Closes the port with the Macchina
+    /// </summary>
+    void ClosePort();
+
+    /// <summary>
+    /// Gets a string containing the last error message during message
+    /// transmission, in the event of CMD_RES::CMD_FAIL, the error message
+    /// originates from the Macchina itself
+    /// </summary>
+    /// <returns>String containing the last error message</returns>
+    std::string getLastError();
+};
+
@@ -0,0 +1,125 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "block_pool.h"
+
+// Each block class keeps its free list as an array of next indexes
+struct block_class {
+    uint8_t* storage;
+    uint8_t* next;
+    uint16_t block_size;
+    uint8_t count;
+    uint8_t head;
+    uint8_t used;
+    uint8_t peak;
+};
+
+#define POOL_END 0xFF
+
+static uint8_t small_storage[POOL_SMALL_BLOCKS][POOL_SMALL_BLOCK_SIZE] __attribute__((aligned(4)));
+static uint8_t large_storage[POOL_LARGE_BLOCKS][POOL_LARGE_BLOCK_SIZE] __attribute__((aligned(4)));
+static uint8_t small_next[POOL_SMALL_BLOCKS];
+static uint8_t large_next[POOL_LARGE_BLOCKS];
+
+static block_class classes[2] = {
+    { &small_storage[0][0], small_next, POOL_SMALL_BLOCK_SIZE, POOL_SMALL_BLOCKS, 0, 0, 0 },
+    { &large_storage[0][0], large_next, POOL_LARGE_BLOCK_SIZE, POOL_LARGE_BLOCKS, 0, 0, 0 }
+};
+
+static bool pool_ready = false;
+static uint16_t failed = 0;
+
+static void init_pool() {
+    for (uint8_t c = 0; c < 2; c++) {
+        for (uint8_t i = 0; i < classes[c].count; i++) {
+            classes[c].next[i] = (i + 1 < classes[c].count) ? i + 1 : POOL_END;
+        }
+        classes[c].head = 0;
+    }
+    pool_ready = true;
+}
+
+// Which class a block belongs to, or nullptr if it did not come from the pool
+static block_class* find_class(uint8_t* block) {
+    for (uint8_t c = 0; c < 2; c++) {
+        uint8_t* start = classes[c].storage;
+        if (block >= start && block < start + classes[c].block_size * classes[c].count) {
+            return &classes[c];
+        }
+    }
+    return nullptr;
+}
+
+namespace POOL {
+    uint8_t* acquire(uint16_t size) {
+        if (!pool_ready) {
+            init_pool();
+        }
+        // Use the smallest class that fits, fall back to a large block if all the small ones are gone
+        for (uint8_t c = 0; c < 2; c++) {
+            block_class* bc = &classes[c];
+            if (size > bc->block_size || bc->head == POOL_END) {
+                continue;
+            }
+            uint8_t idx = bc->head;
+            bc->head = bc->next[idx];
+            bc->used++;
+            if (bc->used > bc->peak) {
+                bc->peak = bc->used;
+            }
+            return bc->storage + (uint32_t)idx * bc->block_size;
+        }
+        failed++;
+        return nullptr;
+    }
+
+    void release(uint8_t* block) {
+        if (block == nullptr) {
+            return;
+        }
+        block_class* bc = find_class(block);
+        if (bc == nullptr) {
+            return; // Not ours
+        }
+        uint8_t idx = (block - bc->storage) / bc->block_size;
+        bc->next[idx] = bc->head;
+        bc->head = idx;
+        bc->used--;
+    }
+
+    uint16_t capacity(uint8_t* block) {
+        block_class* bc = find_class(block);
+        return bc == nullptr ? 0 : bc->block_size;
+    }
+
+    void getStats(pool_stats* stats) {
+        stats->small_used = classes[0].used;
+        stats->small_peak = classes[0].peak;
+        stats->large_used = classes[1].used;
+        stats->large_peak = classes[1].peak;
+        stats->failed = failed;
+    }
+
+    // Peaks start again from what is in use now
+    void resetPeaks() {
+        classes[0].peak = classes[0].used;
+        classes[1].peak = classes[1].used;
+    }
+};
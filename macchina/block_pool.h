@@ -0,0 +1,70 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef BLOCK_POOL_H
+#define BLOCK_POOL_H
+
+#include <stdint.h>
+
+// Small blocks - Single frame payloads, CAN frames
+#ifndef POOL_SMALL_BLOCK_SIZE
+#define POOL_SMALL_BLOCK_SIZE 64
+#endif
+#ifndef POOL_SMALL_BLOCKS
+#define POOL_SMALL_BLOCKS 16
+#endif
+
+// Large blocks - Full ISO15765 payloads (4 byte CAN ID + 4124 bytes)
+#ifndef POOL_LARGE_BLOCK_SIZE
+#define POOL_LARGE_BLOCK_SIZE 4128
+#endif
+// Rx, Tx and a driver part buffer for each CAN bus. ISO15765 sessions (Up to ISO15765_MAX_SESSIONS a channel)
+// only hold a large block whilst a multi frame transfer is in progress, but a bus with several long transfers
+// in flight at once will run the pool dry - Sizing it for every session would need more RAM than the Due has.
+// A transfer that can't get a block is refused (Overflow flow control on Rx, a Tx failure to the driver),
+// and counted in pool_failed of CMD_STATS
+#ifndef POOL_LARGE_BLOCKS
+#define POOL_LARGE_BLOCKS 6
+#endif
+
+struct pool_stats {
+    uint8_t small_used;
+    uint8_t small_peak;
+    uint8_t large_used;
+    uint8_t large_peak;
+    uint16_t failed; // Number of acquires that could not be served
+};
+
+/**
+ * Fixed size block pool, sized at compile time so nothing ever
+ * touches the heap while frames are flowing. Acquire and release are O(1).
+ * Not interrupt safe - Only use from loop()
+ */
+namespace POOL {
+    uint8_t* acquire(uint16_t size);
+    void release(uint8_t* block);
+    uint16_t capacity(uint8_t* block);
+    void getStats(pool_stats* stats);
+    void resetPeaks();
+};
+
+#endif
@@ -1,103 +1,247 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#include "can_handler.h"
-#include "pc_comm.h"
-
-// Try to init CAN interface on one of the 2 avaliable built in interfaces
-canbus_handler::canbus_handler(CANRaw* can, uint8_t led_pin) {
-    if (!can) {
-        PCCOMM::logToSerial("CONSTRUCTOR - WTF Can is null!?");
-        return;
-    }
-    this->can = can;
-    this->actLED = led_pin;
-}
-
-// Is this interface handler free to be claimed?
-bool canbus_handler::isFree() {
-    return !this->inUse;
-}
-
-// Set a filter on one of the Rx mailboxes
-void canbus_handler::setFilter(uint32_t canid, uint32_t mask, bool isExtended) {
-    char buf[40] = {0x00};
-    sprintf(buf, "Setting Rx Filters - MASK: 0x%04X, Filter: 0x%04X", mask, canid);
-    PCCOMM::logToSerial(buf);
-    for (int i = 0; i < 7; i++) {
-        this->can->setRXFilter(canid, mask, isExtended);
-    }
-}
-
-// Transmits a frame on the bus
-void canbus_handler::transmit(CAN_FRAME f) {
-    if (!this->can) {
-        PCCOMM::logToSerial("TRANSMIT - WTF Can is null!?");
-        return;
-    }
-    digitalWrite(this->actLED, LOW);
-    char buf[100] = {0x00};
-    int start = sprintf(buf, "SEND FRMAE: %04X (%lu) ", f.id, f.length);
-    for (int i = 0; i < f.length; i++) {
-        start += sprintf(buf+start, "%02X ", f.data.bytes[i]);
-    }
-    PCCOMM::logToSerial(buf);
-    if (!this->can->sendFrame(f)) {
-        PCCOMM::logToSerial("Error sending CAN Frame!");
-    }
-}
- // Attempts to read an avaliable frame from one of the mailboxes
-bool canbus_handler::read(CAN_FRAME* f) {
-    if (this->can->available() > 0) {
-        digitalWrite(this->actLED, LOW);
-        this->can->read(*f);
-        return true;
-    }
-    return false;
-}
-
-// Locks the interface - Stops another channel from using it
-void canbus_handler::lock(uint32_t baud) {
-    PCCOMM::logToSerial("Locking CAN Interface");
-    if (!this->can) {
-        PCCOMM::logToSerial("LOCK - WTF Can is null!?");
-        return;
-    }
-    this->can->init(baud);
-    PCCOMM::logToSerial("CAN enabled andbaud set!");
-    this->inUse = true;
-}
-
-// Unlocks the interface - Marks it as being avaliable for a new channel
-void canbus_handler::unlock() {
-    PCCOMM::logToSerial("Unlocking CAN Interface");
-    if (!this->can) {
-        PCCOMM::logToSerial("UNLOCK - WTF Can is null!?");
-        return;
-    }
-    this->can->disable();
-    PCCOMM::logToSerial("CAN Disabled!");
-    this->inUse = false;
-    //TODO Clear Tx and Rx buffers here, and put CAN To sleep
-}
-
-// nullptr implies they are not used yet
-extern canbus_handler ch0 = canbus_handler(&Can0, DS4); // First avaliable interface  (Use can0)
-extern canbus_handler ch1 = canbus_handler(&Can1, DS5); // Second avaliable interface (Use can1)
\ No newline at end of file
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "can_handler.h"
+#include "pc_comm.h"
+#include "trace.h"
+
+// Try to init CAN interface on one of the 2 avaliable built in interfaces
+canbus_handler::canbus_handler(CANRaw* can, uint8_t led_pin, hw_timer* timer) {
+    if (!can) {
+        PCCOMM::logToSerial("CONSTRUCTOR - WTF Can is null!?");
+        return;
+    }
+    this->can = can;
+    this->actLED = led_pin;
+    this->timer = timer;
+}
+
+// Hardware timer that paces ISO15765 consecutive frames on this interface
+hw_timer* canbus_handler::getTimer() {
+    return this->timer;
+}
+
+// Is this interface handler free to be claimed? (Not whilst autobaud is listening on it either)
+bool canbus_handler::isFree() {
+    return !this->inUse && !this->scanning;
+}
+
+// Set a filter on one of the free Rx mailboxes. Each filter gets its own mailbox, so
+// several filters (Or standard and extended IDs) can be active at once
+void canbus_handler::setFilter(uint32_t canid, uint32_t mask, bool isExtended) {
+    char buf[60] = {0x00};
+    sprintf(buf, "Setting Rx Filters - MASK: 0x%08X, Filter: 0x%08X", mask, canid);
+    PCCOMM::logToSerial(buf);
+    if (this->can->setRXFilter(canid, mask, isExtended) < 0) {
+        PCCOMM::logToSerial("No free Rx mailboxes for filter!");
+    }
+}
+
+// Transmits a frame on the bus
+void canbus_handler::transmit(CAN_FRAME f) {
+    if (!this->can) {
+        PCCOMM::logToSerial("TRANSMIT - WTF Can is null!?");
+        return;
+    }
+    digitalWrite(this->actLED, LOW);
+    TRACE_FRAME(TRACE_DEBUG, TRACE_CAN_TX_FRAME, f);
+    // The timer interrupt can also queue frames on this interface, don't let it race us
+    this->timer->lock();
+    bool sent = this->can->sendFrame(f);
+    this->timer->unlock();
+    if (!sent) {
+        TRACE_ERROR(TRACE_CAN_TX_FAIL, 0, f.id, 0, 0);
+    }
+}
+
+// Queues a frame without logging - For bulk traffic. Returns false if the Tx ring is full
+bool canbus_handler::queue(CAN_FRAME &f) {
+    digitalWrite(this->actLED, LOW);
+    this->timer->lock();
+    bool sent = this->can->sendFrame(f);
+    this->timer->unlock();
+    return sent;
+}
+
+// Frames queue() can take without waiting
+uint16_t canbus_handler::txFree() {
+    return this->can->txRingFree();
+}
+
+// Transmits a frame from the timer interrupt - No logging allowed here!
+bool canbus_handler::transmitFromISR(CAN_FRAME &f) {
+    digitalWrite(this->actLED, LOW);
+    return this->can->sendFrame(f);
+}
+ // Attempts to read an avaliable frame from one of the mailboxes
+bool canbus_handler::read(CAN_FRAME* f) {
+    if (this->can->available() > 0) {
+        digitalWrite(this->actLED, LOW);
+        this->can->read(*f);
+        return true;
+    }
+    return false;
+}
+
+// CAN controller timer, counts bit times. Frames are stamped with it when they arrive
+uint16_t canbus_handler::getTimerValue() {
+    return this->can->get_internal_timer_value();
+}
+
+// Monitor mode - Listen only, so the controller never ACKs or sends error frames. Every Rx
+// mailbox accepts everything in overwrite mode, so a slow read never stalls reception
+void canbus_handler::setMonitorMode(bool state) {
+    this->can->setListenOnlyMode(state);
+    if (!state) {
+        // Back to default mailboxes, filters need setting again
+        this->can->reset_all_mailbox();
+        this->can->setNumTXBoxes(1);
+        return;
+    }
+    PCCOMM::logToSerial("CAN monitor mode enabled");
+    for (uint8_t mb = 0; mb < this->can->getNumRxBoxes(); mb++) {
+        this->can->setRXFilter(mb, 0x00, 0x00, mb % 2 == 0); // Alternate standard and extended IDs
+        this->can->mailbox_set_mode(mb, CAN_MB_RX_OVER_WR_MODE);
+    }
+}
+
+// Frames lost since the interface was locked
+void canbus_handler::getDropCounts(uint32_t* dropped, uint32_t* overwritten) {
+    *dropped = this->can->getRxDropped();
+    *overwritten = this->can->getRxOverwritten();
+}
+
+void canbus_handler::getStats(can_stats* stats) {
+    stats->rx_frames = this->can->getNumRxFrames();
+    stats->bus_errors = this->can->getNumBusErrors();
+    stats->rx_dropped = this->can->getRxDropped();
+    stats->rx_overwritten = this->can->getRxOverwritten();
+    stats->rx_ring_peak = this->can->getRxRingPeak();
+    stats->tx_ring_peak = this->can->getTxRingPeak();
+    stats->tx_error_cnt = this->can->get_tx_error_cnt();
+    stats->rx_error_cnt = this->can->get_rx_error_cnt();
+}
+
+void canbus_handler::resetPeaks() {
+    this->can->resetRingPeaks();
+}
+
+// Times the last frame queued until it leaves the controller
+void canbus_handler::watchTx() {
+    this->can->watchTx();
+}
+
+bool canbus_handler::txWatchDone(uint32_t* done_us) {
+    return this->can->getWatchedTx(done_us);
+}
+
+// Listens for the bus rate without ever driving the bus. Only works whilst no channel owns the interface,
+// and the interface stays unclaimable until the scan is done. autobaudStep() does the actual listening
+bool canbus_handler::startAutobaud(uint32_t budget_ms) {
+    if (!this->isFree()) {
+        PCCOMM::logToSerial("AUTOBAUD - Interface is in use");
+        return false;
+    }
+    this->can->setRxBufferSize(CAN_RX_RING_SIZE);
+    this->can->setTxBufferSize(CAN_TX_RING_SIZE);
+    this->scanning = true;
+    this->scan_listening = false;
+    this->scan_idx = 0;
+    this->scan_start = millis();
+    this->scan_budget = min(budget_ms, AUTOBAUD_MAX_BUDGET_MS);
+    return true;
+}
+
+// One short look at the bus, so the scan never holds up loop(). Returns true once the scan has finished,
+// with baud 0 if nothing was heard. Leaves the interface disabled again, so the channel that follows inits it at the rate found
+bool canbus_handler::autobaudStep(uint32_t* baud, uint16_t* sample_point) {
+    if (!this->scanning) {
+        return false;
+    }
+    uint32_t now = millis();
+    bool budget_left = now - this->scan_start < this->scan_budget;
+    if (this->scan_listening) {
+        if (this->can->getNumRxFrames() > 0) {
+            return this->endAutobaud(CANRaw::getAutoSpeed(this->scan_idx), baud, sample_point);
+        }
+        // Wrong rate shows up as bit errors within a frame, a quiet bus as nothing for the dwell
+        if (this->can->get_rx_error_cnt() <= this->scan_rec && now - this->scan_dwell < AUTOBAUD_DWELL_MS && budget_left) {
+            return false;
+        }
+        this->scan_listening = false;
+        this->scan_idx = CANRaw::getAutoSpeed(this->scan_idx + 1) != 0 ? this->scan_idx + 1 : 0; // Round again until the budget runs out
+    }
+    if (!budget_left) {
+        return this->endAutobaud(0, baud, sample_point);
+    }
+    if (this->can->listenAutoSpeed(CANRaw::getAutoSpeed(this->scan_idx)) == 0) {
+        this->scan_idx = CANRaw::getAutoSpeed(this->scan_idx + 1) != 0 ? this->scan_idx + 1 : 0;
+        return false;
+    }
+    this->scan_rec = this->can->get_rx_error_cnt();
+    this->scan_dwell = now;
+    this->scan_listening = true;
+    return false;
+}
+
+bool canbus_handler::isScanning() {
+    return this->scanning;
+}
+
+bool canbus_handler::endAutobaud(uint32_t found, uint32_t* baud, uint16_t* sample_point) {
+    *baud = found;
+    *sample_point = found != 0 ? this->can->getSamplePoint() : 0;
+    this->can->disable_autobaud_listen_mode();
+    this->can->disable();
+    this->scanning = false;
+    return true;
+}
+
+// Locks the interface - Stops another channel from using it
+void canbus_handler::lock(uint32_t baud) {
+    PCCOMM::logToSerial("Locking CAN Interface");
+    if (!this->can) {
+        PCCOMM::logToSerial("LOCK - WTF Can is null!?");
+        return;
+    }
+    // Ring sizes only take effect before the first init
+    this->can->setRxBufferSize(CAN_RX_RING_SIZE);
+    this->can->setTxBufferSize(CAN_TX_RING_SIZE);
+    this->can->init(baud);
+    PCCOMM::logToSerial("CAN enabled andbaud set!");
+    this->inUse = true;
+}
+
+// Unlocks the interface - Marks it as being avaliable for a new channel
+void canbus_handler::unlock() {
+    PCCOMM::logToSerial("Unlocking CAN Interface");
+    if (!this->can) {
+        PCCOMM::logToSerial("UNLOCK - WTF Can is null!?");
+        return;
+    }
+    this->can->disable();
+    PCCOMM::logToSerial("CAN Disabled!");
+    this->inUse = false;
+    //TODO Clear Tx and Rx buffers here, and put CAN To sleep
+}
+
+// nullptr implies they are not used yet
+extern canbus_handler ch0 = canbus_handler(&Can0, DS4, &hw_timer0); // First avaliable interface  (Use can0)
+extern canbus_handler ch1 = canbus_handler(&Can1, DS5, &hw_timer1); // Second avaliable interface (Use can1)
\ No newline at end of file
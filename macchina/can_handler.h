@@ -1,50 +1,83 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-
-#ifndef CANBUS_H
-#define CANBUS_H
-
-#include "variant.h"
-#include "due_can.h"
-
-#define CAN0_LED DS3 // CAN 0 LED - On if send or receive data
-#define CAN1_LED DS4 // CAN 1 LED - On if send or receive data
-
-class canbus_handler {
-public:
-    canbus_handler(CANRaw* can, uint8_t led_pin);
-    void setFilter(uint32_t canid, uint32_t mask, bool isExtended);
-    void transmit(CAN_FRAME f);
-    bool read(CAN_FRAME* f);
-    void unlock();
-    void lock(uint32_t baud);
-    bool isFree();
-private:
-    CANRaw *can;
-    uint8_t actLED;
-    bool inUse = false;
-};
-
-extern canbus_handler ch0;
-extern canbus_handler ch1;
-
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef CANBUS_H
+#define CANBUS_H
+
+#include "variant.h"
+#include "due_can.h"
+#include "hw_timer.h"
+#include "stats.h"
+
+#define CAN0_LED DS3 // CAN 0 LED - On if send or receive data
+#define CAN1_LED DS4 // CAN 1 LED - On if send or receive data
+
+// Ring sizes for CANRaw - Big enough to ride out a slow loop() at 100% bus load
+#define CAN_RX_RING_SIZE 128
+#define CAN_TX_RING_SIZE 64
+
+// Longest autobaud can run for - The result has to come back before the driver gives up waiting for it
+#define AUTOBAUD_MAX_BUDGET_MS 1500
+
+class canbus_handler {
+public:
+    canbus_handler(CANRaw* can, uint8_t led_pin, hw_timer* timer);
+    void setFilter(uint32_t canid, uint32_t mask, bool isExtended);
+    void transmit(CAN_FRAME f);
+    bool transmitFromISR(CAN_FRAME &f);
+    bool queue(CAN_FRAME &f);
+    uint16_t txFree();
+    hw_timer* getTimer();
+    bool read(CAN_FRAME* f);
+    uint16_t getTimerValue();
+    void setMonitorMode(bool state);
+    void getDropCounts(uint32_t* dropped, uint32_t* overwritten);
+    bool startAutobaud(uint32_t budget_ms);
+    bool autobaudStep(uint32_t* baud, uint16_t* sample_point);
+    bool isScanning();
+    void getStats(can_stats* stats);
+    void resetPeaks();
+    void watchTx();
+    bool txWatchDone(uint32_t* done_us);
+    void unlock();
+    void lock(uint32_t baud);
+    bool isFree();
+private:
+    CANRaw *can;
+    uint8_t actLED;
+    hw_timer* timer;
+    bool inUse = false;
+    // Autobaud scan, stepped by autobaudStep()
+    bool endAutobaud(uint32_t found, uint32_t* baud, uint16_t* sample_point);
+    bool scanning = false;
+    bool scan_listening = false; // At the rate scan_idx, since scan_dwell
+    uint8_t scan_idx;
+    uint8_t scan_rec; // Rx error count when listening started
+    uint32_t scan_start;
+    uint32_t scan_budget;
+    uint32_t scan_dwell;
+};
+
+extern canbus_handler ch0;
+extern canbus_handler ch1;
+
 #endif
\ No newline at end of file
@@ -1,82 +1,208 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#include "channels.h"
-#include "pc_comm.h"
-
-channel::channel(uint8_t id, uint8_t protocol, unsigned long baudRate) {
-    this->id = id;
-    switch (protocol) {
-    case PROTOCOL_CAN:
-        this->protocol_handler = new can_handler(baudRate);
-        break;
-    case PROTOCOL_ISO15765:
-        this->protocol_handler = new iso15765_handler(baudRate, this->id);
-        break;
-    case PROTOCOL_ISO9141:
-        this->protocol_handler = new iso9141_handler(baudRate);
-        break;
-    default:
-        break;
-    }
-}
-
-void channel::transmit_data(uint16_t len, uint8_t* data) {
-    
-    this->protocol_handler->transmit(data, len);
-}
-
-uint8_t channel::getID() {
-    return this->id;
-}
-
-void channel::kill_channel() {
-    this->protocol_handler->destroy();
-    delete protocol_handler;
-}
-
-void channel::update() {
-    if (this->protocol_handler != nullptr) {
-        if (this->protocol_handler->update()) {
-            PCMSG tx = {0x00};
-            tx.cmd_id = CMD_CHANNEL_DATA;
-            tx.arg_size = this->protocol_handler->getBufSize() + 1; // +1 for Channel ID
-            tx.args[0] = this->id;
-            memcpy(&tx.args[1], this->protocol_handler->getBuf(), this->protocol_handler->getBufSize());
-            PCCOMM::sendMessage(&tx);
-        }
-    }
-}
-
-void channel::set_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp) {
-    if (this->protocol_handler == nullptr) {
-        PCCOMM::logToSerial("Cannot set filter - Handler is null");
-        return;
-    }
-    this->protocol_handler->add_filter(id, type, mask, filter, resp);
-}
-
-void channel::remove_filter(uint8_t id) {
-    if (this->protocol_handler == nullptr) {
-        PCCOMM::logToSerial("Cannot remove filter - Handler is null");
-        return;
-    }
-    this->protocol_handler->destroy_filter(id);
-}
\ No newline at end of file
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "channels.h"
+#include "pc_comm.h"
+#include "block_pool.h"
+#include "j2534_mini.h"
+
+channel::channel(uint8_t id, uint8_t protocol, unsigned long baudRate, uint32_t flags) {
+    this->id = id;
+    switch (protocol) {
+    case PROTOCOL_CAN:
+        this->protocol_handler = new can_handler(baudRate, flags);
+        break;
+    case PROTOCOL_ISO15765:
+        this->protocol_handler = new iso15765_handler(baudRate, this->id, flags);
+        break;
+    case PROTOCOL_ISO9141:
+        this->protocol_handler = new iso9141_handler(baudRate, this->id, flags, false);
+        break;
+    case PROTOCOL_ISO14230:
+        this->protocol_handler = new iso9141_handler(baudRate, this->id, flags, true);
+        break;
+    default:
+        break;
+    }
+}
+
+void channel::transmit_data(uint16_t len, uint8_t* data) {
+    
+    this->protocol_handler->transmit(data, len);
+}
+
+// Collects a payload that the driver had to split up, transmits it once complete
+void channel::transmit_part(uint32_t total, uint32_t offset, uint8_t* data, uint16_t len) {
+    // Each payload that can't be put together is reported once (At its first part, or where it went wrong)
+    if (offset == 0) { // First part, start again
+        POOL::release(this->part_buf);
+        this->part_buf = nullptr;
+        if (total > MAX_PAYLOAD_SIZE || len > total) {
+            PCCOMM::logToSerial("Cannot transmit data part - Invalid size");
+            this->protocol_handler->transmitFailed();
+            return;
+        }
+        this->part_buf = POOL::acquire(total);
+        if (this->part_buf == nullptr) {
+            PCCOMM::logToSerial("Cannot transmit data part - No free buffer");
+            this->protocol_handler->transmitFailed();
+            return;
+        }
+        this->part_total = total;
+        this->part_pos = 0;
+    }
+    if (this->part_buf == nullptr) {
+        return; // Rest of a payload that has already failed
+    }
+    if (total != this->part_total || offset != this->part_pos || offset + len > total) {
+        PCCOMM::logToSerial("Cannot transmit data part - Out of order");
+        POOL::release(this->part_buf);
+        this->part_buf = nullptr;
+        this->protocol_handler->transmitFailed();
+        return;
+    }
+    memcpy(&this->part_buf[offset], data, len);
+    this->part_pos += len;
+    if (this->part_pos == this->part_total) {
+        this->transmit_data(this->part_total, this->part_buf);
+        POOL::release(this->part_buf);
+        this->part_buf = nullptr;
+    }
+}
+
+uint8_t channel::getID() {
+    return this->id;
+}
+
+// Times the next payload transmitted (CMD_TX_TRACE)
+void channel::set_trace(uint16_t trace_id, uint32_t usb_us) {
+    this->protocol_handler->setTrace(this->id, trace_id, usb_us);
+}
+
+void channel::getStats(channel_stats* stats) {
+    memset(stats, 0x00, sizeof(channel_stats));
+    if (this->protocol_handler != nullptr) {
+        this->protocol_handler->getStats(stats);
+    }
+    stats->id = this->id;
+}
+
+// False if the protocol is unknown, or the hardware for it is in use by other channels
+bool channel::isReady() {
+    return this->protocol_handler != nullptr && this->protocol_handler->isReady();
+}
+
+void channel::kill_channel() {
+    this->stop_periodic(0);
+    POOL::release(this->part_buf);
+    this->part_buf = nullptr;
+    if (this->protocol_handler != nullptr) {
+        this->protocol_handler->destroy();
+        delete protocol_handler;
+        this->protocol_handler = nullptr;
+    }
+}
+
+void channel::update() {
+    if (this->protocol_handler == nullptr) {
+        return;
+    }
+    uint16_t credits = PCCOMM::rxCredits(this->id);
+    this->protocol_handler->setRxCredits(credits); // CAN leaves frames in its Rx ring when there are none
+    if (this->protocol_handler->update()) {
+        uint16_t len = this->protocol_handler->getBufSize();
+        if (PCCOMM::messagesFor(len) > credits) { // K-Line and ISO15765 payloads are already off the bus
+            this->protocol_handler->dropRx();
+        } else {
+            PCCOMM::sendChannelData(this->id, this->protocol_handler->getBuf(), len);
+        }
+    }
+    uint16_t limit;
+    if (this->protocol_handler->txCredit(&limit)) {
+        PCCOMM::setTxLimit(this->id, limit);
+    }
+}
+
+void channel::set_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp) {
+    if (this->protocol_handler == nullptr) {
+        PCCOMM::logToSerial("Cannot set filter - Handler is null");
+        return;
+    }
+    this->protocol_handler->add_filter(id, type, mask, filter, resp, ext_mask, ext_filter, ext_resp);
+}
+
+void channel::remove_filter(uint8_t id) {
+    if (this->protocol_handler == nullptr) {
+        PCCOMM::logToSerial("Cannot remove filter - Handler is null");
+        return;
+    }
+    this->protocol_handler->destroy_filter(id);
+}
+
+uint8_t channel::ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len) {
+    if (this->protocol_handler == nullptr) {
+        return ERR_FAILED;
+    }
+    if (id == CLEAR_PERIODIC_MSGS) {
+        this->stop_periodic(0);
+        return STATUS_NOERROR;
+    }
+    return this->protocol_handler->ioctl(id, in, in_len, out, out_len);
+}
+
+// ID is 1 based, replaces whatever was in the slot before
+void channel::start_periodic(uint8_t id, uint32_t interval_ms, uint8_t* data, uint16_t len) {
+    if (id == 0 || id > MAX_PERIODIC_MSGS || len == 0 || len > PERIODIC_MAX_DATA || interval_ms == 0) {
+        PCCOMM::logToSerial("Cannot start periodic message - Invalid args");
+        return;
+    }
+    if (this->periodic[id-1] == nullptr) {
+        this->periodic[id-1] = new periodic_msg;
+    }
+    periodic_msg* p = this->periodic[id-1];
+    p->interval_ms = interval_ms;
+    p->next_ms = millis(); // J2534 wants the first one straight away
+    p->len = len;
+    memcpy(p->data, data, len);
+}
+
+// 0 stops all of them
+void channel::stop_periodic(uint8_t id) {
+    for (uint8_t i = 0; i < MAX_PERIODIC_MSGS; i++) {
+        if ((id == 0 || id == i+1) && this->periodic[i] != nullptr) {
+            delete this->periodic[i];
+            this->periodic[i] = nullptr;
+        }
+    }
+}
+
+void channel::update_periodic(uint32_t now_ms) {
+    for (uint8_t i = 0; i < MAX_PERIODIC_MSGS; i++) {
+        periodic_msg* p = this->periodic[i];
+        if (p == nullptr || (int32_t)(now_ms - p->next_ms) < 0) {
+            continue;
+        }
+        this->protocol_handler->transmitPeriodic(p->data, p->len);
+        p->next_ms += p->interval_ms; // Keeps to the interval even if we were a bit late
+        if ((int32_t)(now_ms - p->next_ms) >= 0) { // Very late, don't send a burst to catch up
+            p->next_ms = now_ms + p->interval_ms;
+        }
+    }
+}
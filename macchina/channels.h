@@ -1,51 +1,76 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-#ifndef CHANNELS_H
-#define CHANNELS_H
-
-#include "handlers.h"
-#include <stdint.h>
-
-// Protocol identifiers for sending to Macchina
-#define PROTOCOL_ISO15765 0x01
-#define PROTOCOL_CAN      0x02
-#define PROTOCOL_ISO9141  0x03
-
-#define PROTOCOL_FILTER_BLOCK 0x01 // Block filter for channel
-#define PROTOCOL_FILTER_PASS  0x02 // Pass filter for channel
-#define PROTOCOL_FILTER_FLOW  0x03 // ISO 15765 filter (pass filter + Response ID)
-
-class channel {
-public:
-    channel(uint8_t id, uint8_t protocol, unsigned long baudRate);
-    void kill_channel();
-    void update();
-    uint8_t getID();
-    void transmit_data(uint16_t len, uint8_t* data);
-    void set_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp);
-    void remove_filter(uint8_t id);
-private:
-    handler* protocol_handler;
-    uint8_t id;
-};
-
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include "handlers.h"
+#include <stdint.h>
+
+// Protocol identifiers for sending to Macchina
+#define PROTOCOL_ISO15765 0x01
+#define PROTOCOL_CAN      0x02
+#define PROTOCOL_ISO9141  0x03
+#define PROTOCOL_ISO14230 0x04
+
+#define PROTOCOL_FILTER_BLOCK 0x01 // Block filter for channel
+#define PROTOCOL_FILTER_PASS  0x02 // Pass filter for channel
+#define PROTOCOL_FILTER_FLOW  0x03 // ISO 15765 filter (pass filter + Response ID)
+
+#define MAX_PAYLOAD_SIZE 4128 // Same as PASSTHRU_MSG Data
+
+#define MAX_PERIODIC_MSGS 10 // Per channel, same as the driver
+#define PERIODIC_MAX_DATA 64 // Single frames only (Or a short K-Line message)
+
+struct periodic_msg {
+    uint32_t interval_ms;
+    uint32_t next_ms; // When it is next due
+    uint16_t len;
+    uint8_t data[PERIODIC_MAX_DATA]; // Formatted the same as CMD_CHANNEL_DATA for the protocol
+};
+
+class channel {
+public:
+    channel(uint8_t id, uint8_t protocol, unsigned long baudRate, uint32_t flags);
+    void kill_channel();
+    bool isReady();
+    void update();
+    uint8_t getID();
+    void transmit_data(uint16_t len, uint8_t* data);
+    void transmit_part(uint32_t total, uint32_t offset, uint8_t* data, uint16_t len);
+    void set_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp);
+    void remove_filter(uint8_t id);
+    uint8_t ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+    void start_periodic(uint8_t id, uint32_t interval_ms, uint8_t* data, uint16_t len);
+    void stop_periodic(uint8_t id);
+    void update_periodic(uint32_t now_ms);
+    void getStats(channel_stats* stats);
+    void set_trace(uint16_t trace_id, uint32_t usb_us);
+private:
+    periodic_msg* periodic[MAX_PERIODIC_MSGS] = { nullptr };
+    handler* protocol_handler = nullptr;
+    uint8_t id;
+    uint8_t* part_buf = nullptr; // Payload being assembled from CMD_CHANNEL_DATA_PART
+    uint32_t part_total = 0;
+    uint32_t part_pos = 0;
+};
+
 #endif
\ No newline at end of file
@@ -123,60 +123,93 @@ uint32_t CANRaw::set_baudrate(uint32_t ul_baudrate)
 	return 1;
 }
 
-uint32_t CANRaw::beginAutoSpeed()
+/*
+ * \brief Rates autobaud tries, most likely first.
+ *
+ * \retval The rate at idx, or 0 past the end of the list.
+ */
+uint32_t CANRaw::getAutoSpeed(uint8_t idx)
 {
-	//set a list of speeds to check here. Terminate that list with 0 or you'll have a bad time.
-	uint32_t speeds[] = {250000ul, 500000ul, 1000000ul, 125000ul, 33333ul, 50000ul, 800000ul, 0};
-	int speedCounter = 0;
-	uint32_t ret;
+	static const uint32_t speeds[] = {500000ul, 250000ul, 125000ul, 1000000ul, 33333ul, 50000ul, 83333ul, 100000ul, 800000ul, 0};
+	return idx < sizeof(speeds) / sizeof(speeds[0]) ? speeds[idx] : 0;
+}
 
-	enable_autobaud_listen_mode(); //go into listen only mode so we don't clobber the bus with a wrong speed setting
+/*
+ * \brief Listens only at a rate, with every mailbox taking any frame. One step of autobaud,
+ * for callers that can't block for the whole scan.
+ *
+ * \retval 0 if the rate could not be set up.
+ */
+uint32_t CANRaw::listenAutoSpeed(uint32_t speed)
+{
+	enable_autobaud_listen_mode(); //listen only mode so we don't clobber the bus with a wrong speed setting
+	if (init(speed) == 0)
+	{
+		return 0;
+	}
+	//alternate extended and standard
+	for (int filter = 0; filter < getNumRxBoxes(); filter++) {
+		setRXFilter(filter, 0, 0, filter % 2 == 0);
+	}
+	return speed;
+}
+
+uint32_t CANRaw::beginAutoSpeed(uint32_t budget_ms)
+{
+	uint32_t start = millis();
 	AUTOBAUD_DEBUG("\n");
 
-	while (speeds[speedCounter] != 0)
+	//Short looks at every rate, repeated until the budget runs out. A quiet bus at the right rate
+	//then costs one dwell per pass, rather than every other rate waiting for a full timeout first
+	while (millis() - start < budget_ms)
 	{
-		AUTOBAUD_DEBUG("\nTrying CAN rate: ");
-		AUTOBAUD_DEBUG(speeds[speedCounter]);
-		ret = init(speeds[speedCounter]);
-		if (ret == 0)
+		for (int speedCounter = 0; getAutoSpeed(speedCounter) != 0 && millis() - start < budget_ms; speedCounter++)
 		{
-			AUTOBAUD_DEBUG("\nCould not init bus at requested speed!\n");
-		}
-		for (int filter = 0; filter < 3; filter++) {
-			setRXFilter(filter, 0, 0, true);
-		}
-		//standard
-		for (int filter = 3; filter < 7; filter++) {
-			setRXFilter(filter, 0, 0, false);
-		}
-        for (int waiting = 0; waiting < 100; waiting++)
-		{
-			CAN_FRAME thisFrame;
-			if (rx_avail() > 0) {
-				read(thisFrame);
-				break;
+			uint32_t speed = getAutoSpeed(speedCounter);
+			AUTOBAUD_DEBUG("\nTrying CAN rate: ");
+			AUTOBAUD_DEBUG(speed);
+			if (listenAutoSpeed(speed) == 0)
+			{
+				AUTOBAUD_DEBUG("\nCould not init bus at requested speed!\n");
+				continue;
 			}
-			delay(6);
-		}
-		if (numRxFrames > 0) 
-		{
-			AUTOBAUD_DEBUG(" SUCCESS!\n\n");
-			disable_autobaud_listen_mode(); //the default is to not be in listen only
-			reset_all_mailbox(); //return mailboxes to default state which is to let nothing through yet
-			init(ret);
-			return ret; //return the speed that succeeded
-		}
-		else 
-		{ 
-			AUTOBAUD_DEBUG(" FAILURE!\n"); 
+			uint8_t rec = get_rx_error_cnt();
+			uint32_t dwell = millis();
+			while (numRxFrames == 0 && millis() - dwell < AUTOBAUD_DWELL_MS && millis() - start < budget_ms)
+			{
+				if (get_rx_error_cnt() > rec) break; //wrong rate, bit errors show up within a frame
+			}
+			if (numRxFrames > 0)
+			{
+				AUTOBAUD_DEBUG(" SUCCESS!\n\n");
+				disable_autobaud_listen_mode(); //the default is to not be in listen only
+				reset_all_mailbox(); //return mailboxes to default state which is to let nothing through yet
+				init(speed);
+				return speed; //return the speed that succeeded
+			}
+			AUTOBAUD_DEBUG(" FAILURE!\n");
 		}
-		speedCounter++;
 	}
 	AUTOBAUD_DEBUG("\nNo speeds worked! Are you sure you're connected to a CAN bus?!\n");
+	disable_autobaud_listen_mode();
 	disable();
 	return 0; 
 }
 
+/*
+ * \brief Sample point of the current bit timing.
+ *
+ * \retval Sample point in tenths of a percent (875 = 87.5%).
+ */
+uint16_t CANRaw::getSamplePoint()
+{
+	uint32_t br = m_pCan->CAN_BR;
+	uint32_t propag = ((br & CAN_BR_PROPAG_Msk) >> CAN_BR_PROPAG_Pos) + 1;
+	uint32_t phase1 = ((br & CAN_BR_PHASE1_Msk) >> CAN_BR_PHASE1_Pos) + 1;
+	uint32_t phase2 = ((br & CAN_BR_PHASE2_Msk) >> CAN_BR_PHASE2_Pos) + 1;
+	return (uint16_t)((1000 * (CAN_BIT_SYNC + propag + phase1)) / (CAN_BIT_SYNC + propag + phase1 + phase2));
+}
+
 /*
  * \brief 
  *
@@ -240,6 +273,12 @@ uint32_t CANRaw::init(uint32_t ul_baudrate)
 	
 	numBusErrors = 0;
     numRxFrames = 0;
+    numRxDropped = 0;
+    numRxOverwritten = 0;
+    numTxQueued = 0;
+    numTxDone = 0;
+    txWatching = false;
+    txWatchDone = false;
 
 	//initialize all function pointers to null
 	//PCCOMM::logToSerial("null fp...");
@@ -366,6 +405,7 @@ void CANRaw::initRingBuffer (ringbuffer_t &ring, volatile CAN_FRAME *buffer, uin
     ring.size   = size;
     ring.head   = 0;
     ring.tail   = 0;
+    ring.peak   = 0;
 }
 
 /*
@@ -393,6 +433,10 @@ bool CANRaw::addToRingBuffer (ringbuffer_t &ring, const CAN_FRAME &msg)
     /* bump the head to point to the next free entry */
     ring.head = nextEntry;
 
+    /* keep the high watermark */
+    uint16_t count = (ring.head + ring.size - ring.tail) % ring.size;
+    if (count > ring.peak) ring.peak = count;
+
     return (true);
 }
 
@@ -926,6 +970,7 @@ bool CANRaw::sendFrame(CAN_FRAME& txFrame)
 	      //tail if it would smash into the head and kill the queue.
 	      result = addToRingBuffer(txRing, txFrame);
 	   }
+	   if (result) numTxQueued++;
    }
    irqRelease();
 
@@ -960,6 +1005,7 @@ bool CANRaw::sendFrame(CAN_FRAME& txFrame, uint8_t mbox)
 		
 		if (!result && txRings[mbox] && addToRingBuffer(*txRings[mbox], txFrame))
 			result=true;
+		if (result) numTxQueued++;
 	}
 	irqRelease();
     
@@ -1235,6 +1281,21 @@ uint32_t CANRaw::mailbox_tx_frame(uint8_t uc_index)
 	return CAN_MAILBOX_TRANSFER_OK;
 }
 
+/**
+* \brief Free entries in the global transmit ring (One entry is always left empty)
+*/
+uint16_t CANRaw::txRingFree()
+{
+	uint16_t val;
+
+	if (txRing.size == 0) return 0;
+	irqLock();
+	val = txRing.size - 1 - ringBufferCount(txRing);
+	irqRelease();
+
+	return val;
+}
+
 uint16_t CANRaw::available()
 {
 	uint16_t val;
@@ -1411,7 +1472,7 @@ void CANRaw::mailbox_int_handler(uint8_t mb,  uint32_t /*ul_status*/)
 			case 1: //receive
 			case 2: //receive w/ overwrite
 			case 4: //consumer - technically still a receive buffer
-				mailbox_read(mb, &tempFrame);
+				if (mailbox_read(mb, &tempFrame) & CAN_MAILBOX_RX_OVER) numRxOverwritten++;
 				numRxFrames++;
 	
 				//First, try to send a callback. If no callback registered then buffer the frame.
@@ -1438,10 +1499,16 @@ void CANRaw::mailbox_int_handler(uint8_t mb,  uint32_t /*ul_status*/)
 					}
 				}
 				// if none of the callback types caught this frame then queue it in the buffer
-				if (!caughtFrame)  addToRingBuffer(rxRing, tempFrame) ;
+				if (!caughtFrame && !addToRingBuffer(rxRing, tempFrame))  numRxDropped++ ;
 				break;
 				
 			case 3: //transmit
+				numTxDone++;
+				if (txWatching && numTxDone == txWatchSeq) {
+					txWatchUs = micros();
+					txWatchDone = true;
+					txWatching = false;
+				}
 				pRing = usesGlobalTxRing(mb) ? &txRing : txRings[mb];
 				if (removeFromRingBuffer(*pRing, tempFrame)) //if there is a frame in the queue to send
 					writeTxRegisters(tempFrame,mb);
@@ -1455,6 +1522,37 @@ void CANRaw::mailbox_int_handler(uint8_t mb,  uint32_t /*ul_status*/)
 	}
 }
 
+/**
+ * \brief Time the last frame passed to sendFrame once it has been sent on the bus
+ *
+ * \note Frames leave in the order they were queued, so the watched frame is done when
+ * the mailboxes have sent as many frames as had been queued. Only one frame is watched at a time
+ */
+void CANRaw::watchTx()
+{
+	irqLock();
+	txWatchSeq = numTxQueued;
+	txWatchDone = numTxDone == txWatchSeq; //Already gone, the time will be a little late
+	txWatching = !txWatchDone;
+	if (txWatchDone) txWatchUs = micros();
+	irqRelease();
+}
+
+/**
+ * \brief Check if the watched frame has been sent
+ *
+ * \param done_us Set to micros() at the time the frame was sent
+ *
+ * \retval true once, after the frame has been sent
+ */
+bool CANRaw::getWatchedTx(uint32_t* done_us)
+{
+	if (!txWatchDone) return false;
+	*done_us = txWatchUs;
+	txWatchDone = false;
+	return true;
+}
+
 /**
  * \brief Interrupt dispatchers - Never directly call these
  *
@@ -72,6 +72,9 @@
 /* CAN timeout for synchronization. */
 #define CAN_TIMEOUT                100000
 
+/* How long autobaud listens at each rate per pass before moving on. */
+#define AUTOBAUD_DWELL_MS          30
+
 /** The max value for CAN baudrate prescale. */
 #define CAN_BAUDRATE_MAX_DIV       128
 
@@ -156,9 +159,22 @@ public:
 	int _setFilterSpecific(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended);
     int _setFilter(uint32_t id, uint32_t mask, bool extended);
 	uint32_t init(uint32_t ul_baudrate);
-    uint32_t beginAutoSpeed();
+    uint32_t beginAutoSpeed(uint32_t budget_ms = 5000);
+    static uint32_t getAutoSpeed(uint8_t idx);
+    uint32_t listenAutoSpeed(uint32_t speed);
+    uint16_t getSamplePoint();
     uint32_t set_baudrate(uint32_t ul_baudrate);
     void setListenOnlyMode(bool state);
+    uint32_t getRxDropped() { return numRxDropped; }
+    uint32_t getRxOverwritten() { return numRxOverwritten; }
+    uint32_t getNumRxFrames() { return numRxFrames; }
+    uint32_t getNumBusErrors() { return numBusErrors; }
+    uint16_t getRxRingPeak() { return rxRing.peak; }
+    uint16_t getTxRingPeak() { return txRing.peak; }
+    uint16_t txRingFree();
+    void resetRingPeaks() { rxRing.peak = 0; txRing.peak = 0; }
+    void watchTx();
+    bool getWatchedTx(uint32_t* done_us);
 	void enable();
 	void disable();
 	bool sendFrame(CAN_FRAME& txFrame);
@@ -216,6 +232,7 @@ protected:
     volatile uint16_t head;
     volatile uint16_t tail;
     uint16_t size;
+    volatile uint16_t peak; //most entries ever in the ring
     volatile CAN_FRAME *buffer;
   };
  
@@ -260,6 +277,14 @@ private:
     
     uint32_t numBusErrors;
     uint32_t numRxFrames;
+    volatile uint32_t numRxDropped; //frames lost because the rx ring was full
+    volatile uint32_t numRxOverwritten; //frames lost in a mailbox before the interrupt read them
+    volatile uint32_t numTxQueued; //frames accepted by sendFrame
+    volatile uint32_t numTxDone; //frames the mailboxes have finished sending
+    volatile uint32_t txWatchSeq; //numTxDone value that completes the watched frame
+    volatile uint32_t txWatchUs; //micros() when the watched frame finished
+    volatile bool txWatching;
+    volatile bool txWatchDone;
 };
 
 extern CANRaw Can0;
@@ -1,366 +1,1157 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#include "channels.h"
-#include "pc_comm.h"
-
-
-handler::handler(unsigned long baud) {
-    this->buflen = 0;
-}
-
-uint32_t handler::getFilterResponseID(uint32_t rxID) {
-    for (int i = 0; i < MAX_FILTERS_PER_HANDLER; i++) {
-        if (filters[i]->mask & rxID == filters[i]->filter) {
-            return filters[i]->flow;
-        }
-    }
-    return 0xFFFFFFFF; // Invalid CID
-}
-
-void handler::add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp) {
-    if (id > MAX_FILTERS_PER_HANDLER-1) {
-        PCCOMM::logToSerial("Cannot add filter - ID is out of range");
-        return;
-    }
-    if (this->filters[id-1] != nullptr) {
-        PCCOMM::logToSerial("Cannot add filter - Already in use");
-        return;
-    }
-    filters[id-1] = new handler_filter {
-        id,
-        type,
-        mask,
-        filter,
-        resp
-    };
-    char buf[100] = {0x00};
-    sprintf(buf, "Setting filter. Type: %02X, Mask: %04X, Filter: %04X, Resp: %04X", type, mask, filter, resp);
-    PCCOMM::logToSerial(buf);
-}
-
-bool handler::update() {
-    return this->getData();
-}
-
-uint8_t* handler::getBuf() {
-    return this->buf;
-}
-
-uint8_t handler::getBufSize() {
-    return this->buflen;
-}
-
-void handler::destroy_filter(uint8_t id) {
-    if (this->filters[id-1] != nullptr) {
-        delete filters[id-1];
-        filters[id-1] = nullptr;
-    } else {
-         PCCOMM::logToSerial("Cannot remove filter - doesn't exist");
-    }
-}
-
-void handler::destroy() {
-    delete this->buf;
-}
-
-// CAN stuff (Normal CAN Payloads)
-
-can_handler::can_handler(unsigned long baud) : handler(baud) {
-    PCCOMM::logToSerial("Setting up CAN Handler");
-    this->buf = new uint8_t[12]; // Max (4 bytes for ID, 8 for DLC)
-    if (ch0.isFree()) {
-        ch0.lock(baud);
-        this->can_handle = &ch0;
-    } else if (ch1.isFree()) {
-        ch1.lock(baud);
-        this->can_handle = &ch1;
-    } else {
-        PCCOMM::logToSerial("NO AVALIABLE CAN HANDLERS!");
-        return;
-    }
-    this->lastFrame = CAN_FRAME{};
-}
-
-bool can_handler::getData() {
-    return false;
-}
-
-void can_handler::destroy() {
-    this->can_handle->unlock();
-}
-
-void can_handler::transmit(uint8_t* args, uint16_t len) {
-
-}
-
-void can_handler::add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp) {
-    handler::add_filter(id, type, mask, filter, resp);
-    if (type == PROTOCOL_FILTER_BLOCK) { // Block filter, so allow everything, then we do bitwising in SW
-        this->can_handle->setFilter(0x7FF, 0x00, false);
-    } else { // Pass filter, so allow into mailboxes
-        this->can_handle->setFilter(mask, filter & 0x7FF, false); // TODO Do Extended filtering
-    }
-}
-
-// ISO 9141 stuff (K-Line)
-
-iso9141_handler::iso9141_handler(unsigned long baud) : handler(baud) {
-    PCCOMM::logToSerial("Setting up ISO9141 Handler");
-}
-
-bool iso9141_handler::getData() {
-    return false;
-}
-
-void iso9141_handler::destroy() {
-
-}
-
-void iso9141_handler::transmit(uint8_t* args, uint16_t len) {
-    // TODO Kline stuff
-}
-
-void iso9141_handler::add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp) {
-    handler::add_filter(id, type, mask, filter, resp);
-}
-
-
-// ISO 15765 stuff (Big CAN Payloads)
-
-iso15765_handler::iso15765_handler(unsigned long baud, uint8_t id) : handler(baud) {
-    this->tx_buffer = new uint8_t[1];
-    this->buf = new uint8_t[1]; // Temporary (Will get destroyed as soon as we read a message)
-    this->channel_id = id;
-    PCCOMM::logToSerial("Setting up ISO15765 Handler");
-    if (ch0.isFree()) {
-        ch0.lock(baud);
-        this->can_handle = &ch0;
-    } else if (ch1.isFree()) {
-        ch1.lock(baud);
-        this->can_handle = &ch1;
-    } else {
-        PCCOMM::logToSerial("NO AVALIABLE CAN HANDLERS!");
-        return;
-    }
-    this->lastFrame = CAN_FRAME{};
-    this->tx_frame = CAN_FRAME{};
-}
-
-bool iso15765_handler::getData() {
-    if (this->clearToSend && this->isSending) {
-        this->send_buffer(); // We need to check if we can send out packets!
-    }
-    if (this->can_handle->read(&lastFrame)) {
-        char buf2[100];
-        int start = sprintf(buf2, "READ FRMAE: %04X (%lu) ", lastFrame.id, lastFrame.length);
-        for (int i = 0; i < lastFrame.length; i++) {
-            start += sprintf(buf2+start, "%02X ", lastFrame.data.bytes[i]);
-        }
-        PCCOMM::logToSerial(buf2);
-        uint8_t bytes_to_copy = 0; // Used for multi-frame Rx
-        switch(lastFrame.data.bytes[0] & 0xF0) {
-            case 0x00:
-                delete buf; // Wipe the old buffer (If any)
-                buf = new uint8_t[lastFrame.data.bytes[0] + 4]; // Data size is ID (4) + ISO Size
-                this->buflen = lastFrame.data.bytes[0] + 4;
-                // Copy ID
-                buf[0] = lastFrame.id >> 24;
-                buf[1] = lastFrame.id >> 16;
-                buf[2] = lastFrame.id >> 8;
-                buf[3] = lastFrame.id;
-                // Copy all the bytes in the payload section of the frame
-                memcpy(&buf[4], &lastFrame.data.bytes[1], lastFrame.data.bytes[0]);
-                return true;
-            case 0x10:
-                PCCOMM::logToSerial("Multi-Frame head!");
-                // First frame indication Tx back to driver
-                this->sendFF(lastFrame.id);
-                // Set buffer to real size
-                delete buf;
-                buf = new uint8_t[lastFrame.data.bytes[1] + 4];
-                this->bufWritePos = 10; // When finished, we will be at the 10th byte
-                this->buflen = lastFrame.data.bytes[1] + 4; // Set the full buffer size
-                buf[0] = lastFrame.id >> 24;
-                buf[1] = lastFrame.id >> 16;
-                buf[2] = lastFrame.id >> 8;
-                buf[3] = lastFrame.id;
-                // Copy all the bytes in the payload section of the frame
-                memcpy(&buf[4], &lastFrame.data.bytes[2], 6); // Copy the first 6 bytes
-                // Need to now send the FC frame
-                this->send_flow_control();
-                return false;
-            case 0x20:
-                PCCOMM::logToSerial("Multi-Frame body!");
-                // At most 7 bytes per frame
-                // buflen tells us how many bytes in total for ISO data
-                // bufWritePos tells us the current number of bytes written
-                bytes_to_copy = min(7, buflen-bufWritePos);
-                memcpy(&buf[bufWritePos], &lastFrame.data.bytes[1], bytes_to_copy);
-                bufWritePos += bytes_to_copy;
-                if (bufWritePos >= buflen && isReceiving) {
-                    // Copy complete
-                    isReceiving = false;
-                    return true;
-                }
-                rx_count++;
-                // Now need to send a new FC frame!
-                if (this->rx_count == MAX_BLOCK_SIZE_RX) {
-                    this->send_flow_control();
-                }
-                return false;
-            case 0x30:
-                // Handle flow control!
-                this->tx_sep = lastFrame.data.bytes[2];
-                this->tx_bs = lastFrame.data.bytes[3];
-                this->clearToSend = true;
-                this->tx_last_send_time = millis();
-                return false;
-            default:
-                PCCOMM::logToSerial("Not a valid ISO Frame!");
-                return false;
-        }
-    }
-    return false;
-}
-
-void iso15765_handler::destroy() {
-    this->can_handle->unlock();
-}
-
-void iso15765_handler::transmit(uint8_t* args, uint16_t len) {
-    if (this->can_handle == nullptr) {
-        PCCOMM::logToSerial("ISO15765 cannot transmit - Handler is null");
-        return;
-    }
-    if (len-4 < 7) {
-        CAN_FRAME f = {0x00};
-        f.extended = false; // TODO Allow for extended frames
-        f.id = args[0] << 24 | args[1] << 16 | args[2] << 8 | args[3];
-        f.data.byte[0] = len-4;
-        f.length = 8; // Always for ISO15765
-        f.priority = 4; // Send this frame now!
-        f.rtr = 0;
-        memcpy(&f.data.bytes[1], &args[4], len-4);
-        this->can_handle->transmit(f);
-    } else {
-        PCCOMM::logToSerial("Sending multiple frames!");
-        delete this->tx_buffer;
-        this->tx_frame.length = 8; // Always for 15765
-        this->tx_frame.id = args[0] << 24 | args[1] << 16 | args[2] << 8 | args[3]; // Set once
-        this->tx_frame.priority = 4;
-        this->tx_frame.rtr = false;
-        this->isSending = true;
-        this->clearToSend = false;
-        this->tx_buffer = new uint8_t[len-4]; // -4 as the CID now lives in the tx_frame
-        this->tx_buffer_size = len-4;
-        memcpy(&tx_buffer[0], &args[4], len-4); // Copy the full payload buffer
-        this->tx_frame.data.bytes[0] = 0x10;
-        this->tx_frame.data.bytes[1] = tx_buffer_size; // Total number of bytes
-        memcpy(&tx_frame.data.bytes[2], &tx_buffer[0], 6); // Copy first 6 bytes
-        this->tx_buffer_pos = 6;
-        this->tx_packet_id = 0x21; // Set the PCI of the next packet
-        this->tx_packets_sent = 0;
-        this->can_handle->transmit(tx_frame);
-    }
-}
-
-void iso15765_handler::add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp) {
-    handler::add_filter(id, type, mask, filter, resp);
-    if (type == PROTOCOL_FILTER_BLOCK) { // Block filter, so allow everything, then we do bitwising in SW
-        this->can_handle->setFilter(0x0, 0x0, false);
-    } else { // Pass filter, so allow into mailboxes
-        this->can_handle->setFilter(filter & 0x7FF, mask, false); // TODO Do Extended filtering
-    }
-}
-
-void iso15765_handler::sendFF(uint32_t canid) {
-    PCMSG tx = {0x00};
-    tx.cmd_id = CMD_CHANNEL_DATA;
-    tx.args[0] = this->channel_id;
-    tx.args[1] = ISO15765_FF_INDICATOR; // As this is never true in a CAN Frame, it can be used as a flag
-    tx.args[2] = canid >> 24;
-    tx.args[3] = canid >> 16;
-    tx.args[4] = canid >> 8;
-    tx.args[5] = canid;
-    tx.arg_size = 6;
-    PCCOMM::sendMessage(&tx);
-}
-
-// Handles sending of 0x2x multi frame payload packets
-void iso15765_handler::send_buffer() {
-    // Check if too early to send buffer. Min call is used so we don't flood CAN
-    if (millis() - tx_last_send_time < min(1, tx_sep)) {
-        return;
-    }
-    PCCOMM::logToSerial("Sending multi frame segment");
-    tx_frame.data.bytes[0] = tx_packet_id;
-    tx_packet_id++;
-    int bytes_left = this->tx_buffer_size - this->tx_buffer_pos;
-    memcpy(&tx_frame.data.bytes[1], &this->tx_buffer[tx_buffer_pos], max(7, bytes_left));
-    this->can_handle->transmit(tx_frame);
-    this->tx_buffer_pos+=7;
-    this->tx_packets_sent++;
-    if (this->tx_packets_sent == tx_bs) { // Need a clear to send packet again
-        PCCOMM::logToSerial("Await new FC Frame");
-        this->tx_packets_sent = 0;
-        clearToSend = false;
-    }
-    // Reset PCI if it overflows
-    if (this->tx_packet_id == 0x30) {
-        this->tx_packet_id = 0x20;
-    }
-    if (tx_buffer_pos >= this->tx_buffer_size) {
-        this->isSending = false;
-        this->clearToSend = false;
-        PCMSG tx = {0x00};
-        tx.cmd_id = CMD_CHANNEL_DATA;
-        tx.args[0] = this->channel_id;
-        tx.args[1] = ISO15765_SD_INDICATOR;
-        tx.arg_size = 2;
-        PCCOMM::sendMessage(&tx);
-        return;
-    }
-    tx_last_send_time = millis();
-}
-
-void iso15765_handler::send_flow_control() {
-    this->rx_count = 0; // Reset
-    // Find the correct Response ID in the filters:
-    uint32_t tmp_id = getFilterResponseID(lastFrame.id);
-    if (tmp_id == 0xFFFFFFFF) {
-        PCCOMM::logToSerial("Couldn't find any response ID's!");
-        return;
-    }
-    PCCOMM::logToSerial("Sending Flow control");
-    // modify lastFrame so its now the response message
-    lastFrame.id = tmp_id;
-    // TODO IOCTL based SP and BS
-    lastFrame.data.bytes[0] = 0x30; // Tell ECU its clear to send!
-    lastFrame.data.bytes[1] = MAX_BLOCK_SIZE_RX; // Block size
-    lastFrame.data.bytes[2] = 0x20; // Min seperation time in ms
-    lastFrame.data.bytes[3] = 0x00;
-    lastFrame.data.bytes[4] = 0x00;
-    lastFrame.data.bytes[5] = 0x00;
-    lastFrame.data.bytes[6] = 0x00;
-    lastFrame.data.bytes[7] = 0x00;
-    isReceiving = true;
-    this->can_handle->transmit(lastFrame);
-}
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "channels.h"
+#include "pc_comm.h"
+#include "trace.h"
+#include "j2534_mini.h"
+
+
+handler::handler(unsigned long baud) {
+    this->buflen = 0;
+    this->rx_credits = CREDIT_UNLIMITED;
+}
+
+uint32_t handler::getFilterResponseID(uint32_t rxID) {
+    for (int i = 0; i < MAX_FILTERS_PER_HANDLER; i++) {
+        if (filters[i] != nullptr && (rxID & filters[i]->mask) == filters[i]->filter) {
+            return filters[i]->flow;
+        }
+    }
+    return 0xFFFFFFFF; // Invalid CID
+}
+
+// J2534 filtering - A frame has to match a pass filter, and no block filters
+bool handler::passesFilters(uint32_t canid) {
+    bool pass = false;
+    for (int i = 0; i < MAX_FILTERS_PER_HANDLER; i++) {
+        if (filters[i] != nullptr && (canid & filters[i]->mask) == (filters[i]->filter & filters[i]->mask)) {
+            if (filters[i]->type == PROTOCOL_FILTER_BLOCK) {
+                return false;
+            }
+            pass = true;
+        }
+    }
+    return pass;
+}
+
+void handler::add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp) {
+    this->store_filter(id, type, mask, filter, resp);
+}
+
+// False if the filter was rejected, in which case handlers must not act on it either
+bool handler::store_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp) {
+    if (id == 0 || id > MAX_FILTERS_PER_HANDLER) {
+        PCCOMM::logToSerial("Cannot add filter - ID is out of range");
+        return false;
+    }
+    if (this->filters[id-1] != nullptr) {
+        PCCOMM::logToSerial("Cannot add filter - Already in use");
+        return false;
+    }
+    filters[id-1] = new handler_filter {
+        id,
+        type,
+        mask,
+        filter,
+        resp
+    };
+    char buf[100] = {0x00};
+    sprintf(buf, "Setting filter. Type: %02X, Mask: %04X, Filter: %04X, Resp: %04X", type, mask, filter, resp);
+    PCCOMM::logToSerial(buf);
+    return true;
+}
+
+bool handler::update() {
+    return this->getData();
+}
+
+uint8_t* handler::getBuf() {
+    return this->buf;
+}
+
+uint16_t handler::getBufSize() {
+    return this->buflen;
+}
+
+void handler::getStats(channel_stats* stats) {
+    memcpy(stats, &this->counts, sizeof(channel_stats));
+}
+
+// The next transmit() is timed through to the bus
+void handler::setTrace(uint8_t channel_id, uint16_t trace_id, uint32_t usb_us) {
+    this->trace_channel = channel_id;
+    this->trace_id = trace_id;
+    this->trace_usb_us = usb_us;
+}
+
+void handler::setRxCredits(uint16_t credits) {
+    this->rx_credits = credits;
+}
+
+// Running total of records the driver may have sent (See CMD_CREDIT). False if the handler
+// takes whatever it is sent
+bool handler::txCredit(uint16_t* limit) {
+    return false;
+}
+
+// False if the hardware the handler needs was already taken, so the channel can't be created
+bool handler::isReady() {
+    return true;
+}
+
+// Periodic messages come from the device itself, so they don't use up the driver's credits
+void handler::transmitPeriodic(uint8_t* args, uint16_t len) {
+    uint16_t records = this->tx_records;
+    this->transmit(args, len);
+    this->tx_records = records;
+}
+
+// Payload in buf was not sent, the driver had no room for it
+void handler::dropRx() {
+    this->counts.rx_dropped++;
+}
+
+// Called as transmit() starts. True if the message is traced, the caller then watches its last frame
+bool handler::startTrace() {
+    if (this->trace_id == 0) {
+        return false;
+    }
+    this->trace_pending = this->trace_id; // Replaces one still waiting on the bus
+    this->trace_tx_us = micros();
+    this->trace_id = 0;
+    return true;
+}
+
+void handler::pollTrace(canbus_handler* c) {
+    uint32_t bus_us;
+    if (this->trace_pending != 0 && c->txWatchDone(&bus_us)) {
+        PCCOMM::sendTxTrace(this->trace_channel, this->trace_pending, this->trace_usb_us, this->trace_tx_us, bus_us);
+        this->trace_pending = 0;
+    }
+}
+
+void handler::destroy_filter(uint8_t id) {
+    if (id != 0 && id <= MAX_FILTERS_PER_HANDLER && this->filters[id-1] != nullptr) {
+        delete filters[id-1];
+        filters[id-1] = nullptr;
+    } else {
+         PCCOMM::logToSerial("Cannot remove filter - doesn't exist");
+    }
+}
+
+// Channel specific IOCTLs, returns a J2534 status code
+uint8_t handler::ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len) {
+    return ERR_NOT_SUPPORTED;
+}
+
+void handler::destroy() {
+    POOL::release(this->buf);
+    this->buf = nullptr;
+}
+
+// Makes sure buf can hold size bytes, reusing the block we already have where possible
+bool handler::reserve_buf(uint16_t size) {
+    if (POOL::capacity(this->buf) >= size) {
+        return true;
+    }
+    POOL::release(this->buf);
+    this->buf = POOL::acquire(size);
+    return this->buf != nullptr;
+}
+
+// CAN stuff (Normal CAN Payloads)
+
+can_handler::can_handler(unsigned long baud, uint32_t flags) : handler(baud) {
+    PCCOMM::logToSerial("Setting up CAN Handler");
+    this->ext_id = (flags & CAN_29BIT_ID) != 0;
+    this->bit_ns = 1000000000UL / baud;
+    this->buf = this->batch; // Records get sent straight out of the batch
+    if (ch0.isFree()) {
+        ch0.lock(baud);
+        this->can_handle = &ch0;
+    } else if (ch1.isFree()) {
+        ch1.lock(baud);
+        this->can_handle = &ch1;
+    } else {
+        PCCOMM::logToSerial("NO AVALIABLE CAN HANDLERS!");
+        return;
+    }
+    this->lastFrame = CAN_FRAME{};
+    if (flags & MACCHINA_MONITOR_MODE) {
+        this->set_monitor(true);
+    }
+}
+
+void can_handler::set_monitor(bool state) {
+    if (state == this->monitor) {
+        return;
+    }
+    this->monitor = state;
+    this->can_handle->setMonitorMode(state);
+    if (!state) { // Put the filters back into the mailboxes
+        for (int i = 0; i < MAX_FILTERS_PER_HANDLER; i++) {
+            if (this->filters[i] != nullptr) {
+                this->add_hw_filter(this->filters[i]->type, this->filters[i]->mask, this->filters[i]->filter);
+            }
+        }
+    }
+}
+
+uint8_t can_handler::ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len) {
+    if (this->can_handle == nullptr) {
+        return ERR_FAILED;
+    }
+    switch (id) {
+        case MACCHINA_IOCTL_SET_MONITOR:
+            if (in_len < 1) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            this->set_monitor(in[0] != 0);
+            return STATUS_NOERROR;
+        default:
+            return handler::ioctl(id, in, in_len, out, out_len);
+    }
+}
+
+// Drains the Rx ring into the batch. Returns true when the batch should be sent
+bool can_handler::getData() {
+    if (this->can_handle == nullptr) {
+        return false;
+    }
+    this->pollTrace(this->can_handle);
+    if (this->batch_sent) { // Last batch went out, start a new one
+        this->buflen = 0;
+        this->batch_sent = false;
+    }
+    if (this->rx_credits == 0) { // Driver has no room, frames wait in the Rx ring
+        return false;
+    }
+    // Tell the PC exactly how many frames it has missed
+    uint32_t dropped, overwritten;
+    this->can_handle->getDropCounts(&dropped, &overwritten);
+    if (dropped != this->reported_dropped || overwritten != this->reported_overwritten) {
+        if (this->buflen == 0) {
+            this->batch_start = micros();
+        }
+        uint8_t* r = &this->batch[this->buflen];
+        uint32_t ts = micros();
+        uint32_t d = dropped - this->reported_dropped;
+        uint32_t o = overwritten - this->reported_overwritten;
+        memset(r, 0x00, CAN_RX_RECORD_HDR);
+        r[0] = CAN_RECORD_STATUS | 8;
+        memcpy(&r[5], &ts, 4);
+        memcpy(&r[CAN_RX_RECORD_HDR], &d, 4);
+        memcpy(&r[CAN_RX_RECORD_HDR + 4], &o, 4);
+        this->buflen += CAN_RX_RECORD_HDR + 8;
+        this->counts.rx_dropped += d + o;
+        this->reported_dropped = dropped;
+        this->reported_overwritten = overwritten;
+    }
+    while (this->buflen + CAN_RX_RECORD_HDR + 8 <= CAN_BATCH_SIZE && this->can_handle->read(&lastFrame)) {
+        // Work back from the CAN timer to when the frame actually arrived
+        uint16_t bits_ago = this->can_handle->getTimerValue() - lastFrame.time;
+        uint32_t ts = micros() - (bits_ago * this->bit_ns) / 1000;
+        if (!this->monitor && ((bool)lastFrame.extended != this->ext_id || !this->passesFilters(lastFrame.id))) {
+            this->counts.rx_filtered++;
+            continue; // Monitor mode takes everything
+        }
+        if (this->buflen == 0) {
+            this->batch_start = micros();
+        }
+        uint8_t* r = &this->batch[this->buflen];
+        uint8_t dlc = min(lastFrame.length, 8);
+        r[0] = dlc | (lastFrame.extended ? CAN_RECORD_EXT : 0) | (lastFrame.rtr ? CAN_RECORD_RTR : 0);
+        r[1] = lastFrame.id >> 24;
+        r[2] = lastFrame.id >> 16;
+        r[3] = lastFrame.id >> 8;
+        r[4] = lastFrame.id;
+        memcpy(&r[5], &ts, 4);
+        memcpy(&r[CAN_RX_RECORD_HDR], lastFrame.data.bytes, dlc);
+        this->buflen += CAN_RX_RECORD_HDR + dlc;
+        this->counts.rx_frames++;
+    }
+    if (this->buflen == 0) {
+        return false;
+    }
+    if (this->buflen + CAN_RX_RECORD_HDR + 8 > CAN_BATCH_SIZE || micros() - this->batch_start >= CAN_BATCH_LATENCY_US) {
+        this->batch_sent = true;
+        return true;
+    }
+    return false;
+}
+
+bool can_handler::isReady() {
+    return this->can_handle != nullptr;
+}
+
+void can_handler::destroy() {
+    if (this->can_handle != nullptr) {
+        this->can_handle->unlock();
+    }
+    this->buf = nullptr; // Not from the pool
+    handler::destroy();
+}
+
+// Records the driver may send, as a running total. Goes up as the Tx ring drains
+bool can_handler::txCredit(uint16_t* limit) {
+    if (this->can_handle == nullptr) {
+        return false;
+    }
+    *limit = this->tx_records + this->can_handle->txFree();
+    return true;
+}
+
+// Sends a batch of records from the PC straight into the Tx mailboxes
+void can_handler::transmit(uint8_t* args, uint16_t len) {
+    // Every record the driver sent used a credit, even ones that go no further
+    for (uint16_t pos = 0; pos + CAN_TX_RECORD_HDR <= len; pos += CAN_TX_RECORD_HDR + (args[pos] & CAN_RECORD_DLC)) {
+        this->tx_records++;
+    }
+    if (this->can_handle == nullptr) {
+        PCCOMM::logToSerial("CAN cannot transmit - Handler is null");
+        return;
+    }
+    if (this->monitor) {
+        PCCOMM::logToSerial("CAN cannot transmit - Monitor mode is listen only");
+        return;
+    }
+    bool traced = this->startTrace();
+    uint16_t pos = 0;
+    while (pos + CAN_TX_RECORD_HDR <= len) {
+        uint8_t dlc = args[pos] & CAN_RECORD_DLC;
+        if (dlc > 8 || pos + CAN_TX_RECORD_HDR + dlc > len) {
+            PCCOMM::logToSerial("CAN cannot transmit - Invalid record");
+            return;
+        }
+        CAN_FRAME f = {0x00};
+        f.extended = (args[pos] & CAN_RECORD_EXT) != 0;
+        f.rtr = (args[pos] & CAN_RECORD_RTR) ? 1 : 0;
+        f.id = (args[pos+1] << 24 | args[pos+2] << 16 | args[pos+3] << 8 | args[pos+4]) & (f.extended ? 0x1FFFFFFF : 0x7FF);
+        f.length = dlc;
+        f.priority = 4;
+        memcpy(f.data.bytes, &args[pos + CAN_TX_RECORD_HDR], dlc);
+        // Ring is full at 100% bus load, give the mailboxes a moment to drain
+        uint32_t start = micros();
+        bool queued;
+        while (!(queued = this->can_handle->queue(f))) {
+            if (micros() - start > CAN_TX_WAIT_US) {
+                this->tx_dropped++;
+                this->counts.tx_dropped++;
+                break;
+            }
+        }
+        if (queued) {
+            this->counts.tx_frames++;
+        }
+        pos += CAN_TX_RECORD_HDR + dlc;
+    }
+    if (this->tx_dropped != 0) {
+        TRACE_ERROR(TRACE_CAN_TX_DROPPED, 0, this->tx_dropped, 0, 0);
+        this->tx_dropped = 0;
+    }
+    if (traced) {
+        this->can_handle->watchTx();
+    }
+}
+
+void can_handler::add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp) {
+    if (!this->store_filter(id, type, mask, filter, resp) || this->can_handle == nullptr || this->monitor) {
+        return; // Monitor mode mailboxes already take everything
+    }
+    this->add_hw_filter(type, mask, filter);
+}
+
+void can_handler::add_hw_filter(uint8_t type, uint32_t mask, uint32_t filter) {
+    if (type == PROTOCOL_FILTER_BLOCK) { // Block filter, so allow everything, then we do bitwising in SW
+        this->can_handle->setFilter(0x00, 0x00, this->ext_id);
+    } else { // Pass filter, so allow into mailboxes
+        mask &= this->ext_id ? 0x1FFFFFFF : 0x7FF;
+        this->can_handle->setFilter(filter & mask, mask, this->ext_id);
+    }
+}
+
+// ISO 9141 stuff (K-Line)
+
+iso9141_handler::iso9141_handler(unsigned long baud, uint8_t id, uint32_t flags, bool iso14230) : handler(baud) {
+    this->channel_id = id;
+    PCCOMM::logToSerial("Setting up ISO9141 Handler");
+    if (!kline.claim(baud, iso14230, !(flags & ISO9141_NO_CHECKSUM))) {
+        PCCOMM::logToSerial("K-LINE IS ALREADY IN USE!");
+        return;
+    }
+    this->kline_handle = &kline;
+}
+
+bool iso9141_handler::getData() {
+    if (this->kline_handle == nullptr) {
+        return false;
+    }
+    if (this->tx_pending_len != 0 && this->kline_handle->send(this->tx_pending, this->tx_pending_len)) {
+        this->tx_pending_len = 0;
+    }
+    uint32_t errors = this->kline_handle->getErrors();
+    if (errors != this->reported_errors) {
+        TRACE_ERROR(TRACE_KLINE_ERRORS, 0, errors - this->reported_errors, 0, 0);
+        this->reported_errors = errors;
+    }
+    if (this->init_ioctl != 0 && this->kline_handle->initResult(&this->init_res)) {
+        uint8_t status = STATUS_NOERROR;
+        if (this->init_res.status == KLINE_INIT_BAD_ECHO) {
+            status = ERR_FAILED;
+        } else if (this->init_res.status != KLINE_INIT_OK) {
+            status = ERR_TIMEOUT; // ECU didn't answer (Or not in the way it should have)
+        }
+        PCCOMM::sendIoctlResult(this->channel_id, this->init_ioctl, status, this->init_res.data, status == STATUS_NOERROR ? this->init_res.len : 0);
+        this->init_ioctl = 0;
+    }
+    while (this->kline_handle->read(&this->rx_msg)) {
+        // Filters match the first 4 bytes (Header) of the message
+        uint32_t hdr = 0;
+        for (uint16_t i = 0; i < 4; i++) {
+            hdr = hdr << 8 | (i < this->rx_msg.len ? this->rx_msg.data[i] : 0x00);
+        }
+        if (!this->passesFilters(hdr)) {
+            this->counts.rx_filtered++;
+            continue;
+        }
+        if (!this->reserve_buf(KLINE_RX_RECORD_HDR + this->rx_msg.len)) {
+            PCCOMM::logToSerial("K-Line no free buffer - Dropping message");
+            this->counts.rx_dropped++;
+            return false;
+        }
+        memcpy(&this->buf[0], &this->rx_msg.timestamp, 4);
+        memcpy(&this->buf[KLINE_RX_RECORD_HDR], this->rx_msg.data, this->rx_msg.len);
+        this->buflen = KLINE_RX_RECORD_HDR + this->rx_msg.len;
+        this->counts.rx_frames++;
+        return true;
+    }
+    return false;
+}
+
+bool iso9141_handler::isReady() {
+    return this->kline_handle != nullptr;
+}
+
+void iso9141_handler::destroy() {
+    if (this->kline_handle != nullptr) {
+        this->kline_handle->release();
+        this->kline_handle = nullptr;
+    }
+    handler::destroy();
+}
+
+void iso9141_handler::transmit(uint8_t* args, uint16_t len) {
+    if (this->kline_handle == nullptr) {
+        PCCOMM::logToSerial("K-Line cannot transmit - Handler is null");
+        return;
+    }
+    if (len == 0 || len > KLINE_MAX_MSG - 1) {
+        PCCOMM::logToSerial("K-Line cannot transmit - Invalid size");
+        return;
+    }
+    if (this->kline_handle->send(args, len)) {
+        this->counts.tx_frames++;
+        return;
+    }
+    if (this->tx_pending_len != 0) {
+        PCCOMM::logToSerial("K-Line cannot transmit - Busy");
+        this->counts.tx_dropped++;
+        return;
+    }
+    memcpy(this->tx_pending, args, len); // Goes out from getData() when the engine is free
+    this->tx_pending_len = len;
+    this->counts.tx_frames++;
+}
+
+uint8_t iso9141_handler::ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len) {
+    if (this->kline_handle == nullptr) {
+        return ERR_FAILED;
+    }
+    uint32_t param, value;
+    switch (id) {
+        case SET_CONFIG:
+            if (in_len == 0 || in_len % 8 != 0) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            for (uint16_t i = 0; i < in_len; i += 8) {
+                memcpy(&param, &in[i], 4);
+                memcpy(&value, &in[i + 4], 4);
+                if (param > 0xFF || !this->kline_handle->setParam(param, value)) {
+                    return ERR_NOT_SUPPORTED;
+                }
+            }
+            return STATUS_NOERROR;
+        case GET_CONFIG:
+            if (in_len != 4) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            memcpy(&param, in, 4);
+            if (param > 0xFF || !this->kline_handle->getParam(param, &value)) {
+                return ERR_NOT_SUPPORTED;
+            }
+            memcpy(out, &value, 4);
+            *out_len = 4;
+            return STATUS_NOERROR;
+        case FIVE_BAUD_INIT: // Both inits take far longer than a CMD_CHANNEL_IOCTL_REQ should, so are finished off by getData()
+            if (in_len != 1) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            if (this->init_ioctl != 0 || !this->kline_handle->startFiveBaud(in[0])) {
+                return ERR_CHANNEL_IN_USE;
+            }
+            this->init_ioctl = id;
+            return STATUS_NOERROR;
+        case FAST_INIT:
+            if (in_len == 0 || in_len > KLINE_MAX_MSG - 1) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            if (this->init_ioctl != 0 || !this->kline_handle->startFastInit(in, in_len)) {
+                return ERR_CHANNEL_IN_USE;
+            }
+            this->init_ioctl = id;
+            return STATUS_NOERROR;
+        default:
+            return handler::ioctl(id, in, in_len, out, out_len);
+    }
+}
+
+
+// ISO 15765 stuff (Big CAN Payloads)
+
+iso15765_handler::iso15765_handler(unsigned long baud, uint8_t id, uint32_t flags) : handler(baud) {
+    this->channel_id = id;
+    memset(this->sessions, 0x00, sizeof(this->sessions));
+    this->ext_id = (flags & CAN_29BIT_ID) != 0;
+    this->id_mask = this->ext_id ? 0x1FFFFFFF : 0x7FF;
+    this->pci = (flags & ISO15765_ADDR_TYPE) ? 1 : 0; // First data byte is the target address
+    this->hdr_len = 4 + this->pci;
+    this->sf_max = 7 - this->pci;
+    this->ff_bytes = 6 - this->pci;
+    this->ff_esc_bytes = 2 - this->pci;
+    this->cf_bytes = 7 - this->pci;
+    this->max_payload = ISO15765_MAX_PAYLOAD + 4 - this->hdr_len;
+    PCCOMM::logToSerial("Setting up ISO15765 Handler");
+    if (ch0.isFree()) {
+        ch0.lock(baud);
+        this->can_handle = &ch0;
+    } else if (ch1.isFree()) {
+        ch1.lock(baud);
+        this->can_handle = &ch1;
+    } else {
+        PCCOMM::logToSerial("NO AVALIABLE CAN HANDLERS!");
+        return;
+    }
+    this->cf_timer = this->can_handle->getTimer();
+    this->cf_timer->attach(iso15765_handler::on_cf_timer, this);
+    this->lastFrame = CAN_FRAME{};
+}
+
+// Converts an ISO 15765-2 STmin byte into microseconds
+static uint32_t stmin_to_us(uint8_t stmin) {
+    if (stmin <= 0x7F) {
+        return stmin * 1000; // 0-127ms
+    }
+    if (stmin >= 0xF1 && stmin <= 0xF9) {
+        return (stmin - 0xF0) * 100; // 100-900us
+    }
+    return 127000; // Reserved values, spec says use the longest STmin
+}
+
+// Session whose flow control filter matches a frame from the ECU
+iso15765_session* iso15765_handler::find_rx_session(CAN_FRAME* f) {
+    for (int i = 0; i < ISO15765_MAX_SESSIONS; i++) {
+        iso15765_session* s = &this->sessions[i];
+        if (s->in_use && (f->id & s->rx_mask) == s->rx_id && (f->data.bytes[0] & s->rx_ext_mask) == s->rx_ext) {
+            return s;
+        }
+    }
+    return nullptr;
+}
+
+// Session that sends on canid (And address byte with extended addressing)
+iso15765_session* iso15765_handler::find_tx_session(uint32_t canid, uint8_t ext) {
+    for (int i = 0; i < ISO15765_MAX_SESSIONS; i++) {
+        iso15765_session* s = &this->sessions[i];
+        if (s->in_use && s->tx_id == canid && (this->pci == 0 || s->tx_ext == ext)) {
+            return s;
+        }
+    }
+    return nullptr;
+}
+
+void iso15765_handler::end_session(iso15765_session* s) {
+    if (this->cf_timer != nullptr) {
+        this->cf_timer->lock();
+        s->isSending = false;
+        s->clearToSend = false;
+        this->cf_timer->unlock();
+    }
+    POOL::release(s->rx_buf);
+    POOL::release(s->tx_buffer);
+    memset(s, 0x00, sizeof(iso15765_session));
+}
+
+bool iso15765_handler::getData() {
+    if (this->can_handle == nullptr) {
+        return false;
+    }
+    this->pollTrace(this->can_handle);
+    for (int i = 0; i < ISO15765_MAX_SESSIONS; i++) {
+        iso15765_session* s = &this->sessions[i];
+        this->deliver_tx_complete(s);
+        this->check_timeouts(s);
+    }
+    if (!this->can_handle->read(&lastFrame)) {
+        return false;
+    }
+    TRACE_FRAME(TRACE_DEBUG, TRACE_ISOTP_RX_FRAME, lastFrame);
+    if (lastFrame.extended != this->ext_id) {
+        return false; // Wrong ID length for this channel
+    }
+    uint8_t pci_byte = lastFrame.data.bytes[this->pci];
+    if ((pci_byte & 0xF0) == 0x00) { // Single frame, no session state needed
+        if (pci_byte == 0 || pci_byte > this->sf_max) {
+            TRACE_ERROR(TRACE_ISOTP_SF_INVALID, 0, lastFrame.id, pci_byte, 0);
+            return false;
+        }
+        if (!this->reserve_buf(pci_byte + this->hdr_len)) { // Data size is ID (4) (+ address byte) + ISO Size
+            PCCOMM::logToSerial("ISO15765 no free buffer - Dropping SF");
+            this->counts.rx_dropped++;
+            return false;
+        }
+        this->buflen = pci_byte + this->hdr_len;
+        this->counts.rx_frames++;
+        // Copy ID
+        buf[0] = lastFrame.id >> 24;
+        buf[1] = lastFrame.id >> 16;
+        buf[2] = lastFrame.id >> 8;
+        buf[3] = lastFrame.id;
+        buf[4] = lastFrame.data.bytes[0]; // Address byte, overwritten below if not extended addressing
+        // Copy all the bytes in the payload section of the frame
+        memcpy(&buf[this->hdr_len], &lastFrame.data.bytes[this->pci + 1], pci_byte);
+        return true;
+    }
+    iso15765_session* s = this->find_rx_session(&lastFrame);
+    if (s == nullptr) {
+        return false; // No flow control filter for this ECU
+    }
+    if ((pci_byte & 0xF0) == 0x30) {
+        this->handle_flow_control(s);
+        return false;
+    }
+    return this->receive_frame(s, pci_byte);
+}
+
+// Reassembly of first and consecutive frames for one session
+bool iso15765_handler::receive_frame(iso15765_session* s, uint8_t pci_byte) {
+    uint16_t bytes_to_copy = 0;
+    uint32_t ff_dl = 0;
+    uint8_t ff_start = 0;
+    uint8_t* d = &lastFrame.data.bytes[this->pci]; // Starts at the PCI byte
+    switch(pci_byte & 0xF0) {
+        case 0x10:
+            // 12 bit FF_DL, or if that is 0, the 32 bit escape length (ISO 15765-2:2016)
+            ff_dl = (d[0] & 0x0F) << 8 | d[1];
+            ff_start = this->pci + 2;
+            if (ff_dl == 0) {
+                ff_dl = d[2] << 24 | d[3] << 16 | d[4] << 8 | d[5];
+                ff_start = this->pci + 6;
+                if (ff_dl <= ISO15765_FF_DL_MAX) { // Spec says a sender must use the 12 bit length for these
+                    PCCOMM::logToSerial("ISO15765 escaped FF_DL fits in 12 bits - Ignoring");
+                    return false;
+                }
+            }
+            TRACE_INFO(TRACE_ISOTP_FF, 0, lastFrame.id, ff_dl, 0);
+            if (ff_dl <= this->sf_max) {
+                PCCOMM::logToSerial("ISO15765 FF_DL too small - Ignoring");
+                return false;
+            }
+            if (ff_dl > this->max_payload) {
+                PCCOMM::logToSerial("ISO15765 FF_DL too large - Sending overflow");
+                this->send_flow_control(s, 0x02);
+                return false;
+            }
+            // Set buffer to real size
+            if (POOL::capacity(s->rx_buf) < ff_dl + this->hdr_len) {
+                POOL::release(s->rx_buf);
+                s->rx_buf = POOL::acquire(ff_dl + this->hdr_len);
+            }
+            if (s->rx_buf == nullptr) {
+                PCCOMM::logToSerial("ISO15765 no free buffer - Sending overflow");
+                this->counts.rx_dropped++;
+                this->send_flow_control(s, 0x02);
+                return false;
+            }
+            // First frame indication Tx back to driver
+            this->sendFF(lastFrame.id, lastFrame.data.bytes[0]);
+            s->rx_len = ff_dl + this->hdr_len; // Set the full buffer size
+            s->rx_buf[0] = lastFrame.id >> 24;
+            s->rx_buf[1] = lastFrame.id >> 16;
+            s->rx_buf[2] = lastFrame.id >> 8;
+            s->rx_buf[3] = lastFrame.id;
+            s->rx_buf[4] = lastFrame.data.bytes[0]; // Address byte, overwritten below if not extended addressing
+            // Copy all the bytes in the payload section of the frame
+            bytes_to_copy = 8 - ff_start;
+            memcpy(&s->rx_buf[this->hdr_len], &lastFrame.data.bytes[ff_start], bytes_to_copy);
+            s->rx_pos = this->hdr_len + bytes_to_copy;
+            s->rx_sn = 1;
+            s->rx_cf_ms = millis();
+            // Need to now send the FC frame
+            this->send_flow_control(s, 0x00);
+            return false;
+        case 0x20:
+            if (!s->isReceiving) {
+                return false; // No first frame for this session
+            }
+            if ((d[0] & 0x0F) != s->rx_sn) { // Lost or repeated frame, the payload can't be trusted (ISO 15765-2)
+                TRACE_ERROR(TRACE_ISOTP_CF_SN, 0, lastFrame.id, s->rx_sn, d[0] & 0x0F);
+                s->isReceiving = false;
+                POOL::release(s->rx_buf);
+                s->rx_buf = nullptr;
+                this->counts.rx_dropped++;
+                return false;
+            }
+            s->rx_sn = (s->rx_sn + 1) & 0x0F;
+            s->rx_cf_ms = millis();
+            // At most 7 bytes per frame (6 with extended addressing)
+            bytes_to_copy = min(this->cf_bytes, s->rx_len - s->rx_pos);
+            memcpy(&s->rx_buf[s->rx_pos], &d[1], bytes_to_copy);
+            s->rx_pos += bytes_to_copy;
+            if (s->rx_pos >= s->rx_len) {
+                // Copy complete, hand the buffer over to the channel rather than copying it
+                s->isReceiving = false;
+                POOL::release(this->buf);
+                this->buf = s->rx_buf;
+                this->buflen = s->rx_len;
+                s->rx_buf = nullptr;
+                this->counts.rx_frames++;
+                return true;
+            }
+            s->rx_count++;
+            // Now need to send a new FC frame!
+            if (this->rx_bs != 0 && s->rx_count == this->rx_bs) {
+                this->send_flow_control(s, 0x00);
+            }
+            return false;
+        default:
+            TRACE_ERROR(TRACE_ISOTP_BAD_FRAME, 0, lastFrame.id, pci_byte, 0);
+            return false;
+    }
+}
+
+void iso15765_handler::handle_flow_control(iso15765_session* s) {
+    if (!s->isSending) {
+        return; // Not for us
+    }
+    TRACE_DEBUG(TRACE_ISOTP_FC_RX, 0, lastFrame.data.bytes[this->pci + 1], stmin_to_us(lastFrame.data.bytes[this->pci + 2]), lastFrame.data.bytes[this->pci] & 0x0F);
+    switch (lastFrame.data.bytes[this->pci] & 0x0F) {
+        case 0x00: // Clear to send
+            this->cf_timer->lock();
+            s->tx_bs = lastFrame.data.bytes[this->pci + 1];
+            s->tx_sep_us = stmin_to_us(lastFrame.data.bytes[this->pci + 2]);
+            s->tx_packets_sent = 0;
+            s->tx_deadline = micros(); // First CF can go straight away
+            s->clearToSend = true;
+            this->cf_timer->start_us(0); // Timer works out who is due
+            this->cf_timer->unlock();
+            break;
+        case 0x01: // Wait - ECU will send another FC later, N_Bs starts again
+            s->tx_fc_ms = millis();
+            break;
+        default: // Overflow or invalid, abort the transfer
+            PCCOMM::logToSerial("ISO15765 FC overflow - Aborting Tx");
+            this->cf_timer->lock();
+            s->isSending = false;
+            s->clearToSend = false;
+            this->cf_timer->unlock();
+            this->send_tx_failed(s->tx_id, s->tx_ext);
+            break;
+    }
+}
+
+bool iso15765_handler::isReady() {
+    return this->can_handle != nullptr;
+}
+
+void iso15765_handler::destroy() {
+    if (this->can_handle != nullptr) {
+        this->cf_timer->detach();
+        this->can_handle->unlock();
+    }
+    for (int i = 0; i < ISO15765_MAX_SESSIONS; i++) {
+        this->end_session(&this->sessions[i]);
+    }
+    handler::destroy();
+}
+
+void iso15765_handler::transmit(uint8_t* args, uint16_t len) {
+    if (this->can_handle == nullptr) {
+        PCCOMM::logToSerial("ISO15765 cannot transmit - Handler is null");
+        return;
+    }
+    if (len <= this->hdr_len) {
+        PCCOMM::logToSerial("ISO15765 cannot transmit - Invalid payload size");
+        return;
+    }
+    uint32_t canid = args[0] << 24 | args[1] << 16 | args[2] << 8 | args[3];
+    uint8_t ext = args[4]; // Only used with extended addressing
+    if (len - this->hdr_len > this->max_payload) {
+        PCCOMM::logToSerial("ISO15765 cannot transmit - Invalid payload size");
+        this->send_tx_failed(canid, ext);
+        return;
+    }
+    uint16_t payload_len = len - this->hdr_len;
+    uint8_t* payload = &args[this->hdr_len];
+    bool traced = this->startTrace();
+    if (payload_len <= this->sf_max) {
+        CAN_FRAME f = {0x00};
+        f.extended = this->ext_id;
+        f.id = canid & this->id_mask;
+        f.data.byte[0] = ext; // Overwritten by the PCI if not extended addressing
+        f.data.byte[this->pci] = payload_len;
+        f.length = 8; // Always for ISO15765
+        f.priority = 4; // Send this frame now!
+        f.rtr = 0;
+        memcpy(&f.data.bytes[this->pci + 1], payload, payload_len);
+        this->can_handle->transmit(f);
+        if (traced) {
+            this->can_handle->watchTx();
+        }
+        this->counts.tx_frames++;
+        return;
+    }
+    iso15765_session* s = this->find_tx_session(canid, ext);
+    if (s == nullptr) {
+        PCCOMM::logToSerial("ISO15765 cannot transmit - No flow control filter for ID");
+        this->counts.tx_dropped++;
+        this->send_tx_failed(canid, ext);
+        return;
+    }
+    TRACE_INFO(TRACE_ISOTP_TX_MULTI, 0, canid, payload_len, 0);
+    // A payload the timer has just finished is reported first, so the driver hears about it before its buffer is reused
+    this->deliver_tx_complete(s);
+    if (s->isSending) { // The driver waits for each indication before its next payload, so this one is out of turn
+        PCCOMM::logToSerial("ISO15765 cannot transmit - Session is still sending");
+        this->counts.tx_dropped++;
+        this->send_tx_failed(canid, ext);
+        return;
+    }
+    if (POOL::capacity(s->tx_buffer) < payload_len) { // The CID now lives in the tx_frame
+        POOL::release(s->tx_buffer);
+        s->tx_buffer = POOL::acquire(payload_len);
+    }
+    if (s->tx_buffer == nullptr) {
+        PCCOMM::logToSerial("ISO15765 cannot transmit - No free buffer");
+        this->counts.tx_dropped++;
+        this->send_tx_failed(canid, ext);
+        return;
+    }
+    s->tx_frame.length = 8; // Always for 15765
+    s->tx_frame.id = canid & this->id_mask; // Set once
+    s->tx_frame.extended = this->ext_id;
+    s->tx_frame.priority = 4;
+    s->tx_frame.rtr = false;
+    s->tx_frame.data.bytes[0] = ext; // Set once, overwritten by the PCI if not extended addressing
+    s->tx_buffer_size = payload_len;
+    memcpy(&s->tx_buffer[0], payload, payload_len); // Copy the full payload buffer
+    uint8_t* d = &s->tx_frame.data.bytes[this->pci]; // Starts at the PCI byte
+    if (s->tx_buffer_size <= ISO15765_FF_DL_MAX) {
+        d[0] = 0x10 | (s->tx_buffer_size >> 8);
+        d[1] = s->tx_buffer_size; // Total number of bytes
+        memcpy(&d[2], &s->tx_buffer[0], this->ff_bytes);
+        s->tx_buffer_pos = this->ff_bytes;
+    } else { // Escape sequence, FF_DL of 0 followed by a 32 bit length
+        d[0] = 0x10;
+        d[1] = 0x00;
+        d[2] = 0x00;
+        d[3] = 0x00;
+        d[4] = s->tx_buffer_size >> 8;
+        d[5] = s->tx_buffer_size;
+        memcpy(&d[6], &s->tx_buffer[0], this->ff_esc_bytes);
+        s->tx_buffer_pos = this->ff_esc_bytes;
+    }
+    s->tx_packet_id = 0x21; // Set the PCI of the next packet
+    s->tx_packets_sent = 0;
+    s->traced = traced;
+    s->tx_fc_ms = millis();
+    s->isSending = true; // Waits for the ECU's flow control
+    this->can_handle->transmit(s->tx_frame);
+}
+
+void iso15765_handler::add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp) {
+    if (this->can_handle == nullptr) {
+        return;
+    }
+    if (!this->store_filter(id, type, mask, filter, resp)) {
+        return; // No session or mailbox filter for a filter the channel doesn't have
+    }
+    mask &= this->id_mask;
+    if (type == PROTOCOL_FILTER_FLOW && id <= ISO15765_MAX_SESSIONS) {
+        iso15765_session* s = &this->sessions[id-1];
+        s->rx_mask = mask;
+        s->rx_id = filter & mask;
+        s->tx_id = resp & this->id_mask;
+        if (this->pci != 0) {
+            s->rx_ext_mask = ext_mask;
+            s->rx_ext = ext_filter & ext_mask;
+            s->tx_ext = ext_resp;
+        }
+        s->in_use = true;
+    }
+    if (type == PROTOCOL_FILTER_BLOCK) { // Block filter, so allow everything, then we do bitwising in SW
+        this->can_handle->setFilter(0x0, 0x0, this->ext_id);
+    } else { // Pass filter, so allow into mailboxes
+        this->can_handle->setFilter(filter & mask, mask, this->ext_id);
+    }
+}
+
+void iso15765_handler::destroy_filter(uint8_t id) {
+    handler::destroy_filter(id);
+    if (id != 0 && id <= ISO15765_MAX_SESSIONS && this->sessions[id-1].in_use) {
+        this->end_session(&this->sessions[id-1]);
+    }
+}
+
+// Flow control we ask the ECU for, takes effect from the next first frame
+uint8_t iso15765_handler::ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len) {
+    uint32_t param, value;
+    switch (id) {
+        case SET_CONFIG:
+            if (in_len == 0 || in_len % 8 != 0) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            for (uint16_t i = 0; i < in_len; i += 8) {
+                memcpy(&param, &in[i], 4);
+                memcpy(&value, &in[i + 4], 4);
+                if (value > 0xFF) {
+                    return ERR_INVALID_IOCTL_VALUE;
+                }
+                if (param == ISO15765_PARAM_BS) {
+                    this->rx_bs = value;
+                } else if (param == ISO15765_PARAM_STMIN) {
+                    this->rx_stmin = value;
+                } else {
+                    return ERR_NOT_SUPPORTED;
+                }
+            }
+            return STATUS_NOERROR;
+        case GET_CONFIG:
+            if (in_len != 4) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            memcpy(&param, in, 4);
+            if (param == ISO15765_PARAM_BS) {
+                value = this->rx_bs;
+            } else if (param == ISO15765_PARAM_STMIN) {
+                value = this->rx_stmin;
+            } else {
+                return ERR_NOT_SUPPORTED;
+            }
+            memcpy(out, &value, 4);
+            *out_len = 4;
+            return STATUS_NOERROR;
+        default:
+            return handler::ioctl(id, in, in_len, out, out_len);
+    }
+}
+
+void iso15765_handler::sendFF(uint32_t canid, uint8_t ext) {
+    uint8_t ind[6];
+    ind[0] = ISO15765_FF_INDICATOR; // As this is never true in a CAN Frame, it can be used as a flag
+    ind[1] = canid >> 24;
+    ind[2] = canid >> 16;
+    ind[3] = canid >> 8;
+    ind[4] = canid;
+    ind[5] = ext; // Address byte of the ECU, only sent with extended addressing
+    PCCOMM::sendChannelData(this->channel_id, ind, 5 + this->pci);
+}
+
+void iso15765_handler::on_cf_timer(void* ctx) {
+    ((iso15765_handler*)ctx)->send_buffer();
+}
+
+// Handles sending of 0x2x multi frame payload packets for every session. Runs in the timer interrupt!
+void iso15765_handler::send_buffer() {
+    uint32_t now = micros();
+    bool ring_full = false;
+    bool sent = true;
+    // Every session that is due gets a frame per pass, so sessions with an STmin of 0
+    // take turns filling the Tx ring rather than one of them hogging it
+    while (sent && !ring_full) {
+        sent = false;
+        for (int i = 0; i < ISO15765_MAX_SESSIONS && !ring_full; i++) {
+            iso15765_session* s = &this->sessions[i];
+            if (!s->isSending || !s->clearToSend || (int32_t)(now - s->tx_deadline) < 0) {
+                continue;
+            }
+            if (this->send_cf(s, now)) {
+                sent = true;
+            } else {
+                ring_full = true;
+            }
+        }
+    }
+    // Re-arm for the earliest deadline
+    bool pending = false;
+    uint32_t wait_us = 0;
+    for (int i = 0; i < ISO15765_MAX_SESSIONS; i++) {
+        iso15765_session* s = &this->sessions[i];
+        if (!s->isSending || !s->clearToSend) {
+            continue;
+        }
+        int32_t left = (int32_t)(s->tx_deadline - now);
+        uint32_t us = left < 0 ? 0 : left;
+        if (!pending || us < wait_us) {
+            wait_us = us;
+            pending = true;
+        }
+    }
+    if (ring_full) {
+        // Tx ring is full, try again once a mailbox has had time to drain
+        wait_us = max(100, wait_us);
+    }
+    if (pending) {
+        this->cf_timer->start_us(wait_us);
+    }
+}
+
+// Sends the next consecutive frame of a session, returns false if the Tx ring is full
+bool iso15765_handler::send_cf(iso15765_session* s, uint32_t now) {
+    s->tx_frame.data.bytes[this->pci] = s->tx_packet_id;
+    int bytes_left = min(this->cf_bytes, s->tx_buffer_size - s->tx_buffer_pos);
+    memcpy(&s->tx_frame.data.bytes[this->pci + 1], &s->tx_buffer[s->tx_buffer_pos], bytes_left);
+    if (!this->can_handle->transmitFromISR(s->tx_frame)) {
+        return false;
+    }
+    s->tx_packet_id++;
+    // Reset PCI if it overflows
+    if (s->tx_packet_id == 0x30) {
+        s->tx_packet_id = 0x20;
+    }
+    s->tx_buffer_pos += bytes_left;
+    if (s->tx_buffer_pos >= s->tx_buffer_size) {
+        s->isSending = false;
+        s->clearToSend = false;
+        s->txComplete = true; // loop() lets the driver know
+        if (s->traced) {
+            s->traced = false;
+            this->can_handle->watchTx();
+        }
+        return true;
+    }
+    s->tx_deadline = now + s->tx_sep_us;
+    s->tx_packets_sent++;
+    if (s->tx_bs != 0 && s->tx_packets_sent == s->tx_bs) { // Need a clear to send packet again
+        s->tx_packets_sent = 0;
+        s->tx_fc_ms = millis();
+        s->clearToSend = false;
+    }
+    return true;
+}
+
+// N_Bs - Flow control that never came, and N_Cr - Consecutive frames that stopped coming.
+// Either way the other end has given up, so the session is free for the next transfer
+void iso15765_handler::check_timeouts(iso15765_session* s) {
+    uint32_t now = millis();
+    this->cf_timer->lock();
+    bool fc_lost = s->isSending && !s->clearToSend && now - s->tx_fc_ms > ISO15765_N_BS_MS;
+    if (fc_lost) {
+        s->isSending = false;
+    }
+    this->cf_timer->unlock();
+    if (fc_lost) {
+        TRACE_ERROR(TRACE_ISOTP_FC_TIMEOUT, 0, s->tx_id, ISO15765_N_BS_MS, 0);
+        this->counts.tx_dropped++;
+        this->send_tx_failed(s->tx_id, s->tx_ext);
+    }
+    if (s->isReceiving && now - s->rx_cf_ms > ISO15765_N_CR_MS) {
+        TRACE_ERROR(TRACE_ISOTP_CF_TIMEOUT, 0, s->rx_id, ISO15765_N_CR_MS, 0);
+        s->isReceiving = false;
+        POOL::release(s->rx_buf);
+        s->rx_buf = nullptr;
+        this->counts.rx_dropped++;
+    }
+}
+
+// Sends the indication for a payload the timer interrupt has finished, if there is one.
+// Once the interrupt is done with the Tx block it goes back to the pool, so idle sessions hold no large blocks
+void iso15765_handler::deliver_tx_complete(iso15765_session* s) {
+    this->cf_timer->lock();
+    bool complete = s->txComplete;
+    bool idle = !s->isSending;
+    s->txComplete = false;
+    this->cf_timer->unlock();
+    if (idle && s->tx_buffer != nullptr) {
+        POOL::release(s->tx_buffer);
+        s->tx_buffer = nullptr;
+    }
+    if (complete) {
+        this->send_tx_complete(s);
+    }
+}
+
+// Tells the driver the multi frame payload has been sent (With the CAN ID it was sent on)
+void iso15765_handler::send_tx_complete(iso15765_session* s) {
+    this->counts.tx_frames++;
+    uint8_t ind[6];
+    ind[0] = ISO15765_SD_INDICATOR;
+    ind[1] = s->tx_id >> 24;
+    ind[2] = s->tx_id >> 16;
+    ind[3] = s->tx_id >> 8;
+    ind[4] = s->tx_id;
+    ind[5] = s->tx_ext; // Only sent with extended addressing
+    PCCOMM::sendChannelData(this->channel_id, ind, 5 + this->pci); // Counts against the driver's RX credits
+}
+
+// Tells the driver a multi frame payload was not sent, so it can send the next one
+void iso15765_handler::send_tx_failed(uint32_t canid, uint8_t ext) {
+    uint8_t ind[6];
+    ind[0] = ISO15765_TX_FAIL_INDICATOR;
+    ind[1] = canid >> 24;
+    ind[2] = canid >> 16;
+    ind[3] = canid >> 8;
+    ind[4] = canid;
+    ind[5] = ext; // Only sent with extended addressing
+    PCCOMM::sendChannelData(this->channel_id, ind, 5 + this->pci);
+}
+
+// A payload sent in parts (CMD_CHANNEL_DATA_PART) never made it to transmit()
+void iso15765_handler::transmitFailed() {
+    this->counts.tx_dropped++;
+    this->send_tx_failed(0, 0);
+}
+
+// Flow status - 0x00 = Clear to send, 0x01 = Wait, 0x02 = Overflow
+void iso15765_handler::send_flow_control(iso15765_session* s, uint8_t flow_status) {
+    s->rx_count = 0; // Reset
+    TRACE_DEBUG(TRACE_ISOTP_FC_TX, 0, s->tx_id, this->rx_bs, flow_status);
+    CAN_FRAME fc = {0x00};
+    fc.id = s->tx_id;
+    fc.extended = this->ext_id;
+    fc.length = 8;
+    fc.priority = 4;
+    fc.data.bytes[0] = s->tx_ext; // Overwritten by the PCI if not extended addressing
+    fc.data.bytes[this->pci] = 0x30 | flow_status; // Tell ECU if its clear to send!
+    fc.data.bytes[this->pci + 1] = this->rx_bs; // Block size
+    fc.data.bytes[this->pci + 2] = this->rx_stmin; // Min seperation time
+    s->isReceiving = flow_status == 0x00;
+    this->can_handle->transmit(fc);
+}
@@ -1,129 +1,258 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-
-#ifndef HANDLERS_H_
-#define HANDLERS_H_
-
-#include "can_handler.h"
-
-#define MAX_FILTERS_PER_HANDLER 10
-#define ISO15765_FF_INDICATOR 0xFF // ISO15765 First frame indication
-#define ISO15765_SD_INDICATOR 0xAA // ISO15765 Indication of complete transmission
-
-struct handler_filter {
-    uint8_t id;
-    uint8_t type;
-    uint32_t mask;
-    uint32_t filter;
-    uint32_t flow;
-};
-
-/**
- * Handlers for various protocol - Base class
- */
-class handler {
-public:
-    handler(unsigned long baud);
-    virtual bool update();
-    virtual void destroy();
-    virtual void transmit(uint8_t* args, uint16_t len) = 0;
-    virtual void add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp);
-    virtual void destroy_filter(uint8_t id);
-    uint8_t* getBuf();
-    uint8_t getBufSize();
-private:
-    handler_filter* filters[MAX_FILTERS_PER_HANDLER] = { nullptr };
-protected:
-    uint32_t getFilterResponseID(uint32_t rxID);
-    uint8_t* buf;
-    uint8_t buflen;
-    virtual bool getData() = 0;
-};
-
-/**
- * CAN protocol handler
- */
-class can_handler : public handler {
-public:
-    can_handler(unsigned long baud);
-    bool getData();
-    void destroy();
-    void transmit(uint8_t* args, uint16_t len);
-    void add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp);
-private:
-    CAN_FRAME lastFrame;
-    canbus_handler *can_handle;
-};
-
-/**
- * ISO9141 handler for K-Line
- */
-class iso9141_handler : public handler {
-public:
-    iso9141_handler(unsigned long baud);
-    bool getData();
-    void destroy();
-    void transmit(uint8_t* args, uint16_t len);
-    void add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp);
-private:
-    can_handler *can_handle;
-};
-
-
-#define MAX_BLOCK_SIZE_RX 8
-
-/**
- * ISO15765 handler for Large CAN payloads
- */
-class iso15765_handler : public handler {
-public:
-    iso15765_handler(unsigned long baud, uint8_t chanid);
-    bool getData();
-    void destroy();
-    void transmit(uint8_t* args, uint16_t len);
-    void add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp);
-    void sendFF(uint32_t canid);
-private:
-    uint8_t channel_id; // Used for FF indications
-    uint16_t bufWritePos = 0;
-    CAN_FRAME lastFrame;
-    canbus_handler *can_handle;
-
-    // For ISO 15765 Sending
-    unsigned long tx_last_send_time = millis();
-    bool isSending = false;
-    bool clearToSend = false;
-    bool isReceiving = false;
-    uint8_t rx_count; // When asking to generate a new FC message
-    uint8_t* tx_buffer;
-    uint8_t  tx_buffer_size;
-    uint8_t  tx_buffer_pos;
-    uint8_t  tx_packet_id;
-    uint8_t  tx_packets_sent;
-    uint8_t  tx_bs; // Block size
-    uint8_t  tx_sep; // Seperation time
-    CAN_FRAME tx_frame;
-    void send_buffer();
-    void send_flow_control();
-};
-
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef HANDLERS_H_
+#define HANDLERS_H_
+
+#include "can_handler.h"
+#include "kline_port.h"
+#include "block_pool.h"
+#include "stats.h"
+
+#define MAX_FILTERS_PER_HANDLER 10
+#define ISO15765_FF_INDICATOR 0xFF // ISO15765 First frame indication
+#define ISO15765_SD_INDICATOR 0xAA // ISO15765 Indication of complete transmission
+#define ISO15765_TX_FAIL_INDICATOR 0xAB // ISO15765 multi frame payload was dropped or aborted
+#define ISO15765_MAX_PAYLOAD  4124 // Largest payload the driver can hold (PASSTHRU_MSG minus 4 byte CAN ID)
+#define ISO15765_FF_DL_MAX    4095 // Largest length that fits the 12 bit FF_DL, anything bigger uses the escape
+
+struct handler_filter {
+    uint8_t id;
+    uint8_t type;
+    uint32_t mask;
+    uint32_t filter;
+    uint32_t flow;
+};
+
+/**
+ * Handlers for various protocol - Base class
+ */
+class handler {
+public:
+    handler(unsigned long baud);
+    virtual bool update();
+    virtual void destroy();
+    virtual void transmit(uint8_t* args, uint16_t len) = 0;
+    virtual void add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp);
+    virtual void destroy_filter(uint8_t id);
+    virtual uint8_t ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+    virtual void transmitFailed() {} // Payload sent in parts never reached transmit()
+    uint8_t* getBuf();
+    uint16_t getBufSize();
+    void getStats(channel_stats* stats);
+    void setTrace(uint8_t channel_id, uint16_t trace_id, uint32_t usb_us);
+    void setRxCredits(uint16_t credits);
+    virtual bool txCredit(uint16_t* limit);
+    virtual bool isReady();
+    void transmitPeriodic(uint8_t* args, uint16_t len);
+    void dropRx();
+protected:
+    channel_stats counts = {0x00}; // Frames (Or payloads) in each direction
+    uint16_t rx_credits; // Data messages the driver has room for, set before each update()
+    uint16_t tx_records = 0; // Records the driver has sent, for handlers that limit it (See CMD_CREDIT)
+    // CMD_TX_TRACE - Only CAN based handlers time their messages to the bus
+    bool startTrace();
+    void pollTrace(canbus_handler* c);
+    uint8_t trace_channel = 0;
+    uint16_t trace_id = 0; // For the next transmit() only
+    uint32_t trace_usb_us = 0;
+    uint16_t trace_pending = 0; // Transmitting, waiting on the bus
+    uint32_t trace_tx_us = 0;
+    handler_filter* filters[MAX_FILTERS_PER_HANDLER] = { nullptr };
+    uint32_t getFilterResponseID(uint32_t rxID);
+    bool store_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp);
+    bool passesFilters(uint32_t canid);
+    bool reserve_buf(uint16_t size);
+    uint8_t* buf = nullptr; // From POOL
+    uint16_t buflen;
+    virtual bool getData() = 0;
+};
+
+// Raw CAN batch records, packed back to back in CMD_CHANNEL_DATA (Both directions)
+// 0   - Flags (CAN_RECORD_*) | DLC
+// 1-4 - CAN ID (Big endian, same as J2534)
+// 5-8 - Rx timestamp in us (Device to PC only)
+// ..  - Data
+#define CAN_RECORD_EXT     0x80 // 29 bit ID
+#define CAN_RECORD_RTR     0x40 // Remote frame
+#define CAN_RECORD_STATUS  0x20 // Not a frame - Data is frames dropped by the Rx ring, then frames overwritten in mailboxes since the last status (32bit each)
+#define CAN_RECORD_DLC     0x0F
+#define CAN_RX_RECORD_HDR  9
+#define CAN_TX_RECORD_HDR  5
+#define CAN_BATCH_SIZE     511 // Fits in a single CMD_CHANNEL_DATA with the channel ID
+#define CAN_BATCH_LATENCY_US 1000 // Longest a received frame waits for its batch to fill up
+#define CAN_TX_WAIT_US     2000 // Longest to wait for room in the Tx ring before dropping a frame
+
+/**
+ * CAN protocol handler
+ */
+class can_handler : public handler {
+public:
+    can_handler(unsigned long baud, uint32_t flags);
+    bool getData();
+    void destroy();
+    void transmit(uint8_t* args, uint16_t len);
+    void add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp);
+    uint8_t ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+    bool txCredit(uint16_t* limit);
+    bool isReady();
+private:
+    bool ext_id; // 29 bit CAN IDs (CAN_29BIT_ID)
+    bool monitor = false; // Listen only, everything on the bus (MACCHINA_MONITOR_MODE)
+    uint32_t reported_dropped = 0;
+    uint32_t reported_overwritten = 0;
+    void set_monitor(bool state);
+    void add_hw_filter(uint8_t type, uint32_t mask, uint32_t filter);
+    uint32_t bit_ns; // Length of a bit, for converting CAN timer stamps
+    uint32_t batch_start; // micros() when the first record went into the batch
+    bool batch_sent = false;
+    uint8_t batch[CAN_BATCH_SIZE];
+    uint16_t tx_dropped = 0;
+    CAN_FRAME lastFrame;
+    canbus_handler *can_handle = nullptr;
+};
+
+// K-Line messages, one per CMD_CHANNEL_DATA
+// 0-3 - Rx timestamp in us (Device to PC only)
+// ..  - Message, without its checksum
+#define KLINE_RX_RECORD_HDR 4
+
+/**
+ * ISO9141 / ISO14230 handler for K-Line
+ */
+class iso9141_handler : public handler {
+public:
+    iso9141_handler(unsigned long baud, uint8_t id, uint32_t flags, bool iso14230);
+    bool getData();
+    void destroy();
+    void transmit(uint8_t* args, uint16_t len);
+    uint8_t ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+    bool isReady();
+private:
+    kline_handler* kline_handle = nullptr;
+    kline_msg rx_msg;
+    uint8_t tx_pending[KLINE_MAX_MSG]; // Waiting for the engine to finish the last message
+    uint16_t tx_pending_len = 0;
+    uint32_t reported_errors = 0;
+    uint8_t channel_id;
+    uint32_t init_ioctl = 0; // FIVE_BAUD_INIT or FAST_INIT whilst one is running
+    kline_init_result init_res;
+};
+
+
+// Config parameter IDs (Same as J2534 SET_CONFIG). Sent to the ECU in our flow control frames
+#define ISO15765_PARAM_BS    0x1E // Consecutive frames between flow control frames, 0 for none
+#define ISO15765_PARAM_STMIN 0x1F // Separation time byte, same encoding as the frame
+#define ISO15765_MAX_SESSIONS MAX_FILTERS_PER_HANDLER // One per flow control filter
+#define ISO15765_N_BS_MS     1000 // Longest wait for a flow control frame (ISO 15765-2 N_Bs)
+#define ISO15765_N_CR_MS     1000 // Longest wait for the next consecutive frame (ISO 15765-2 N_Cr)
+
+/**
+ * State for one ISO15765 conversation, keyed by the flow control filter
+ * (ECU's Rx ID and our Tx ID). Several ECUs can segment in parallel on one channel
+ */
+struct iso15765_session {
+    bool in_use;
+    uint32_t rx_mask;
+    uint32_t rx_id; // ID the ECU sends on
+    uint32_t tx_id; // ID we send on (Flow control and our own payloads)
+    uint8_t rx_ext_mask; // Extended addressing only - Address byte of the ECU's frames
+    uint8_t rx_ext;
+    uint8_t tx_ext; // Extended addressing only - Address byte of our frames
+
+    // Receiving
+    uint8_t* rx_buf; // From POOL. 4 byte CAN ID (+ address byte) + payload
+    uint16_t rx_len;
+    uint16_t rx_pos;
+    uint8_t rx_count; // When asking to generate a new FC message
+    uint8_t rx_sn; // Sequence number the next consecutive frame should have
+    uint32_t rx_cf_ms; // millis() of the last first or consecutive frame (N_Cr)
+    bool isReceiving;
+
+    // Sending - Consecutive frames are sent from the timer interrupt
+    uint8_t* tx_buffer; // From POOL, kept until the session ends as the timer may still be sending from it
+    uint16_t tx_buffer_size;
+    volatile uint16_t tx_buffer_pos;
+    volatile uint8_t tx_packet_id;
+    volatile uint8_t tx_packets_sent;
+    volatile bool isSending;
+    volatile bool clearToSend;
+    volatile bool txComplete; // Set by the timer interrupt, send indication from loop()
+    volatile uint32_t tx_deadline; // micros() when the next CF is due
+    volatile uint32_t tx_fc_ms; // millis() flow control has been awaited since (N_Bs)
+    bool traced; // Time the last CF to the bus (CMD_TX_TRACE)
+    uint8_t tx_bs; // Block size
+    uint32_t tx_sep_us; // Seperation time (Decoded from STmin)
+    CAN_FRAME tx_frame;
+};
+
+/**
+ * ISO15765 handler for Large CAN payloads
+ */
+class iso15765_handler : public handler {
+public:
+    iso15765_handler(unsigned long baud, uint8_t chanid, uint32_t flags);
+    bool getData();
+    void destroy();
+    void transmit(uint8_t* args, uint16_t len);
+    void add_filter(uint8_t id, uint8_t type, uint32_t mask, uint32_t filter, uint32_t resp, uint8_t ext_mask, uint8_t ext_filter, uint8_t ext_resp);
+    void destroy_filter(uint8_t id);
+    uint8_t ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len);
+    void transmitFailed();
+    bool isReady();
+    void sendFF(uint32_t canid, uint8_t ext);
+    static void on_cf_timer(void* ctx);
+private:
+    uint8_t channel_id; // Used for FF indications
+    CAN_FRAME lastFrame;
+    canbus_handler *can_handle = nullptr;
+    hw_timer* cf_timer = nullptr; // Shared by all sessions, always armed for the earliest deadline
+
+    // Worked out once from the connect flags, so the frame paths never have to check the addressing mode
+    bool ext_id; // 29 bit CAN IDs (CAN_29BIT_ID)
+    uint32_t id_mask;
+    uint8_t pci; // Offset of the PCI byte, 1 with extended addressing (ISO15765_ADDR_TYPE)
+    uint8_t hdr_len; // CAN ID (+ address byte) at the start of driver payloads
+    uint8_t sf_max; // Payload bytes in a single frame
+    uint8_t ff_bytes; // Payload bytes in a first frame
+    uint8_t ff_esc_bytes; // Payload bytes in an escaped (> 4095 bytes) first frame
+    uint8_t cf_bytes; // Payload bytes in a consecutive frame
+    uint16_t max_payload;
+    uint8_t rx_bs = 0; // ISO15765_PARAM_BS
+    uint8_t rx_stmin = 0; // ISO15765_PARAM_STMIN
+    iso15765_session sessions[ISO15765_MAX_SESSIONS];
+
+    iso15765_session* find_rx_session(CAN_FRAME* f);
+    iso15765_session* find_tx_session(uint32_t canid, uint8_t ext);
+    void end_session(iso15765_session* s);
+    bool receive_frame(iso15765_session* s, uint8_t pci_byte);
+    void handle_flow_control(iso15765_session* s);
+    void send_buffer();
+    bool send_cf(iso15765_session* s, uint32_t now);
+    void send_flow_control(iso15765_session* s, uint8_t flow_status);
+    void send_tx_complete(iso15765_session* s);
+    void deliver_tx_complete(iso15765_session* s);
+    void send_tx_failed(uint32_t canid, uint8_t ext);
+    void check_timeouts(iso15765_session* s);
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,117 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "hw_timer.h"
+
+hw_timer::hw_timer(Tc* tc, uint32_t channel, IRQn_Type irq, uint32_t periph_id) {
+    this->tc = tc;
+    this->channel = channel;
+    this->irq = irq;
+    this->periph_id = periph_id;
+}
+
+// Sets up the TC channel as a one-shot counter (Stops itself on RC compare)
+void hw_timer::configure() {
+    pmc_set_writeprotect(false);
+    pmc_enable_periph_clk(this->periph_id);
+    TC_Configure(this->tc, this->channel, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_CPCSTOP | TC_CMR_TCCLKS_TIMER_CLOCK1);
+    this->tc->TC_CHANNEL[this->channel].TC_IER = TC_IER_CPCS;
+    this->tc->TC_CHANNEL[this->channel].TC_IDR = ~TC_IER_CPCS;
+    // Same as CAN (12). Callbacks call CANRaw::sendFrame, which only masks the CAN IRQ, so
+    // they must not preempt the CAN ISR whilst it refills a Tx mailbox
+    NVIC_SetPriority(this->irq, 12);
+    NVIC_ClearPendingIRQ(this->irq);
+    NVIC_EnableIRQ(this->irq);
+    this->configured = true;
+}
+
+void hw_timer::attach(hw_timer_callback cb, void* ctx) {
+    if (!this->configured) {
+        this->configure();
+    }
+    this->lock();
+    this->cb = cb;
+    this->ctx = ctx;
+    this->unlock();
+}
+
+void hw_timer::detach() {
+    this->stop();
+    this->lock();
+    this->cb = nullptr;
+    this->ctx = nullptr;
+    this->unlock();
+}
+
+// Fires the callback once after 'us' microseconds. Restarts the timer if already running
+void hw_timer::start_us(uint32_t us) {
+    if (!this->configured) {
+        return;
+    }
+    uint32_t ticks = us * HW_TIMER_TICKS_PER_US;
+    if (ticks == 0) {
+        ticks = 1; // RC of 0 never matches
+    }
+    TC_Stop(this->tc, this->channel);
+    TC_SetRC(this->tc, this->channel, ticks);
+    TC_Start(this->tc, this->channel);
+}
+
+void hw_timer::stop() {
+    if (!this->configured) {
+        return;
+    }
+    TC_Stop(this->tc, this->channel);
+    TC_GetStatus(this->tc, this->channel); // Clear any pending compare
+    NVIC_ClearPendingIRQ(this->irq);
+}
+
+// Stops the callback from running whilst loop() modifies state it shares
+void hw_timer::lock() {
+    NVIC_DisableIRQ(this->irq);
+}
+
+void hw_timer::unlock() {
+    NVIC_EnableIRQ(this->irq);
+}
+
+void hw_timer::handleInterrupt() {
+    TC_GetStatus(this->tc, this->channel); // Reading SR acknowledges the interrupt
+    hw_timer_callback f = this->cb;
+    if (f != nullptr) {
+        f(this->ctx);
+    }
+}
+
+void TC3_Handler(void) {
+    hw_timer0.handleInterrupt();
+}
+
+void TC4_Handler(void) {
+    hw_timer1.handleInterrupt();
+}
+
+void TC5_Handler(void) {
+    hw_timer2.handleInterrupt();
+}
+
+hw_timer hw_timer0 = hw_timer(TC1, 0, TC3_IRQn, ID_TC3);
+hw_timer hw_timer1 = hw_timer(TC1, 1, TC4_IRQn, ID_TC4);
+hw_timer hw_timer2 = hw_timer(TC1, 2, TC5_IRQn, ID_TC5);
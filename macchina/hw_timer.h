@@ -0,0 +1,62 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef HW_TIMER_H
+#define HW_TIMER_H
+
+#include <Arduino.h>
+
+// TIMER_CLOCK1 runs at MCK/2, so 42 ticks per microsecond on the SAM3X
+#define HW_TIMER_TICKS_PER_US (VARIANT_MCK / 2 / 1000000)
+
+typedef void (*hw_timer_callback)(void* ctx);
+
+/**
+ * One-shot microsecond timer backed by a SAM3X timer-counter channel.
+ * The callback runs in interrupt context, so it must not log or talk to the PC
+ */
+class hw_timer {
+public:
+    hw_timer(Tc* tc, uint32_t channel, IRQn_Type irq, uint32_t periph_id);
+    void attach(hw_timer_callback cb, void* ctx);
+    void detach();
+    void start_us(uint32_t us);
+    void stop();
+    void lock();
+    void unlock();
+    void handleInterrupt();
+private:
+    void configure();
+    Tc* tc;
+    uint32_t channel;
+    IRQn_Type irq;
+    uint32_t periph_id;
+    bool configured = false;
+    volatile hw_timer_callback cb = nullptr;
+    void* volatile ctx = nullptr;
+};
+
+extern hw_timer hw_timer0; // TC1 channel 0 - Consecutive frames on CAN0
+extern hw_timer hw_timer1; // TC1 channel 1 - Consecutive frames on CAN1
+extern hw_timer hw_timer2; // TC1 channel 2 - K-Line byte timing
+
+#endif
@@ -0,0 +1,557 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "kline_handler.h"
+#include <string.h>
+
+// Same order as params[], J2534 defaults
+static const uint8_t param_ids[KLINE_PARAM_COUNT] = {
+    KLINE_P1_MAX, KLINE_P3_MIN, KLINE_P4_MIN, KLINE_W1, KLINE_W2, KLINE_W3, KLINE_W4, KLINE_W5, KLINE_TIDLE, KLINE_TINIL, KLINE_TWUP,
+    KLINE_FIVE_BAUD_MOD
+};
+static const uint32_t param_defaults[KLINE_PARAM_COUNT] = {
+    40, 110, 10, 300, 20, 20, 50, 300, 300, 25, 50, KLINE_5BAUD_ISO9141_2
+};
+
+static int param_index(uint8_t id) {
+    for (int i = 0; i < KLINE_PARAM_COUNT; i++) {
+        if (param_ids[i] == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+kline_handler::kline_handler(kline_port* port) {
+    this->port = port;
+    memcpy(this->params, param_defaults, sizeof(this->params));
+}
+
+// Takes the K-Line for a channel. Checksums are added on Tx and checked (Then removed) on Rx
+bool kline_handler::claim(uint32_t baud, bool iso14230, bool checksum) {
+    if (this->inUse || baud == 0) {
+        return false;
+    }
+    this->iso14230 = iso14230;
+    this->checksum = checksum;
+    this->byte_us = 10000000UL / baud; // Start + 8 data + stop
+    memcpy(this->params, param_defaults, sizeof(this->params));
+    this->rx_len = 0;
+    this->rx_head = 0;
+    this->rx_tail = 0;
+    this->tx_len = 0;
+    this->state = kline_state::IDLE;
+    this->errors = 0;
+    this->init = kline_init::NONE;
+    this->port->begin(baud);
+    this->last_bus = this->port->micros();
+    this->inUse = true;
+    this->port->schedule(KLINE_TICK_US);
+    return true;
+}
+
+void kline_handler::release() {
+    this->inUse = false;
+    this->port->cancel();
+    if (this->init != kline_init::NONE) {
+        this->port->release_line();
+        this->init = kline_init::NONE;
+    }
+    this->port->end();
+    this->tx_len = 0;
+    this->state = kline_state::IDLE;
+}
+
+bool kline_handler::isFree() {
+    return !this->inUse;
+}
+
+bool kline_handler::setParam(uint8_t id, uint32_t value) {
+    int i = param_index(id);
+    if (i < 0) {
+        return false;
+    }
+    this->params[i] = value;
+    return true;
+}
+
+bool kline_handler::getParam(uint8_t id, uint32_t* value) {
+    int i = param_index(id);
+    if (i < 0) {
+        return false;
+    }
+    *value = this->params[i];
+    return true;
+}
+
+// Parameter as microseconds. P timings are in 0.5ms steps, W and T timings in 1ms steps
+uint32_t kline_handler::param_us(uint8_t id) {
+    uint32_t v = 0;
+    this->getParam(id, &v);
+    if (id == KLINE_P1_MAX || id == KLINE_P3_MIN || id == KLINE_P4_MIN) {
+        return v * 500;
+    }
+    if (id == KLINE_FIVE_BAUD_MOD) {
+        return v;
+    }
+    return v * 1000;
+}
+
+// Queues a message to go out once the bus has been idle for P3. False if one is still going out
+bool kline_handler::send(uint8_t* data, uint16_t len) {
+    if (!this->inUse || this->init != kline_init::NONE || this->tx_len != 0 || len == 0 || len > KLINE_MAX_MSG - 1) {
+        return false;
+    }
+    memcpy(this->tx_buf, data, len);
+    if (this->checksum) {
+        uint8_t cs = 0;
+        for (uint16_t i = 0; i < len; i++) {
+            cs += data[i];
+        }
+        this->tx_buf[len++] = cs;
+    }
+    this->tx_len = len; // tick() owns tx_buf from here
+    return true;
+}
+
+// Collects the oldest complete Rx message
+bool kline_handler::read(kline_msg* msg) {
+    if (this->rx_tail == this->rx_head) {
+        return false;
+    }
+    kline_msg* m = &this->rx_queue[this->rx_tail];
+    msg->timestamp = m->timestamp;
+    msg->len = m->len;
+    memcpy(msg->data, m->data, m->len);
+    this->rx_tail = (this->rx_tail + 1) % KLINE_RX_QUEUE;
+    return true;
+}
+
+uint32_t kline_handler::getErrors() {
+    return this->errors;
+}
+
+// ISO 14230 messages say how long they are, so they can be finished without waiting for P1 to run out
+uint16_t kline_handler::expected_len() {
+    uint8_t fmt = this->rx_buf[0];
+    uint16_t hdr = (fmt & 0xC0) ? 3 : 1; // Target and source address bytes
+    uint16_t len = fmt & 0x3F;
+    if (len == 0) { // Separate length byte
+        if (this->rx_len <= hdr) {
+            return 0;
+        }
+        len = this->rx_buf[hdr];
+        hdr++;
+    }
+    return hdr + len + (this->checksum ? 1 : 0);
+}
+
+void kline_handler::rx_byte(uint8_t b, uint32_t now) {
+    if (this->rx_len == 0) {
+        this->rx_start = now;
+    }
+    if (this->rx_len < KLINE_MAX_MSG) {
+        this->rx_buf[this->rx_len++] = b;
+    } else {
+        this->errors++; // Too long, drop the extra bytes
+    }
+    this->last_rx = now;
+    if (this->iso14230) {
+        uint16_t want = this->expected_len();
+        if (want != 0 && this->rx_len >= want) {
+            this->end_rx();
+        }
+    }
+}
+
+// Whole message received. Check it and pass it to loop()
+void kline_handler::end_rx() {
+    uint16_t len = this->rx_len;
+    this->rx_len = 0;
+    if (this->checksum) {
+        uint8_t cs = 0;
+        for (uint16_t i = 0; i + 1 < len; i++) {
+            cs += this->rx_buf[i];
+        }
+        if (len < 2 || cs != this->rx_buf[len - 1]) {
+            this->errors++;
+            return;
+        }
+        len--; // Checksum is not passed on
+    }
+    if (this->init == kline_init::FAST_RESP) { // Goes back with the IOCTL rather than to the channel
+        memcpy(this->init_res.data, this->rx_buf, len);
+        this->init_res.len = len;
+        this->end_init(KLINE_INIT_OK, this->last_rx);
+        return;
+    }
+    uint8_t next = (this->rx_head + 1) % KLINE_RX_QUEUE;
+    if (next == this->rx_tail) {
+        this->errors++; // loop() isn't keeping up
+        return;
+    }
+    kline_msg* m = &this->rx_queue[this->rx_head];
+    m->timestamp = this->rx_start;
+    m->len = len;
+    memcpy(m->data, this->rx_buf, len);
+    this->rx_head = next;
+}
+
+// Starts a 5 baud init with the ECU address. initResult() gets the key bytes once its done
+bool kline_handler::startFiveBaud(uint8_t addr) {
+    this->init_addr = addr;
+    this->fast_init = false;
+    return this->start_init(kline_init::WAIT_IDLE);
+}
+
+// Starts a fast init (Wake up pattern then 'req'). initResult() gets the ECU's response once its done
+bool kline_handler::startFastInit(uint8_t* req, uint16_t len) {
+    if (this->init != kline_init::NONE || len == 0 || len > KLINE_MAX_MSG - 1) {
+        return false;
+    }
+    // Borrow the Tx buffer, send() refuses to touch it whilst an init runs
+    if (this->tx_len != 0) {
+        return false;
+    }
+    memcpy(this->tx_buf, req, len);
+    if (this->checksum) {
+        uint8_t cs = 0;
+        for (uint16_t i = 0; i < len; i++) {
+            cs += req[i];
+        }
+        this->tx_buf[len++] = cs;
+    }
+    this->init_res.len = 0;
+    this->fast_init = true;
+    if (!this->start_init(kline_init::WAIT_IDLE)) {
+        return false;
+    }
+    this->tx_len = len;
+    return true;
+}
+
+bool kline_handler::start_init(kline_init first) {
+    if (!this->inUse || this->init != kline_init::NONE || this->tx_len != 0) {
+        return false;
+    }
+    this->init_res.status = KLINE_INIT_OK;
+    this->init_res.len = 0;
+    this->init_mark = this->port->micros();
+    this->init = first; // tick() takes it from here
+    return true;
+}
+
+// Collects the result of an init. False whilst it is still running
+bool kline_handler::initResult(kline_init_result* res) {
+    if (this->init != kline_init::DONE) {
+        return false;
+    }
+    res->status = this->init_res.status;
+    res->len = this->init_res.len;
+    memcpy(res->data, this->init_res.data, this->init_res.len);
+    this->init = kline_init::NONE;
+    return true;
+}
+
+void kline_handler::end_init(uint8_t status, uint32_t now) {
+    this->port->release_line();
+    this->init_res.status = status;
+    if (status != KLINE_INIT_OK && !this->fast_init) {
+        this->init_res.len = 0;
+    }
+    this->tx_len = 0;
+    this->rx_len = 0;
+    this->state = kline_state::IDLE;
+    this->last_bus = now; // P3 before the first request
+    this->init = kline_init::DONE;
+}
+
+// A byte from the ECU (Or our own echo) during an init
+void kline_handler::init_byte(uint8_t b, uint32_t now) {
+    uint8_t mode = this->params[param_index(KLINE_FIVE_BAUD_MOD)];
+    bool tester_inverts = mode == KLINE_5BAUD_ISO9141_2 || mode == KLINE_5BAUD_INV_KB2;
+    bool ecu_inverts = mode == KLINE_5BAUD_ISO9141_2 || mode == KLINE_5BAUD_INV_ADDR;
+    this->last_bus = now;
+    switch (this->init) {
+        case kline_init::SYNC:
+            if (b != 0x55) {
+                this->end_init(KLINE_INIT_NO_SYNC, now);
+                return;
+            }
+            this->init = kline_init::KB1;
+            break;
+        case kline_init::KB1:
+            this->init_res.data[0] = b;
+            this->init_res.len = 1;
+            this->init = kline_init::KB2;
+            break;
+        case kline_init::KB2:
+            this->init_res.data[1] = b;
+            this->init_res.len = 2;
+            if (tester_inverts) {
+                this->init_echo = false;
+                this->init = kline_init::KB2_INV;
+            } else if (ecu_inverts) {
+                this->init = kline_init::ADDR_INV;
+            } else {
+                this->end_init(KLINE_INIT_OK, now);
+                return;
+            }
+            break;
+        case kline_init::KB2_INV:
+            if (!this->init_echo || b != (uint8_t)~this->init_res.data[1]) {
+                this->end_init(KLINE_INIT_BAD_ECHO, now);
+                return;
+            }
+            if (!ecu_inverts) {
+                this->end_init(KLINE_INIT_OK, now);
+                return;
+            }
+            this->init = kline_init::ADDR_INV;
+            break;
+        case kline_init::ADDR_INV:
+            this->end_init(b == (uint8_t)~this->init_addr ? KLINE_INIT_OK : KLINE_INIT_NO_ADDR_INV, now);
+            return;
+        case kline_init::FAST_TX:
+            if (!this->init_echo || b != this->tx_buf[this->tx_pos]) {
+                this->end_init(KLINE_INIT_BAD_ECHO, now);
+                return;
+            }
+            this->init_echo = false;
+            this->tx_pos++;
+            if (this->tx_pos == this->tx_len) {
+                this->rx_len = 0;
+                this->init = kline_init::FAST_RESP;
+            }
+            break;
+        case kline_init::FAST_RESP:
+            this->rx_byte(b, now);
+            return; // end_rx() finishes the init
+        default: // Our own 5 baud bits or wake up pattern, or line noise whilst idle
+            return;
+    }
+    this->init_mark = now;
+}
+
+// High part of the fast init wake up pattern
+uint32_t kline_handler::wake_high_us() {
+    uint32_t twup = this->param_us(KLINE_TWUP);
+    uint32_t tinil = this->param_us(KLINE_TINIL);
+    return twup > tinil ? twup - tinil : 0;
+}
+
+// Wake up sequences. Each step schedules the next tick for exactly when it ends
+void kline_handler::init_tick(uint32_t now) {
+    int c;
+    while ((c = this->port->read()) >= 0 && this->init != kline_init::DONE) {
+        this->init_byte((uint8_t)c, now);
+    }
+    uint32_t elapsed = now - this->init_mark;
+    uint32_t wait = 0; // How long this step lasts
+    switch (this->init) {
+        case kline_init::WAIT_IDLE:
+            wait = this->param_us(this->fast_init ? KLINE_TIDLE : KLINE_W5);
+            elapsed = now - this->last_bus;
+            if (elapsed >= wait) {
+                this->port->drive(false); // Start bit, or TiniL
+                this->init_mark = now;
+                this->init_bit = 0;
+                this->init = this->fast_init ? kline_init::WAKE_LOW : kline_init::ADDR_BITS;
+                this->port->schedule(this->fast_init ? this->param_us(KLINE_TINIL) : KLINE_5BAUD_BIT_US);
+                return;
+            }
+            break;
+        case kline_init::ADDR_BITS:
+            wait = KLINE_5BAUD_BIT_US;
+            if (elapsed >= wait) {
+                this->init_bit++;
+                this->init_mark += KLINE_5BAUD_BIT_US; // Keeps the bits from drifting if a tick runs late
+                if (this->init_bit <= 8) { // LSB first
+                    this->port->drive((this->init_addr >> (this->init_bit - 1)) & 0x01);
+                } else if (this->init_bit == 9) { // Stop bit, the line idles high anyway
+                    this->port->release_line();
+                } else { // Address sent, W1 runs from here
+                    while (this->port->read() >= 0) {} // Whatever the UART made of our bits
+                    this->init = kline_init::SYNC;
+                    this->init_mark = now;
+                    this->port->schedule(KLINE_TICK_US);
+                    return;
+                }
+                elapsed = now - this->init_mark;
+            }
+            break;
+        case kline_init::SYNC:
+            wait = this->param_us(KLINE_W1);
+            if (elapsed > wait) {
+                this->end_init(KLINE_INIT_NO_SYNC, now);
+            }
+            break;
+        case kline_init::KB1:
+            wait = this->param_us(KLINE_W2);
+            if (elapsed > wait) {
+                this->end_init(KLINE_INIT_NO_KEYBYTES, now);
+            }
+            break;
+        case kline_init::KB2:
+            wait = this->param_us(KLINE_W3);
+            if (elapsed > wait) {
+                this->end_init(KLINE_INIT_NO_KEYBYTES, now);
+            }
+            break;
+        case kline_init::KB2_INV:
+            if (!this->init_echo) {
+                wait = this->param_us(KLINE_W4);
+                if (elapsed >= wait) {
+                    this->port->write(~this->init_res.data[1]);
+                    this->init_echo = true;
+                    this->init_mark = now;
+                    elapsed = 0;
+                }
+            } else {
+                wait = 2 * this->byte_us + 1000;
+                if (elapsed > wait) {
+                    this->end_init(KLINE_INIT_BAD_ECHO, now);
+                }
+            }
+            break;
+        case kline_init::ADDR_INV:
+            wait = 2 * this->param_us(KLINE_W4);
+            if (elapsed > wait) {
+                this->end_init(KLINE_INIT_NO_ADDR_INV, now);
+            }
+            break;
+        case kline_init::WAKE_LOW:
+            wait = this->param_us(KLINE_TINIL);
+            if (elapsed >= wait) {
+                this->port->drive(true);
+                this->init = kline_init::WAKE_HIGH;
+                this->init_mark = now;
+                this->port->schedule(this->wake_high_us());
+                return;
+            }
+            break;
+        case kline_init::WAKE_HIGH:
+            wait = this->wake_high_us();
+            if (elapsed >= wait) { // Request goes out straight after the wake up pattern
+                this->port->release_line();
+                while (this->port->read() >= 0) {}
+                this->tx_pos = 0;
+                this->port->write(this->tx_buf[0]);
+                this->init_echo = true;
+                this->init = kline_init::FAST_TX;
+                this->init_mark = now;
+                this->port->schedule(KLINE_TICK_US);
+                return;
+            }
+            break;
+        case kline_init::FAST_TX:
+            if (this->init_echo) {
+                wait = 2 * this->byte_us + 1000;
+                if (elapsed > wait) {
+                    this->end_init(KLINE_INIT_BAD_ECHO, now);
+                }
+            } else {
+                wait = this->param_us(KLINE_P4_MIN);
+                if (elapsed >= wait) {
+                    this->port->write(this->tx_buf[this->tx_pos]);
+                    this->init_echo = true;
+                    this->init_mark = now;
+                    elapsed = 0;
+                    wait = 0;
+                }
+            }
+            break;
+        case kline_init::FAST_RESP:
+            if (this->rx_len > 0 && now - this->last_rx > this->param_us(KLINE_P1_MAX)) {
+                this->end_rx();
+            } else if (this->rx_len == 0 && elapsed > KLINE_INIT_RESP_US) {
+                this->end_init(KLINE_INIT_NO_RESPONSE, now);
+            }
+            break;
+        default:
+            break;
+    }
+    uint32_t next = KLINE_TICK_US;
+    if (wait > elapsed && wait - elapsed < next) {
+        next = wait - elapsed;
+    }
+    this->port->schedule(next);
+}
+
+// Called by the port from its timer interrupt
+void kline_handler::tick() {
+    if (!this->inUse) {
+        return;
+    }
+    uint32_t now = this->port->micros();
+    if (this->init != kline_init::NONE && this->init != kline_init::DONE) {
+        this->init_tick(now);
+        return;
+    }
+    int c;
+    while ((c = this->port->read()) >= 0) {
+        this->last_bus = now;
+        if (this->state == kline_state::TX_ECHO) { // K-Line is one wire, so we hear everything we send
+            if ((uint8_t)c != this->tx_buf[this->tx_pos]) { // Collision, give up on this message
+                this->errors++;
+                this->tx_len = 0;
+                this->state = kline_state::IDLE;
+                continue;
+            }
+            this->tx_pos++;
+            this->tx_mark = now;
+            if (this->tx_pos == this->tx_len) {
+                this->tx_len = 0;
+                this->state = kline_state::IDLE;
+            } else {
+                this->state = kline_state::TX_WAIT;
+            }
+            continue;
+        }
+        this->rx_byte((uint8_t)c, now);
+    }
+    // Gap longer than P1 means the ECU has finished
+    if (this->rx_len > 0 && now - this->last_rx > this->param_us(KLINE_P1_MAX)) {
+        this->end_rx();
+    }
+    uint32_t next = KLINE_TICK_US;
+    if (this->state == kline_state::IDLE && this->tx_len != 0) {
+        this->tx_pos = 0;
+        this->state = kline_state::TX_WAIT;
+    }
+    if (this->state == kline_state::TX_WAIT && this->rx_len == 0) {
+        // P3 before a request (From the last thing on the bus), P4 between our own bytes
+        uint32_t gap = this->tx_pos == 0 ? this->param_us(KLINE_P3_MIN) : this->param_us(KLINE_P4_MIN);
+        uint32_t since = this->tx_pos == 0 ? this->last_bus : this->tx_mark;
+        uint32_t elapsed = now - since;
+        if (elapsed >= gap) {
+            this->port->write(this->tx_buf[this->tx_pos]);
+            this->tx_mark = now;
+            this->state = kline_state::TX_ECHO;
+        } else if (gap - elapsed < next) {
+            next = gap - elapsed;
+        }
+    } else if (this->state == kline_state::TX_ECHO && now - this->tx_mark > 2 * this->byte_us + 1000) {
+        this->errors++; // Never heard our byte, line is stuck or the transceiver is off
+        this->tx_len = 0;
+        this->state = kline_state::IDLE;
+    }
+    this->port->schedule(next);
+}
@@ -1,28 +1,185 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-
-#ifndef KLINE_H
-#define KLINE_H
-
-// TODO - K line stuff for ISO9141
-
-#endif
\ No newline at end of file
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef KLINE_H
+#define KLINE_H
+
+#include <stdint.h>
+
+// Longest K-line message - ISO 14230 format + 2 address + length byte + 255 data + checksum
+#define KLINE_MAX_MSG 260
+
+// Completed Rx messages waiting for loop() to collect them
+#ifndef KLINE_RX_QUEUE
+#define KLINE_RX_QUEUE 4
+#endif
+
+// How often the engine looks at the line whilst it has nothing better to wait for
+#define KLINE_TICK_US 250
+
+// Config parameter IDs (Same as J2534 SET_CONFIG)
+#define KLINE_P1_MAX   0x07 // Max gap between ECU bytes (0.5ms units)
+#define KLINE_P3_MIN   0x0A // Min gap between ECU response and next request (0.5ms units)
+#define KLINE_P4_MIN   0x0C // Min gap between tester bytes (0.5ms units)
+#define KLINE_W1       0x0E // Max time from address to sync pattern (ms)
+#define KLINE_W2       0x0F // Max time from sync pattern to key byte 1 (ms)
+#define KLINE_W3       0x10 // Max time between key bytes (ms)
+#define KLINE_W4       0x11 // Time between key byte 2 and its inversion (ms)
+#define KLINE_W5       0x12 // Bus idle before the 5 baud address (ms)
+#define KLINE_TIDLE    0x13 // Bus idle before a fast init (ms)
+#define KLINE_TINIL    0x14 // Fast init low time (ms)
+#define KLINE_TWUP     0x15 // Fast init wake up pattern time (ms)
+#define KLINE_FIVE_BAUD_MOD 0x21 // Which side inverts what after the key bytes (See below)
+#define KLINE_PARAM_COUNT 12
+
+// KLINE_FIVE_BAUD_MOD values
+#define KLINE_5BAUD_ISO9141_2   0 // Tester inverts key byte 2, ECU inverts the address (Also ISO 14230-4)
+#define KLINE_5BAUD_INV_KB2     1 // Tester inverts key byte 2 only
+#define KLINE_5BAUD_INV_ADDR    2 // ECU inverts the address only
+#define KLINE_5BAUD_ISO9141     3 // Neither
+
+#define KLINE_5BAUD_BIT_US   200000 // One bit at 5 baud
+#define KLINE_INIT_RESP_US   300000 // Longest wait for the StartCommunication response after a fast init
+
+// Init results
+#define KLINE_INIT_OK          0
+#define KLINE_INIT_NO_SYNC     1 // No (Or wrong) sync byte within W1
+#define KLINE_INIT_NO_KEYBYTES 2 // Key bytes missing after W2 / W3
+#define KLINE_INIT_NO_ADDR_INV 3 // ECU did not send the inverted address
+#define KLINE_INIT_NO_RESPONSE 4 // Nothing back from a StartCommunication request
+#define KLINE_INIT_BAD_ECHO    5 // Line fault, or something else talking whilst we were
+
+/**
+ * What the engine needs from the hardware. The firmware drives a UART and a
+ * hardware timer, a host build can drive a simulated ECU instead
+ */
+class kline_port {
+public:
+    virtual void begin(uint32_t baud) = 0;
+    virtual void end() = 0;
+    virtual int read() = 0; // -1 if no byte waiting
+    virtual void write(uint8_t b) = 0;
+    virtual uint32_t micros() = 0;
+    virtual void schedule(uint32_t us) = 0; // Call tick() again in 'us' microseconds
+    virtual void cancel() = 0;
+    virtual void drive(bool high) = 0; // Take the line from the UART and hold it at a level (Wake up patterns)
+    virtual void release_line() = 0; // Give the line back to the UART
+};
+
+struct kline_msg {
+    uint32_t timestamp; // us, when the first byte arrived
+    uint16_t len;
+    uint8_t data[KLINE_MAX_MSG];
+};
+
+struct kline_init_result {
+    uint8_t status; // KLINE_INIT_*
+    uint16_t len;
+    uint8_t data[KLINE_MAX_MSG]; // Key bytes (5 baud), or the StartCommunication response (Fast init)
+};
+
+// Wake up sequences, run entirely from tick()
+enum class kline_init {
+    NONE,
+    WAIT_IDLE, // Bus has to be quiet for W5 (5 baud) or TIDLE (Fast) first
+    ADDR_BITS, // Bit banging the address at 5 baud
+    SYNC, // Waiting for 0x55 (W1)
+    KB1, // Waiting for key byte 1 (W2)
+    KB2, // Waiting for key byte 2 (W3)
+    KB2_INV, // Sending inverted key byte 2 after W4
+    ADDR_INV, // Waiting for the ECU's inverted address
+    WAKE_LOW, // TiniL
+    WAKE_HIGH, // Rest of TWUP
+    FAST_TX, // StartCommunication request
+    FAST_RESP, // StartCommunication response
+    DONE // Result waiting for loop()
+};
+
+enum class kline_state {
+    IDLE, // Nothing to send
+    TX_WAIT, // Waiting for the byte gap (P3 before a request, P4 between bytes)
+    TX_ECHO, // Waiting for our byte to come back off the line
+};
+
+/**
+ * ISO 9141 / ISO 14230 byte engine. All line timing happens in tick(), which the port
+ * calls from a timer interrupt, so nothing depends on how often loop() runs.
+ * loop() only hands over whole messages with send() and collects them with read()
+ */
+class kline_handler {
+public:
+    explicit kline_handler(kline_port* port);
+    bool claim(uint32_t baud, bool iso14230, bool checksum);
+    void release();
+    bool isFree();
+    bool setParam(uint8_t id, uint32_t value);
+    bool getParam(uint8_t id, uint32_t* value);
+    bool send(uint8_t* data, uint16_t len);
+    bool read(kline_msg* msg);
+    uint32_t getErrors();
+    bool startFiveBaud(uint8_t addr);
+    bool startFastInit(uint8_t* req, uint16_t len);
+    bool initResult(kline_init_result* res);
+    void tick();
+private:
+    void init_tick(uint32_t now);
+    void init_byte(uint8_t b, uint32_t now);
+    void end_init(uint8_t status, uint32_t now);
+    bool start_init(kline_init first);
+    uint32_t wake_high_us();
+    void rx_byte(uint8_t b, uint32_t now);
+    void end_rx();
+    uint16_t expected_len();
+    uint32_t param_us(uint8_t id);
+    kline_port* port;
+    volatile bool inUse = false;
+    bool iso14230 = false;
+    bool checksum = true;
+    uint32_t byte_us = 0; // Time for one byte on the line (10 bits)
+    uint32_t params[KLINE_PARAM_COUNT];
+    // Rx
+    uint8_t rx_buf[KLINE_MAX_MSG];
+    uint16_t rx_len = 0;
+    uint32_t rx_start = 0;
+    uint32_t last_rx = 0;
+    kline_msg rx_queue[KLINE_RX_QUEUE];
+    volatile uint8_t rx_head = 0; // Written by tick()
+    volatile uint8_t rx_tail = 0; // Written by read()
+    // Tx
+    kline_state state = kline_state::IDLE;
+    uint8_t tx_buf[KLINE_MAX_MSG];
+    volatile uint16_t tx_len = 0; // Non zero whilst a message is queued or sending
+    uint16_t tx_pos = 0;
+    uint32_t tx_mark = 0; // When the current gap / echo wait started
+    uint32_t last_bus = 0; // Last time anything was on the line
+    volatile uint32_t errors = 0; // Bad checksums, echo mismatches, overflows
+    // Init
+    volatile kline_init init = kline_init::NONE;
+    bool fast_init = false;
+    bool init_echo = false; // Waiting to hear our own byte
+    uint8_t init_addr = 0;
+    uint8_t init_bit = 0;
+    uint32_t init_mark = 0; // When the current init step started
+    kline_init_result init_res;
+};
+
+#endif
@@ -0,0 +1,96 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "kline_port.h"
+
+serial_kline_port::serial_kline_port(USARTClass* serial, hw_timer* timer, uint8_t slp_pin, uint8_t tx_pin, kline_handler* engine) {
+    this->serial = serial;
+    this->timer = timer;
+    this->slp_pin = slp_pin;
+    this->tx_pin = tx_pin;
+    this->engine = engine;
+}
+
+void serial_kline_port::begin(uint32_t baud) {
+    pinMode(this->slp_pin, OUTPUT);
+    digitalWrite(this->slp_pin, HIGH); // Wake the transceiver
+    this->serial->begin(baud);
+    while (this->serial->available() > 0) { // Anything from before we took the line is not ours
+        this->serial->read();
+    }
+    this->timer->attach(serial_kline_port::on_timer, this);
+}
+
+void serial_kline_port::end() {
+    this->timer->detach();
+    this->serial->end();
+    digitalWrite(this->slp_pin, LOW);
+}
+
+int serial_kline_port::read() {
+    return this->serial->read();
+}
+
+void serial_kline_port::write(uint8_t b) {
+    this->serial->write(b);
+}
+
+uint32_t serial_kline_port::micros() {
+    return ::micros();
+}
+
+void serial_kline_port::schedule(uint32_t us) {
+    this->timer->start_us(us);
+}
+
+void serial_kline_port::cancel() {
+    this->timer->stop();
+}
+
+// Takes the TX pin off the UART. Setting the level straight on the PIO keeps it
+// to a single register write, so bit edges land where the timer says
+void serial_kline_port::drive(bool high) {
+    const PinDescription* p = &g_APinDescription[this->tx_pin];
+    if (!this->driving) {
+        PIO_Configure(p->pPort, high ? PIO_OUTPUT_1 : PIO_OUTPUT_0, p->ulPin, PIO_DEFAULT);
+        this->driving = true;
+    } else if (high) {
+        p->pPort->PIO_SODR = p->ulPin;
+    } else {
+        p->pPort->PIO_CODR = p->ulPin;
+    }
+}
+
+// Hands the TX pin back to the UART
+void serial_kline_port::release_line() {
+    if (!this->driving) {
+        return;
+    }
+    const PinDescription* p = &g_APinDescription[this->tx_pin];
+    PIO_Configure(p->pPort, p->ulPinType, p->ulPin, p->ulPinConfiguration);
+    this->driving = false;
+}
+
+void serial_kline_port::on_timer(void* ctx) {
+    ((serial_kline_port*)ctx)->engine->tick();
+}
+
+serial_kline_port kline_serial = serial_kline_port(&KLINE_SERIAL, &hw_timer2, KLINE_SLP_PIN, KLINE_TX_PIN, &kline);
+kline_handler kline = kline_handler(&kline_serial);
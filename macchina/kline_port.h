@@ -0,0 +1,69 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef KLINE_PORT_H
+#define KLINE_PORT_H
+
+#include <Arduino.h>
+#include "kline_handler.h"
+#include "hw_timer.h"
+
+// M2 K-Line transceiver - UART and its sleep pin (High = awake)
+#ifndef KLINE_SERIAL
+#define KLINE_SERIAL Serial1
+#endif
+#ifndef KLINE_SLP_PIN
+#define KLINE_SLP_PIN LIN_KSLP
+#endif
+#ifndef KLINE_TX_PIN
+#define KLINE_TX_PIN LIN_KTX // Driven directly for wake up patterns
+#endif
+
+/**
+ * K-Line port on the M2's UART. tick() runs from a hardware timer, so byte
+ * timing is kept no matter how busy loop() is with USB
+ */
+class serial_kline_port : public kline_port {
+public:
+    serial_kline_port(USARTClass* serial, hw_timer* timer, uint8_t slp_pin, uint8_t tx_pin, kline_handler* engine);
+    void begin(uint32_t baud);
+    void end();
+    int read();
+    void write(uint8_t b);
+    uint32_t micros();
+    void schedule(uint32_t us);
+    void cancel();
+    void drive(bool high);
+    void release_line();
+private:
+    static void on_timer(void* ctx);
+    USARTClass* serial;
+    hw_timer* timer;
+    uint8_t slp_pin;
+    uint8_t tx_pin;
+    bool driving = false;
+    kline_handler* engine;
+};
+
+extern kline_handler kline;
+
+#endif
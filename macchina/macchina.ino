@@ -21,7 +21,11 @@
 #include "pc_comm.h"
 #include "can_handler.h"
 #include "channels.h"
+#include "block_pool.h"
 #include "j2534_mini.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "stats.h"
 #include <map>
 
 #include <M2_12VIO.h>
@@ -37,9 +41,32 @@ bool connected = false;
 // DS6 - Green LED - Connected!
 
 #define MAX_CHANNELS 10
+#define DEVICE_CAPS (CAP_CAN_BATCH | CAP_DATA_PART | CAP_PERIODIC | CAP_STATS | CAP_TX_TRACE | CAP_KLINE) // Reported in CMD_HELLO
 channel* channels[MAX_CHANNELS] = {nullptr};
+int8_t channel_tasks[MAX_CHANNELS] = {0};
 unsigned long active_channels = 0;
 
+// Task timings (us)
+#define USB_RX_BUDGET_US    500 // One message, including whatever it asks a channel to do
+#define USB_TX_BUDGET_US    200 // One USB packet
+#define CHANNEL_BUDGET_US   300 // One frame in or out
+#define PERIODIC_PERIOD_US  1000
+#define PERIODIC_BUDGET_US  200
+#define LED_PERIOD_US       20000
+#define LED_BUDGET_US       50
+#define TRACE_PERIOD_US     10000
+#define TRACE_BUDGET_US     100
+#define AUTOBAUD_PERIOD_US  1000
+#define AUTOBAUD_BUDGET_US  200 // One look at the bus, or one rate change
+
+void task_usb_rx(void* ctx);
+void task_usb_tx(void* ctx);
+void task_channel(void* ctx);
+void task_periodic(void* ctx);
+void task_leds(void* ctx);
+void task_trace(void* ctx);
+void task_autobaud(void* ctx);
+
 PCMSG comm_msg = {0x00};
 
 // the setup function runs once when you press reset or power the board
@@ -59,6 +86,12 @@ void setup() {
     digitalWrite(DS7_BLUE, HIGH);
     digitalWrite(DS7_RED, HIGH);
     M2IO.Init_12VIO();
+    SCHED::add("usb_rx", task_usb_rx, nullptr, 0, USB_RX_BUDGET_US);
+    SCHED::add("usb_tx", task_usb_tx, nullptr, 0, USB_TX_BUDGET_US);
+    SCHED::add("periodic", task_periodic, nullptr, PERIODIC_PERIOD_US, PERIODIC_BUDGET_US);
+    SCHED::add("leds", task_leds, nullptr, LED_PERIOD_US, LED_BUDGET_US);
+    SCHED::add("trace", task_trace, nullptr, TRACE_PERIOD_US, TRACE_BUDGET_US);
+    SCHED::add("autobaud", task_autobaud, nullptr, AUTOBAUD_PERIOD_US, AUTOBAUD_BUDGET_US);
 }
 
 // https://github.com/kenny-macchina/M2VoltageMonitor/blob/master/M2VoltageMonitor_V4/M2VoltageMonitor_V4.ino
@@ -75,37 +108,118 @@ float getVoltage() {
 
 unsigned long lastPing = 0;
 void doPing() {
-    char buf[50];
-    sprintf(buf, "Voltage: %.2f, Active channels: %lu", getVoltage(), active_channels);
+    char buf[120];
+    pool_stats ps;
+    POOL::getStats(&ps);
+    sprintf(buf, "Voltage: %.2f, Active channels: %lu, Pool peak: %u/%u small, %u/%u large, %u failed",
+        getVoltage(), active_channels, ps.small_peak, POOL_SMALL_BLOCKS, ps.large_peak, POOL_LARGE_BLOCKS, ps.failed);
     PCCOMM::logToSerial(buf);
+    // Any task that went over its budget since the last ping
+    sched_task_stats ts;
+    for (uint8_t i = 0; SCHED::getStats(i, &ts); i++) {
+        if (ts.overruns != 0) {
+            sprintf(buf, "Task %s overran %lu/%lu times, max %lu us (Budget %lu us)", ts.name, ts.overruns, ts.runs, ts.max_us, ts.budget_us);
+            PCCOMM::logToSerial(buf);
+        }
+    }
+    SCHED::resetStats();
+    pc_comm_stats txs;
+    PCCOMM::getStats(&txs);
+    if (txs.stalls != 0 || txs.dropped != 0) {
+        sprintf(buf, "USB Tx ring peak %u/%u, stalls %lu, dropped %lu", txs.peak, PCCOMM_TX_RING_SIZE, txs.stalls, txs.dropped);
+        PCCOMM::logToSerial(buf);
+    }
+}
+
+// Snapshot of every counter for the driver (CMD_STATS)
+void doStats(uint8_t flags) {
+    device_stats st;
+    memset(&st, 0x00, sizeof(st));
+    st.uptime_ms = millis();
+    SCHED::getLoopStats(st.loop_hist, &st.loop_max_us);
+    pc_comm_stats cs;
+    PCCOMM::getStats(&cs);
+    st.usb_bytes_in = cs.bytes_in;
+    st.usb_bytes_out = cs.bytes_out;
+    st.usb_tx_peak = cs.peak;
+    st.usb_tx_stalls = cs.stalls;
+    st.usb_tx_dropped = cs.dropped;
+    st.usb_rx_crc_errors = cs.rx_crc_errors;
+    st.usb_rx_skipped = cs.rx_skipped;
+    pool_stats ps;
+    POOL::getStats(&ps);
+    st.pool_small_peak = ps.small_peak;
+    st.pool_large_peak = ps.large_peak;
+    st.pool_failed = ps.failed;
+    ch0.getStats(&st.can[0]);
+    ch1.getStats(&st.can[1]);
+    for (uint8_t i = 0; i < MAX_CHANNELS && i < STATS_MAX_CHANNELS; i++) {
+        if (channels[i] != nullptr) {
+            channels[i]->getStats(&st.channels[i]);
+        }
+    }
+    if (flags & STATS_RESET) {
+        SCHED::resetLoopStats();
+        PCCOMM::resetPeak();
+        ch0.resetPeaks();
+        ch1.resetPeaks();
+        POOL::resetPeaks();
+    }
+    PCCOMM::respondOK(CMD_STATS, (uint8_t*)&st, sizeof(st));
 }
 
+// Lets the driver check it has found a Macchina, and what this firmware can do
+void doHello() {
+    uint8_t res[HELLO_SIZE] = {0x00};
+    uint16_t version = PC_PROTOCOL_VERSION;
+    uint32_t caps = DEVICE_CAPS;
+    memcpy(&res[0], &version, 2);
+    memcpy(&res[2], &caps, 4);
+    res[6] = MAX_CHANNELS;
+    strncpy((char*)&res[7], __DATE__ " " __TIME__, HELLO_SIZE - 8);
+    PCCOMM::respondOK(CMD_HELLO, res, sizeof(res));
+}
 
-void create_channel(uint8_t id, uint8_t protocol, unsigned long baud) {
-    if (id > MAX_CHANNELS-1) {
+void create_channel(uint8_t id, uint8_t protocol, unsigned long baud, uint32_t flags, uint16_t rx_window) {
+    if (id == 0 || id > MAX_CHANNELS) {
        PCCOMM::respondFail(CMD_CHANNEL_CREATE, ERR_INVALID_CHANNEL_ID, "Channel ID is too large");
         return;
     }
-    if (channels[id] != nullptr) {
+    if (channels[id-1] != nullptr) {
         PCCOMM::respondFail(CMD_CHANNEL_CREATE, ERR_CHANNEL_IN_USE, "Channel ID is already in use");
         return;
     }
-    channels[id-1] = new channel(id, protocol, baud);
+    channel* c = new channel(id, protocol, baud, flags);
+    if (!c->isReady()) {
+        c->kill_channel();
+        delete c;
+        PCCOMM::respondFail(CMD_CHANNEL_CREATE, ERR_EXCEEDED_LIMIT, "No free hardware for the protocol");
+        return;
+    }
+    PCCOMM::openCredits(id, rx_window);
+    channels[id-1] = c;
+    channel_tasks[id-1] = SCHED::add("channel", task_channel, channels[id-1], 0, CHANNEL_BUDGET_US);
     active_channels++;
     uint8_t res[1] = {0x00};
     PCCOMM::respondOK(CMD_CHANNEL_CREATE, res, 1);
 }
 
+void free_channel(uint8_t idx) {
+    SCHED::remove(channel_tasks[idx]);
+    channels[idx]->kill_channel();
+    delete channels[idx];
+    channels[idx] = nullptr;
+    PCCOMM::closeCredits(idx + 1);
+    active_channels--;
+}
+
 void destroy_channel(uint8_t id) {
-    if (id > MAX_CHANNELS) { 
+    if (id == 0 || id > MAX_CHANNELS) {
         PCCOMM::respondFail(CMD_CHANNEL_DESTROY, ERR_INVALID_CHANNEL_ID, "Channel ID is too large");
         return;
     }
     if (channels[id-1] != nullptr) {
-        channels[id-1]->kill_channel();
-        delete channels[id];
-        channels[id-1] = nullptr;
-        active_channels--;
+        free_channel(id-1);
         uint8_t res[1] = {0x00};
         PCCOMM::respondOK(CMD_CHANNEL_DESTROY, res, 1);
     } else {
@@ -113,80 +227,228 @@ void destroy_channel(uint8_t id) {
     }
 }
 
-void update_channels() { // Tells all channels to check to send data, or to read incomming data
+// Checks a channel for data to send, or incomming data. Each channel is its own task so a busy one can't hold up the rest
+void task_channel(void* ctx) {
+    ((channel*)ctx)->update();
+}
+
+void task_periodic(void* ctx) {
+    uint32_t now = millis();
     for (int i = 0; i < MAX_CHANNELS; i++) {
         if (channels[i] != nullptr) {
-            channels[i]->update();
+            channels[i]->update_periodic(now);
         }
     }
 }
 
 void channel_send_data(uint8_t channelID, uint8_t* data, uint16_t len) {
-    if (channels[channelID-1] != nullptr) {
+    if (channelID != 0 && channelID <= MAX_CHANNELS && channels[channelID-1] != nullptr) {
+        channels[channelID-1]->set_trace(comm_msg.trace_id, PCCOMM::lastRxTime());
         channels[channelID-1]->transmit_data(len, data);
     }  else {
         PCCOMM::logToSerial("Cannot trasmit data on channel. Does not exist");
     }
 }
 
-void channel_set_filter(uint8_t channelID, uint8_t* args) {
-    if (channels[channelID-1] != nullptr) {
-        uint8_t id = args[0];
-        uint8_t type = args[1];
-        // Most horrible C++ code award goes here
-        // Forcing bit shift rather than memcpy to avoid bytes being swapped around
-        uint32_t mask = args[2] << 24 | args[3] << 16 | args[4] << 8 | args[5];
-        uint32_t filter = args[6] << 24 | args[7] << 16 | args[8] << 8 | args[9];
-        uint32_t resp = args[10] << 24 | args[11] << 16 | args[12] << 8 | args[13];
-        channels[channelID-1]->set_filter(id, type, mask, filter, resp);
-    }  else {
+void channel_send_data_part(uint8_t channelID, uint8_t* args, uint16_t len) {
+    if (channelID == 0 || channelID > MAX_CHANNELS || channels[channelID-1] == nullptr) {
+        PCCOMM::logToSerial("Cannot trasmit data on channel. Does not exist");
+        return;
+    }
+    if (comm_msg.arg_size < DATA_PART_HEADER_SIZE) { // len has already wrapped if there was no channel ID
+        PCCOMM::logToSerial("Data part is too short");
+        return;
+    }
+    uint32_t total, offset;
+    memcpy(&total, &args[0], 4);
+    memcpy(&offset, &args[4], 4);
+    channels[channelID-1]->set_trace(comm_msg.trace_id, PCCOMM::lastRxTime()); // Only the last part has one
+    channels[channelID-1]->transmit_part(total, offset, &args[8], len-8);
+}
+
+void channel_set_filter(uint8_t channelID, uint8_t* args, uint16_t len) {
+    if (channelID == 0 || channelID > MAX_CHANNELS || channels[channelID-1] == nullptr) {
         PCCOMM::logToSerial("Cannot set channel filter. Does not exist");
+        return;
+    }
+    if (len < FILTER_ARGS_SIZE - 1) {
+        PCCOMM::logToSerial("Cannot set channel filter. Args too short");
+        return;
     }
+    uint8_t id = args[0];
+    uint8_t type = args[1];
+    // Most horrible C++ code award goes here
+    // Forcing bit shift rather than memcpy to avoid bytes being swapped around
+    uint32_t mask = args[2] << 24 | args[3] << 16 | args[4] << 8 | args[5];
+    uint32_t filter = args[6] << 24 | args[7] << 16 | args[8] << 8 | args[9];
+    uint32_t resp = args[10] << 24 | args[11] << 16 | args[12] << 8 | args[13];
+    // Extended addressing bytes (Mask, pattern, flow)
+    channels[channelID-1]->set_filter(id, type, mask, filter, resp, args[14], args[15], args[16]);
+}
+
+void channel_start_periodic(uint8_t channelID, uint8_t* args, uint16_t len) {
+    if (channelID == 0 || channelID > MAX_CHANNELS || channels[channelID-1] == nullptr || len < PERIODIC_HEADER_SIZE - 1) {
+        PCCOMM::logToSerial("Cannot start periodic message. Channel does not exist");
+        return;
+    }
+    uint32_t interval;
+    memcpy(&interval, &args[1], 4);
+    channels[channelID-1]->start_periodic(args[0], interval, &args[5], len - 5);
+}
+
+void channel_stop_periodic(uint8_t channelID, uint8_t id) {
+    if (channelID == 0 || channelID > MAX_CHANNELS || channels[channelID-1] == nullptr) {
+        PCCOMM::logToSerial("Cannot stop periodic message. Channel does not exist");
+        return;
+    }
+    channels[channelID-1]->stop_periodic(id);
 }
 
 void channel_remove_filter(uint8_t channelID, uint8_t id) {
-    if (channels[channelID-1] != nullptr) {
-        channels[channelID-1]->remove_filter(id);
-    }  else {
+    if (channelID == 0 || channelID > MAX_CHANNELS || channels[channelID-1] == nullptr) {
         PCCOMM::logToSerial("Cannot remove channel filter. Does not exist");
+        return;
     }
+    channels[channelID-1]->remove_filter(id);
 }
 
-// the loop function runs over and over again until power down or reset
+// IOCTLs that are not for a channel (Sent with channel ID 0)
+uint8_t device_ioctl(uint32_t id, uint8_t* in, uint16_t in_len, uint8_t* out, uint16_t* out_len) {
+    switch (id) {
+        case MACCHINA_IOCTL_AUTOBAUD: { // Far too long for a CMD_CHANNEL_IOCTL_REQ, so task_autobaud() sends the result
+            if (in_len < 5 || in[0] > 1) {
+                return ERR_INVALID_IOCTL_VALUE;
+            }
+            uint32_t budget;
+            memcpy(&budget, &in[1], 4);
+            canbus_handler* c = in[0] == 0 ? &ch0 : &ch1;
+            if (ch0.isScanning() || ch1.isScanning() || !c->startAutobaud(budget)) { // The driver waits on one result per channel ID
+                return ERR_CHANNEL_IN_USE;
+            }
+            return STATUS_NOERROR;
+        }
+        default:
+            return ERR_INVALID_IOCTL_ID;
+    }
+}
+
+void channel_ioctl(uint8_t channelID, uint8_t* args, uint16_t len) {
+    if (channelID > MAX_CHANNELS || (channelID != 0 && channels[channelID-1] == nullptr)) {
+        PCCOMM::respondFail(CMD_CHANNEL_IOCTL_REQ, ERR_INVALID_CHANNEL_ID, "Cannot run IOCTL on channel. Does not exist");
+        return;
+    }
+    if (len < 4) {
+        PCCOMM::respondFail(CMD_CHANNEL_IOCTL_REQ, ERR_INVALID_IOCTL_ID, "IOCTL request too short");
+        return;
+    }
+    uint32_t id;
+    memcpy(&id, &args[0], 4);
+    uint8_t out[64];
+    uint16_t out_len = 0;
+    uint8_t res;
+    if (channelID == 0) {
+        res = device_ioctl(id, &args[4], len-4, out, &out_len);
+    } else {
+        res = channels[channelID-1]->ioctl(id, &args[4], len-4, out, &out_len);
+    }
+    if (res == STATUS_NOERROR) {
+        PCCOMM::respondOK(CMD_CHANNEL_IOCTL_REQ, out, out_len);
+    } else {
+        PCCOMM::respondFail(CMD_CHANNEL_IOCTL_REQ, res, "IOCTL failed");
+    }
+}
+
+// Handles at most one message from the PC
 unsigned long l; // Temp buffer;
-void loop() {
-    if (PCCOMM::pollMessage(&comm_msg)) {
-        lastPing = millis();
-        connected = true;
-        switch (comm_msg.cmd_id) {
-            case CMD_PING: // Ping request - Read bat voltage
-                doPing();
-                break;
-            case CMD_EXIT: // User space application quit
-                connected = false;
-                break;
-            case CMD_CHANNEL_CREATE: // Create a new channel
-                memcpy(&l, &comm_msg.args[2], 4);
-                create_channel(comm_msg.args[0], comm_msg.args[1], l);
-                break;
-            case CMD_CHANNEL_DATA: // Send data to a channel
-                channel_send_data(comm_msg.args[0], &comm_msg.args[1], comm_msg.arg_size-1);
-                break;
-            case CMD_CHANNEL_SET_FILTER:
-                channel_set_filter(comm_msg.args[0], &comm_msg.args[1]);
-                break;
-            case CMD_CHANNEL_REM_FILTER:
-                channel_remove_filter(comm_msg.args[0], comm_msg.args[1]);
-                break;
-            case CMD_CHANNEL_DESTROY: // Destroy a channel
-                destroy_channel(comm_msg.args[0]);
-                break;
-            default: // Unknown??
-                PCCOMM::logToSerial("Unknown Payload CMD");
-                break;
+uint32_t flags;
+uint16_t rx_window;
+void task_usb_rx(void* ctx) {
+    if (!PCCOMM::pollMessage(&comm_msg)) {
+        return;
+    }
+    lastPing = millis();
+    connected = true;
+    switch (comm_msg.cmd_id) {
+        case CMD_PING: // Ping request - Read bat voltage
+            doPing();
+            break;
+        case CMD_HELLO: // Driver looking for the device
+            doHello();
+            break;
+        case CMD_STATS: // Performance counters
+            doStats(comm_msg.arg_size > 0 ? comm_msg.args[0] : 0);
+            break;
+        case CMD_EXIT: // User space application quit, back to the default state for the next one
+            for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+                if (channels[i] != nullptr) {
+                    free_channel(i);
+                }
+            }
+            connected = false;
+            break;
+        case CMD_CHANNEL_CREATE: // Create a new channel
+            memcpy(&l, &comm_msg.args[2], 4);
+            memcpy(&flags, &comm_msg.args[6], 4); // 0 from older drivers
+            memcpy(&rx_window, &comm_msg.args[10], 2); // 0 from the passthru daemon, it buffers for its clients
+            create_channel(comm_msg.args[0], comm_msg.args[1], l, flags, rx_window);
+            break;
+        case CMD_CHANNEL_DATA: // Send data to a channel
+            channel_send_data(comm_msg.args[0], &comm_msg.args[1], comm_msg.arg_size-1);
+            break;
+        case CMD_CHANNEL_DATA_PART: // Send part of a large payload to a channel
+            channel_send_data_part(comm_msg.args[0], &comm_msg.args[1], comm_msg.arg_size-1);
+            break;
+        case CMD_CHANNEL_SET_FILTER:
+            channel_set_filter(comm_msg.args[0], &comm_msg.args[1], comm_msg.arg_size-1);
+            break;
+        case CMD_CHANNEL_REM_FILTER:
+            channel_remove_filter(comm_msg.args[0], comm_msg.args[1]);
+            break;
+        case CMD_CHANNEL_START_PERIODIC:
+            channel_start_periodic(comm_msg.args[0], &comm_msg.args[1], comm_msg.arg_size-1);
+            break;
+        case CMD_CHANNEL_STOP_PERIODIC:
+            channel_stop_periodic(comm_msg.args[0], comm_msg.args[1]);
+            break;
+        case CMD_CHANNEL_IOCTL_REQ: // IOCTL on a channel
+            channel_ioctl(comm_msg.args[0], &comm_msg.args[1], comm_msg.arg_size-1);
+            break;
+        case CMD_CHANNEL_DESTROY: // Destroy a channel
+            destroy_channel(comm_msg.args[0]);
+            break;
+        default: // Unknown??
+            PCCOMM::logToSerial("Unknown Payload CMD");
+            break;
+    }
+}
+
+// Writes queued messages to the PC, one USB packet at a time
+void task_usb_tx(void* ctx) {
+    PCCOMM::flushCredits();
+    PCCOMM::flushTx();
+}
+
+// Batches up trace events for the driver
+void task_trace(void* ctx) {
+    TRACE::flush();
+}
+
+// Steps any autobaud scan, and sends its result as a CMD_CHANNEL_IOCTL_RESP on channel 0
+void task_autobaud(void* ctx) {
+    canbus_handler* controllers[2] = { &ch0, &ch1 };
+    for (uint8_t i = 0; i < 2; i++) {
+        uint32_t baud;
+        uint16_t sample_point;
+        if (controllers[i]->autobaudStep(&baud, &sample_point)) {
+            uint8_t res[6];
+            memcpy(&res[0], &baud, 4);
+            memcpy(&res[4], &sample_point, 2);
+            PCCOMM::sendIoctlResult(0, MACCHINA_IOCTL_AUTOBAUD, baud != 0 ? STATUS_NOERROR : ERR_TIMEOUT, res, baud != 0 ? sizeof(res) : 0);
         }
     }
-    
+}
+
+void task_leds(void* ctx) {
     // Do status LED thing to show connected or not
     if(millis() - lastPing > 5000 ||!connected) { // Not connected
         digitalWrite(DS6, HIGH);
@@ -199,5 +461,9 @@ void loop() {
     digitalWrite(DS3, HIGH); // Can 0
     digitalWrite(DS4, HIGH); // Can 1
     digitalWrite(DS5, HIGH); // K-Line
-    update_channels();
+}
+
+// the loop function runs over and over again until power down or reset
+void loop() {
+    SCHED::run();
 }
@@ -1,87 +1,440 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#include "pc_comm.h"
-#include "j2534_mini.h"
-
-namespace PCCOMM {
-    char tempbuf[520] = {0x00};
-    uint16_t read_count = 0;
-    uint8_t lastID = 0x00;
-    bool pollMessage(PCMSG *msg) {
-        if(SerialUSB.available() > 0) { // Is there enough data in the buffer for
-
-            // Calculate how many bytes to read (min of avaliable bytes, or left to read to complete the data)
-            uint16_t maxRead = min(SerialUSB.available(), sizeof(PCMSG)-read_count);
-            digitalWrite(DS7_RED, LOW);
-            SerialUSB.readBytes(&tempbuf[read_count], maxRead);
-            digitalWrite(DS7_RED, HIGH);
-            read_count += maxRead;
-
-            // Size OK now, full payload received
-            if(read_count == sizeof(struct PCMSG)) {
-                memcpy(msg, &tempbuf, sizeof(PCMSG));
-                read_count = 0;
-                memset(tempbuf, 0x00, sizeof(tempbuf)); // Reset buffer
-                lastID = msg->msg_id; // Set this for response
-                return true;
-            }
-        }
-        return false;
-    }
-
-    void sendMessage(PCMSG *msg) {
-        digitalWrite(DS7_GREEN, LOW);
-        SerialUSB.write((char*)msg, sizeof(struct PCMSG));
-        digitalWrite(DS7_GREEN, HIGH);
-    }
-
-    void logToSerial(char* msg) {
-        uint16_t len = max(strlen(msg), 512);
-        PCMSG res = {0x00};
-        res.cmd_id = CMD_LOG;
-        res.arg_size = len;
-        memcpy(res.args, msg, len);
-        sendMessage(&res);
-    }
-
-    void respondOK(uint8_t cmd_id, uint8_t* resp_data, uint16_t resp_data_len) {
-        PCMSG send = {
-            cmd_id | CMD_RES_FROM_CMD,
-            STATUS_NOERROR,
-            resp_data_len+1
-        };
-        send.msg_id = lastID;
-        memcpy(&send.args[1], &resp_data, resp_data_len);
-        sendMessage(&send);
-    }
-
-    void respondFail(uint8_t cmd_id, uint8_t err_code, char* msg) {
-        int len = strlen(msg);
-        PCMSG send = {
-            cmd_id | CMD_RES_FROM_CMD,
-            err_code,
-            len
-        };
-        send.msg_id = lastID;
-        memcpy(&send.args, &msg, len);
-        sendMessage(&send);
-    }
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#include "pc_comm.h"
+#include "j2534_mini.h"
+#include <stddef.h>
+
+namespace PCCOMM {
+    uint8_t tempbuf[FRAME_SIZE] = {0x00};
+    uint16_t read_count = 0;
+    uint8_t lastID = 0x00;
+    pc_comm_stats comm_stats = {0x00};
+    uint32_t last_rx_us = 0; // When the last message finished arriving
+
+    uint32_t crc_table[256];
+    bool crc_ready = false;
+
+    uint32_t crcUpdate(uint32_t crc, const uint8_t* data, uint16_t len) {
+        if (!crc_ready) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (uint8_t bit = 0; bit < 8; bit++) {
+                    c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                }
+                crc_table[i] = c;
+            }
+            crc_ready = true;
+        }
+        for (uint16_t i = 0; i < len; i++) {
+            crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    // CRC-32 (IEEE) of the credit update in the frame header and the message, leaving out
+    // the args that aren't used. 0 if arg_size is too big to be real
+    uint32_t frameCrc(const uint8_t* header, PCMSG* msg) {
+        if (msg->arg_size > sizeof(msg->args)) {
+            return 0;
+        }
+        uint8_t* m = (uint8_t*)msg;
+        uint32_t crc = 0xFFFFFFFF;
+        crc = crcUpdate(crc, &header[2], FRAME_HEADER_SIZE - 2);
+        crc = crcUpdate(crc, m, offsetof(PCMSG, args));
+        crc = crcUpdate(crc, msg->args, msg->arg_size);
+        crc = crcUpdate(crc, &m[offsetof(PCMSG, msg_id)], sizeof(PCMSG) - offsetof(PCMSG, msg_id));
+        return ~crc;
+    }
+
+    // Moves the first place at or after 'from' that could be the start of a frame to the front of tempbuf
+    void resync(uint16_t from) {
+        uint16_t i = from;
+        while (i < read_count && !(tempbuf[i] == FRAME_SYNC_0 && (i + 1 == read_count || tempbuf[i+1] == FRAME_SYNC_1))) {
+            i++;
+        }
+        if (i == 0) {
+            return;
+        }
+        comm_stats.rx_skipped += i;
+        memmove(tempbuf, &tempbuf[i], read_count - i);
+        read_count -= i;
+    }
+
+    // Flow control state for each channel ID (See CMD_CREDIT)
+    struct channel_credit {
+        bool rx_flow; // Driver gave an RX window when it created the channel
+        uint16_t rx_limit; // Running total of data messages the driver has room for
+        uint16_t rx_sent;
+        bool tx_flow; // Handler limits what the driver sends it
+        uint16_t tx_limit; // Running total of records the driver may send
+        uint16_t tx_told; // Last limit the driver was sent
+        uint32_t tx_since; // micros() when the limit first moved on from tx_told
+    };
+    channel_credit credits[PCCOMM_CREDIT_CHANNELS + 1];
+    uint8_t credit_next = 1; // Channel the next frame header looks at first
+    uint32_t credit_refresh_ms = 0;
+
+    channel_credit* getCredit(uint8_t channel_id) {
+        if (channel_id == 0 || channel_id > PCCOMM_CREDIT_CHANNELS) {
+            return nullptr;
+        }
+        return &credits[channel_id];
+    }
+
+    // New RX limit from the driver. Limits only ever go up, an older one arriving late is ignored
+    void applyCredit(uint8_t channel_id, uint16_t limit) {
+        channel_credit* c = getCredit(channel_id);
+        if (c != nullptr && c->rx_flow && (int16_t)(limit - c->rx_limit) > 0) {
+            c->rx_limit = limit;
+        }
+    }
+
+    // Called for a new channel. A window of 0 means the driver takes whatever it is sent
+    void openCredits(uint8_t channel_id, uint16_t rx_window) {
+        channel_credit* c = getCredit(channel_id);
+        if (c != nullptr) {
+            memset(c, 0x00, sizeof(channel_credit));
+            c->rx_flow = rx_window != 0;
+            c->rx_limit = rx_window;
+        }
+    }
+
+    void closeCredits(uint8_t channel_id) {
+        channel_credit* c = getCredit(channel_id);
+        if (c != nullptr) {
+            memset(c, 0x00, sizeof(channel_credit));
+        }
+    }
+
+    // Data messages that can be sent on the channel before the driver runs out of room
+    uint16_t rxCredits(uint8_t channel_id) {
+        channel_credit* c = getCredit(channel_id);
+        if (c == nullptr || !c->rx_flow) {
+            return CREDIT_UNLIMITED;
+        }
+        int16_t left = (int16_t)(c->rx_limit - c->rx_sent);
+        return left > 0 ? left : 0;
+    }
+
+    // Messages sendChannelData needs for a payload
+    uint16_t messagesFor(uint16_t len) {
+        if (len <= sizeof(PCMSG::args) - 1) {
+            return 1;
+        }
+        return (len + DATA_PART_MAX_BYTES - 1) / DATA_PART_MAX_BYTES;
+    }
+
+    // Handler has room for more, the driver finds out with the next frame or CMD_CREDIT
+    void setTxLimit(uint8_t channel_id, uint16_t limit) {
+        channel_credit* c = getCredit(channel_id);
+        if (c == nullptr || (c->tx_flow && (int16_t)(limit - c->tx_limit) <= 0)) {
+            return; // Periodic messages can use up slots, but a limit never goes back down
+        }
+        if (!c->tx_flow || c->tx_limit == c->tx_told) {
+            c->tx_since = micros();
+        }
+        c->tx_flow = true;
+        c->tx_limit = limit;
+    }
+
+    // Puts the next TX limit the driver hasn't been sent into a frame header
+    void headerCredit(uint8_t* header) {
+        for (uint8_t i = 0; i < PCCOMM_CREDIT_CHANNELS; i++) {
+            uint8_t id = credit_next;
+            credit_next = credit_next % PCCOMM_CREDIT_CHANNELS + 1;
+            channel_credit* c = &credits[id];
+            if (c->tx_flow && c->tx_limit != c->tx_told) {
+                header[2] = id;
+                memcpy(&header[4], &c->tx_limit, 2);
+                c->tx_told = c->tx_limit;
+                return;
+            }
+        }
+    }
+
+    bool pollMessage(PCMSG *msg) {
+        if(SerialUSB.available() > 0) {
+            // Calculate how many bytes to read (min of avaliable bytes, or left to read to complete the frame)
+            uint16_t maxRead = min(SerialUSB.available(), FRAME_SIZE-read_count);
+            digitalWrite(DS7_RED, LOW);
+            SerialUSB.readBytes(&tempbuf[read_count], maxRead);
+            comm_stats.bytes_in += maxRead;
+            digitalWrite(DS7_RED, HIGH);
+            read_count += maxRead;
+        }
+        resync(0);
+        if (read_count < FRAME_SIZE) {
+            return false;
+        }
+        // Whole frame received, check it before trusting any of it
+        memcpy(msg, &tempbuf[FRAME_HEADER_SIZE], sizeof(PCMSG));
+        uint32_t crc;
+        memcpy(&crc, &tempbuf[FRAME_HEADER_SIZE + sizeof(PCMSG)], FRAME_CRC_SIZE);
+        if (msg->arg_size > sizeof(msg->args) || crc != frameCrc(tempbuf, msg)) {
+            comm_stats.rx_crc_errors++;
+            resync(1); // Sync bytes were real data, the next frame starts somewhere after them
+            return false;
+        }
+        read_count = 0;
+        uint16_t limit;
+        memcpy(&limit, &tempbuf[4], 2);
+        applyCredit(tempbuf[2], limit);
+        if (msg->cmd_id == CMD_CREDIT) { // Nothing else to do with these
+            for (uint16_t pos = 0; pos + CREDIT_RECORD_SIZE <= msg->arg_size; pos += CREDIT_RECORD_SIZE) {
+                memcpy(&limit, &msg->args[pos + 1], 2);
+                applyCredit(msg->args[pos], limit);
+            }
+            return false;
+        }
+        lastID = msg->msg_id; // Set this for response
+        last_rx_us = micros();
+        return true;
+    }
+
+    // One of the USB Tx rings. Only ever holds whole frames, so the bytes of the frame
+    // being written that are still to go are always used % FRAME_SIZE
+    struct tx_lane {
+        uint8_t* ring;
+        uint16_t size;
+        uint16_t head; // Next byte to queue
+        uint16_t tail; // Next byte to write to USB
+        uint16_t used;
+    };
+
+    uint8_t data_ring[PCCOMM_TX_RING_SIZE];
+    uint8_t ctrl_ring[PCCOMM_CTRL_RING_SIZE];
+    tx_lane data_lane = { data_ring, PCCOMM_TX_RING_SIZE, 0, 0, 0 }; // Channel data, logs and traces
+    tx_lane ctrl_lane = { ctrl_ring, PCCOMM_CTRL_RING_SIZE, 0, 0, 0 }; // Responses and everything else
+
+    // Bulk messages the driver can wait for. Anything a command round trip depends on must not be in here
+    tx_lane* laneFor(uint8_t cmd_id) {
+        switch (cmd_id) {
+            case CMD_CHANNEL_DATA:
+            case CMD_CHANNEL_DATA_PART:
+            case CMD_LOG:
+            case CMD_TRACE:
+            case CMD_TX_TRACE:
+                return &data_lane;
+            default:
+                return &ctrl_lane;
+        }
+    }
+
+    void queueBytes(tx_lane* lane, const uint8_t* data, uint16_t len) {
+        uint16_t first = min(len, lane->size - lane->head);
+        memcpy(&lane->ring[lane->head], data, first);
+        memcpy(&lane->ring[0], data + first, len - first);
+        lane->head = (lane->head + len) % lane->size;
+        lane->used += len;
+    }
+
+    // Queues a message for the PC. Only waits on USB if the ring is full, and log messages are dropped instead
+    void sendMessage(PCMSG *msg) {
+        const uint16_t size = FRAME_SIZE;
+        tx_lane* lane = laneFor(msg->cmd_id);
+        if (lane->size - lane->used < size) {
+            if (msg->cmd_id == CMD_LOG || msg->cmd_id == CMD_TRACE) { // Diagnostics only
+                comm_stats.dropped++;
+                return;
+            }
+            // Responses and channel data shouldn't be lost, the driver would be waiting on them
+            comm_stats.stalls++;
+            unsigned long start = millis();
+            while (lane->size - lane->used < size) {
+                flushTx();
+                if (millis() - start > PCCOMM_STALL_MS) {
+                    comm_stats.dropped++;
+                    return;
+                }
+            }
+        }
+        uint8_t header[FRAME_HEADER_SIZE] = { FRAME_SYNC_0, FRAME_SYNC_1 };
+        headerCredit(header);
+        uint32_t crc = frameCrc(header, msg);
+        queueBytes(lane, header, FRAME_HEADER_SIZE);
+        queueBytes(lane, (uint8_t*)msg, sizeof(PCMSG));
+        queueBytes(lane, (uint8_t*)&crc, FRAME_CRC_SIZE);
+        if (data_lane.used > comm_stats.peak) {
+            comm_stats.peak = data_lane.used;
+        }
+    }
+
+    // Writes the next USB packet worth of queued bytes. Messages are back to back, so small ones
+    // share packets rather than each ending in a short one. Control frames go next once the data
+    // frame being written has finished, frames are never mixed. True if there is more to write
+    bool flushTx() {
+        uint16_t data_left = data_lane.used % FRAME_SIZE; // Of the data frame part way out
+        tx_lane* lane = (ctrl_lane.used != 0 && data_left == 0) ? &ctrl_lane : &data_lane;
+        if (lane->used == 0) {
+            return false;
+        }
+        uint16_t len = min(min(lane->used, PCCOMM_TX_CHUNK), lane->size - lane->tail);
+        if (lane == &data_lane && ctrl_lane.used != 0) {
+            len = min(len, data_left); // Control frame is waiting, only finish this one
+        }
+        digitalWrite(DS7_GREEN, LOW);
+        size_t written = SerialUSB.write(&lane->ring[lane->tail], len);
+        digitalWrite(DS7_GREEN, HIGH);
+        if (written > len) { // Error (Host not listening), try again next time
+            written = 0;
+        }
+        lane->tail = (lane->tail + written) % lane->size;
+        lane->used -= written;
+        comm_stats.bytes_out += written;
+        return data_lane.used != 0 || ctrl_lane.used != 0;
+    }
+
+    // Sends TX limits in a CMD_CREDIT when enough have built up, or the driver could be
+    // waiting on one. Busy links never get here, their frame headers carry the limits
+    void flushCredits() {
+        if (ctrl_lane.used + FRAME_SIZE > ctrl_lane.size) { // Frames already waiting will carry the limits
+            return;
+        }
+        bool refresh = millis() - credit_refresh_ms >= PCCOMM_CREDIT_REFRESH_MS;
+        bool due = refresh;
+        uint32_t now = micros();
+        for (uint8_t id = 1; id <= PCCOMM_CREDIT_CHANNELS && !due; id++) {
+            channel_credit* c = &credits[id];
+            if (c->tx_flow && c->tx_limit != c->tx_told) {
+                due = (uint16_t)(c->tx_limit - c->tx_told) >= PCCOMM_CREDIT_BATCH || now - c->tx_since >= PCCOMM_CREDIT_DELAY_US;
+            }
+        }
+        if (!due) {
+            return;
+        }
+        if (refresh) {
+            credit_refresh_ms = millis();
+        }
+        PCMSG msg = {0x00};
+        msg.cmd_id = CMD_CREDIT;
+        for (uint8_t id = 1; id <= PCCOMM_CREDIT_CHANNELS; id++) {
+            channel_credit* c = &credits[id];
+            if (c->tx_flow && (refresh || c->tx_limit != c->tx_told)) {
+                msg.args[msg.arg_size] = id;
+                memcpy(&msg.args[msg.arg_size + 1], &c->tx_limit, 2);
+                msg.arg_size += CREDIT_RECORD_SIZE;
+                c->tx_told = c->tx_limit;
+            }
+        }
+        if (msg.arg_size != 0) {
+            sendMessage(&msg);
+        }
+    }
+
+    uint32_t lastRxTime() {
+        return last_rx_us;
+    }
+
+    void getStats(pc_comm_stats* stats) {
+        memcpy(stats, &comm_stats, sizeof(pc_comm_stats));
+    }
+
+    void resetPeak() {
+        comm_stats.peak = data_lane.used;
+    }
+
+    void logToSerial(char* msg) {
+        uint16_t len = min(strlen(msg), sizeof(PCMSG::args));
+        PCMSG res = {0x00};
+        res.cmd_id = CMD_LOG;
+        res.arg_size = len;
+        memcpy(res.args, msg, len);
+        sendMessage(&res);
+    }
+
+    void respondOK(uint8_t cmd_id, uint8_t* resp_data, uint16_t resp_data_len) {
+        PCMSG send = {
+            cmd_id | CMD_RES_FROM_CMD,
+            STATUS_NOERROR,
+            resp_data_len+1
+        };
+        send.msg_id = lastID;
+        memcpy(&send.args[1], resp_data, min(resp_data_len, sizeof(send.args) - 1));
+        sendMessage(&send);
+    }
+
+    void respondFail(uint8_t cmd_id, uint8_t err_code, char* msg) {
+        uint16_t len = min(strlen(msg), sizeof(PCMSG::args));
+        PCMSG send = {
+            cmd_id | CMD_RES_FROM_CMD,
+            err_code,
+            len
+        };
+        send.msg_id = lastID;
+        memcpy(send.args, msg, len);
+        sendMessage(&send);
+    }
+
+    // Sends a payload for a channel, splitting it into parts if it doesn't fit in one message
+    void sendChannelData(uint8_t channel_id, uint8_t* data, uint16_t len) {
+        channel_credit* c = getCredit(channel_id);
+        if (c != nullptr) {
+            c->rx_sent += messagesFor(len);
+        }
+        PCMSG tx = {0x00};
+        tx.args[0] = channel_id;
+        if (len <= sizeof(tx.args) - 1) {
+            tx.cmd_id = CMD_CHANNEL_DATA;
+            tx.arg_size = len + 1; // +1 for Channel ID
+            memcpy(&tx.args[1], data, len);
+            sendMessage(&tx);
+            return;
+        }
+        tx.cmd_id = CMD_CHANNEL_DATA_PART;
+        uint32_t total = len;
+        memcpy(&tx.args[1], &total, 4);
+        for (uint32_t offset = 0; offset < total; offset += DATA_PART_MAX_BYTES) {
+            uint16_t part_len = min(DATA_PART_MAX_BYTES, total - offset);
+            memcpy(&tx.args[5], &offset, 4);
+            memcpy(&tx.args[DATA_PART_HEADER_SIZE], &data[offset], part_len);
+            tx.arg_size = DATA_PART_HEADER_SIZE + part_len;
+            sendMessage(&tx);
+        }
+    }
+
+    // Result of an IOCTL that ran in the background (FIVE_BAUD_INIT, FAST_INIT)
+    void sendIoctlResult(uint8_t channel_id, uint32_t ioctl_id, uint8_t status, uint8_t* data, uint16_t len) {
+        PCMSG tx = {0x00};
+        tx.cmd_id = CMD_CHANNEL_IOCTL_RESP;
+        len = min(len, sizeof(tx.args) - IOCTL_RESP_HEADER_SIZE);
+        tx.arg_size = IOCTL_RESP_HEADER_SIZE + len;
+        tx.args[0] = channel_id;
+        memcpy(&tx.args[1], &ioctl_id, 4);
+        tx.args[5] = status;
+        memcpy(&tx.args[IOCTL_RESP_HEADER_SIZE], data, len);
+        sendMessage(&tx);
+    }
+
+    // Stage times of a traced message, once its last frame is on the bus
+    void sendTxTrace(uint8_t channel_id, uint16_t trace_id, uint32_t usb_us, uint32_t tx_us, uint32_t bus_us) {
+        PCMSG tx = {0x00};
+        tx.cmd_id = CMD_TX_TRACE;
+        tx.arg_size = TX_TRACE_SIZE;
+        tx.args[0] = channel_id;
+        memcpy(&tx.args[1], &trace_id, 2);
+        memcpy(&tx.args[3], &usb_us, 4);
+        memcpy(&tx.args[7], &tx_us, 4);
+        memcpy(&tx.args[11], &bus_us, 4);
+        uint32_t now = micros();
+        memcpy(&tx.args[15], &now, 4);
+        sendMessage(&tx);
+    }
 };
\ No newline at end of file
@@ -1,69 +1,208 @@
-/*
-**
-** Copyright (C) 2020 Ashcon Mohseninia
-** Author: Ashcon Mohseninia <ashcon50@gmail.com>
-**
-** This library is free software; you can redistribute it and/or modify
-** it under the terms of the GNU Lesser General Public License as published
-** by the Free Software Foundation, either version 3 of the License, or (at
-** your option) any later version.
-**
-** This library is distributed in the hope that it will be useful,
-** but WITHOUT ANY WARRANTY; without even the implied warranty of
-** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-** Lesser General Public License for more details.
-**
-** You should have received a copy of the GNU Lesser General Public
-** License along with this library; if not, <http://www.gnu.org/licenses/>.
-**
-*/
-
-#pragma once
-
-#ifndef PC_COMM_H
-#define PC_COMM_H
-
-#include <stdint.h>
-#include <Arduino.h>
-
-struct PCMSG { // Total 512 bytes
-    uint8_t cmd_id;
-    uint8_t resp_code; // J2534 response code
-    uint16_t arg_size;
-    uint8_t args[512];
-    uint8_t msg_id;
-    bool __require_response;
-};
-
-
-namespace PCCOMM {
-    bool pollMessage(PCMSG *msg);
-    void sendMessage(PCMSG *msg);
-    void logToSerial(char* msg);
-    void respondOK(uint8_t cmd_id, uint8_t* resp_data, uint16_t resp_data_len);
-    void respondFail(uint8_t cmd_id, uint8_t err_code, char* msg);
-};
-
-
-// Command ID's for Misc
-#define CMD_LOG  0x01
-#define CMD_PING 0x02
-
-// Channel command ID's
-#define CMD_CHANNEL_CREATE     0x03 // Creating a new channel
-#define CMD_CHANNEL_DATA       0x04 // Send data to/from channel
-#define CMD_CHANNEL_DESTROY    0x05 // Killing a channel
-#define CMD_CHANNEL_IOCTL_REQ  0x06 // IOCTL request to device
-#define CMD_CHANNEL_IOCTL_RESP 0x07 // IOCTL Response from device
-#define CMD_CHANNEL_SET_FILTER 0x08 // Add a filter to a channel
-#define CMD_CHANNEL_REM_FILTER 0x09 // Remove a filter from a channel;
-
-// Command responses (From macchina)
-#define CMD_RES_FROM_CMD       0xA0 // This gets put onto the first nibble of a CMD Id if its the Macchina responding from it 
-#define CMD_RES_STATE_OK       0x10 // Command sent to Macchina was OK
-#define CMD_RES_STATE_FAIL     0x20 // Command send to Macchina failed, args contains error message
-
-#define CMD_EXIT 0xFF // If sent, device will reset itself back into default state (Assume use app has quit)
-
-
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+#pragma once
+
+#ifndef PC_COMM_H
+#define PC_COMM_H
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// USB Tx rings. Messages are queued here and written out by flushTx(), so nothing waits on the PC.
+// Responses and other control messages have their own ring, which goes out ahead of channel data
+// as soon as the frame being written is finished, so a command round trip never waits behind a full ring
+#ifndef PCCOMM_TX_RING_SIZE
+#define PCCOMM_TX_RING_SIZE 8192 // 15 frames
+#endif
+#ifndef PCCOMM_CTRL_RING_SIZE
+#define PCCOMM_CTRL_RING_SIZE 2120 // 4 frames
+#endif
+#define PCCOMM_TX_CHUNK 512 // Bulk endpoint size, one USB packet per write
+#define PCCOMM_STALL_MS 100 // Longest a message waits for room before being dropped (PC gone)
+
+struct pc_comm_stats {
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint16_t peak; // Most bytes ever waiting in the data Tx ring
+    uint32_t dropped; // Messages thrown away because the ring was full
+    uint32_t stalls; // Times a message had to wait for the PC because the ring was full
+    uint32_t rx_crc_errors; // Frames from the PC thrown away as corrupt
+    uint32_t rx_skipped; // Bytes from the PC thrown away finding the start of a frame
+};
+
+// Flow control (See CMD_CREDIT)
+#define PCCOMM_CREDIT_CHANNELS 16 // Highest channel ID that can be flow controlled
+#define PCCOMM_CREDIT_BATCH 16 // TX credits given back in one go once this many are waiting...
+#define PCCOMM_CREDIT_DELAY_US 500 // ...or once the first of them has waited this long
+#define PCCOMM_CREDIT_REFRESH_MS 100 // Every TX limit is sent again this often, in case an update was lost
+#define CREDIT_UNLIMITED 0xFFFF
+
+struct PCMSG { // Total 512 bytes
+    uint8_t cmd_id;
+    uint8_t resp_code; // J2534 response code
+    uint16_t arg_size;
+    uint8_t args[512];
+    uint8_t msg_id;
+    bool __require_response;
+    uint16_t trace_id; // Non zero to time this message through to the bus (See CMD_TX_TRACE)
+};
+
+// Every PCMSG goes inside a frame (Both directions), so after lost or mangled bytes
+// the next good message is found again. Same as link_frame.h in the driver
+// 0-1     - FRAME_SYNC_0, FRAME_SYNC_1
+// 2       - Channel ID of the credit update carried by this frame, 0 if none (See CMD_CREDIT)
+// 3       - Unused, 0
+// 4-5     - Credit limit for that channel
+// 6-525   - PCMSG
+// 526-529 - CRC-32 of bytes 2-5, the PCMSG header, arg_size bytes of args, and the fields after args
+#define FRAME_SYNC_0 0xA5
+#define FRAME_SYNC_1 0x5A
+#define FRAME_HEADER_SIZE 6
+#define FRAME_CRC_SIZE 4
+#define FRAME_SIZE (FRAME_HEADER_SIZE + sizeof(PCMSG) + FRAME_CRC_SIZE)
+
+namespace PCCOMM {
+    bool pollMessage(PCMSG *msg);
+    void sendMessage(PCMSG *msg);
+    bool flushTx();
+    void getStats(pc_comm_stats* stats);
+    void resetPeak();
+    void logToSerial(char* msg);
+    void respondOK(uint8_t cmd_id, uint8_t* resp_data, uint16_t resp_data_len);
+    void respondFail(uint8_t cmd_id, uint8_t err_code, char* msg);
+    void sendChannelData(uint8_t channel_id, uint8_t* data, uint16_t len);
+    void sendIoctlResult(uint8_t channel_id, uint32_t ioctl_id, uint8_t status, uint8_t* data, uint16_t len);
+    void sendTxTrace(uint8_t channel_id, uint16_t trace_id, uint32_t usb_us, uint32_t tx_us, uint32_t bus_us);
+    uint32_t lastRxTime();
+    void openCredits(uint8_t channel_id, uint16_t rx_window);
+    void closeCredits(uint8_t channel_id);
+    uint16_t rxCredits(uint8_t channel_id);
+    uint16_t messagesFor(uint16_t len);
+    void setTxLimit(uint8_t channel_id, uint16_t limit);
+    void flushCredits();
+};
+
+
+// Command ID's for Misc
+#define CMD_LOG  0x01
+#define CMD_PING 0x02
+
+// Channel command ID's
+#define CMD_CHANNEL_CREATE     0x03 // Creating a new channel
+#define CMD_CHANNEL_DATA       0x04 // Send data to/from channel
+#define CMD_CHANNEL_DESTROY    0x05 // Killing a channel
+#define CMD_CHANNEL_IOCTL_REQ  0x06 // IOCTL request to device
+#define CMD_CHANNEL_IOCTL_RESP 0x07 // IOCTL Response from device
+#define CMD_CHANNEL_SET_FILTER 0x08 // Add a filter to a channel
+#define CMD_CHANNEL_REM_FILTER 0x09 // Remove a filter from a channel;
+#define CMD_CHANNEL_DATA_PART  0x0A // Part of channel data too big for one message (See below)
+#define CMD_CHANNEL_START_PERIODIC 0x0B // Start (Or replace) a periodic message (See below)
+#define CMD_CHANNEL_STOP_PERIODIC  0x0C // Stop a periodic message. Args - Channel ID, message ID
+#define CMD_TRACE              0x0D // Binary trace events (See trace.h)
+#define CMD_STATS              0x0E // Performance counters. Args - STATS_* flags. Response is a device_stats (See stats.h)
+#define CMD_TX_TRACE           0x0F // Where the time went for a message sent with a trace_id (See below)
+#define CMD_HELLO              0x10 // Handshake when the driver opens the port. Args - Driver's PC_PROTOCOL_VERSION (16bit). Response below
+#define CMD_CREDIT             0x11 // Flow control limits (Both directions, see below). No response
+
+// CMD_HELLO response format
+// 0-1 - PC_PROTOCOL_VERSION. Goes up when a message changes in a way older drivers can't handle
+// 2-5 - Capabilities (CAP_*)
+// 6   - Number of channels
+// 7.. - Firmware build date and time, NUL terminated
+#define HELLO_SIZE 32
+#define PC_PROTOCOL_VERSION 3
+
+#define CAP_CAN_BATCH 0x00000001 // CAN frames are batched in CMD_CHANNEL_DATA
+#define CAP_DATA_PART 0x00000002 // CMD_CHANNEL_DATA_PART
+#define CAP_PERIODIC  0x00000004 // Periodic messages run on the device
+#define CAP_STATS     0x00000008 // CMD_STATS
+#define CAP_TX_TRACE  0x00000010 // CMD_TX_TRACE
+#define CAP_KLINE     0x00000020 // ISO9141 and ISO14230 channels
+
+// CMD_CHANNEL_CREATE args format
+// 0     - Channel ID
+// 1     - Protocol (PROTOCOL_*)
+// 2-5   - Baud rate
+// 6-9   - Connect flags
+// 10-11 - RX window. Data messages the driver has room for, 0 to send without limit (See below)
+
+// Credit based flow control. Each side only sends a channel what the other has room for.
+// Limits are running totals from when the channel was created (16 bit, wrapping), so an
+// update that goes missing is made up by the next one rather than losing credits for good
+// TX - Raw CAN channels. Limit is CAN records the driver may have sent, going up as the Tx ring drains
+// RX - Channels created with an RX window. Limit is CMD_CHANNEL_DATA and CMD_CHANNEL_DATA_PART
+//      messages Macchina may have sent, going up as the application reads from the driver
+// One update rides in the header of every frame. CMD_CREDIT carries all the waiting updates
+// when there is no other traffic for them, its args are records of:
+// 0   - Channel ID
+// 1-2 - Limit
+#define CREDIT_RECORD_SIZE 3
+
+// CMD_CHANNEL_SET_FILTER args format
+// 0     - Channel ID
+// 1     - Filter ID
+// 2     - Filter type
+// 3-6   - Mask (32bit)
+// 7-10  - Pattern (32bit)
+// 11-14 - Flow control (32bit)
+// 15-17 - Extended address bytes (Mask, pattern, flow control)
+#define FILTER_ARGS_SIZE 18
+
+// CMD_CHANNEL_START_PERIODIC args format
+// 0   - Channel ID
+// 1   - Message ID (1 based)
+// 2-5 - Interval in ms (32bit)
+// 6.. - Message, formatted the same as CMD_CHANNEL_DATA
+#define PERIODIC_HEADER_SIZE 6
+
+// CMD_CHANNEL_IOCTL_RESP args format (IOCTLs that finish after their CMD_CHANNEL_IOCTL_REQ was answered)
+// 0     - Channel ID
+// 1-4   - IOCTL ID (32bit)
+// 5     - J2534 status
+// 6-511 - Output
+#define IOCTL_RESP_HEADER_SIZE 6
+
+// CMD_TX_TRACE args format. All times are micros() on the device
+// 0     - Channel ID
+// 1-2   - Trace ID of the message
+// 3-6   - Message finished arriving over USB
+// 7-10  - Handler started transmitting it
+// 11-14 - Last frame of it left the CAN controller
+// 15-18 - This report was queued for the PC
+#define TX_TRACE_SIZE 19
+
+// CMD_CHANNEL_DATA_PART args format
+// 0     - Channel ID
+// 1-4   - Total payload size (32bit)
+// 5-8   - Offset of this part within the payload (32bit)
+// 9-511 - Payload bytes
+#define DATA_PART_HEADER_SIZE  9
+#define DATA_PART_MAX_BYTES    (512 - DATA_PART_HEADER_SIZE)
+
+// Command responses (From macchina)
+#define CMD_RES_FROM_CMD       0xA0 // This gets put onto the first nibble of a CMD Id if its the Macchina responding from it 
+#define CMD_RES_STATE_OK       0x10 // Command sent to Macchina was OK
+#define CMD_RES_STATE_FAIL     0x20 // Command send to Macchina failed, args contains error message
+
+#define CMD_EXIT 0xFF // If sent, device will reset itself back into default state (Assume use app has quit)
+
+
 #endif
\ No newline at end of file
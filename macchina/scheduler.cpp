@@ -0,0 +1,143 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#include "scheduler.h"
+#include <Arduino.h>
+
+struct sched_task {
+    bool in_use;
+    sched_fn fn;
+    void* ctx;
+    uint32_t last_start;
+    sched_task_stats stats;
+};
+
+namespace SCHED {
+    sched_task tasks[SCHED_MAX_TASKS] = {};
+    uint32_t loop_hist[SCHED_LOOP_BUCKETS] = {0};
+    uint32_t loop_max_us = 0;
+
+    // Every pass of run(), so the worst case the PC or a bus sees for anything waiting on loop()
+    void record_pass(uint32_t us) {
+        uint8_t b = 0;
+        while (b < SCHED_LOOP_BUCKETS - 1 && us >= (4UL << b)) {
+            b++;
+        }
+        loop_hist[b]++;
+        if (us > loop_max_us) {
+            loop_max_us = us;
+        }
+    }
+
+    // Returns the task ID, or -1 if the table is full
+    int8_t add(const char* name, sched_fn fn, void* ctx, uint32_t period_us, uint32_t budget_us) {
+        for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) {
+            if (!tasks[i].in_use) {
+                memset(&tasks[i], 0x00, sizeof(sched_task));
+                tasks[i].fn = fn;
+                tasks[i].ctx = ctx;
+                tasks[i].last_start = micros() - period_us; // Due straight away
+                tasks[i].stats.name = name;
+                tasks[i].stats.period_us = period_us;
+                tasks[i].stats.budget_us = budget_us;
+                tasks[i].in_use = true;
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void remove(int8_t id) {
+        if (id >= 0 && id < SCHED_MAX_TASKS) {
+            tasks[id].in_use = false;
+        }
+    }
+
+    // Runs the most urgent task that is due. Call this from loop()
+    void run() {
+        uint32_t now = micros();
+        sched_task* next = nullptr;
+        uint32_t next_late = 0;
+        for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) {
+            sched_task* t = &tasks[i];
+            if (!t->in_use) {
+                continue;
+            }
+            uint32_t since = now - t->last_start;
+            if (since < t->stats.period_us) {
+                continue; // Not due yet
+            }
+            uint32_t late = since - t->stats.period_us; // How far past its deadline
+            if (next == nullptr || late > next_late) {
+                next = t;
+                next_late = late;
+            }
+        }
+        if (next == nullptr) {
+            record_pass(micros() - now);
+            return;
+        }
+        if (next_late > next->stats.max_late_us && next->stats.period_us != 0) {
+            next->stats.max_late_us = next_late;
+        }
+        next->last_start = now;
+        next->fn(next->ctx);
+        uint32_t took = micros() - now;
+        next->stats.runs++;
+        if (took > next->stats.max_us) {
+            next->stats.max_us = took;
+        }
+        if (took > next->stats.budget_us) {
+            next->stats.overruns++;
+        }
+        record_pass(took);
+    }
+
+    // Stats of the idx'th active task. False once there are no more
+    bool getStats(uint8_t idx, sched_task_stats* stats) {
+        for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) {
+            if (tasks[i].in_use && idx-- == 0) {
+                memcpy(stats, &tasks[i].stats, sizeof(sched_task_stats));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void getLoopStats(uint32_t* hist, uint32_t* max_us) {
+        memcpy(hist, loop_hist, sizeof(loop_hist));
+        *max_us = loop_max_us;
+    }
+
+    void resetLoopStats() {
+        memset(loop_hist, 0x00, sizeof(loop_hist));
+        loop_max_us = 0;
+    }
+
+    void resetStats() {
+        for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) {
+            tasks[i].stats.runs = 0;
+            tasks[i].stats.max_us = 0;
+            tasks[i].stats.overruns = 0;
+            tasks[i].stats.max_late_us = 0;
+        }
+    }
+};
@@ -0,0 +1,64 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#ifndef SCHED_MAX_TASKS
+#define SCHED_MAX_TASKS 16 // USB, LEDs, periodic messages, trace, autobaud and one per channel
+#endif
+#define SCHED_LOOP_BUCKETS 12 // Pass time histogram. Bucket 0 < 4us, bucket n < 2^(n+2)us, last one is everything longer
+
+typedef void (*sched_fn)(void* ctx);
+
+struct sched_task_stats {
+    const char* name;
+    uint32_t period_us;
+    uint32_t budget_us;
+    uint32_t runs;
+    uint32_t max_us; // Longest single run
+    uint32_t overruns; // Runs that took longer than budget_us
+    uint32_t max_late_us; // Worst time past its deadline before it got to run
+};
+
+/**
+ * Cooperative earliest deadline first scheduler for loop(). A task is due
+ * once period_us has passed since it last started (0 = Every pass), and its
+ * deadline is that moment. Out of the due tasks the one with the earliest
+ * deadline runs, so a task that keeps being due (USB, channels) can never
+ * starve the others. Tasks must return within their budget - Nothing is
+ * preempted, overruns are only counted
+ */
+namespace SCHED {
+    int8_t add(const char* name, sched_fn fn, void* ctx, uint32_t period_us, uint32_t budget_us);
+    void remove(int8_t id);
+    void run();
+    bool getStats(uint8_t idx, sched_task_stats* stats);
+    void getLoopStats(uint32_t* hist, uint32_t* max_us);
+    void resetStats();
+    void resetLoopStats();
+};
+
+#endif
@@ -0,0 +1,76 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Layout of the CMD_STATS response. Must match MACCHINA_DEVICE_STATS in the driver (macchina_j2534_ext.h).
+// Counters only ever go up (The driver takes the difference between reads),
+// the histogram, maximums and peaks are cleared when the request asks for it
+
+#define STATS_LOOP_BUCKETS 12 // loop() time histogram. Bucket 0 < 4us, bucket n < 2^(n+2)us, last one is everything longer
+#define STATS_MAX_CHANNELS 10
+
+#define STATS_RESET 0x01 // CMD_STATS args[0] - Clear the histogram, maximums and peaks after reading
+
+struct __attribute__((packed)) can_stats {
+    uint32_t rx_frames; // Received by the controller, including ones nobody wanted
+    uint32_t bus_errors;
+    uint32_t rx_dropped; // Rx ring full
+    uint32_t rx_overwritten; // Lost in a mailbox
+    uint16_t rx_ring_peak;
+    uint16_t tx_ring_peak;
+    uint8_t tx_error_cnt; // TEC right now
+    uint8_t rx_error_cnt; // REC right now
+};
+
+struct __attribute__((packed)) channel_stats {
+    uint8_t id; // 0 if the slot is unused
+    uint32_t rx_frames; // Sent to the PC
+    uint32_t tx_frames; // Sent on the bus
+    uint32_t rx_dropped; // Could not be passed to the PC
+    uint32_t tx_dropped; // Could not be sent on the bus
+    uint32_t rx_filtered; // Thrown away by the channel's filters
+};
+
+struct __attribute__((packed)) device_stats {
+    uint32_t uptime_ms;
+    uint32_t loop_hist[STATS_LOOP_BUCKETS];
+    uint32_t loop_max_us;
+    uint32_t usb_bytes_in;
+    uint32_t usb_bytes_out;
+    uint16_t usb_tx_peak;
+    uint32_t usb_tx_stalls;
+    uint32_t usb_tx_dropped;
+    can_stats can[2];
+    channel_stats channels[STATS_MAX_CHANNELS];
+    uint32_t usb_rx_crc_errors; // Frames from the PC thrown away as corrupt
+    uint32_t usb_rx_skipped; // Bytes from the PC thrown away finding the start of a frame
+    uint8_t pool_small_peak; // Most block pool blocks in use at once
+    uint8_t pool_large_peak;
+    uint16_t pool_failed; // Block pool acquires that could not be served (Payloads that were refused for it)
+};
+
+#endif
@@ -0,0 +1,442 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+// K-Line engine (kline_handler.cpp) against a simulated line and ECU on the host. Time is
+// simulated too, tick() runs exactly when the engine schedules it, so every gap can be checked
+// to the microsecond. The Arduino IDE only builds the sketch folder itself, so this is left out
+//
+// g++ -std=c++17 -Wall -I.. kline_test.cpp ../kline_handler.cpp -o kline_test && ./kline_test
+
+#include "kline_handler.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define TEST_BAUD 10400
+#define BYTE_US (uint32_t)(10000000UL / TEST_BAUD)
+#define P1_MAX_US (40 * 500) // J2534 defaults
+#define P3_MIN_US (110 * 500)
+#define P4_MIN_US (10 * 500)
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+// One byte on the line. Bytes are heard (By both sides) once their stop bit is done
+struct line_byte {
+    uint32_t start;
+    uint32_t heard;
+    uint8_t value; // What the line carried, which the UART reads back
+    bool tester;
+};
+
+// Line level the tester drove directly (Wake up patterns), or -1 when it gave the line back to the UART
+struct line_level {
+    uint32_t at;
+    int level;
+};
+
+/**
+ * Both ends of the K-Line. The tester side is the kline_port the engine drives, the
+ * ECU side answers each request after P2, and can also be told to send by the test
+ */
+class sim_kline_port : public kline_port {
+public:
+    void begin(uint32_t baud) {
+        this->baud = baud;
+        this->open = true;
+    }
+    void end() {
+        this->open = false;
+    }
+    int read() {
+        if (!this->open || this->rx_pos >= this->rx.size() || this->rx[this->rx_pos].heard > this->now) {
+            return -1;
+        }
+        return this->rx[this->rx_pos++].value;
+    }
+    void write(uint8_t b) {
+        line_byte l = { this->now, this->now + BYTE_US, b, true };
+        this->tester.push_back(l);
+        if (this->tester.size() - 1 == this->corrupt_echo) { // Something else talked over this byte
+            l.value ^= 0x5A;
+        }
+        if (this->echo) {
+            this->hear(l);
+        }
+        this->heard_by_ecu++;
+        if (this->heard_by_ecu == this->reply_after) {
+            this->ecuSend(l.heard + this->reply_p2, this->reply, this->reply_gap);
+        }
+    }
+    uint32_t micros() {
+        return this->now;
+    }
+    void schedule(uint32_t us) {
+        this->armed = true;
+        this->tick_at = this->now + us;
+    }
+    void cancel() {
+        this->armed = false;
+    }
+    void drive(bool high) {
+        this->levels.push_back({ this->now, high ? 1 : 0 });
+    }
+    void release_line() {
+        this->levels.push_back({ this->now, -1 });
+    }
+
+    // ECU sends a message, starting at 'start' with 'gap' us between its bytes
+    void ecuSend(uint32_t start, std::vector<uint8_t> data, uint32_t gap) {
+        for (uint8_t b : data) {
+            line_byte l = { start, start + BYTE_US, b, false };
+            this->ecu.push_back(l);
+            this->hear(l);
+            start = l.heard + gap;
+        }
+    }
+
+    // Sent by the ECU once it has heard 'after' more bytes from the tester
+    void replyAfter(uint16_t after, std::vector<uint8_t> data, uint32_t p2, uint32_t gap) {
+        this->heard_by_ecu = 0;
+        this->reply_after = after;
+        this->reply = data;
+        this->reply_p2 = p2;
+        this->reply_gap = gap;
+    }
+
+    // Runs the engine's timer until 'until'
+    void run(kline_handler* k, uint32_t until) {
+        while (this->armed && this->tick_at <= until) {
+            this->now = this->tick_at;
+            this->armed = false;
+            k->tick();
+        }
+        this->now = until;
+    }
+
+    uint32_t now = 0;
+    uint32_t baud = 0;
+    bool echo = true; // False for a transceiver that is off
+    size_t corrupt_echo = SIZE_MAX; // Index into tester of a byte that collides
+    std::vector<line_byte> tester;
+    std::vector<line_byte> ecu;
+    std::vector<line_level> levels;
+private:
+    // Keeps rx in the order bytes finish, which is how the UART hands them over
+    void hear(line_byte l) {
+        size_t i = this->rx.size();
+        while (i > this->rx_pos && this->rx[i - 1].heard > l.heard) {
+            i--;
+        }
+        this->rx.insert(this->rx.begin() + i, l);
+    }
+    bool open = false;
+    bool armed = false;
+    uint32_t tick_at = 0;
+    std::vector<line_byte> rx;
+    size_t rx_pos = 0;
+    uint16_t heard_by_ecu = 0;
+    uint16_t reply_after = 0;
+    std::vector<uint8_t> reply;
+    uint32_t reply_p2 = 0;
+    uint32_t reply_gap = 0;
+};
+
+static uint8_t checksum(std::vector<uint8_t> data) {
+    uint8_t cs = 0;
+    for (uint8_t b : data) {
+        cs += b;
+    }
+    return cs;
+}
+
+static std::vector<uint8_t> withChecksum(std::vector<uint8_t> data) {
+    data.push_back(checksum(data));
+    return data;
+}
+
+static bool sameBytes(const uint8_t* data, uint16_t len, std::vector<uint8_t> want) {
+    return len == want.size() && memcmp(data, want.data(), len) == 0;
+}
+
+// Request goes out P3 after the bus was last used, P4 between its bytes, with a checksum on the end
+static void test_request_timing() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    std::vector<uint8_t> req = { 0x68, 0x6A, 0xF1, 0x01, 0x00 };
+    CHECK(k.send(req.data(), req.size()));
+    port.run(&k, 200000);
+    std::vector<uint8_t> want = withChecksum(req);
+    CHECK(port.tester.size() == want.size());
+    if (port.tester.size() != want.size()) {
+        return;
+    }
+    CHECK(port.tester[0].start >= P3_MIN_US && port.tester[0].start <= P3_MIN_US + KLINE_TICK_US);
+    for (size_t i = 0; i < want.size(); i++) {
+        CHECK(port.tester[i].value == want[i]);
+        if (i > 0) {
+            uint32_t gap = port.tester[i].start - port.tester[i - 1].heard;
+            CHECK(gap >= P4_MIN_US && gap <= P4_MIN_US + KLINE_TICK_US);
+        }
+    }
+    kline_msg msg;
+    CHECK(!k.read(&msg)); // Our own echo is never a message
+    CHECK(k.getErrors() == 0);
+}
+
+// Response ends once the line has been quiet for P1, the next request waits P3 after it
+static void test_response_p1_p3() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    std::vector<uint8_t> req = { 0x68, 0x6A, 0xF1, 0x01, 0x00 };
+    std::vector<uint8_t> resp = { 0x48, 0x6B, 0x10, 0x41, 0x00, 0xBE, 0x1F, 0xB8, 0x10 };
+    port.replyAfter(req.size() + 1, withChecksum(resp), 30000, P1_MAX_US / 2); // Slow ECU, but within P1
+    CHECK(k.send(req.data(), req.size()));
+    port.run(&k, 100000);
+    CHECK(port.ecu.size() == resp.size() + 1);
+    if (port.ecu.size() != resp.size() + 1) {
+        return;
+    }
+    uint32_t last = port.ecu.back().heard;
+    kline_msg msg;
+    port.run(&k, last + P1_MAX_US - KLINE_TICK_US);
+    CHECK(!k.read(&msg)); // Could still be more coming
+    port.run(&k, last + P1_MAX_US + 2 * KLINE_TICK_US);
+    CHECK(k.read(&msg));
+    CHECK(sameBytes(msg.data, msg.len, resp));
+    CHECK(msg.timestamp >= port.ecu[0].heard && msg.timestamp <= port.ecu[0].heard + KLINE_TICK_US);
+    CHECK(!k.read(&msg));
+
+    size_t sent = port.tester.size();
+    CHECK(k.send(req.data(), req.size()));
+    port.run(&k, last + 2 * P3_MIN_US);
+    CHECK(port.tester.size() > sent);
+    if (port.tester.size() > sent) {
+        uint32_t gap = port.tester[sent].start - last;
+        CHECK(gap >= P3_MIN_US && gap <= P3_MIN_US + KLINE_TICK_US);
+    }
+    CHECK(k.getErrors() == 0);
+}
+
+// A gap longer than P1 splits what the ECU sends into two messages
+static void test_p1_split() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    std::vector<uint8_t> a = { 0x48, 0x6B, 0x10, 0x41, 0x00 };
+    std::vector<uint8_t> b = { 0x48, 0x6B, 0x18, 0x41, 0x00 };
+    port.ecuSend(10000, withChecksum(a), 0);
+    port.ecuSend(port.ecu.back().heard + P1_MAX_US + 2000, withChecksum(b), 0);
+    port.run(&k, 200000);
+    kline_msg msg;
+    CHECK(k.read(&msg) && sameBytes(msg.data, msg.len, a));
+    CHECK(k.read(&msg) && sameBytes(msg.data, msg.len, b));
+    CHECK(!k.read(&msg));
+    CHECK(k.getErrors() == 0);
+}
+
+// Bad checksums are counted and dropped, no checksum mode passes everything through as is
+static void test_checksum() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    std::vector<uint8_t> bad = withChecksum({ 0x48, 0x6B, 0x10, 0x41, 0x00 });
+    bad.back() ^= 0x01;
+    port.ecuSend(10000, bad, 0);
+    port.run(&k, 100000);
+    kline_msg msg;
+    CHECK(!k.read(&msg));
+    CHECK(k.getErrors() == 1);
+    k.release();
+
+    sim_kline_port raw_port;
+    kline_handler raw(&raw_port);
+    CHECK(raw.claim(TEST_BAUD, false, false));
+    std::vector<uint8_t> req = { 0x68, 0x6A, 0xF1, 0x01, 0x00 };
+    CHECK(raw.send(req.data(), req.size()));
+    raw_port.ecuSend(150000, bad, 0);
+    raw_port.run(&raw, 300000);
+    CHECK(raw_port.tester.size() == req.size()); // Nothing added
+    CHECK(raw.read(&msg) && sameBytes(msg.data, msg.len, bad));
+    CHECK(raw.getErrors() == 0);
+}
+
+// Echo that doesn't match what we sent means someone else is talking. The rest of the
+// message is abandoned, and the next one goes out normally
+static void test_collision() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    port.corrupt_echo = 2;
+    std::vector<uint8_t> req = { 0x68, 0x6A, 0xF1, 0x01, 0x00 };
+    CHECK(k.send(req.data(), req.size()));
+    port.run(&k, 200000);
+    CHECK(port.tester.size() == 3);
+    CHECK(k.getErrors() == 1);
+    kline_msg msg;
+    CHECK(!k.read(&msg)); // The mangled byte is not passed on either
+
+    CHECK(k.send(req.data(), req.size()));
+    port.run(&k, 400000);
+    CHECK(port.tester.size() == 3 + req.size() + 1);
+    CHECK(k.getErrors() == 1);
+}
+
+// No echo at all means the line is stuck or the transceiver is off
+static void test_no_echo() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    port.echo = false;
+    std::vector<uint8_t> req = { 0x68, 0x6A, 0xF1, 0x01, 0x00 };
+    CHECK(k.send(req.data(), req.size()));
+    port.run(&k, 200000);
+    CHECK(port.tester.size() == 1);
+    CHECK(k.getErrors() == 1);
+    CHECK(k.send(req.data(), req.size())); // Free for the next message
+}
+
+// ISO 14230 messages finish as soon as their length says, without waiting for P1
+static void test_iso14230_length() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, true, true));
+    std::vector<uint8_t> resp = { 0x83, 0xF1, 0x10, 0x41, 0x00, 0xBE };
+    port.ecuSend(10000, withChecksum(resp), 0);
+    port.run(&k, port.ecu.back().heard + KLINE_TICK_US);
+    kline_msg msg;
+    CHECK(k.read(&msg) && sameBytes(msg.data, msg.len, resp));
+
+    // Separate length byte (Format byte length of 0)
+    std::vector<uint8_t> longer = { 0x80, 0xF1, 0x10, 0x02, 0x50, 0x81 };
+    port.ecuSend(port.now + 10000, withChecksum(longer), 0);
+    port.run(&k, port.ecu.back().heard + KLINE_TICK_US);
+    CHECK(k.read(&msg) && sameBytes(msg.data, msg.len, longer));
+    CHECK(k.getErrors() == 0);
+}
+
+// TIDLE of quiet, TiniL low, the rest of TWUP high, then StartCommunication straight away
+static void test_fast_init() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, true, true));
+    std::vector<uint8_t> req = { 0xC1, 0x33, 0xF1, 0x81 };
+    std::vector<uint8_t> resp = { 0x83, 0xF1, 0x10, 0xC1, 0xE9, 0x8F };
+    port.replyAfter(req.size() + 1, withChecksum(resp), 25000, 0);
+    CHECK(k.startFastInit(req.data(), req.size()));
+    port.run(&k, 600000);
+    CHECK(port.levels.size() >= 3);
+    if (port.levels.size() < 3) {
+        return;
+    }
+    CHECK(port.levels[0].at == 300000 && port.levels[0].level == 0); // TIDLE
+    CHECK(port.levels[1].at == 325000 && port.levels[1].level == 1); // TiniL
+    CHECK(port.levels[2].at == 350000 && port.levels[2].level == -1); // TWUP
+    for (size_t i = 3; i < port.levels.size(); i++) {
+        CHECK(port.levels[i].level == -1); // Nothing but the UART on the line from here
+    }
+    CHECK(port.tester.size() == req.size() + 1);
+    if (port.tester.size() == req.size() + 1) {
+        CHECK(port.tester[0].start == 350000);
+        CHECK(port.tester.back().value == checksum(req));
+    }
+    kline_init_result res;
+    CHECK(k.initResult(&res));
+    CHECK(res.status == KLINE_INIT_OK);
+    CHECK(sameBytes(res.data, res.len, resp));
+}
+
+// Address at 5 baud after W5, then sync, key bytes, our inverted key byte 2 after W4, and the ECU's inverted address
+static void test_five_baud() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    uint8_t addr = 0x33;
+    CHECK(k.startFiveBaud(addr));
+    port.run(&k, 300000 + 10 * KLINE_5BAUD_BIT_US);
+    CHECK(port.levels.size() == 10); // Start bit, 8 data bits, release for the stop bit
+    if (port.levels.size() != 10) {
+        return;
+    }
+    uint32_t start = port.levels[0].at;
+    CHECK(start == 300000 && port.levels[0].level == 0); // W5
+    for (int bit = 0; bit < 8; bit++) {
+        CHECK(port.levels[bit + 1].at == start + (bit + 1) * KLINE_5BAUD_BIT_US);
+        CHECK(port.levels[bit + 1].level == ((addr >> bit) & 0x01));
+    }
+    CHECK(port.levels[9].at == start + 9 * KLINE_5BAUD_BIT_US && port.levels[9].level == -1);
+
+    port.ecuSend(start + 10 * KLINE_5BAUD_BIT_US + 20000, { 0x55, 0x08, 0x08 }, 10000);
+    port.replyAfter(1, { (uint8_t)~addr }, 30000, 0);
+    port.run(&k, 3000000);
+    CHECK(port.tester.size() == 1);
+    if (port.tester.size() == 1) {
+        uint32_t w4 = port.tester[0].start - port.ecu[2].heard;
+        CHECK(port.tester[0].value == (uint8_t)~0x08);
+        CHECK(w4 >= 50000 && w4 <= 50000 + KLINE_TICK_US);
+    }
+    kline_init_result res;
+    CHECK(k.initResult(&res));
+    CHECK(res.status == KLINE_INIT_OK);
+    CHECK(sameBytes(res.data, res.len, { 0x08, 0x08 }));
+}
+
+// Wrong sync byte ends the init straight away
+static void test_five_baud_no_sync() {
+    sim_kline_port port;
+    kline_handler k(&port);
+    CHECK(k.claim(TEST_BAUD, false, true));
+    CHECK(k.startFiveBaud(0x33));
+    port.ecuSend(300000 + 10 * KLINE_5BAUD_BIT_US + 20000, { 0x54 }, 0);
+    port.run(&k, 3000000);
+    kline_init_result res;
+    CHECK(k.initResult(&res));
+    CHECK(res.status == KLINE_INIT_NO_SYNC);
+    CHECK(res.len == 0);
+}
+
+int main() {
+    struct {
+        const char* name;
+        void (*fn)();
+    } tests[] = {
+        { "request_timing", test_request_timing },
+        { "response_p1_p3", test_response_p1_p3 },
+        { "p1_split", test_p1_split },
+        { "checksum", test_checksum },
+        { "collision", test_collision },
+        { "no_echo", test_no_echo },
+        { "iso14230_length", test_iso14230_length },
+        { "fast_init", test_fast_init },
+        { "five_baud", test_five_baud },
+        { "five_baud_no_sync", test_five_baud_no_sync },
+    };
+    for (auto& t : tests) {
+        int before = failures;
+        t.fn();
+        printf("%s %s\n", failures == before ? "PASS" : "FAIL", t.name);
+    }
+    printf("%d check(s) failed\n", failures);
+    return failures == 0 ? 0 : 1;
+}
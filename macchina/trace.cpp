@@ -0,0 +1,75 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#include "trace.h"
+#include "pc_comm.h"
+
+namespace TRACE {
+    trace_event ring[TRACE_RING_EVENTS];
+    volatile uint16_t head = 0; // Next free slot
+    volatile uint16_t tail = 0; // Oldest event
+    volatile uint32_t lost = 0;
+
+    // Records an event. Can be called from interrupts
+    void event(uint8_t level, uint16_t id, uint8_t aux, uint32_t a0, uint32_t a1, uint32_t a2) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        uint16_t next = (head + 1) % TRACE_RING_EVENTS;
+        if (next == tail) { // Full, keep the older events since they explain how we got here
+            lost++;
+            __set_PRIMASK(primask);
+            return;
+        }
+        trace_event* e = &ring[head];
+        e->timestamp = micros();
+        e->id = id;
+        e->level = level;
+        e->aux = aux;
+        e->args[0] = a0;
+        e->args[1] = a1;
+        e->args[2] = a2;
+        head = next;
+        __set_PRIMASK(primask);
+    }
+
+    // Sends everything recorded so far as CMD_TRACE messages
+    void flush() {
+        while (tail != head || lost != 0) {
+            PCMSG msg = {0x00};
+            msg.cmd_id = CMD_TRACE;
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            uint32_t l = lost;
+            lost = 0;
+            __set_PRIMASK(primask);
+            memcpy(&msg.args[0], &l, 4);
+            uint16_t count = 0;
+            while (tail != head && count < TRACE_MSG_MAX_EVENTS) {
+                // Slot is only reused once tail moves past it, so no need to lock for the copy
+                memcpy(&msg.args[TRACE_MSG_HEADER_SIZE + count * sizeof(trace_event)], &ring[tail], sizeof(trace_event));
+                tail = (tail + 1) % TRACE_RING_EVENTS;
+                count++;
+            }
+            msg.arg_size = TRACE_MSG_HEADER_SIZE + count * sizeof(trace_event);
+            PCCOMM::sendMessage(&msg);
+        }
+    }
+};
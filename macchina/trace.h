@@ -0,0 +1,106 @@
+/*
+**
+** Copyright (C) 2020 Ashcon Mohseninia
+** Author: Ashcon Mohseninia <ashcon50@gmail.com>
+**
+** This library is free software; you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or (at
+** your option) any later version.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with this library; if not, <http://www.gnu.org/licenses/>.
+**
+*/
+
+
+#pragma once
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Trace levels. Anything above TRACE_LEVEL compiles to nothing
+#define TRACE_LEVEL_OFF   0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3 // Every frame - Only for bench debugging
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#ifndef TRACE_RING_EVENTS
+#define TRACE_RING_EVENTS 64
+#endif
+
+// Event IDs - Must match trace_decoder.cpp in the driver, which holds the text for each.
+// The text takes its values in the order a0, a1, a2, aux
+#define TRACE_CAN_TX_FRAME     0x0001 // a0 - CAN ID, a1 - Data 0-3, a2 - Data 4-7, aux - DLC
+#define TRACE_CAN_TX_FAIL      0x0002 // a0 - CAN ID
+#define TRACE_CAN_TX_DROPPED   0x0003 // a0 - Frames dropped because the Tx ring was full
+#define TRACE_ISOTP_RX_FRAME   0x0010 // a0 - CAN ID, a1 - Data 0-3, a2 - Data 4-7, aux - DLC
+#define TRACE_ISOTP_SF_INVALID 0x0011 // a0 - CAN ID, a1 - PCI byte
+#define TRACE_ISOTP_FF         0x0012 // a0 - CAN ID, a1 - FF_DL
+#define TRACE_ISOTP_BAD_FRAME  0x0013 // a0 - CAN ID, a1 - PCI byte
+#define TRACE_ISOTP_FC_TX      0x0014 // a0 - CAN ID, a1 - Block size, a2 - Flow status
+#define TRACE_ISOTP_FC_RX      0x0015 // a0 - Block size, a1 - STmin in us, a2 - Flow status
+#define TRACE_ISOTP_TX_MULTI   0x0016 // a0 - CAN ID, a1 - Payload length
+#define TRACE_ISOTP_CF_SN      0x0017 // a0 - CAN ID, a1 - SN expected, a2 - SN received
+#define TRACE_ISOTP_FC_TIMEOUT 0x0018 // a0 - CAN ID, a1 - N_Bs in ms
+#define TRACE_ISOTP_CF_TIMEOUT 0x0019 // a0 - CAN ID, a1 - N_Cr in ms
+#define TRACE_KLINE_ERRORS     0x0020 // a0 - Errors since the last report
+
+// One event, sent to the PC as is (20 bytes)
+struct __attribute__((packed)) trace_event {
+    uint32_t timestamp; // us
+    uint16_t id;
+    uint8_t level;
+    uint8_t aux; // Small extra argument (DLC)
+    uint32_t args[3];
+};
+
+// CMD_TRACE args format
+// 0-3  - Events lost since the last CMD_TRACE because the ring was full (32bit)
+// 4..  - trace_event records back to back
+#define TRACE_MSG_HEADER_SIZE 4
+#define TRACE_MSG_MAX_EVENTS  ((512 - TRACE_MSG_HEADER_SIZE) / sizeof(trace_event))
+
+/**
+ * Binary event trace. Recording an event is a few stores into a ring (Safe
+ * from interrupts), and flush() sends them to the driver in batches which
+ * turns them into text. Far cheaper than sprintf + a 518 byte CMD_LOG per line
+ */
+namespace TRACE {
+    void event(uint8_t level, uint16_t id, uint8_t aux, uint32_t a0, uint32_t a1, uint32_t a2);
+    void flush();
+};
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(id, aux, a0, a1, a2) TRACE::event(TRACE_LEVEL_ERROR, id, aux, a0, a1, a2)
+#else
+#define TRACE_ERROR(id, aux, a0, a1, a2)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(id, aux, a0, a1, a2) TRACE::event(TRACE_LEVEL_INFO, id, aux, a0, a1, a2)
+#else
+#define TRACE_INFO(id, aux, a0, a1, a2)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(id, aux, a0, a1, a2) TRACE::event(TRACE_LEVEL_DEBUG, id, aux, a0, a1, a2)
+#else
+#define TRACE_DEBUG(id, aux, a0, a1, a2)
+#endif
+
+// CAN frame as trace args (ID, first 4 bytes, last 4 bytes, DLC)
+#define TRACE_FRAME(level_macro, event_id, f) level_macro(event_id, (f).length, (f).id, (f).data.low, (f).data.high)
+
+#endif